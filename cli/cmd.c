@@ -34,6 +34,12 @@ static GetLine *gl;              /* The line editor */
 static ui_cmd_t cmds[] = {
     {CTX_ALL, "hashprio", 1, func_set_hash_prio, cpl_none, "set hashing priority (1-5)"},
     {CTX_ALL, "debug", 1, func_debug, cpl_none, "change debug level"},
+    {CTX_ALL, "evstats", 0, func_event_stats, cpl_none, "show event loop latencies, or set the slow callback threshold (ms)"},
+    {CTX_ALL, "bwlimit", 2, func_set_bandwidth_limit, cpl_none, "limit upload and download rates (KiB/s, 0 is unlimited)"},
+    {CTX_ALL, "upcache", 1, func_set_upload_cache_size, cpl_none, "set size of the upload block cache (MiB, 0 disables)"},
+    {CTX_ALL, "minrate", 1, func_set_slot_min_rate, cpl_none, "reclaim upload slots slower than this while others wait (KiB/s, 0 disables)"},
+    {CTX_ALL, "slstats", 0, func_search_listener_stats, cpl_none, "show UDP search listener counters"},
+    {CTX_ALL, "rates", 0, func_transfer_rates, cpl_none, "show transfer rates per hub over 1, 10 and 60 seconds"},
     {CTX_ALL, "hublist", 0, func_hublist, cpl_none, "enter hublist context"},
     {CTX_ALL, "qls", 0, func_queue_ls, cpl_none, "list download queue"},
     {CTX_ALL, "qrm", 1, func_queue_remove, cpl_none, "remove a file from the download queue"},
@@ -13,6 +13,46 @@ int func_debug(sp_t *sp, arg_t *args)
     return 0;
 }
 
+int func_event_stats(sp_t *sp, arg_t *args)
+{
+    if(args->argc > 1)
+        sp_send_slow_callback_threshold(sp, atoi(args->argv[1]));
+    else
+        sp_send_event_stats(sp);
+    return 0;
+}
+
+int func_search_listener_stats(sp_t *sp, arg_t *args)
+{
+    sp_send_search_listener_stats(sp);
+    return 0;
+}
+
+int func_transfer_rates(sp_t *sp, arg_t *args)
+{
+    sp_send_transfer_rates(sp);
+    return 0;
+}
+
+int func_set_bandwidth_limit(sp_t *sp, arg_t *args)
+{
+    sp_send_set_bandwidth_limit(sp, atoi(args->argv[1]) * 1024,
+            atoi(args->argv[2]) * 1024);
+    return 0;
+}
+
+int func_set_upload_cache_size(sp_t *sp, arg_t *args)
+{
+    sp_send_set_upload_cache_size(sp, atoi(args->argv[1]));
+    return 0;
+}
+
+int func_set_slot_min_rate(sp_t *sp, arg_t *args)
+{
+    sp_send_set_slot_min_rate(sp, atoi(args->argv[1]) * 1024);
+    return 0;
+}
+
 int func_exit(sp_t *sp, arg_t *args)
 {
     cmd_fini();
@@ -532,17 +532,92 @@ static int spcb_hub_redirect(sp_t *sp, const char *hub, const char *new_address)
 
 static int spcb_transfer_stats(sp_t *sp, const char *local_filename,
         unsigned long long offset, unsigned long long filesize,
-        unsigned bytes_per_sec)
+        unsigned bytes_per_sec, unsigned rate_limit,
+        unsigned compression_ratio)
 {
     const char *filename = strrchr(local_filename, '/');
     if(filename++ == NULL)
         filename = local_filename;
 
-    msg("%s is %.1f%% complete (%s of %s): %s/s", filename,
+    char compressed[32] = "";
+    if(compression_ratio < 100)
+    {
+        snprintf(compressed, sizeof(compressed),
+                ", compressed to %u%%", compression_ratio);
+    }
+
+    msg("%s is %.1f%% complete (%s of %s): %s/s%s%s%s%s", filename,
             100 * ((float)offset / filesize),
             str_size_human(offset),
             str_size_human(filesize),
-            str_size_human(bytes_per_sec));
+            str_size_human(bytes_per_sec),
+            rate_limit ? " (limited to " : "",
+            rate_limit ? str_size_human(rate_limit) : "",
+            rate_limit ? "/s)" : "",
+            compressed);
+
+    return 0;
+}
+
+static int spcb_move_progress(sp_t *sp, const char *target_filename,
+        unsigned long long offset, unsigned long long filesize)
+{
+    const char *filename = strrchr(target_filename, '/');
+    if(filename++ == NULL)
+        filename = target_filename;
+
+    msg("moving %s: %.1f%% done (%s of %s)", filename,
+            filesize ? 100 * ((float)offset / filesize) : 100.0,
+            str_size_human(offset),
+            str_size_human(filesize));
+
+    return 0;
+}
+
+static int spcb_event_stats(sp_t *sp, const char *name,
+        unsigned long long count, unsigned long long total_usec,
+        unsigned long long max_usec, const char *histogram)
+{
+    msg("%s: %llu calls, avg %.2f ms, max %.2f ms [%s]", name, count,
+            count ? (double)total_usec / count / 1000 : 0.0,
+            (double)max_usec / 1000, histogram);
+
+    return 0;
+}
+
+static int spcb_search_listener_stats(sp_t *sp, unsigned long long datagrams,
+        unsigned long long batches, unsigned long long max_burst,
+        unsigned long long truncated, unsigned long long dropped)
+{
+    msg("search listener: %llu datagrams in %llu batches, max burst %llu,"
+            " %llu truncated, %llu dropped",
+            datagrams, batches, max_burst, truncated, dropped);
+
+    return 0;
+}
+
+static int spcb_transfer_rates(sp_t *sp, const char *hub_address,
+        unsigned upload_1s, unsigned upload_10s, unsigned upload_60s,
+        unsigned download_1s, unsigned download_10s, unsigned download_60s)
+{
+    char *up[3], *down[3];
+    up[0] = strdup(str_size_human(upload_1s));
+    up[1] = strdup(str_size_human(upload_10s));
+    up[2] = strdup(str_size_human(upload_60s));
+    down[0] = strdup(str_size_human(download_1s));
+    down[1] = strdup(str_size_human(download_10s));
+    down[2] = strdup(str_size_human(download_60s));
+
+    msg("%s: up %s/s %s/s %s/s, down %s/s %s/s %s/s",
+            *hub_address ? hub_address : "total",
+            up[0], up[1], up[2], down[0], down[1], down[2]);
+
+    int i;
+    for(i = 0; i < 3; i++)
+    {
+        free(up[i]);
+        free(down[i]);
+    }
 
     return 0;
 }
@@ -730,6 +805,10 @@ int main(int argc, char **argv)
     sp->cb_queue_remove_source = spcb_source_remove;
     sp->cb_hub_redirect = spcb_hub_redirect;
     sp->cb_transfer_stats = spcb_transfer_stats;
+    sp->cb_move_progress = spcb_move_progress;
+    sp->cb_event_stats = spcb_event_stats;
+    sp->cb_search_listener_stats = spcb_search_listener_stats;
+    sp->cb_transfer_rates = spcb_transfer_rates;
     sp->cb_hub_add = spcb_hub_add;
     sp->cb_port = spcb_port;
     sp->cb_connection_closed = spcb_connection_closed;
@@ -764,6 +843,9 @@ int main(int argc, char **argv)
     /* set the update interval for transfer stats */
     sp_send_transfer_stats_interval(sp, 10);
 
+    /* get the user lists in batches */
+    sp_send_set_user_batching(sp, 1);
+
     signal(SIGTSTP, sighandler);
     signal(SIGCONT, sighandler);
     signal(SIGINT, sighandler);
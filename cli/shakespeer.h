@@ -204,6 +204,12 @@ void cmd_display_text(const char *str);
  */
 int func_set_hash_prio(sp_t *sp, arg_t *args);
 int func_debug(sp_t *sp, arg_t *args);
+int func_event_stats(sp_t *sp, arg_t *args);
+int func_search_listener_stats(sp_t *sp, arg_t *args);
+int func_transfer_rates(sp_t *sp, arg_t *args);
+int func_set_bandwidth_limit(sp_t *sp, arg_t *args);
+int func_set_upload_cache_size(sp_t *sp, arg_t *args);
+int func_set_slot_min_rate(sp_t *sp, arg_t *args);
 int func_exit(sp_t *sp, arg_t *args);
 int func_connect(sp_t *sp, arg_t *args);
 int func_hublist(sp_t *sp, arg_t *args);
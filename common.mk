@@ -29,6 +29,10 @@ ifeq ($(HAVE_FGETLN),no)
   CFLAGS += -DMISSING_FGETLN
 endif
 
+ifeq ($(HAVE_RECVMMSG),yes)
+  CFLAGS += -DHAVE_RECVMMSG
+endif
+
 # Disable coredumps for public releases
 ifneq ($(BUILD_PROFILE),release)
   CFLAGS+=-DCOREDUMPS_ENABLED=1
@@ -62,6 +66,9 @@ ifeq ($(os),Linux)
   LIBS+=-lresolv
 endif
 
+# The share scanner uses worker threads
+LIBS+=-lpthread
+
 # search for xcodebuild in path
 pathsearch = $(firstword $(wildcard $(addsuffix /$(1),$(subst :, ,$(PATH)))))
 XCODE := $(call pathsearch,xcodebuild)
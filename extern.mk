@@ -104,6 +104,11 @@ BZ2_CFLAGS=-I$(TOP)/bzip2-install/include
 BZ2_LIBS=$(TOP)/bzip2-install/lib/libbz2.a
 endif
 
+# zlib comes with every supported system
+ifneq (${HAS_ZLIB},yes)
+ZLIB_LIBS=-lz
+endif
+
 ifneq (${HAS_ICONV},yes)
 EXTERN_DEPENDS+=libiconv
 ICONV_CFLAGS=-I${TOP}/libiconv-install/include
@@ -130,5 +135,6 @@ CFLAGS+=${EXPAT_CFLAGS}
 LIBS=-L${TOP}/spclient -lspclient -L${TOP}/splib -lsplib \
      ${ICONV_LDFLAGS} ${ICONV_LIBS} \
      ${BZ2_LDFLAGS} ${BZ2_LIBS} \
+     ${ZLIB_LDFLAGS} ${ZLIB_LIBS} \
      ${EXPAT_LDFLAGS} ${EXPAT_LIBS} \
      ${LIBEVENT_LDFLAGS} ${LIBEVENT_LIBS}
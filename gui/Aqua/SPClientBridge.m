@@ -245,13 +245,16 @@ static int spcb_upload_starting(sp_t *sp, const char *hub_address, const char *n
 
 static int spcb_transfer_stats(sp_t *sp, const char *local_filename,
         uint64_t offset,
-        uint64_t filesize, unsigned bytes_per_sec)
+        uint64_t filesize, unsigned bytes_per_sec, unsigned rate_limit,
+        unsigned compression_ratio)
 {
     sendNotification(SPNotificationTransferStats,
             @"targetFilename", [NSString stringWithUTF8String:local_filename],
             @"offset", [NSNumber numberWithUnsignedLongLong:offset],
             @"size", [NSNumber numberWithUnsignedLongLong:filesize],
             @"bps", [NSNumber numberWithInt:bytes_per_sec],
+            @"rateLimit", [NSNumber numberWithUnsignedInt:rate_limit],
+            @"compressionRatio", [NSNumber numberWithUnsignedInt:compression_ratio],
             nil);
     return 0;
 }
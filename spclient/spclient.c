@@ -106,6 +106,7 @@ sp_t *sp_create(void *user_data)
 {
     sp_t *sp = sp_init();
     sp->user_data = user_data;
+    sp->cb_user_login_batch = sp_user_login_batch;
 
     return sp;
 }
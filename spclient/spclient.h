@@ -21,10 +21,34 @@
 #ifndef _spclient_h_
 #define _spclient_h_
 
+#include <stdint.h>
+
+#include "dstring.h"
 #include "filelist.h"
 #include "spclient_cmd.h"
 #include "spclient_send.h"
 
+/* Separators of the user records and their fields in a user-login-batch.
+ * The fields of a record are the same as in user-login, without the hub
+ * address.
+ */
+#define SP_BATCH_RECORD_SEP "\x1e"
+#define SP_BATCH_FIELD_SEP "\x1f"
+
+/* Appends the fields of one user record to a user-login-batch. The
+ * separators are replaced by spaces in the fields, they come from remote
+ * users and could otherwise inject records. Records are separated by
+ * SP_BATCH_RECORD_SEP, which the caller appends.
+ */
+void sp_user_batch_append(dstring_t *users, const char *nick,
+        const char *description, const char *tag, const char *speed,
+        const char *email, uint64_t shared_size, int is_operator,
+        unsigned int extra_slots);
+
+/* Calls cb_user_login for each record of a user-login-batch. */
+int sp_user_login_batch(sp_t *sp, const char *hub_address,
+        unsigned int count, const char *users);
+
 sp_t *sp_create(void *user_data);
 void sp_free(sp_t *sp);
 int sp_connect_remote(sp_t *sp, const char *remote_address);
@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2008 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spclient.h"
+#include "log.h"
+
+static void sp_user_batch_append_field(dstring_t *users, const char *field)
+{
+    for(; field && *field; field++)
+    {
+        if(*field == SP_BATCH_RECORD_SEP[0] || *field == SP_BATCH_FIELD_SEP[0])
+            dstring_append_char(users, ' ');
+        else
+            dstring_append_char(users, *field);
+    }
+    dstring_append(users, SP_BATCH_FIELD_SEP);
+}
+
+void sp_user_batch_append(dstring_t *users, const char *nick,
+        const char *description, const char *tag, const char *speed,
+        const char *email, uint64_t shared_size, int is_operator,
+        unsigned int extra_slots)
+{
+    sp_user_batch_append_field(users, nick);
+    sp_user_batch_append_field(users, description);
+    sp_user_batch_append_field(users, tag);
+    sp_user_batch_append_field(users, speed);
+    sp_user_batch_append_field(users, email);
+    dstring_append_format(users,
+            "%"PRIu64 SP_BATCH_FIELD_SEP "%u" SP_BATCH_FIELD_SEP "%u",
+            shared_size, is_operator, extra_slots);
+}
+
+/* Splits a user-login-batch into user-login callbacks, so clients that
+ * enable user batching don't need to handle it themselves. A batch whose
+ * record count doesn't match is dropped.
+ */
+int sp_user_login_batch(sp_t *sp, const char *hub_address,
+        unsigned int count, const char *users)
+{
+    if(sp->cb_user_login == NULL)
+        return 0;
+
+    unsigned nrecords = 1;
+    const char *p;
+    for(p = users; (p = strchr(p, SP_BATCH_RECORD_SEP[0])) != NULL; p++)
+        nrecords++;
+    if(nrecords != count)
+    {
+        WARNING("user-login-batch has %u records, expected %u",
+                nrecords, count);
+        return 0;
+    }
+
+    char *copy = strdup(users);
+    char *next = copy;
+    char *record;
+    while((record = strsep(&next, SP_BATCH_RECORD_SEP)) != NULL)
+    {
+        char *fields[8];
+        int n = 0;
+        while(n < 8 && (fields[n] = strsep(&record, SP_BATCH_FIELD_SEP)) != NULL)
+            n++;
+        if(n != 8 || record != NULL)
+        {
+            WARNING("invalid user record in user-login-batch");
+            continue;
+        }
+
+        sp->cb_user_login(sp, hub_address, fields[0], fields[1], fields[2],
+                fields[3], fields[4], strtoull(fields[5], NULL, 0),
+                strtol(fields[6], NULL, 0), strtoul(fields[7], NULL, 0));
+    }
+    free(copy);
+
+    return 0;
+}
+
+#ifdef TEST
+
+#include "unit_test.h"
+
+static int nlogins = 0;
+
+static int login(sp_t *sp, const char *hub_address, const char *nick,
+        const char *description, const char *tag, const char *speed,
+        const char *email, uint64_t shared_size, int is_operator,
+        unsigned int extra_slots)
+{
+    fail_unless(strcmp(hub_address, "hub") == 0);
+    if(nlogins++ == 0)
+    {
+        fail_unless(strcmp(nick, "bob") == 0);
+        fail_unless(strcmp(description, "hi") == 0);
+        fail_unless(strcmp(tag, "<++ V:1>") == 0);
+        fail_unless(shared_size == 1234567890123ULL);
+        fail_unless(is_operator == 1 && extra_slots == 2);
+    }
+    else
+    {
+        /* the separators were replaced, no records were injected */
+        fail_unless(strcmp(nick, "eve") == 0);
+        fail_unless(strcmp(description,
+                    "x fake a b c d 1 0 0") == 0);
+        fail_unless(strcmp(email, "") == 0);
+        fail_unless(shared_size == 42);
+    }
+    return 0;
+}
+
+int main(void)
+{
+    sp_log_set_level("warning");
+
+    sp_t *sp = calloc(1, sizeof(sp_t));
+    sp->cb_user_login = login;
+
+    dstring_t *users = dstring_new(NULL);
+    sp_user_batch_append(users, "bob", "hi", "<++ V:1>", "DSL", "b@x",
+            1234567890123ULL, 1, 2);
+    dstring_append(users, SP_BATCH_RECORD_SEP);
+    sp_user_batch_append(users, "eve",
+            "x\x1e" "fake\x1f" "a\x1f" "b\x1f" "c\x1f" "d\x1f"
+            "1\x1f" "0\x1f" "0",
+            NULL, NULL, NULL, 42, 0, 0);
+
+    sp_user_login_batch(sp, "hub", 2, users->string);
+    fail_unless(nlogins == 2);
+
+    /* a batch with the wrong count is dropped */
+    nlogins = 0;
+    sp_user_login_batch(sp, "hub", 3, users->string);
+    fail_unless(nlogins == 0);
+
+    dstring_free(users, 1);
+    free(sp);
+
+    return 0;
+}
+
+#endif
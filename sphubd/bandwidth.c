@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2008 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdbool.h>
+
+#include "bandwidth.h"
+#include "event_profile.h"
+
+/* when throttled, wait until at least this much can be moved */
+#define BW_MIN_CHUNK 4096
+
+static bw_bucket_t bw_global[2];
+static unsigned bw_connection_rate[2];
+
+static int64_t bw_bucket_capacity(const bw_bucket_t *bucket)
+{
+    int64_t capacity = (int64_t)bucket->rate * BW_BURST;
+    return capacity < BW_MIN_BURST ? BW_MIN_BURST : capacity;
+}
+
+void bw_bucket_init(bw_bucket_t *bucket, unsigned rate)
+{
+    bucket->rate = rate;
+    bucket->tokens = bw_bucket_capacity(bucket);
+    bucket->last_refill = 0;
+}
+
+void bw_bucket_set_rate(bw_bucket_t *bucket, unsigned rate)
+{
+    if(bucket->rate == rate)
+        return;
+
+    bool was_unlimited = (bucket->rate == 0);
+    bucket->rate = rate;
+
+    int64_t capacity = bw_bucket_capacity(bucket);
+    if(was_unlimited || bucket->tokens > capacity)
+        bucket->tokens = capacity;
+    bucket->last_refill = 0;
+}
+
+void bw_bucket_refill(bw_bucket_t *bucket, uint64_t now)
+{
+    if(bucket->rate == 0)
+        return;
+
+    if(bucket->last_refill == 0 || now < bucket->last_refill)
+    {
+        bucket->last_refill = now;
+        return;
+    }
+
+    uint64_t tokens = (now - bucket->last_refill) * bucket->rate / 1000000;
+    if(tokens == 0)
+        return;
+
+    /* only advance by whole tokens, so slow rates don't lose the rest */
+    bucket->last_refill += tokens * 1000000 / bucket->rate;
+    bucket->tokens += tokens;
+
+    int64_t capacity = bw_bucket_capacity(bucket);
+    if(bucket->tokens >= capacity)
+    {
+        bucket->tokens = capacity;
+        bucket->last_refill = now;
+    }
+}
+
+void bw_bucket_charge(bw_bucket_t *bucket, size_t nbytes)
+{
+    if(bucket->rate)
+        bucket->tokens -= nbytes;
+}
+
+size_t bw_bucket_available(bw_bucket_t *bucket, uint64_t now, size_t want)
+{
+    if(bucket->rate == 0)
+        return want;
+
+    bw_bucket_refill(bucket, now);
+    if(bucket->tokens <= 0)
+        return 0;
+    if((uint64_t)bucket->tokens < want)
+        return bucket->tokens;
+    return want;
+}
+
+unsigned bw_bucket_delay(const bw_bucket_t *bucket)
+{
+    if(bucket->rate == 0 || bucket->tokens > 0)
+        return 0;
+
+    int64_t chunk = bw_bucket_capacity(bucket);
+    if(chunk > BW_MIN_CHUNK)
+        chunk = BW_MIN_CHUNK;
+
+    uint64_t needed = chunk - bucket->tokens;
+    return needed * 1000 / bucket->rate + 1;
+}
+
+void bw_set_global_limit(bw_direction_t dir, unsigned rate)
+{
+    bw_bucket_set_rate(&bw_global[dir], rate);
+}
+
+unsigned bw_get_global_limit(bw_direction_t dir)
+{
+    return bw_global[dir].rate;
+}
+
+void bw_set_connection_limit(bw_direction_t dir, unsigned rate)
+{
+    bw_connection_rate[dir] = rate;
+}
+
+unsigned bw_get_connection_limit(bw_direction_t dir)
+{
+    return bw_connection_rate[dir];
+}
+
+size_t bw_allowance(bw_bucket_t *conn, bw_bucket_t *hub, bw_direction_t dir,
+        size_t want)
+{
+    uint64_t now = ep_now();
+
+    want = bw_bucket_available(&bw_global[dir], now, want);
+    if(hub && want)
+        want = bw_bucket_available(hub, now, want);
+    if(conn && want)
+        want = bw_bucket_available(conn, now, want);
+
+    return want;
+}
+
+void bw_charge(bw_bucket_t *conn, bw_bucket_t *hub, bw_direction_t dir,
+        size_t nbytes)
+{
+    bw_bucket_charge(&bw_global[dir], nbytes);
+    if(hub)
+        bw_bucket_charge(hub, nbytes);
+    if(conn)
+        bw_bucket_charge(conn, nbytes);
+}
+
+unsigned bw_delay(bw_bucket_t *conn, bw_bucket_t *hub, bw_direction_t dir)
+{
+    unsigned delay = bw_bucket_delay(&bw_global[dir]);
+
+    if(hub && bw_bucket_delay(hub) > delay)
+        delay = bw_bucket_delay(hub);
+    if(conn && bw_bucket_delay(conn) > delay)
+        delay = bw_bucket_delay(conn);
+
+    return delay;
+}
+
+static unsigned bw_min_rate(unsigned a, unsigned b)
+{
+    if(a == 0)
+        return b;
+    if(b == 0 || a < b)
+        return a;
+    return b;
+}
+
+unsigned bw_effective_limit(bw_bucket_t *conn, bw_bucket_t *hub,
+        bw_direction_t dir)
+{
+    unsigned rate = bw_global[dir].rate;
+
+    if(hub)
+        rate = bw_min_rate(rate, hub->rate);
+    if(conn)
+        rate = bw_min_rate(rate, conn->rate);
+
+    return rate;
+}
+
+void bw_charge_control(bw_direction_t dir, size_t nbytes)
+{
+    bw_bucket_charge(&bw_global[dir], nbytes);
+}
+
+#ifdef TEST
+
+#include "unit_test.h"
+
+int main(void)
+{
+    bw_bucket_t bucket;
+
+    /* unlimited buckets never run out */
+    bw_bucket_init(&bucket, 0);
+    fail_unless(bw_bucket_available(&bucket, 1, 1000000) == 1000000);
+    bw_bucket_charge(&bucket, 1000000);
+    fail_unless(bw_bucket_available(&bucket, 2, 100) == 100);
+    fail_unless(bw_bucket_delay(&bucket) == 0);
+
+    /* a new bucket starts full */
+    bw_bucket_init(&bucket, 100000);
+    fail_unless(bw_bucket_available(&bucket, 1000000, 200000) == 100000);
+    bw_bucket_charge(&bucket, 150000);
+    fail_unless(bucket.tokens == -50000);
+    fail_unless(bw_bucket_available(&bucket, 1000000, 1) == 0);
+
+    /* 54096 bytes are needed to get back to 4096: 541 ms */
+    fail_unless(bw_bucket_delay(&bucket) == 541);
+
+    /* half a second later the debt is paid */
+    fail_unless(bw_bucket_available(&bucket, 1500000, 10000) == 0);
+    fail_unless(bucket.tokens == 0);
+    fail_unless(bw_bucket_available(&bucket, 1600000, 100000) == 10000);
+
+    /* tokens are capped at the burst size */
+    fail_unless(bw_bucket_available(&bucket, 60000000, 1000000) == 100000);
+
+    /* slow rates don't lose fractional tokens */
+    bw_bucket_init(&bucket, 10);
+    bw_bucket_charge(&bucket, BW_MIN_BURST);
+    uint64_t now = 1000000;
+    bw_bucket_refill(&bucket, now);
+    int i;
+    for(i = 0; i < 100; i++)
+    {
+        now += 50000;
+        bw_bucket_refill(&bucket, now);
+    }
+    fail_unless(bucket.tokens == 50);
+
+    /* small rates still allow BW_MIN_BURST */
+    bw_bucket_init(&bucket, 10);
+    fail_unless(bucket.tokens == BW_MIN_BURST);
+
+    /* lowering the rate caps the tokens */
+    bw_bucket_init(&bucket, 100000);
+    bw_bucket_set_rate(&bucket, 50000);
+    fail_unless(bucket.tokens == 50000);
+    bw_bucket_set_rate(&bucket, 0);
+    fail_unless(bw_bucket_available(&bucket, 1, 1000000) == 1000000);
+
+    /* the least of the levels applies */
+    bw_bucket_t hub, conn;
+    bw_bucket_init(&hub, 30000);
+    bw_bucket_init(&conn, 0);
+    fail_unless(bw_allowance(&conn, &hub, BW_UPLOAD, 1000000) == 30000);
+    fail_unless(bw_effective_limit(&conn, &hub, BW_UPLOAD) == 30000);
+
+    bw_set_global_limit(BW_UPLOAD, 20000);
+    fail_unless(bw_get_global_limit(BW_UPLOAD) == 20000);
+    fail_unless(bw_allowance(&conn, &hub, BW_UPLOAD, 1000000) == 20000);
+    fail_unless(bw_effective_limit(&conn, &hub, BW_UPLOAD) == 20000);
+    fail_unless(bw_effective_limit(NULL, NULL, BW_DOWNLOAD) == 0);
+
+    bw_charge(&conn, &hub, BW_UPLOAD, 20000);
+    fail_unless(hub.tokens == 10000);
+    fail_unless(bw_allowance(&conn, &hub, BW_UPLOAD, 1000) == 0);
+    fail_unless(bw_delay(&conn, &hub, BW_UPLOAD) > 0);
+    fail_unless(bw_allowance(&conn, &hub, BW_DOWNLOAD, 1000) == 1000);
+
+    /* control traffic only affects the global bucket */
+    bw_set_global_limit(BW_UPLOAD, 0);
+    bw_charge_control(BW_UPLOAD, 5000);
+    fail_unless(hub.tokens == 10000);
+
+    return 0;
+}
+
+#endif
+
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2008 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef _bandwidth_h_
+#define _bandwidth_h_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Token bucket bandwidth shaping.
+ *
+ * Transfer data in each direction passes three buckets: a global one, one
+ * per hub and one per client connection. A rate of 0 means unlimited. A
+ * transfer asks how many bytes it may move now (the least of the buckets)
+ * and is charged for what it actually moved. Buckets may go into debt,
+ * which only delays the next transfer.
+ *
+ * Hub and UDP control traffic is never delayed, but is charged to the
+ * global upload bucket so that transfers give way to it.
+ */
+
+/* a bucket holds at most this many seconds worth of tokens */
+#define BW_BURST 1
+
+/* ...but never less than this, so transfers can move reasonable chunks */
+#define BW_MIN_BURST 16384
+
+typedef enum
+{
+    BW_UPLOAD,
+    BW_DOWNLOAD
+} bw_direction_t;
+
+typedef struct bw_bucket bw_bucket_t;
+struct bw_bucket
+{
+    unsigned rate; /* bytes per second, 0 if unlimited */
+    int64_t tokens;
+    uint64_t last_refill; /* microseconds */
+};
+
+void bw_bucket_init(bw_bucket_t *bucket, unsigned rate);
+void bw_bucket_set_rate(bw_bucket_t *bucket, unsigned rate);
+void bw_bucket_refill(bw_bucket_t *bucket, uint64_t now);
+void bw_bucket_charge(bw_bucket_t *bucket, size_t nbytes);
+
+/* Returns the number of bytes that may be moved after a refill at NOW, at
+ * most WANT.
+ */
+size_t bw_bucket_available(bw_bucket_t *bucket, uint64_t now, size_t want);
+
+/* Returns the number of milliseconds until the bucket has tokens again. */
+unsigned bw_bucket_delay(const bw_bucket_t *bucket);
+
+void bw_set_global_limit(bw_direction_t dir, unsigned rate);
+unsigned bw_get_global_limit(bw_direction_t dir);
+
+/* the limit given to new client connections */
+void bw_set_connection_limit(bw_direction_t dir, unsigned rate);
+unsigned bw_get_connection_limit(bw_direction_t dir);
+
+/* Returns how many of WANT bytes a transfer may move now, given its
+ * connection and hub buckets (either may be NULL).
+ */
+size_t bw_allowance(bw_bucket_t *conn, bw_bucket_t *hub, bw_direction_t dir,
+        size_t want);
+void bw_charge(bw_bucket_t *conn, bw_bucket_t *hub, bw_direction_t dir,
+        size_t nbytes);
+
+/* Returns the number of milliseconds until the transfer may move data. */
+unsigned bw_delay(bw_bucket_t *conn, bw_bucket_t *hub, bw_direction_t dir);
+
+/* Returns the lowest non-zero rate of the buckets, or 0 if unlimited. */
+unsigned bw_effective_limit(bw_bucket_t *conn, bw_bucket_t *hub,
+        bw_direction_t dir);
+
+/* Charges hub and UDP control traffic to the global bucket. */
+void bw_charge_control(bw_direction_t dir, size_t nbytes);
+
+#endif
+
@@ -22,6 +22,7 @@
 #include <sys/socket.h>
 
 #include <stdio.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -38,22 +39,149 @@
 #include "encoding.h"
 #include "log.h"
 #include "xstr.h"
+#include "event_profile.h"
+#include "trace.h"
+#include "zlig.h"
 
 static LIST_HEAD(, cc) cc_list_head;
 
+/* Connections are indexed by nick and direction, and by the targets of
+ * their transfers: the local filename of an upload and the target
+ * filenames of the current and pipelined downloads. The target index is
+ * sorted, so the transfers below a directory are found by a range scan.
+ * Equal keys are sorted with the newest connection first, as in the list.
+ */
+struct cc_target
+{
+    RB_ENTRY(cc_target) link;
+    LIST_ENTRY(cc_target) next; /* targets of the same connection */
+    char *target;
+    cc_t *cc;
+};
+
+static int cc_serial_cmp(const cc_t *a, const cc_t *b)
+{
+    if(a->serial == b->serial)
+        return 0;
+    return a->serial > b->serial ? -1 : 1;
+}
+
+static int cc_nick_cmp(cc_t *a, cc_t *b)
+{
+    int rc = strcmp(a->nick, b->nick);
+    if(rc == 0)
+        rc = (int)a->direction - (int)b->direction;
+    if(rc == 0)
+        rc = cc_serial_cmp(a, b);
+    return rc;
+}
+
+static int cc_target_cmp(struct cc_target *a, struct cc_target *b)
+{
+    int rc = strcmp(a->target, b->target);
+    if(rc == 0)
+        rc = cc_serial_cmp(a->cc, b->cc);
+    return rc;
+}
+
+RB_HEAD(cc_nick_tree, cc);
+RB_PROTOTYPE(cc_nick_tree, cc, nick_link, cc_nick_cmp);
+RB_GENERATE(cc_nick_tree, cc, nick_link, cc_nick_cmp);
+
+RB_HEAD(cc_target_tree, cc_target);
+RB_PROTOTYPE(cc_target_tree, cc_target, link, cc_target_cmp);
+RB_GENERATE(cc_target_tree, cc_target, link, cc_target_cmp);
+
+static struct cc_nick_tree cc_nick_index = RB_INITIALIZER(&cc_nick_index);
+static struct cc_target_tree cc_target_index =
+    RB_INITIALIZER(&cc_target_index);
+static unsigned cc_next_serial;
+
 void cc_list_init(void)
 {
     LIST_INIT(&cc_list_head);
+    RB_INIT(&cc_nick_index);
+    RB_INIT(&cc_target_index);
+}
+
+void cc_index_nick(cc_t *cc)
+{
+    if(cc->nick_indexed)
+        RB_REMOVE(cc_nick_tree, &cc_nick_index, cc);
+    cc->nick_indexed = (cc->nick != NULL);
+    if(cc->nick_indexed)
+        RB_INSERT(cc_nick_tree, &cc_nick_index, cc);
+}
+
+static void cc_index_add_target(cc_t *cc, const char *target)
+{
+    struct cc_target *t = calloc(1, sizeof(struct cc_target));
+    t->target = strdup(target);
+    t->cc = cc;
+    if(RB_INSERT(cc_target_tree, &cc_target_index, t) != NULL)
+    {
+        /* already indexed for this connection */
+        free(t->target);
+        free(t);
+    }
+    else
+        LIST_INSERT_HEAD(&cc->targets, t, next);
+}
+
+static void cc_index_remove_targets(cc_t *cc)
+{
+    struct cc_target *t;
+    while((t = LIST_FIRST(&cc->targets)) != NULL)
+    {
+        LIST_REMOVE(t, next);
+        RB_REMOVE(cc_target_tree, &cc_target_index, t);
+        free(t->target);
+        free(t);
+    }
+}
+
+void cc_index_targets(cc_t *cc)
+{
+    cc_index_remove_targets(cc);
+
+    if(cc->local_filename) /* upload */
+        cc_index_add_target(cc, cc->local_filename);
+    if(cc->current_queue)
+        cc_index_add_target(cc, cc->current_queue->target_filename);
+
+    struct cc_request *req;
+    TAILQ_FOREACH(req, &cc->pipeline, link)
+    {
+        cc_index_add_target(cc, req->queue->target_filename);
+    }
+}
+
+/* Returns the first indexed target that is greater than or equal to
+ * target, or NULL.
+ */
+static struct cc_target *cc_index_find_target(const char *target)
+{
+    cc_t key_cc;
+    key_cc.serial = UINT_MAX;
+    struct cc_target key;
+    key.target = (char *)target;
+    key.cc = &key_cc;
+    return RB_NFIND(cc_target_tree, &cc_target_index, &key);
 }
 
 cc_t *cc_new(int fd, hub_t *hub)
 {
     cc_t *cc = calloc(1, sizeof(cc_t));
 
+    cc->serial = cc_next_serial++;
+    LIST_INIT(&cc->targets);
     cc->hub = hub;
     cc->fd = fd;
     cc->last_activity = time(0);
     cc->local_fd = -1;
+    TAILQ_INIT(&cc->pipeline);
+    bw_bucket_init(&cc->bw[BW_UPLOAD], bw_get_connection_limit(BW_UPLOAD));
+    bw_bucket_init(&cc->bw[BW_DOWNLOAD], bw_get_connection_limit(BW_DOWNLOAD));
 
     return cc;
 }
@@ -109,6 +237,10 @@ void cc_free(cc_t *cc)
             queue_free(cc->current_queue);
         }
 
+        cc_download_pipeline_free(cc);
+
+        cc_download_hash_free(cc);
+        zlig_free(cc->zlig);
         free(cc->local_filename);
         free(cc->nick);
         free(cc);
@@ -146,7 +278,11 @@ void cc_cancel_directory_transfers(const char *target_directory)
             {
                 return_if_fail(cc->current_queue);
                 /* FIXME: why do we pause the download? */
-                queue_set_priority(cc->current_queue->target_filename, 0);
+                if(str_has_prefix(cc->current_queue->target_filename,
+                            target_directory))
+                {
+                    queue_set_priority(cc->current_queue->target_filename, 0);
+                }
             }
             cc_close_connection(cc);
         }
@@ -156,6 +292,7 @@ void cc_cancel_directory_transfers(const char *target_directory)
 int cc_send_string(cc_t *cc, const char *string)
 {
     print_command(string, "-> (fd %i)", cc->fd);
+    trace_line(TRACE_CLIENT, TRACE_OUT, cc->fd, string);
     cc->last_activity = time(0);
     return bufferevent_write(cc->bufev, (void *)string, strlen(string));
 }
@@ -210,6 +347,17 @@ int cc_send_command_as_is(cc_t *cc, const char *fmt, ...)
 void cc_close_connection(cc_t *cc)
 {
     DEBUG("closing down cc on fd %i", cc->fd);
+    if(cc->fd != -1 && trace_enabled())
+        trace_write(TRACE_CLIENT, TRACE_CLOSE, cc->fd, "", 0);
+
+    if(cc->splicing)
+        event_del(&cc->splice_event);
+
+    if(cc->throttled)
+        event_del(&cc->throttle_event);
+
+    if(event_initialized(&cc->input_event))
+        event_del(&cc->input_event);
 
     if(cc->bufev)
         bufferevent_free(cc->bufev);
@@ -224,7 +372,12 @@ void cc_close_connection(cc_t *cc)
         event_del(&cc->handshake_timer_event);
 
     if(cc->local_fd != -1)
+    {
+        /* keep what we got, so the download can be resumed */
+        cc_download_writer_close(cc);
         close(cc->local_fd);
+    }
+    uc_release(cc->upload_block);
 
     INFO("removing client connection with nick [%s]",
             cc->nick ? cc->nick : "unknown");
@@ -235,6 +388,9 @@ void cc_close_connection(cc_t *cc)
     }
 
     LIST_REMOVE(cc, next);
+    if(cc->nick_indexed)
+        RB_REMOVE(cc_nick_tree, &cc_nick_index, cc);
+    cc_index_remove_targets(cc);
 
     cc_free(cc);
 }
@@ -285,6 +441,7 @@ void cc_in_event(struct bufferevent *bufev, void *data)
             break;
         }
         print_command(cmd, "<- (fd %d)", cc->fd);
+        trace_line(TRACE_CLIENT, TRACE_IN, cc->fd, cmd);
         if(strcmp(cmd, "ping") == 0)
         {
             DEBUG("received ping, sending pong");
@@ -324,6 +481,9 @@ void cc_out_event(struct bufferevent *bufev, void *data)
     cc_t *cc = data;
     return_if_fail(cc);
 
+    if(cc->throttled)
+        return;
+
     if(cc->state == CC_STATE_BUSY && cc->direction == CC_DIR_UPLOAD)
     {
         cc->last_transfer_activity = time(0);
@@ -342,6 +502,23 @@ void cc_out_event(struct bufferevent *bufev, void *data)
                 nbytes = cc->bytes_to_transfer - cc->bytes_done;
             }
 
+            nbytes = cc_bandwidth_allowance(cc, BW_UPLOAD, nbytes);
+            if(nbytes == 0)
+            {
+                cc_throttle(cc, BW_UPLOAD);
+                return;
+            }
+
+            if(cc->zlig)
+            {
+                if(cc_upload_compress(cc, nbytes) != 0)
+                {
+                    WARNING("compressed upload failed: %s", strerror(errno));
+                    cc_close_connection(cc);
+                }
+                return;
+            }
+
             ssize_t bytes_read = cc_upload_read(cc, buf, nbytes);
             if(bytes_read == -1)
             {
@@ -352,6 +529,7 @@ void cc_out_event(struct bufferevent *bufev, void *data)
             {
                 bufferevent_write(bufev, buf, bytes_read);
                 cc->bytes_done += bytes_read;
+                cc_bandwidth_charge(cc, BW_UPLOAD, bytes_read);
             }
         }
     }
@@ -381,13 +559,110 @@ static void cc_expire_handshake_timer_event_func(int fd, short condition, void *
     cc_close_connection(cc);
 }
 
+static void cc_input_event(int fd, short why, void *data)
+{
+    cc_t *cc = data;
+    cc_in_event(cc->bufev, cc);
+}
+
+static void cc_throttle_event(int fd, short why, void *data)
+{
+    cc_t *cc = data;
+
+    cc->throttled = false;
+    if(cc->direction == CC_DIR_UPLOAD)
+        cc_out_event(cc->bufev, cc);
+    else if(cc->splicing)
+        event_add(&cc->splice_event, NULL);
+    else
+        bufferevent_enable(cc->bufev, EV_READ);
+}
+
+EP_BUFFER_CALLBACK(cc_in_event)
+EP_BUFFER_CALLBACK(cc_out_event)
+EP_ERROR_CALLBACK(cc_err_event)
+EP_EVENT_CALLBACK(cc_expire_handshake_timer_event_func)
+EP_EVENT_CALLBACK(cc_throttle_event)
+EP_EVENT_CALLBACK(cc_input_event)
+
+/* Runs cc_in_event from the event loop for data that is already in the
+ * input buffer, as the bufferevent only calls it when more data arrives.
+ */
+void cc_process_input_later(cc_t *cc)
+{
+    struct timeval tv = {.tv_sec = 0, .tv_usec = 0};
+
+    if(!event_initialized(&cc->input_event))
+        evtimer_set(&cc->input_event, EP_PROFILED(cc_input_event), cc);
+    evtimer_add(&cc->input_event, &tv);
+}
+
+static bw_bucket_t *cc_hub_bucket(cc_t *cc, bw_direction_t dir)
+{
+    return cc->hub ? &cc->hub->bw[dir] : NULL;
+}
+
+/* Returns how many of WANT bytes the transfer may move now. */
+size_t cc_bandwidth_allowance(cc_t *cc, bw_direction_t dir, size_t want)
+{
+    return bw_allowance(&cc->bw[dir], cc_hub_bucket(cc, dir), dir, want);
+}
+
+/* Charges moved bytes to the bandwidth limits and the rate meters. */
+void cc_bandwidth_charge(cc_t *cc, bw_direction_t dir, size_t nbytes)
+{
+    bw_charge(&cc->bw[dir], cc_hub_bucket(cc, dir), dir, nbytes);
+
+    uint64_t now = ep_now();
+    rm_add(&cc->rate[dir], now, nbytes);
+    if(cc->hub)
+        rm_add(&cc->hub->rate[dir], now, nbytes);
+    rm_add(rm_global(dir), now, nbytes);
+}
+
+/* Stops moving data until the bandwidth limits allow it again. Uploads
+ * stop refilling the output buffer, downloads stop reading the socket.
+ */
+void cc_throttle(cc_t *cc, bw_direction_t dir)
+{
+    if(cc->throttled)
+        return;
+
+    if(dir == BW_DOWNLOAD)
+    {
+        if(cc->splicing)
+            event_del(&cc->splice_event);
+        else
+            bufferevent_disable(cc->bufev, EV_READ);
+    }
+
+    unsigned msec = bw_delay(&cc->bw[dir], cc_hub_bucket(cc, dir), dir);
+    struct timeval tv = {.tv_sec = msec / 1000,
+        .tv_usec = (msec % 1000) * 1000};
+    evtimer_set(&cc->throttle_event, EP_PROFILED(cc_throttle_event), cc);
+    evtimer_add(&cc->throttle_event, &tv);
+    cc->throttled = true;
+}
+
+/* Changes the per-connection limit, for new and existing connections. */
+void cc_set_bandwidth_limit(bw_direction_t dir, unsigned rate)
+{
+    bw_set_connection_limit(dir, rate);
+
+    cc_t *cc;
+    LIST_FOREACH(cc, &cc_list_head, next)
+    {
+        bw_bucket_set_rate(&cc->bw[dir], rate);
+    }
+}
+
 /* Add a socket for a client connection to the main event loop.
  *
  * INCOMING_CONNECTION is true if the client connection was initiated by
  * another peer (ie, as a response to a $ConnectToMe). It is the connecting
  * peer that sends the first requests.
  */
-static void cc_add_channel(int fd, bool incoming_connection, hub_t *hub,
+cc_t *cc_add_channel(int fd, bool incoming_connection, hub_t *hub,
         struct sockaddr_in *peer_addr)
 {
     /* Create a new client connection struct */
@@ -397,11 +672,19 @@ static void cc_add_channel(int fd, bool incoming_connection, hub_t *hub,
     io_set_blocking(fd, 0);
 
     DEBUG("adding file descriptor %d to client connections", fd);
-    cc->bufev = bufferevent_new(fd, cc_in_event, cc_out_event, cc_err_event, cc);
+    cc->bufev = bufferevent_new(fd, EP_PROFILED(cc_in_event),
+            EP_PROFILED(cc_out_event), EP_PROFILED(cc_err_event), cc);
     bufferevent_enable(cc->bufev, EV_READ);
 
     LIST_INSERT_HEAD(&cc_list_head, cc, next);
 
+    if(trace_enabled())
+    {
+        trace_printf(TRACE_CLIENT, TRACE_OPEN, fd, "%s %s",
+                incoming_connection ? "in" : "out",
+                hub ? hub->address : "-");
+    }
+
     if(peer_addr)
     {
         memcpy(&cc->addr, peer_addr, sizeof(struct sockaddr_in));
@@ -409,7 +692,7 @@ static void cc_add_channel(int fd, bool incoming_connection, hub_t *hub,
 
     if(cc->incoming_connection == false)
     {
-        return_if_fail(hub);
+        return_val_if_fail(hub, cc);
         cc_send_command(cc, "$MyNick %s|", hub->me->nick);
         char *lock_pk = nmdc_makelock_pk(global_id_lock, global_id_version);
         cc_send_command(cc, "$Lock %s|", lock_pk);
@@ -419,19 +702,35 @@ static void cc_add_channel(int fd, bool incoming_connection, hub_t *hub,
     /* add a timer to close the connection if handshake takes too long time to
      * complete */
     evtimer_set(&cc->handshake_timer_event,
-            cc_expire_handshake_timer_event_func, cc);
+            EP_PROFILED(cc_expire_handshake_timer_event_func), cc);
     struct timeval tv = {.tv_sec = 90, .tv_usec = 0};
     evtimer_add(&cc->handshake_timer_event, &tv);
+
+    return cc;
 }
 
 cc_t *cc_find_by_nick_and_direction(const char *nick, cc_direction_t direction)
 {
     return_val_if_fail(nick, NULL);
 
+    cc_t key;
+    key.nick = (char *)nick;
+    key.direction = direction;
+    key.serial = UINT_MAX;
+
+    cc_t *cc = RB_NFIND(cc_nick_tree, &cc_nick_index, &key);
+    if(cc && strcmp(nick, cc->nick) == 0 && cc->direction == direction)
+        return cc;
+
+    return NULL;
+}
+
+cc_t *cc_find_by_fd(int fd)
+{
     cc_t *cc;
     LIST_FOREACH(cc, &cc_list_head, next)
     {
-        if(cc->nick && strcmp(nick, cc->nick) == 0 && cc->direction == direction)
+        if(cc->fd == fd)
         {
             return cc;
         }
@@ -447,17 +746,9 @@ cc_t *cc_find_by_nick(const char *nick)
 
 cc_t *cc_find_by_local_filename(const char *local_filename)
 {
-    cc_t *cc;
-    LIST_FOREACH(cc, &cc_list_head, next)
-    {
-        if((cc->local_filename && /* upload ? */
-            strcmp(local_filename, cc->local_filename) == 0) ||
-           (cc->current_queue && /* download ? */
-            strcmp(local_filename, cc->current_queue->target_filename) == 0))
-        {
-            return cc;
-        }
-    }
+    struct cc_target *t = cc_index_find_target(local_filename);
+    if(t && strcmp(t->target, local_filename) == 0)
+        return t->cc;
 
     return NULL;
 }
@@ -475,17 +766,11 @@ cc_t *cc_find_by_target_directory(const char *target_directory)
 
     DEBUG("looking for transfers with prefix [%s]", x);
 
+    /* targets below the directory sort right after the prefix */
     cc_t *cc = NULL;
-    LIST_FOREACH(cc, &cc_list_head, next)
-    {
-        if((cc->local_filename && /* upload ? */
-            str_has_prefix(cc->local_filename, x)) ||
-           (cc->current_queue && /* download ? */
-            str_has_prefix(cc->current_queue->target_filename, x)))
-        {
-            break;
-        }
-    }
+    struct cc_target *t = cc_index_find_target(x);
+    if(t && str_has_prefix(t->target, x))
+        cc = t->cc;
 
     free(x);
 
@@ -547,8 +832,24 @@ static void cc_send_transfer_stats(int fd, short condition, void *data)
 	    continue;
 	}
 
-	unsigned duration = now - cc->transfer_start_time;
-	unsigned bytes_per_sec = cc->bytes_done / (duration ? duration : 1);
+	/* reclaim normal slots from slow uploads while others are waiting,
+	 * unless the transfer is slow because we throttle it ourselves */
+	if(cc->direction == CC_DIR_UPLOAD && cc->slot_state == SLOT_NORMAL &&
+		now - cc->transfer_start_time >= 60 &&
+		bw_effective_limit(&cc->bw[BW_UPLOAD],
+		    cc_hub_bucket(cc, BW_UPLOAD), BW_UPLOAD) == 0)
+	{
+	    unsigned rate = rm_rate(&cc->rate[BW_UPLOAD], ep_now(), RM_60S);
+	    if(hub_slot_reclaim(rate, now))
+	    {
+		ui_send_status_message(NULL, cc->hub->address,
+			"Reclaiming upload slot from nick '%s'"
+			" (%u bytes/s, %u waiting)",
+			cc->nick, rate, hub_slot_waiters());
+		cc_close_connection(cc);
+		continue;
+	    }
+	}
 
 	const char *target = NULL;
 	if(cc->direction == CC_DIR_DOWNLOAD && cc->current_queue)
@@ -562,8 +863,13 @@ static void cc_send_transfer_stats(int fd, short condition, void *data)
 
 	if(target)
 	{
+	    bw_direction_t dir = (cc->direction == CC_DIR_UPLOAD ?
+		    BW_UPLOAD : BW_DOWNLOAD);
+	    unsigned bytes_per_sec = rm_rate(&cc->rate[dir], ep_now(), RM_10S);
 	    ui_send_transfer_stats(NULL, target, cc->bytes_done + cc->offset,
-		    cc->filesize, bytes_per_sec);
+		    cc->filesize, bytes_per_sec,
+		    bw_effective_limit(&cc->bw[dir], cc_hub_bucket(cc, dir), dir),
+		    cc->zlig ? zlig_ratio(cc->zlig) : 100);
 	}
 
 #if 0
@@ -579,6 +885,8 @@ static void cc_send_transfer_stats(int fd, short condition, void *data)
     cc_set_transfer_stats_interval(-1);
 }
 
+EP_EVENT_CALLBACK(cc_send_transfer_stats)
+
 void cc_set_transfer_stats_interval(int interval)
 {
     static struct event ev;
@@ -590,7 +898,7 @@ void cc_set_transfer_stats_interval(int interval)
     }
     else
     {
-        evtimer_set(&ev, cc_send_transfer_stats, NULL);
+        evtimer_set(&ev, EP_PROFILED(cc_send_transfer_stats), NULL);
     }
 
     if(interval != -1)
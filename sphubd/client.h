@@ -26,15 +26,31 @@
 #include <stdbool.h>
 
 #include "sys_queue.h"
+#include "sys_tree.h"
 #include "hub.h"
 #include "queue.h"
 #include "io.h"
+#include "tigertree.h"
 #include "ui.h"
 #include "xerr.h"
+#include "bandwidth.h"
+#include "rate_meter.h"
+#include "upload_cache.h"
 
 /* idle timeout in seconds before a transfer is aborted due to inactivity */
 #define CC_IDLE_TIMEOUT 5*60
 
+/* At most this many $ADCGET requests are outstanding on a connection, so
+ * small files don't cost a round trip each. Only files this small are
+ * requested ahead of time. */
+#define CC_MAX_PIPELINED_REQUESTS 4
+#define CC_PIPELINE_MAX_SIZE (1024 * 1024)
+
+/* A compressed upload reads at most this much input per out-event before
+ * flushing the compressor, so well-compressing files don't stall the
+ * event loop. */
+#define CC_COMPRESS_MAX_INPUT (64 * 1024)
+
 enum cc_direction {
     CC_DIR_UNKNOWN,
     CC_DIR_DOWNLOAD = 1,
@@ -55,11 +71,25 @@ enum cc_state
 };
 typedef enum cc_state cc_state_t;
 
+/* a download request sent ahead of the current one */
+struct cc_request
+{
+    TAILQ_ENTRY(cc_request) link;
+    queue_t *queue;
+};
+
 typedef struct cc cc_t;
 struct cc
 {
     LIST_ENTRY(cc) next;
-    
+
+    /* indexes of the connection list, see cc_index_nick and
+     * cc_index_targets */
+    unsigned serial; /* newer connections have higher serial numbers */
+    RB_ENTRY(cc) nick_link;
+    bool nick_indexed;
+    LIST_HEAD(, cc_target) targets;
+
     int fd;
     struct bufferevent *bufev;
     struct sockaddr_in addr;
@@ -80,6 +110,7 @@ struct cc
     bool has_adcget;
     bool has_tthl;
     bool has_tthf;
+    bool has_zlig;
 
     char upload_buf[4096];
     int upload_buf_offset;
@@ -99,6 +130,49 @@ struct cc
     void *leafdata;
     unsigned leafdata_len;
     unsigned leafdata_index;
+
+    /* tiger tree of the data downloaded so far, NULL if not hashing */
+    TT_CONTEXT *tth_ctx;
+
+    /* buffers downloaded data for local_fd */
+    struct download_writer *writer;
+    /* writes buffered data if no more arrives, see DW_FLUSH_INTERVAL */
+    struct event writer_flush_event;
+
+    /* if true, downloaded data is checked against the leaves of a
+     * partially shared file (see share_partial.h) */
+    bool verify_leaves;
+    TT_CONTEXT *leaf_ctx; /* hashes the leaf starting at leaf_start */
+    uint64_t leaf_start;
+
+    /* compresses or decompresses the current transfer, NULL if plain */
+    struct zlig *zlig;
+
+    /* if true, uploaded data is read through the shared block cache */
+    bool upload_cached;
+    uc_file_t upload_file;
+    uc_block_t *upload_block; /* current block of the upload, or NULL */
+
+    /* if true, downloaded data is spliced from fd instead of read by bufev */
+    bool splicing;
+    struct event splice_event;
+
+    /* per-connection bandwidth limits */
+    bw_bucket_t bw[2];
+
+    /* transfer rates of the connection */
+    rate_meter_t rate[2];
+
+    /* if true, the transfer waits for throttle_event before moving data */
+    bool throttled;
+    struct event throttle_event;
+
+    /* requests sent after current_queue, in the order they were sent */
+    TAILQ_HEAD(cc_request_list, cc_request) pipeline;
+    unsigned npipelined;
+
+    /* handles input left over when a pipelined download is finished */
+    struct event input_event;
 };
 
 cc_t *cc_new(int fd, hub_t *hub);
@@ -114,11 +188,17 @@ cc_t *cc_find_by_local_filename(const char *local_filename);
 cc_t *cc_find_by_target_directory(const char *target_directory);
 void cc_trigger_download(void);
 void cc_set_transfer_stats_interval(int interval);
+void cc_set_bandwidth_limit(bw_direction_t dir, unsigned rate);
+size_t cc_bandwidth_allowance(cc_t *cc, bw_direction_t dir, size_t want);
+void cc_bandwidth_charge(cc_t *cc, bw_direction_t dir, size_t nbytes);
+void cc_throttle(cc_t *cc, bw_direction_t dir);
 void cc_close_connection(cc_t *cc);
 void cc_close_all_connections(void);
 void cc_close_all_on_hub(hub_t *hub);
 void cc_send_ongoing_transfers(ui_t *ui);
 void cc_accept_connection(int fd, short condition, void *data);
+cc_t *cc_add_channel(int fd, bool incoming_connection, hub_t *hub,
+        struct sockaddr_in *peer_addr);
 int cc_connect(const char *address, hub_t *hub);
 
 int cc_send_string(cc_t *cc, const char *string);
@@ -126,9 +206,17 @@ int cc_send_command(cc_t *cc, const char *fmt, ...);
 int cc_send_command_as_is(cc_t *cc, const char *fmt, ...);
 void cc_in_event(struct bufferevent *bufev, void *data);
 void cc_out_event(struct bufferevent *bufev, void *data);
+void cc_process_input_later(cc_t *cc);
 
 void cc_list_init(void);
 
+/* Must be called when the nick or direction of a connection changes. */
+void cc_index_nick(cc_t *cc);
+
+/* Must be called when the local filename, current download or pipelined
+ * downloads of a connection change. */
+void cc_index_targets(cc_t *cc);
+
 /* client_cmd.c
  */
 int client_execute_command(int fd, void *data, char *cmdstr);
@@ -137,6 +225,12 @@ int client_execute_command(int fd, void *data, char *cmdstr);
  */
 void cc_download_read(cc_t *cc);
 int cc_start_download(cc_t *cc);
+void cc_download_hash_free(cc_t *cc);
+int cc_download_writer_close(cc_t *cc);
+void cc_download_splice_stop(cc_t *cc);
+void cc_download_pipeline_free(cc_t *cc);
+bool cc_download_reply_matches(cc_t *cc, const char *filename,
+        uint64_t offset);
 void cc_fl_match_queue(const char *filelist_path, const char *nick);
 
 /* client_upload.c
@@ -146,6 +240,7 @@ int cc_upload_prepare(cc_t *cc, const char *filename,
 int cc_start_upload(cc_t *cc);
 void cc_finish_upload(cc_t *cc);
 ssize_t cc_upload_read(cc_t *cc, void *buf, size_t nbytes);
+int cc_upload_compress(cc_t *cc, size_t nbytes);
 
 #endif
 
@@ -29,12 +29,21 @@
 #include "rx.h"
 #include "log.h"
 #include "xstr.h"
+#include "zlig.h"
 
 static void
 cc_download_request_failed(cc_t *cc, const char *reason)
 {
 	return_if_fail(cc->current_queue);
-	if(cc->current_queue)
+	if(cc->fetch_leaves == 1)
+	{
+		/* no leaves, just get the file */
+		INFO("failed to get leaves for [%s]: %s",
+			cc->current_queue->target_filename, reason);
+		cc->fetch_leaves = 2;
+		cc_request_download(cc);
+	}
+	else if(cc->current_queue)
 	{
 		ui_send_status_message(NULL, cc->hub ? cc->hub->address : NULL,
 			"Download request for %s from %s failed: %s",
@@ -73,13 +82,33 @@ cc_cmd_MaxedOut(void *data, int argc, char **argv)
 {
 	cc_t *cc = data;
 
-	ui_send_status_message(NULL,
-		cc->hub ? cc->hub->address : NULL,
-		"Nick %s has no free slots", cc->nick);
+	if(argc > 0 && argv[0] && *argv[0])
+	{
+		ui_send_status_message(NULL,
+			cc->hub ? cc->hub->address : NULL,
+			"Nick %s has no free slots (queued at position %s)",
+			cc->nick, argv[0]);
+	}
+	else
+	{
+		ui_send_status_message(NULL,
+			cc->hub ? cc->hub->address : NULL,
+			"Nick %s has no free slots", cc->nick);
+	}
 
 	return -1;
 }
 
+/* Tells the peer that no slot is available, and its place in the slot
+ * queue (DC++ shows the position given with $MaxedOut). */
+static int cc_send_maxed_out(cc_t *cc)
+{
+    unsigned position = hub_slot_queue_position(cc->nick);
+    if(position > 0)
+        return cc_send_command(cc, "$MaxedOut %u|", position);
+    return cc_send_command(cc, "$MaxedOut|");
+}
+
 /* $Send */
 static int cc_cmd_Send(void *data, int argc, char **argv)
 {
@@ -142,7 +171,7 @@ static int cc_cmd_Get(void *data, int argc, char **argv)
             cc->local_filename, cc->filesize);
     if(cc->slot_state == SLOT_NONE)
     {
-        cc_send_command(cc, "$MaxedOut|");
+        cc_send_maxed_out(cc);
         return -1;
     }
 
@@ -150,6 +179,26 @@ static int cc_cmd_Get(void *data, int argc, char **argv)
     return cc_send_command(cc, "$FileLength %"PRIu64"|", cc->filesize);
 }
 
+/* matches <type> <filename> <startpos> <bytes> <flag0>...<flagN> */
+#define CC_ADC_TRANSFER_RX "([^ ]+) (.+) ([0-9]+) (-?[0-9]+)([^0-9].*|)$"
+
+/* Returns true if flag is one of the space separated flags.
+ */
+static bool cc_has_flag(const char *flags, const char *flag)
+{
+    size_t len = strlen(flag);
+    const char *p = flags;
+
+    while((p = strstr(p, flag)) != NULL)
+    {
+        if((p == flags || p[-1] == ' ') && (p[len] == 0 || p[len] == ' '))
+            return true;
+        p += len;
+    }
+
+    return false;
+}
+
 /* $ADCGET <type> <filename> <startpos> <bytes> <flag0>...<flagN> */
 static int cc_cmd_ADCGET(void *data, int argc, char **argv)
 {
@@ -157,8 +206,8 @@ static int cc_cmd_ADCGET(void *data, int argc, char **argv)
 
     return_val_if_fail(cc->state == CC_STATE_READY, -1);
 
-    rx_subs_t *subs = rx_search(argv[0], "([^ ]+) (.+) ([0-9]+) (-?[0-9]+)");
-    if(subs == NULL || subs->nsubs != 4)
+    rx_subs_t *subs = rx_search(argv[0], CC_ADC_TRANSFER_RX);
+    if(subs == NULL || subs->nsubs != 5)
     {
         INFO("invalid ADCGET request");
         DEBUG("string = [%s]", argv[0]);
@@ -214,6 +263,7 @@ static int cc_cmd_ADCGET(void *data, int argc, char **argv)
         cc->bytes_done = 0;
         cc->offset = 0;
         cc->local_filename = NULL;
+        cc_index_targets(cc);
         cc->state = CC_STATE_REQUEST;
         cc->local_fd = -1; /* no local file opened, we're sending leaf data */
         return_val_if_fail(cc_start_upload(cc) == 0, -1);
@@ -252,14 +302,22 @@ static int cc_cmd_ADCGET(void *data, int argc, char **argv)
     if(cc->slot_state == SLOT_NONE)
     {
         rx_free_subs(subs);
-        cc_send_command(cc, "$MaxedOut|");
+        cc_send_maxed_out(cc);
         return -1;
     }
 
-    cc_send_command_as_is(cc, "$ADCSND file %s %"PRIu64" %"PRIu64"|",
-            filename_utf8, cc->offset, cc->bytes_to_transfer);
+    /* empty files are never compressed, there is nothing to gain */
+    bool compressed = cc_has_flag(subs->subs[4], "ZL1") &&
+        cc->bytes_to_transfer > 0;
+
+    cc_send_command_as_is(cc, "$ADCSND file %s %"PRIu64" %"PRIu64"%s|",
+            filename_utf8, cc->offset, cc->bytes_to_transfer,
+            compressed ? " ZL1" : "");
     rx_free_subs(subs);
 
+    if(compressed)
+        cc->zlig = zlig_deflate_new();
+
     cc->state = CC_STATE_REQUEST;
 
     return_val_if_fail(cc_start_upload(cc) == 0, -1);
@@ -316,7 +374,7 @@ static int cc_cmd_UGetBlock(void *data, int argc, char **argv)
             cc->local_filename, cc->filesize);
     if(cc->slot_state == SLOT_NONE)
     {
-        return cc_send_command(cc, "$MaxedOut|");
+        return cc_send_maxed_out(cc);
     }
 
     return_val_if_fail(cc_send_command(cc, "$Sending %"PRIu64"|",
@@ -346,7 +404,7 @@ static int cc_cmd_Sending(void *data, int argc, char **argv)
     return 1;
 }
 
-/* $ADCSND <type> <file> <offset> <nbytes> */
+/* $ADCSND <type> <file> <offset> <nbytes> <flag0>...<flagN> */
 /* offset is 0-based */
 static int cc_cmd_ADCSND(void *data, int argc, char **argv)
 {
@@ -354,8 +412,8 @@ static int cc_cmd_ADCSND(void *data, int argc, char **argv)
 
     return_val_if_fail(cc->state == CC_STATE_REQUEST, -1);
 
-    rx_subs_t *subs = rx_search(argv[0], "([^ ]+) (.+) ([0-9]+) (-?[0-9]+)");
-    if(subs == NULL || subs->nsubs != 4)
+    rx_subs_t *subs = rx_search(argv[0], CC_ADC_TRANSFER_RX);
+    if(subs == NULL || subs->nsubs != 5)
     {
         INFO("invalid ADCSND request");
         DEBUG("string = [%s]", argv[0]);
@@ -363,12 +421,22 @@ static int cc_cmd_ADCSND(void *data, int argc, char **argv)
         return -1;
     }
 
+    if(!cc_download_reply_matches(cc, subs->subs[1],
+                strtoull(subs->subs[2], 0, 10)))
+    {
+        rx_free_subs(subs);
+        return -1;
+    }
+
     cc->bytes_to_transfer = strtoull(subs->subs[3], 0, 10);
     if(cc->filesize == 0ULL)
     {
         cc->filesize = cc->bytes_to_transfer;
     }
 
+    if(cc_has_flag(subs->subs[4], "ZL1"))
+        cc->zlig = zlig_inflate_new();
+
     rx_free_subs(subs);
 
     return_val_if_fail(cc_start_download(cc) == 0, -1);
@@ -450,6 +518,7 @@ static int cc_cmd_Direction(void *data, int argc, char **argv)
             {
                 INFO("switching to upload");
                 cc->direction = CC_DIR_UPLOAD;
+                cc_index_nick(cc);
                 return_val_if_fail(cc->current_queue == NULL, -1);
             }
             else if(cc->challenge == challenge)
@@ -489,6 +558,8 @@ static int cc_cmd_Supports(void *data, int argc, char **argv)
                 cc->has_tthl = true;
             else if(strcmp(argv[i], "TTHF") == 0)
                 cc->has_tthf = true;
+            else if(strcmp(argv[i], "ZLIG") == 0)
+                cc->has_zlig = true;
             else
                 INFO("Client supports unknown feature %s", argv[i]);
         }
@@ -528,7 +599,7 @@ static int cc_cmd_Lock(void *data, int argc, char **argv)
 
     if(cc->extended_protocol)
     {
-        cc_send_command(cc, "$Supports MiniSlots XmlBZList ADCGet TTHL TTHF |");
+        cc_send_command(cc, "$Supports MiniSlots XmlBZList ADCGet TTHL TTHF ZLIG |");
     }
 
     cc->challenge = random();
@@ -607,6 +678,7 @@ cc_cmd_MyNick(void *data, int argc, char **argv)
 			return -1;
 		}
 	}
+	cc_index_nick(cc);
 
 	if(cc->incoming_connection)
 	{
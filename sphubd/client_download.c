@@ -31,61 +31,67 @@
 #include "log.h"
 #include "globals.h"
 #include "client.h"
+#include "base64.h"
 #include "bz2.h"
 #include "he3.h"
 #include "notifications.h"
+#include "share.h"
+#include "tthdb.h"
 #include "xerr.h"
 #include "xstr.h"
+#include "download_writer.h"
+#include "share_partial.h"
+#include "event_profile.h"
+#include "zlig.h"
 
-/* Sends a download request for the current download queue (assumes
- * cc->current_queue is already set). Chooses request command based on the
- * peers capabilities.
+/* Returns the name used to request the queue with $ADCGET. */
+static char *cc_adcget_filename(cc_t *cc, queue_t *queue)
+{
+    char *filename = 0;
+
+    if(!queue->is_filelist && queue->tth && cc->has_tthf)
+    {
+        int num_returned_bytes = asprintf(&filename, "TTH/%s", queue->tth);
+        if (num_returned_bytes == -1)
+            DEBUG("asprintf did not return anything");
+    }
+    else
+        filename = strdup(queue->source_filename);
+
+    return filename;
+}
+
+/* Sends a download request for the queue. Chooses request command based on
+ * the peers capabilities.
  *
  * returns 0 on success, any other value on error
  */
 static int
-cc_send_download_request(cc_t *cc)
+cc_send_download_request(cc_t *cc, queue_t *queue)
 {
     return_val_if_fail(cc, -1);
-    return_val_if_fail(cc->current_queue, -1);
-
-    queue_t *queue = cc->current_queue;
-    cc->state = CC_STATE_REQUEST;
-    cc->last_activity = time(0);
+    return_val_if_fail(queue, -1);
 
     if(cc->has_adcget)
     {
         if(queue->is_filelist)
         {
-            return cc_send_command_as_is(cc, "$ADCGET file %s 0 -1|",
-                    queue->source_filename);
+            /* bzip2 compressed lists don't shrink any further */
+            bool compressed = cc->has_zlig &&
+                !str_has_suffix(queue->source_filename, ".bz2");
+            return cc_send_command_as_is(cc, "$ADCGET file %s 0 -1%s|",
+                    queue->source_filename, compressed ? " ZL1" : "");
         }
         else
         {
-            const char *base = "";
-            const char *request_filename = queue->source_filename;
-            if(queue->tth && cc->has_tthf)
-            {
-                base = "TTH/";
-                request_filename = queue->tth;
-            }
-            /* fetching of TTH leafdata is not enabled, since we're not even
-             * verifying the TTH on downloaded files yet */
-#if 0
-            if(cc->has_tthl && queue->tth && cc->fetch_leaves == 0)
-            {
-                cc->fetch_leaves = 1;
-                return cc_send_command_as_is(cc, "$ADCGET tthl %s%s 0 -1|",
-                        base, request_filename);
-            }
-            else
-#endif
-            {
-                return cc_send_command_as_is(cc,
-			"$ADCGET file %s%s %"PRIu64" %"PRIu64"|",
-                        base, request_filename,
-                        queue->offset, queue->size - queue->offset);
-            }
+            char *request_filename = cc_adcget_filename(cc, queue);
+            int rc = cc_send_command_as_is(cc,
+                    "$ADCGET file %s %"PRIu64" %"PRIu64"%s|",
+                    request_filename,
+                    queue->offset, queue->size - queue->offset,
+                    cc->has_zlig ? " ZL1" : "");
+            free(request_filename);
+            return rc;
         }
     }
     else if(cc->has_xmlbzlist && queue->size > 0 && !queue->is_filelist)
@@ -101,19 +107,19 @@ cc_send_download_request(cc_t *cc)
     }
 }
 
-int
-cc_request_download(cc_t *cc)
+/* Returns the next file to download from the nick, or NULL if there is
+ * nothing more to download.
+ */
+static queue_t *
+cc_next_download(cc_t *cc)
 {
-    return_val_if_fail(cc, -1);
-    return_val_if_fail(cc->current_queue == NULL || cc->fetch_leaves == 2, -1);
-
-    queue_t *queue = cc->current_queue;
+    queue_t *queue = NULL;
     int num_returned_bytes;
     while (queue == NULL) {
         queue = queue_get_next_source_for_nick(cc->nick);
         if (queue == NULL) {
             /* no more files to download */
-            return -1;
+            return NULL;
         }
 
         queue->offset = 0ULL;
@@ -208,27 +214,348 @@ cc_request_download(cc_t *cc)
         queue = NULL;
     }
 
-    cc->current_queue = queue;
-    if (cc_send_download_request(cc) != 0) {
-        cc_close_connection(cc);
-        return -1;
+    return queue;
+}
+
+static bool cc_pipeline_accepts(queue_t *queue)
+{
+    return !queue->is_filelist &&
+        queue->size - queue->offset <= CC_PIPELINE_MAX_SIZE;
+}
+
+/* Sends requests for the files after the current one, so the peer can send
+ * them back to back. The replies arrive in the order of the requests.
+ */
+static void cc_pipeline_fill(cc_t *cc)
+{
+    if(!cc->has_adcget || cc->fetch_leaves ||
+       !cc_pipeline_accepts(cc->current_queue))
+    {
+        return;
+    }
+
+    while(cc->npipelined + 1 < CC_MAX_PIPELINED_REQUESTS)
+    {
+        queue_t *queue = cc_next_download(cc);
+        if(queue == NULL)
+            break;
+
+        if(!cc_pipeline_accepts(queue) ||
+           cc_send_download_request(cc, queue) != 0)
+        {
+            /* requested when the current download is done */
+            queue_free(queue);
+            break;
+        }
+
+        DEBUG("pipelined request for [%s]", queue->target_filename);
+        queue_set_active(queue, 1);
+
+        struct cc_request *req = calloc(1, sizeof(struct cc_request));
+        req->queue = queue;
+        TAILQ_INSERT_TAIL(&cc->pipeline, req, link);
+        cc->npipelined++;
+    }
+}
+
+static queue_t *cc_pipeline_shift(cc_t *cc)
+{
+    struct cc_request *req = TAILQ_FIRST(&cc->pipeline);
+    if(req == NULL)
+        return NULL;
+
+    TAILQ_REMOVE(&cc->pipeline, req, link);
+    cc->npipelined--;
+
+    queue_t *queue = req->queue;
+    free(req);
+    return queue;
+}
+
+void cc_download_pipeline_free(cc_t *cc)
+{
+    queue_t *queue;
+    while((queue = cc_pipeline_shift(cc)) != NULL)
+    {
+        queue_set_active(queue, 0);
+        queue_free(queue);
+    }
+}
+
+/* Checks that an $ADCSND is the reply to the current request. With
+ * pipelined requests, a reply for anything else means we have lost track
+ * of the data stream.
+ */
+bool cc_download_reply_matches(cc_t *cc, const char *filename,
+        uint64_t offset)
+{
+    return_val_if_fail(cc->current_queue, false);
+
+    char *expected;
+    uint64_t expected_offset = cc->current_queue->offset;
+    if(cc->fetch_leaves == 1)
+    {
+        int num_returned_bytes = asprintf(&expected, "TTH/%s",
+                cc->current_queue->tth);
+        if (num_returned_bytes == -1)
+            DEBUG("asprintf did not return anything");
+        expected_offset = 0;
+    }
+    else
+        expected = cc_adcget_filename(cc, cc->current_queue);
+
+    bool matches = (strcmp(filename, expected) == 0 &&
+            offset == expected_offset);
+
+    if(!matches)
+    {
+        if(cc->npipelined)
+        {
+            WARNING("got $ADCSND for [%s] at %"PRIu64", expected [%s] at %"PRIu64,
+                    filename, offset, expected, expected_offset);
+        }
+        else
+        {
+            /* not pipelining, the peer may just spell the name differently */
+            DEBUG("got $ADCSND for [%s], expected [%s]", filename, expected);
+            matches = true;
+        }
+    }
+
+    free(expected);
+    return matches;
+}
+
+/* Returns true if the leaves should be fetched before the file, so the
+ * verified parts can be shared while it is downloading. Leaves we already
+ * have in the TTH store are used directly.
+ */
+static bool cc_needs_leaves(cc_t *cc, queue_t *queue)
+{
+    if(queue->is_filelist || queue->tth == NULL || queue->tth[0] == 0 ||
+       queue->size < SHARE_PARTIAL_MIN_SIZE)
+    {
+        return false;
+    }
+
+    if(share_partial_lookup(queue->tth))
+        return false;
+
+    struct tth_entry *te = tth_store_lookup(global_tth_store, queue->tth);
+    if(te && tth_store_load_leafdata(global_tth_store, te) == 0 &&
+       share_partial_add(queue->tth, queue->target_filename, queue->size,
+           te->leafdata, te->leafdata_len) != NULL)
+    {
+        return false;
+    }
+
+    return cc->has_adcget && cc->has_tthl;
+}
+
+/* Registers the leaves fetched into the .tthl file, and keeps them in the
+ * TTH store for resumed downloads.
+ */
+static void cc_download_leaves_finish(cc_t *cc)
+{
+    queue_t *queue = cc->current_queue;
+    char *path = 0;
+    int num_returned_bytes = asprintf(&path, "%s/%s.tthl",
+            global_incomplete_directory, queue->target_filename);
+    if (num_returned_bytes == -1)
+        DEBUG("asprintf did not return anything");
+
+    void *leafdata = malloc(cc->bytes_done);
+    int fd = open(path, O_RDONLY);
+    ssize_t len = -1;
+    if(fd != -1)
+    {
+        len = read(fd, leafdata, cc->bytes_done);
+        close(fd);
+    }
+    unlink(path);
+
+    if(len != (ssize_t)cc->bytes_done)
+    {
+        WARNING("failed to read leaves from [%s]", path);
+    }
+    else if(share_partial_add(queue->tth, queue->target_filename,
+                queue->size, leafdata, len) != NULL &&
+            tth_store_lookup(global_tth_store, queue->tth) == NULL)
+    {
+        int enclen = len * 2 + 4;
+        char *leafdata_base64 = malloc(enclen);
+        if(base64_ntop(leafdata, len, leafdata_base64, enclen) > 0)
+        {
+            tth_store_add_entry(global_tth_store, queue->tth,
+                    leafdata_base64, 0);
+        }
+        free(leafdata_base64);
+    }
+
+    free(leafdata);
+    free(path);
+}
+
+int
+cc_request_download(cc_t *cc)
+{
+    return_val_if_fail(cc, -1);
+    return_val_if_fail(cc->current_queue == NULL || cc->fetch_leaves == 2, -1);
+
+    queue_t *queue = cc->current_queue;
+    if(queue == NULL && (queue = cc_pipeline_shift(cc)) != NULL)
+    {
+        /* already requested and active */
+        cc->current_queue = queue;
+        cc->state = CC_STATE_REQUEST;
+        cc->last_activity = time(0);
+    }
+    else
+    {
+        if(queue == NULL)
+        {
+            queue = cc_next_download(cc);
+            if(queue == NULL)
+            {
+                cc_index_targets(cc);
+                return -1;
+            }
+        }
+
+        cc->current_queue = queue;
+        cc->state = CC_STATE_REQUEST;
+        cc->last_activity = time(0);
+
+        int rc;
+        if(cc->fetch_leaves == 0 && cc_needs_leaves(cc, queue))
+        {
+            cc->fetch_leaves = 1;
+            rc = cc_send_command_as_is(cc, "$ADCGET tthl TTH/%s 0 -1|",
+                    queue->tth);
+        }
+        else
+            rc = cc_send_download_request(cc, queue);
+        if (rc != 0) {
+            cc_close_connection(cc);
+            return -1;
+        }
+
+        /* tell the download queue that we're now handling this request */
+        queue_set_active(queue, 1);
     }
 
     if (queue->is_filelist)
         cc->filesize = 0ULL;
     else
         cc->filesize = queue->size;
-    cc->offset = queue->offset;
+    /* leaves are always fetched from the start */
+    cc->offset = (cc->fetch_leaves == 1 ? 0 : queue->offset);
 
-    /* tell the download queue that we're now handling this request */
-    queue_set_active(queue, 1);
+    cc_pipeline_fill(cc);
+    cc_index_targets(cc);
 
     return 0;
 }
 
+void cc_download_hash_free(cc_t *cc)
+{
+    if(cc->tth_ctx)
+    {
+        tt_destroy(cc->tth_ctx);
+        free(cc->tth_ctx);
+        cc->tth_ctx = NULL;
+    }
+    if(cc->leaf_ctx)
+    {
+        tt_destroy(cc->leaf_ctx);
+        free(cc->leaf_ctx);
+        cc->leaf_ctx = NULL;
+    }
+}
+
+/* Finishes the tiger tree of a completely downloaded file and, if it matches
+ * the expected TTH, registers it with the inode in the TTH store. This way
+ * the file is already hashed when it shows up in a shared directory and is
+ * never read back from disk.
+ */
+static void cc_download_hash_finish(cc_t *cc)
+{
+    if(cc->tth_ctx == NULL)
+        return;
+
+    TT_CONTEXT *ctx = cc->tth_ctx;
+    tt_digest(ctx, NULL);
+    char *tth = tt_base32(ctx);
+    char *leafdata_base64 = tt_leafdata_base64(ctx);
+    cc_download_hash_free(cc);
+
+    queue_t *queue = cc->current_queue;
+    char *local_path = 0;
+    int num_returned_bytes = asprintf(&local_path, "%s/%s",
+            global_incomplete_directory, queue->target_filename);
+    if (num_returned_bytes == -1)
+        DEBUG("asprintf did not return anything");
+
+    struct stat stbuf;
+    if(queue->tth && strcmp(queue->tth, tth) != 0)
+    {
+        WARNING("TTH mismatch for [%s]: expected %s, got %s",
+                local_path, queue->tth, tth);
+        ui_send_status_message(NULL, cc->hub->address,
+                "Downloaded file %s doesn't match the expected TTH",
+                queue->target_filename);
+    }
+    else if(stat(local_path, &stbuf) != 0)
+    {
+        WARNING("%s: %s", local_path, strerror(errno));
+    }
+    else if(leafdata_base64)
+    {
+        if(tth_store_lookup(global_tth_store, tth) == NULL)
+            tth_store_add_entry(global_tth_store, tth, leafdata_base64, 0);
+        tth_store_add_inode(global_tth_store,
+                SHARE_STAT_TO_INODE((&stbuf)), stbuf.st_mtime, tth);
+        DEBUG("registered TTH %s for downloaded file [%s]", tth, local_path);
+    }
+
+    free(local_path);
+    free(leafdata_base64);
+    free(tth);
+}
+
+/* Writes any buffered data and frees the download writer. */
+int cc_download_writer_close(cc_t *cc)
+{
+    if(event_initialized(&cc->writer_flush_event))
+        evtimer_del(&cc->writer_flush_event);
+
+    uint64_t written = cc->writer ? dw_written(cc->writer) : 0;
+    int rc = dw_close(cc->writer);
+    cc->writer = NULL;
+
+    if(cc->verify_leaves && cc->current_queue)
+    {
+        share_partial_t *sp = share_partial_lookup(cc->current_queue->tth);
+        if(sp)
+            share_partial_set_written(sp, rc == 0 ? UINT64_MAX : written);
+    }
+
+    return rc;
+}
+
 void cc_finish_download(cc_t *cc)
 {
     INFO("finished downloading file");
+    if(cc->zlig)
+    {
+        INFO("compressed to %u%%", zlig_ratio(cc->zlig));
+        zlig_free(cc->zlig);
+        cc->zlig = NULL;
+    }
+    if(cc_download_writer_close(cc) != 0)
+    {
+        WARNING("failed to write the end of the file");
+    }
     if(close(cc->local_fd) != 0)
     {
         WARNING("close: %s", strerror(errno));
@@ -237,60 +564,188 @@ void cc_finish_download(cc_t *cc)
 
     return_if_fail(cc->current_queue);
 
-    if(cc->current_queue->is_filelist)
+    if(cc->fetch_leaves == 1)
     {
-	nc_send_filelist_finished_notification(nc_default(),
-	    cc->hub->address,
-	    cc->current_queue->nick,
-	    cc->current_queue->target_filename,
-	    cc->current_queue->auto_matched);
+        cc_download_leaves_finish(cc);
+
+        /* now request the file itself */
+        cc->fetch_leaves = 2;
     }
-    else if(cc->fetch_leaves != 1)
+    else if(!cc->current_queue->is_filelist &&
+            cc->offset + cc->bytes_done < cc->current_queue->size)
     {
-        nc_send_download_finished_notification(nc_default(),
-                cc->current_queue->target_filename);
-        ui_send_download_finished(NULL, cc->current_queue->target_filename);
+        /* The peer only had part of the file (it may still be downloading
+         * it), the rest is requested again later. */
+        INFO("got %"PRIu64" bytes of [%s], %"PRIu64" bytes left",
+                cc->bytes_done, cc->current_queue->target_filename,
+                cc->current_queue->size - cc->offset - cc->bytes_done);
+        cc_download_hash_free(cc);
+        queue_set_active(cc->current_queue, 0);
+        queue_free(cc->current_queue);
+        cc->current_queue = NULL;
+        cc->fetch_leaves = 0;
     }
-
-    if(cc->fetch_leaves != 1)
+    else
     {
+        /* must be done before the download_finished notification moves
+         * the file */
+        cc_download_hash_finish(cc);
+
         if(cc->current_queue->is_filelist)
         {
+            nc_send_filelist_finished_notification(nc_default(),
+                cc->hub->address,
+                cc->current_queue->nick,
+                cc->current_queue->target_filename,
+                cc->current_queue->auto_matched);
             queue_remove_filelist(cc->current_queue->nick);
         }
         else
         {
+            if(cc->current_queue->tth)
+                share_partial_remove(cc->current_queue->tth);
+            nc_send_download_finished_notification(nc_default(),
+                    cc->current_queue->target_filename);
+            ui_send_download_finished(NULL,
+                    cc->current_queue->target_filename);
             queue_remove_target(cc->current_queue->target_filename);
         }
         queue_free(cc->current_queue);
         cc->current_queue = NULL;
         cc->fetch_leaves = 0;
     }
-    else
-    {
-        cc->fetch_leaves = 2;
-    }
 
     cc->state = CC_STATE_READY;
     cc->last_activity = time(0);
 
     /* Request another file if there is one in queue for us */
-    cc_request_download(cc);
+    if(cc_request_download(cc) == 0 &&
+       EVBUFFER_LENGTH(EVBUFFER_INPUT(cc->bufev)) > 0)
+    {
+        /* the reply to a pipelined request may already be here */
+        cc_process_input_later(cc);
+    }
 }
 
+/* Checks downloaded data at file offset POS against the leaves of the
+ * partially shared file. Data before the first whole leaf can't be
+ * checked.
+ */
+static void cc_download_verify(cc_t *cc, uint64_t pos, char *buf, size_t len)
+{
+    share_partial_t *sp = share_partial_lookup(cc->current_queue->tth);
+    if(sp == NULL)
+    {
+        /* no longer shared */
+        cc->verify_leaves = false;
+        return;
+    }
+
+    uint64_t leafsize = share_partial_leafsize(sp);
+    uint64_t size = cc->current_queue->size;
+
+    while(len > 0)
+    {
+        if(cc->leaf_ctx == NULL)
+        {
+            uint64_t start = (pos + leafsize - 1) / leafsize * leafsize;
+            if(start >= pos + len)
+                break;
+            buf += start - pos;
+            len -= start - pos;
+            pos = start;
+
+            cc->leaf_ctx = malloc(sizeof(TT_CONTEXT));
+            tt_init(cc->leaf_ctx, 0);
+            cc->leaf_start = pos;
+        }
+
+        uint64_t leaf_end = cc->leaf_start + leafsize;
+        if(leaf_end > size)
+            leaf_end = size;
+        size_t n = len;
+        if(n > leaf_end - pos)
+            n = leaf_end - pos;
+
+        tt_update(cc->leaf_ctx, (unsigned char *)buf, n);
+        buf += n;
+        len -= n;
+        pos += n;
+
+        if(pos == leaf_end)
+        {
+            unsigned char hash[TIGERSIZE];
+            tt_digest(cc->leaf_ctx, hash);
+            unsigned leaf = cc->leaf_start / leafsize;
+            if(!share_partial_check_leaf(sp, leaf, hash))
+            {
+                WARNING("leaf %u of [%s] doesn't match the TTH",
+                        leaf, cc->current_queue->target_filename);
+            }
+            tt_init(cc->leaf_ctx, 0);
+            cc->leaf_start = pos;
+        }
+    }
+
+    share_partial_set_written(sp, dw_written(cc->writer));
+}
+
+/* Writes data the download writer has held for DW_FLUSH_INTERVAL. Without
+ * this, a stalled or throttled download would keep it unwritten (and
+ * unshared) until the connection is closed.
+ */
+static void cc_download_flush_event(int fd, short why, void *data)
+{
+    cc_t *cc = data;
+
+    if(cc->writer == NULL)
+        return;
+
+    if(dw_flush(cc->writer) != 0)
+    {
+        cc_close_connection(cc);
+        return;
+    }
+
+    if(cc->verify_leaves && cc->current_queue)
+    {
+        share_partial_t *sp = share_partial_lookup(cc->current_queue->tth);
+        if(sp)
+            share_partial_set_written(sp, dw_written(cc->writer));
+    }
+}
+
+EP_EVENT_CALLBACK(cc_download_flush_event)
+
 static int cc_download_write(cc_t *cc, char *buf, size_t bytes_read)
 {
     return_val_if_fail(cc, -1);
     return_val_if_fail(buf, -1);
 
-    if(write(cc->local_fd, buf, bytes_read) == -1)
+    if(dw_write(cc->writer, buf, bytes_read) != 0)
     {
-        WARNING("write failed: %s", strerror(errno));
         return -1;
     }
 
+    if(dw_buffered(cc->writer) > 0 &&
+       !(event_initialized(&cc->writer_flush_event) &&
+         evtimer_pending(&cc->writer_flush_event, NULL)))
+    {
+        struct timeval tv = {.tv_sec = DW_FLUSH_INTERVAL, .tv_usec = 0};
+        evtimer_set(&cc->writer_flush_event,
+                EP_PROFILED(cc_download_flush_event), cc);
+        evtimer_add(&cc->writer_flush_event, &tv);
+    }
+
+    uint64_t pos = cc->offset + cc->bytes_done;
     cc->bytes_done += bytes_read;
 
+    if(cc->tth_ctx)
+        tt_update(cc->tth_ctx, (unsigned char *)buf, bytes_read);
+
+    if(cc->verify_leaves)
+        cc_download_verify(cc, pos, buf, bytes_read);
+
     return 0;
 }
 
@@ -365,12 +820,38 @@ int cc_start_download(cc_t *cc)
     }
     free(local_dir);
 
-    if(lseek(cc->local_fd, cc->offset, SEEK_SET) == -1)
+    /* The rest of the file is preallocated, and written in large chunks
+     * to keep it from fragmenting when downloads are interleaved. */
+    cc_download_writer_close(cc);
+    cc->writer = dw_new(cc->local_fd, cc->offset,
+            cc->offset + cc->bytes_to_transfer, global_download_direct_io);
+    if(cc->writer == NULL)
     {
-        WARNING("lseek failed: %s", strerror(errno));
+        WARNING("failed to create download writer");
         return -1;
     }
 
+    /* Hash the data as it passes through, but only if we see all of it.
+     * Resumed downloads are hashed by sphashd as usual. */
+    cc_download_hash_free(cc);
+    if(cc->fetch_leaves != 1 && !cc->current_queue->is_filelist &&
+       cc->offset == 0 && cc->current_queue->size > 0)
+    {
+        cc->tth_ctx = malloc(sizeof(TT_CONTEXT));
+        tt_init(cc->tth_ctx, tt_calc_block_size(cc->current_queue->size, 10));
+    }
+
+    /* With known leaves, verified parts are shared while downloading. */
+    share_partial_t *sp = NULL;
+    if(cc->fetch_leaves != 1 && !cc->current_queue->is_filelist &&
+       cc->current_queue->tth)
+    {
+        sp = share_partial_lookup(cc->current_queue->tth);
+    }
+    cc->verify_leaves = (sp != NULL);
+    if(sp)
+        share_partial_set_written(sp, cc->offset);
+
     cc->transfer_start_time = time(0);
     cc->last_transfer_activity = time(0);
 
@@ -384,11 +865,166 @@ int cc_start_download(cc_t *cc)
     return 0;
 }
 
+/* Stops splicing and goes back to reading through the bufferevent. */
+void cc_download_splice_stop(cc_t *cc)
+{
+    if(cc->splicing)
+    {
+        event_del(&cc->splice_event);
+        bufferevent_enable(cc->bufev, EV_READ);
+        cc->splicing = false;
+    }
+}
+
+static void cc_download_splice_event(int fd, short why, void *data)
+{
+    cc_t *cc = data;
+
+    uint64_t left = cc->bytes_to_transfer - cc->bytes_done;
+    size_t len = cc_bandwidth_allowance(cc, BW_DOWNLOAD,
+            left > DW_PIPE_SIZE ? DW_PIPE_SIZE : left);
+    if(len == 0)
+    {
+        cc_throttle(cc, BW_DOWNLOAD);
+        return;
+    }
+
+    ssize_t n = dw_splice(cc->writer, cc->fd, len);
+    if(n == 0)
+    {
+        INFO("end-of-file on connection %i", cc->fd);
+        cc_close_connection(cc);
+        return;
+    }
+    if(n == -1)
+    {
+        if(errno == EAGAIN || errno == EINTR)
+            return;
+        if(!dw_can_splice(cc->writer))
+        {
+            /* nothing was lost, continue in user space */
+            cc_download_splice_stop(cc);
+            return;
+        }
+        WARNING("splice failed: %s", strerror(errno));
+        cc_close_connection(cc);
+        return;
+    }
+
+    cc->bytes_done += n;
+    cc->last_transfer_activity = time(0);
+    cc_bandwidth_charge(cc, BW_DOWNLOAD, n);
+
+    if(cc->bytes_done >= cc->bytes_to_transfer)
+    {
+        cc_download_splice_stop(cc);
+        cc_finish_download(cc);
+    }
+    else if(!dw_can_splice(cc->writer))
+    {
+        cc_download_splice_stop(cc);
+    }
+}
+
+EP_EVENT_CALLBACK(cc_download_splice_event)
+
+/* Once the input buffer is empty, the rest of the download is moved
+ * straight from the socket to the file. Not possible if we hash the data.
+ */
+static void cc_download_splice_start(cc_t *cc)
+{
+    if(cc->splicing || cc->tth_ctx || cc->verify_leaves || cc->zlig ||
+            !dw_can_splice(cc->writer))
+        return;
+
+    DEBUG("splicing download on fd %d", cc->fd);
+    bufferevent_disable(cc->bufev, EV_READ);
+    event_set(&cc->splice_event, cc->fd, EV_READ | EV_PERSIST,
+            EP_PROFILED(cc_download_splice_event), cc);
+    event_add(&cc->splice_event, NULL);
+    cc->splicing = true;
+}
+
+/* Inflates compressed data from the input buffer. The end of the
+ * compressed stream ends the reply, anything after it belongs to the next
+ * pipelined reply.
+ */
+static void cc_download_read_compressed(cc_t *cc)
+{
+    struct evbuffer *input_buffer = EVBUFFER_INPUT(cc->bufev);
+    static char buf[65536];
+
+    for(;;)
+    {
+        size_t inlen = EVBUFFER_LENGTH(input_buffer);
+        size_t outlen = sizeof(buf);
+        int rc = zlig_inflate(cc->zlig, EVBUFFER_DATA(input_buffer), &inlen,
+                buf, &outlen);
+        if(rc == -1)
+        {
+            WARNING("invalid compressed data");
+            cc_close_connection(cc);
+            return;
+        }
+
+        evbuffer_drain(input_buffer, inlen);
+        cc_bandwidth_charge(cc, BW_DOWNLOAD, inlen);
+
+        if(cc->bytes_done + outlen > cc->bytes_to_transfer)
+        {
+            WARNING("compressed data exceeds the requested size");
+            cc_close_connection(cc);
+            return;
+        }
+
+        if(outlen > 0 && cc_download_write(cc, buf, outlen) != 0)
+        {
+            cc_close_connection(cc);
+            return;
+        }
+
+        if(rc == 1)
+        {
+            if(cc->bytes_done != cc->bytes_to_transfer)
+            {
+                WARNING("compressed data ended early:"
+                        " bytes_to_transfer=%"PRIu64", bytes_done=%"PRIu64,
+                        cc->bytes_to_transfer, cc->bytes_done);
+                cc_close_connection(cc);
+                return;
+            }
+            cc_finish_download(cc);
+            return;
+        }
+
+        if(inlen == 0 && outlen == 0)
+            break;
+    }
+
+    cc->last_transfer_activity = time(0);
+    if(cc_bandwidth_allowance(cc, BW_DOWNLOAD, 1) == 0)
+        cc_throttle(cc, BW_DOWNLOAD);
+}
+
 void cc_download_read(cc_t *cc)
 {
     struct evbuffer *input_buffer = EVBUFFER_INPUT(cc->bufev);
     size_t input_data_len = EVBUFFER_LENGTH(input_buffer);
 
+    if(cc->zlig)
+    {
+        /* even an empty file is sent as a compressed stream */
+        cc_download_read_compressed(cc);
+        return;
+    }
+
+    if(cc->bytes_done >= cc->bytes_to_transfer)
+    {
+        /* nothing to read for an empty file */
+        cc_finish_download(cc);
+        return;
+    }
+
     if(input_data_len == 0)
     {
         return;
@@ -397,9 +1033,13 @@ void cc_download_read(cc_t *cc)
     uint64_t maxsize = cc->bytes_to_transfer - cc->bytes_done;
     if((uint64_t)input_data_len > maxsize)
     {
-	WARNING("truncated input data length:"
-		"bytes_to_transfer=%"PRIu64", bytes_done=%"PRIu64", maxsize=%lu",
-	    cc->bytes_to_transfer, cc->bytes_done, maxsize);
+        /* with pipelined requests, the rest is the next reply */
+        if(cc->npipelined == 0)
+        {
+            WARNING("truncated input data length:"
+                    "bytes_to_transfer=%"PRIu64", bytes_done=%"PRIu64", maxsize=%lu",
+                cc->bytes_to_transfer, cc->bytes_done, maxsize);
+        }
         input_data_len = (size_t)maxsize;
     }
 
@@ -414,11 +1054,18 @@ void cc_download_read(cc_t *cc)
         evbuffer_drain(input_buffer, input_data_len);
 
         cc->last_transfer_activity = time(0);
+        cc_bandwidth_charge(cc, BW_DOWNLOAD, input_data_len);
 
         if(cc->bytes_done >= cc->bytes_to_transfer)
         {
             cc_finish_download(cc);
         }
+        else
+        {
+            cc_download_splice_start(cc);
+            if(cc_bandwidth_allowance(cc, BW_DOWNLOAD, 1) == 0)
+                cc_throttle(cc, BW_DOWNLOAD);
+        }
     }
 }
 
@@ -32,6 +32,8 @@
 #include "globals.h"
 #include "xstr.h"
 #include "xerr.h"
+#include "share_partial.h"
+#include "zlig.h"
 
 void cc_finish_upload(cc_t *cc)
 {
@@ -40,6 +42,8 @@ void cc_finish_upload(cc_t *cc)
 	INFO("finished uploading file [%s]", cc->local_filename);
         close(cc->local_fd);
         cc->local_fd = -1;
+        uc_release(cc->upload_block);
+        cc->upload_block = NULL;
         ui_send_upload_finished(NULL, cc->local_filename);
     }
     else
@@ -51,6 +55,13 @@ void cc_finish_upload(cc_t *cc)
         cc->leafdata_len = 0;
     }
 
+    if(cc->zlig)
+    {
+        INFO("compressed to %u%%", zlig_ratio(cc->zlig));
+        zlig_free(cc->zlig);
+        cc->zlig = NULL;
+    }
+
     cc->state = CC_STATE_READY;
     cc->last_activity = time(0);
 
@@ -63,13 +74,15 @@ void cc_finish_upload(cc_t *cc)
 
     free(cc->local_filename);
     cc->local_filename = NULL;
+    cc_index_targets(cc);
 }
 
 /* Reads at most nbytes bytes of data to be uploaded to client cc.
  * Places read bytes in *buf and returns number of bytes actually read.
  *
  * Data can be read either from a file (normal file upload) or from the
- * cc->leafdata buffer when uploading TTH leaf data.
+ * cc->leafdata buffer when uploading TTH leaf data. Complete files are
+ * read through the upload cache, shared with other uploads of the file.
  *
  * Returns >= 0 on success, or -1 on error.
  */
@@ -77,6 +90,11 @@ ssize_t cc_upload_read(cc_t *cc, void *buf, size_t nbytes)
 {
     if(cc->local_fd != -1)
     {
+        if(cc->upload_cached)
+        {
+            return uc_read(&cc->upload_block, &cc->upload_file,
+                    cc->local_fd, cc->offset + cc->bytes_done, buf, nbytes);
+        }
         return read(cc->local_fd, buf, nbytes);
     }
     else
@@ -98,6 +116,93 @@ ssize_t cc_upload_read(cc_t *cc, void *buf, size_t nbytes)
     }
 }
 
+/* Reads at most nbytes bytes of data to be uploaded and writes it
+ * compressed to the output buffer. The compressor may hold back its
+ * output, so more data is read until something is written (or the stream
+ * is finished), otherwise the out-event would never be triggered again.
+ * After CC_COMPRESS_MAX_INPUT bytes the compressor is flushed instead.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+int cc_upload_compress(cc_t *cc, size_t nbytes)
+{
+    static char buf[8192];
+    static char zbuf[16384];
+    size_t written = 0;
+    size_t consumed = 0;
+    bool finish = false;
+
+    return_val_if_fail(cc->zlig, -1);
+
+    if(nbytes > sizeof(buf))
+        nbytes = sizeof(buf);
+
+    while(written == 0 && !finish)
+    {
+        if(consumed >= CC_COMPRESS_MAX_INPUT)
+        {
+            int rc;
+            do
+            {
+                size_t outlen = sizeof(zbuf);
+                rc = zlig_flush(cc->zlig, zbuf, &outlen);
+                if(rc == -1)
+                {
+                    errno = EINVAL;
+                    return -1;
+                }
+                if(outlen > 0)
+                {
+                    bufferevent_write(cc->bufev, zbuf, outlen);
+                    written += outlen;
+                }
+            } while(rc == 0);
+            break;
+        }
+
+        uint64_t left = cc->bytes_to_transfer - cc->bytes_done;
+        if(nbytes > left)
+            nbytes = left;
+
+        ssize_t bytes_read = 0;
+        if(nbytes > 0)
+        {
+            bytes_read = cc_upload_read(cc, buf, nbytes);
+            if(bytes_read == 0)
+                errno = EIO; /* file was truncated */
+            if(bytes_read <= 0)
+                return -1;
+        }
+        cc->bytes_done += bytes_read;
+        consumed += bytes_read;
+        finish = (cc->bytes_done >= cc->bytes_to_transfer);
+
+        size_t offset = 0;
+        int rc;
+        do
+        {
+            size_t inlen = bytes_read - offset;
+            size_t outlen = sizeof(zbuf);
+            rc = zlig_deflate(cc->zlig, buf + offset, &inlen,
+                    zbuf, &outlen, finish);
+            if(rc == -1)
+            {
+                errno = EINVAL;
+                return -1;
+            }
+            offset += inlen;
+            if(outlen > 0)
+            {
+                bufferevent_write(cc->bufev, zbuf, outlen);
+                written += outlen;
+            }
+        } while(offset < bytes_read || (finish && rc == 0));
+    }
+
+    cc_bandwidth_charge(cc, BW_UPLOAD, written);
+    return 0;
+}
+
 int cc_start_upload(cc_t *cc)
 {
     return_val_if_fail(cc->state == CC_STATE_REQUEST, -1);
@@ -132,9 +237,17 @@ int cc_upload_prepare(cc_t *cc, const char *filename,
 {
     char *local_filename = 0;
     int fl_type = 0;
+    share_partial_t *partial = NULL;
 
-    if (str_has_prefix(filename, "TTH/"))
+    if (str_has_prefix(filename, "TTH/")) {
         local_filename = share_translate_tth(global_share, filename + 4);
+        if (local_filename == NULL) {
+            /* we may have verified parts of a file we're downloading */
+            partial = share_partial_shared(filename + 4);
+            if (partial)
+                local_filename = share_partial_local_path(partial);
+        }
+    }
     else if ((fl_type = is_filelist(filename)) != FILELIST_NONE) {
         if (fl_type == FILELIST_DCLST) {
             xerr_set(err, -1, "NMDC-style lists no longer supported, please upgrade your client");
@@ -185,8 +298,24 @@ int cc_upload_prepare(cc_t *cc, const char *filename,
         return -1;
     }
 
+    uint64_t limit = stbuf.st_size; /* end of the data we can send */
+    if (partial) {
+        /* only the verified data is sent, possibly less than requested */
+        uint64_t available = share_partial_available(partial, offset);
+        if (available == 0) {
+            INFO("%s: no verified data at offset %"PRIu64,
+                    local_filename, offset);
+            free(local_filename);
+            xerr_set(err, -1, "File Not Available");
+            return -1;
+        }
+        if (bytes_to_transfer == 0 || bytes_to_transfer > available)
+            bytes_to_transfer = available;
+        limit = offset + available;
+    }
+
     if (bytes_to_transfer > 0) {
-        if (stbuf.st_size < offset + bytes_to_transfer) {
+        if (limit < offset + bytes_to_transfer) {
             INFO("%s: Request for too many bytes: st_size = %"PRIu64","
                     " offset = %"PRIu64", bytes_to_transfer = %"PRIu64,
                     local_filename, (uint64_t)stbuf.st_size,
@@ -198,7 +327,7 @@ int cc_upload_prepare(cc_t *cc, const char *filename,
         cc->bytes_to_transfer = bytes_to_transfer;
     }
     else
-        cc->bytes_to_transfer = stbuf.st_size - offset;
+        cc->bytes_to_transfer = limit - offset;
         
     DEBUG("set cc->bytes_to_transfer = %"PRIu64, cc->bytes_to_transfer);
 
@@ -218,12 +347,19 @@ int cc_upload_prepare(cc_t *cc, const char *filename,
         return -1;
     }
 
+    /* partial files are still being written, so their blocks may change */
+    struct stat fdst;
+    cc->upload_cached = (partial == NULL && fstat(cc->local_fd, &fdst) == 0);
+    if (cc->upload_cached)
+        uc_file_init(&cc->upload_file, &fdst);
+
     cc->offset = offset;
     cc->local_filename = local_filename;
-    cc->filesize = stbuf.st_size;
+    cc->filesize = partial ? share_partial_file(partial)->size : stbuf.st_size;
     cc->bytes_done = 0ULL;
 
     cc->upload_buf_size = cc->upload_buf_offset = 0;
+    cc_index_targets(cc);
 
     return 0;
 }
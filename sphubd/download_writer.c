@@ -0,0 +1,517 @@
+/*
+ * Copyright (c) 2008 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "download_writer.h"
+#include "log.h"
+
+struct download_writer
+{
+    int fd;
+    uint64_t pos; /* file offset of the first buffered byte */
+
+    char *buf;
+    size_t size;
+    size_t len;
+    time_t buffered_since;
+
+    bool direct_io; /* use O_DIRECT when possible */
+    bool direct_enabled; /* O_DIRECT is currently set on fd */
+    unsigned nwrites;
+
+    bool splice_failed;
+    int pipe[2]; /* for splice, created on first use */
+};
+
+static void dw_preallocate(int fd, uint64_t offset, uint64_t size)
+{
+    if(size <= offset)
+        return;
+
+#if defined(FALLOC_FL_KEEP_SIZE)
+    if(fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, size - offset) != 0)
+    {
+        DEBUG("fallocate: %s (ignored)", strerror(errno));
+    }
+#elif defined(F_PREALLOCATE)
+    fstore_t store = {F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, size - offset, 0};
+    if(fcntl(fd, F_PREALLOCATE, &store) == -1)
+    {
+        store.fst_flags = F_ALLOCATEALL;
+        if(fcntl(fd, F_PREALLOCATE, &store) == -1)
+        {
+            DEBUG("F_PREALLOCATE: %s (ignored)", strerror(errno));
+        }
+    }
+#endif
+}
+
+download_writer_t *dw_new(int fd, uint64_t offset, uint64_t size,
+        bool direct_io)
+{
+    download_writer_t *dw = calloc(1, sizeof(download_writer_t));
+    dw->fd = fd;
+    dw->pos = offset;
+    dw->pipe[0] = dw->pipe[1] = -1;
+
+    /* no need for a full buffer for small files */
+    dw->size = DW_BUFFER_SIZE;
+    if(size > offset && size - offset < DW_BUFFER_SIZE)
+    {
+        dw->size = (size - offset + DW_ALIGN - 1) & ~(DW_ALIGN - 1);
+    }
+    if(posix_memalign((void **)&dw->buf, DW_ALIGN, dw->size) != 0)
+    {
+        free(dw);
+        return NULL;
+    }
+
+#ifdef O_DIRECT
+    dw->direct_io = direct_io;
+#endif
+
+    dw_preallocate(fd, offset, size);
+
+    return dw;
+}
+
+static void dw_set_direct(download_writer_t *dw, bool enable)
+{
+#ifdef O_DIRECT
+    if(enable == dw->direct_enabled)
+        return;
+
+    int flags = fcntl(dw->fd, F_GETFL);
+    if(flags == -1 ||
+       fcntl(dw->fd, F_SETFL, enable ? flags | O_DIRECT : flags & ~O_DIRECT) == -1)
+    {
+        if(enable)
+        {
+            DEBUG("unable to enable O_DIRECT: %s", strerror(errno));
+            dw->direct_io = false;
+        }
+        return;
+    }
+    dw->direct_enabled = enable;
+#endif
+}
+
+static ssize_t dw_pwrite(download_writer_t *dw, const char *buf, size_t len,
+        uint64_t pos)
+{
+    ssize_t rc = pwrite(dw->fd, buf, len, pos);
+    dw->nwrites++;
+
+    if(rc == -1 && errno == EINVAL && dw->direct_enabled)
+    {
+        /* the filesystem doesn't support O_DIRECT after all */
+        DEBUG("O_DIRECT write failed, falling back to buffered writes");
+        dw->direct_io = false;
+        dw_set_direct(dw, false);
+        rc = pwrite(dw->fd, buf, len, pos);
+        dw->nwrites++;
+    }
+
+    return rc;
+}
+
+int dw_flush(download_writer_t *dw)
+{
+    if(dw->len == 0)
+        return 0;
+
+    /* O_DIRECT requires aligned file offsets and lengths, the tail of the
+     * file is written through the page cache */
+    if(dw->direct_io)
+    {
+        dw_set_direct(dw, dw->pos % DW_ALIGN == 0 && dw->len % DW_ALIGN == 0);
+    }
+
+    size_t done = 0;
+    while(done < dw->len)
+    {
+        ssize_t rc = dw_pwrite(dw, dw->buf + done, dw->len - done,
+                dw->pos + done);
+        if(rc == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            WARNING("write failed: %s", strerror(errno));
+            return -1;
+        }
+        done += rc;
+    }
+
+    dw->pos += dw->len;
+    dw->len = 0;
+
+    return 0;
+}
+
+int dw_write(download_writer_t *dw, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while(len > 0)
+    {
+        if(dw->len == 0)
+            dw->buffered_since = time(0);
+
+        /* end the first write on an alignment boundary, so the following
+         * ones are aligned */
+        size_t threshold = dw->size - (dw->pos % DW_ALIGN);
+        size_t n = threshold - dw->len;
+        if(n > len)
+            n = len;
+        memcpy(dw->buf + dw->len, p, n);
+        dw->len += n;
+        p += n;
+        len -= n;
+
+        if(dw->len == threshold && dw_flush(dw) != 0)
+            return -1;
+    }
+
+    if(dw->len > 0 && time(0) - dw->buffered_since >= DW_FLUSH_INTERVAL)
+        return dw_flush(dw);
+
+    return 0;
+}
+
+bool dw_can_splice(const download_writer_t *dw)
+{
+#ifdef SPLICE_F_MOVE
+    return !dw->splice_failed;
+#else
+    return false;
+#endif
+}
+
+#ifdef SPLICE_F_MOVE
+
+static int dw_splice_open_pipe(download_writer_t *dw)
+{
+    if(pipe(dw->pipe) != 0)
+    {
+        WARNING("pipe: %s", strerror(errno));
+        return -1;
+    }
+
+    int i;
+    for(i = 0; i < 2; i++)
+    {
+        int flags = fcntl(dw->pipe[i], F_GETFL);
+        fcntl(dw->pipe[i], F_SETFL, flags | O_NONBLOCK);
+    }
+
+#ifdef F_SETPIPE_SZ
+    /* fewer system calls per megabyte, ignore failures */
+    fcntl(dw->pipe[1], F_SETPIPE_SZ, DW_PIPE_SIZE);
+#endif
+
+    return 0;
+}
+
+/* Writes len bytes waiting in the pipe through the buffer, after splicing
+ * to the file failed.
+ */
+static int dw_splice_drain_pipe(download_writer_t *dw, size_t len)
+{
+    while(len > 0)
+    {
+        size_t n = len < dw->size ? len : dw->size;
+        ssize_t rc = read(dw->pipe[0], dw->buf, n);
+        if(rc <= 0)
+        {
+            if(rc == -1 && errno == EINTR)
+                continue;
+            WARNING("read from pipe failed: %s",
+                    rc == 0 ? "end of file" : strerror(errno));
+            return -1;
+        }
+        dw->len = rc;
+        if(dw_flush(dw) != 0)
+            return -1;
+        len -= rc;
+    }
+
+    return 0;
+}
+
+ssize_t dw_splice(download_writer_t *dw, int sockfd, size_t len)
+{
+    if(dw->splice_failed)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(dw_flush(dw) != 0)
+        return -1;
+
+    /* O_DIRECT is only used for our own aligned writes */
+    dw_set_direct(dw, false);
+
+    if(dw->pipe[0] == -1 && dw_splice_open_pipe(dw) != 0)
+    {
+        dw->splice_failed = true;
+        errno = EINVAL;
+        return -1;
+    }
+
+    ssize_t n = splice(sockfd, NULL, dw->pipe[1], NULL, len,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(n <= 0)
+    {
+        if(n == -1 && (errno == EINVAL || errno == ENOSYS))
+        {
+            DEBUG("unable to splice from socket: %s", strerror(errno));
+            dw->splice_failed = true;
+        }
+        return n;
+    }
+
+    size_t left = n;
+    while(left > 0)
+    {
+        loff_t off = dw->pos;
+        ssize_t rc = splice(dw->pipe[0], NULL, dw->fd, &off, left,
+                SPLICE_F_MOVE);
+        dw->nwrites++;
+        if(rc == -1 && errno == EINTR)
+            continue;
+        if(rc <= 0)
+        {
+            DEBUG("unable to splice to file: %s", strerror(errno));
+            dw->splice_failed = true;
+            if(dw_splice_drain_pipe(dw, left) != 0)
+                return -1;
+            break;
+        }
+        dw->pos += rc;
+        left -= rc;
+    }
+
+    return n;
+}
+
+#else
+
+ssize_t dw_splice(download_writer_t *dw, int sockfd, size_t len)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+#endif
+
+int dw_close(download_writer_t *dw)
+{
+    if(dw == NULL)
+        return 0;
+
+    int rc = dw_flush(dw);
+    dw_set_direct(dw, false);
+    if(dw->pipe[0] != -1)
+    {
+        close(dw->pipe[0]);
+        close(dw->pipe[1]);
+    }
+    DEBUG("wrote up to offset %"PRIu64" in %u writes", dw->pos, dw->nwrites);
+
+    free(dw->buf);
+    free(dw);
+
+    return rc;
+}
+
+uint64_t dw_written(const download_writer_t *dw)
+{
+    return dw->pos;
+}
+
+size_t dw_buffered(const download_writer_t *dw)
+{
+    return dw->len;
+}
+
+unsigned dw_nwrites(const download_writer_t *dw)
+{
+    return dw->nwrites;
+}
+
+#ifdef TEST
+
+#include <sys/socket.h>
+
+#include "unit_test.h"
+
+static char *make_data(size_t len)
+{
+    char *data = malloc(len);
+    size_t i;
+    for(i = 0; i < len; i++)
+        data[i] = (i * 7 + i / 4096) & 0xFF;
+    return data;
+}
+
+/* writes data[offset..size) in chunks of varying size */
+static unsigned write_file(const char *filename, const char *data,
+        uint64_t offset, uint64_t size, bool direct_io)
+{
+    int fd = open(filename, O_RDWR | O_CREAT, 0644);
+    fail_unless(fd != -1);
+
+    download_writer_t *dw = dw_new(fd, offset, size, direct_io);
+    fail_unless(dw);
+
+    uint64_t pos = offset;
+    size_t chunk = 1;
+    while(pos < size)
+    {
+        size_t n = chunk;
+        if(n > size - pos)
+            n = size - pos;
+        fail_unless(dw_write(dw, data + pos, n) == 0);
+        pos += n;
+        chunk = (chunk * 3 + 1) % 20000;
+    }
+
+    /* nothing has been written beyond what was requested */
+    struct stat sb;
+    fail_unless(fstat(fd, &sb) == 0);
+    fail_unless((uint64_t)sb.st_size <= size);
+    fail_unless(dw_written(dw) == (uint64_t)sb.st_size);
+    fail_unless(dw_written(dw) + dw_buffered(dw) == size);
+
+    unsigned nwrites = dw_nwrites(dw);
+    fail_unless(dw_flush(dw) == 0);
+    fail_unless(dw_written(dw) == size);
+    fail_unless(dw_buffered(dw) == 0);
+    fail_unless(dw_close(dw) == 0);
+    close(fd);
+
+    return nwrites;
+}
+
+static void check_file(const char *filename, const char *data, uint64_t size)
+{
+    int fd = open(filename, O_RDONLY);
+    fail_unless(fd != -1);
+    char *buf = malloc(size + 1);
+    fail_unless(read(fd, buf, size + 1) == (ssize_t)size);
+    fail_unless(memcmp(buf, data, size) == 0);
+    free(buf);
+    close(fd);
+}
+
+int main(void)
+{
+    sp_log_set_level("debug");
+
+    char filename[] = "download_writer_test.XXXXXX";
+    int fd = mkstemp(filename);
+    fail_unless(fd != -1);
+    close(fd);
+
+    uint64_t size = 5 * DW_BUFFER_SIZE + 12345;
+    char *data = make_data(size);
+
+    /* one write per full buffer, the tail is written on close */
+    unsigned nwrites = write_file(filename, data, 0, size, false);
+    fail_unless(nwrites == 5);
+    check_file(filename, data, size);
+
+    /* resume at an unaligned offset */
+    uint64_t offset = 3 * DW_BUFFER_SIZE / 2 + 17;
+    fail_unless(truncate(filename, offset) == 0);
+    nwrites = write_file(filename, data, offset, size, false);
+    fail_unless(nwrites == 3);
+    check_file(filename, data, size);
+
+    /* O_DIRECT, or buffered writes where not supported */
+    unlink(filename);
+    write_file(filename, data, 0, size, true);
+    check_file(filename, data, size);
+
+    /* buffered data followed by data spliced from a socket */
+    unlink(filename);
+    fd = open(filename, O_RDWR | O_CREAT, 0644);
+    fail_unless(fd != -1);
+    int sv[2];
+    fail_unless(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    fail_unless(fcntl(sv[0], F_SETFL, O_NONBLOCK) == 0);
+    download_writer_t *dw = dw_new(fd, 0, size, false);
+    fail_unless(dw_write(dw, data, 1000) == 0);
+    uint64_t sent = 1000, received = 1000;
+    while(received < size)
+    {
+        if(sent < size)
+        {
+            size_t n = size - sent < 65536 ? size - sent : 65536;
+            ssize_t rc = write(sv[1], data + sent, n);
+            fail_unless(rc > 0);
+            sent += rc;
+        }
+        if(!dw_can_splice(dw))
+        {
+            char buf[65536];
+            ssize_t rc = read(sv[0], buf, sizeof(buf));
+            fail_unless(rc > 0);
+            fail_unless(dw_write(dw, buf, rc) == 0);
+            received += rc;
+            continue;
+        }
+        ssize_t rc = dw_splice(dw, sv[0], size - received);
+        fail_unless(rc > 0 || (rc == -1 && (errno == EAGAIN ||
+                        !dw_can_splice(dw))));
+        if(rc > 0)
+            received += rc;
+    }
+    close(sv[1]);
+    if(dw_can_splice(dw))
+        fail_unless(dw_splice(dw, sv[0], 1) == 0); /* end of file */
+    fail_unless(dw_close(dw) == 0);
+    close(sv[0]);
+    close(fd);
+    check_file(filename, data, size);
+
+    /* a small file, and a file of unknown size */
+    unlink(filename);
+    write_file(filename, data, 0, 1000, false);
+    check_file(filename, data, 1000);
+    unlink(filename);
+    write_file(filename, data, 0, 0, false);
+    check_file(filename, data, 0);
+
+    unlink(filename);
+    free(data);
+
+    return 0;
+}
+
+#endif
+
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2008 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _download_writer_h_
+#define _download_writer_h_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Writes downloaded data to a file in large, aligned chunks.
+ *
+ * The rest of the file is preallocated when the writer is created, without
+ * changing the file size (which is used to resume downloads). Data is
+ * collected in a buffer and written when the buffer is full, when the
+ * oldest buffered data is older than DW_FLUSH_INTERVAL, or when the writer
+ * is closed. The age is only checked by dw_write, so a caller that may
+ * stop writing should call dw_flush from a timer while dw_buffered is
+ * non-zero. Buffer-sized writes start at DW_ALIGN boundaries, and can
+ * optionally bypass the page cache with O_DIRECT.
+ *
+ * On Linux, data can also be moved straight from a socket to the file
+ * with splice(2), without copying it through user space.
+ */
+
+#define DW_BUFFER_SIZE (1024 * 1024)
+#define DW_ALIGN 4096
+#define DW_FLUSH_INTERVAL 2 /* seconds */
+#define DW_PIPE_SIZE (1024 * 1024) /* requested size of the splice pipe */
+
+typedef struct download_writer download_writer_t;
+
+/* The data is written to fd starting at offset. If size is non-zero, the
+ * file is expected to grow to size bytes and is preallocated.
+ */
+download_writer_t *dw_new(int fd, uint64_t offset, uint64_t size,
+        bool direct_io);
+
+/* Returns 0 on success, -1 with errno set if buffered data couldn't be
+ * written.
+ */
+int dw_write(download_writer_t *dw, const void *buf, size_t len);
+int dw_flush(download_writer_t *dw);
+
+/* Moves at most len bytes from the socket to the file. Buffered data is
+ * written first. Returns the number of bytes moved, 0 at end of file or -1
+ * with errno set (EAGAIN if no data is available).
+ *
+ * If splicing turns out not to work for the socket or the file,
+ * dw_can_splice returns false from then on and the caller should go back
+ * to dw_write. Data already taken from the socket is never lost.
+ */
+ssize_t dw_splice(download_writer_t *dw, int sockfd, size_t len);
+bool dw_can_splice(const download_writer_t *dw);
+
+/* Flushes and frees the writer, the file descriptor is not closed. */
+int dw_close(download_writer_t *dw);
+
+/* Returns the file offset up to which data has been written to the file,
+ * data after that may still be buffered.
+ */
+uint64_t dw_written(const download_writer_t *dw);
+
+/* number of bytes buffered but not yet written */
+size_t dw_buffered(const download_writer_t *dw);
+
+/* number of write system calls so far */
+unsigned dw_nwrites(const download_writer_t *dw);
+
+#endif
+
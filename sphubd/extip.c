@@ -39,6 +39,7 @@
 #include "util.h"
 #include "rx.h"
 #include "notifications.h"
+#include "event_profile.h"
 
 static struct {
 	const char *host;
@@ -423,13 +424,15 @@ static void extip_run_update(int fd, short why, void *data)
 	extip_send_lookup_request(data);
 }
 
+EP_EVENT_CALLBACK(extip_run_update)
+
 /* Set a timer that will send a lookup request.
  */
 static void extip_schedule_update(struct lookup_info *info)
 {
 	if(event_initialized(&info->ev))
 		evtimer_del(&info->ev);
-	evtimer_set(&info->ev, extip_run_update, info);
+	evtimer_set(&info->ev, EP_PROFILED(extip_run_update), info);
 
 	struct timeval tv = {.tv_sec = 30, .tv_usec = 0};
 	evtimer_add(&info->ev, &tv);
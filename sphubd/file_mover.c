@@ -0,0 +1,614 @@
+/*
+ * Copyright (c) 2008 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Moves finished downloads to the download directory.
+ *
+ * A plain rename() is used whenever possible. If the incomplete and download
+ * directories are on different devices, the file (or directory tree) is
+ * copied to a hidden name in the target directory, a chunk at a time from a
+ * timer event so the main loop is never blocked for long. Holes in sparse
+ * files are preserved. When everything is copied and synced, the copy is
+ * renamed into place and the source is removed. Moves are done one at a
+ * time, in the order they were requested.
+ */
+
+#include "sys_queue.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef __linux__
+# include <sys/sendfile.h>
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "file_mover.h"
+#include "globals.h"
+#include "log.h"
+#include "share.h"
+#include "tthdb.h"
+#include "ui.h"
+#include "xstr.h"
+#include "event_profile.h"
+
+/* max number of bytes copied in each event */
+#define FILE_MOVER_CHUNK_SIZE (2*1024*1024)
+
+struct file_mover_entry
+{
+	char *path; /* relative to source and target, "" for the top level */
+	bool is_directory;
+};
+
+struct file_mover_job
+{
+	TAILQ_ENTRY(file_mover_job) link;
+
+	char *source;
+	char *target;
+	char *tmp_target; /* hidden name in the target directory */
+
+	file_mover_done_func_t done_func;
+	void *user_data;
+
+	/* all directories and files, parents before children */
+	struct file_mover_entry *entries;
+	unsigned nentries;
+	unsigned index;
+
+	uint64_t total_bytes;
+	uint64_t bytes_done;
+	time_t last_progress;
+
+	/* the file currently being copied */
+	int src_fd;
+	int dst_fd;
+	struct stat src_st;
+	off_t offset;
+	/* range of the previous chunk, its writeback has been started */
+	off_t writeback_start;
+	off_t writeback_end;
+};
+
+static TAILQ_HEAD(, file_mover_job) fm_jobs = TAILQ_HEAD_INITIALIZER(fm_jobs);
+static struct event fm_event;
+
+static void fm_event_func(int fd, short why, void *data);
+
+static char *
+fm_path(const char *base, const char *relpath)
+{
+	char *path = 0;
+	if(asprintf(&path, "%s%s", base, relpath) == -1)
+		return NULL;
+	return path;
+}
+
+static void
+fm_add_entry(struct file_mover_job *job, const char *relpath,
+	bool is_directory)
+{
+	job->entries = realloc(job->entries,
+		(job->nentries + 1) * sizeof(struct file_mover_entry));
+	job->entries[job->nentries].path = strdup(relpath);
+	job->entries[job->nentries].is_directory = is_directory;
+	job->nentries++;
+}
+
+/* Recursively lists all files and directories in the source.
+ * Returns 0 or an errno value. */
+static int
+fm_scan(struct file_mover_job *job, const char *relpath)
+{
+	int error = 0;
+	char *path = fm_path(job->source, relpath);
+	return_val_if_fail(path, ENOMEM);
+
+	struct stat stbuf;
+	if(lstat(path, &stbuf) != 0)
+	{
+		error = errno;
+		WARNING("%s: %s", path, strerror(error));
+	}
+	else if(S_ISDIR(stbuf.st_mode))
+	{
+		fm_add_entry(job, relpath, true);
+
+		DIR *dir = opendir(path);
+		if(dir == NULL)
+		{
+			error = errno;
+			WARNING("%s: %s", path, strerror(error));
+		}
+		else
+		{
+			struct dirent *dp;
+			while(error == 0 && (dp = readdir(dir)) != NULL)
+			{
+				if(strcmp(dp->d_name, ".") == 0 ||
+				   strcmp(dp->d_name, "..") == 0)
+					continue;
+
+				char *subpath = 0;
+				if(asprintf(&subpath, "%s/%s",
+					relpath, dp->d_name) == -1)
+				{
+					error = ENOMEM;
+					break;
+				}
+				error = fm_scan(job, subpath);
+				free(subpath);
+			}
+			closedir(dir);
+		}
+	}
+	else if(S_ISREG(stbuf.st_mode))
+	{
+		fm_add_entry(job, relpath, false);
+		job->total_bytes += stbuf.st_size;
+	}
+	else
+	{
+		WARNING("not moving [%s]: not a regular file", path);
+	}
+
+	free(path);
+	return error;
+}
+
+static void
+fm_job_free(struct file_mover_job *job)
+{
+	unsigned i;
+	for(i = 0; i < job->nentries; i++)
+		free(job->entries[i].path);
+	free(job->entries);
+	free(job->source);
+	free(job->target);
+	free(job->tmp_target);
+	free(job);
+}
+
+/* Removes all listed entries below base, children before parents. */
+static void
+fm_remove_entries(struct file_mover_job *job, const char *base)
+{
+	unsigned i;
+	for(i = job->nentries; i > 0; i--)
+	{
+		struct file_mover_entry *e = &job->entries[i - 1];
+		char *path = fm_path(base, e->path);
+		if(path == NULL)
+			continue;
+		int rc = e->is_directory ? rmdir(path) : unlink(path);
+		if(rc != 0 && errno != ENOENT)
+			WARNING("%s: %s", path, strerror(errno));
+		free(path);
+	}
+}
+
+/* The copy has a new inode; carry over the TTH of the original so the
+ * file isn't hashed again. */
+static void
+fm_carry_over_tth(struct file_mover_job *job)
+{
+	struct stat dst_st;
+	if(global_tth_store == NULL || fstat(job->dst_fd, &dst_st) != 0)
+		return;
+
+	struct tth_inode *ti = tth_store_lookup_inode(global_tth_store,
+		SHARE_STAT_TO_INODE((&job->src_st)));
+	if(ti == NULL || ti->mtime != job->src_st.st_mtime)
+		return;
+
+	char tth[40];
+	strlcpy(tth, ti->tth, sizeof(tth));
+	tth_store_add_inode(global_tth_store,
+		SHARE_STAT_TO_INODE((&dst_st)), dst_st.st_mtime, tth);
+}
+
+static ssize_t
+fm_copy_range(int src_fd, int dst_fd, off_t offset, size_t len)
+{
+#ifdef __linux__
+	static bool use_copy_file_range = true;
+	static bool use_sendfile = true;
+
+	if(use_copy_file_range)
+	{
+		loff_t in = offset, out = offset;
+		ssize_t n = copy_file_range(src_fd, &in, dst_fd, &out, len, 0);
+		if(n >= 0)
+			return n;
+		if(errno != ENOSYS && errno != EXDEV && errno != EINVAL &&
+		   errno != EOPNOTSUPP)
+			return -1;
+		DEBUG("copy_file_range: %s, falling back to sendfile",
+			strerror(errno));
+		use_copy_file_range = false;
+	}
+
+	if(use_sendfile)
+	{
+		off_t in = offset;
+		if(lseek(dst_fd, offset, SEEK_SET) == -1)
+			return -1;
+		ssize_t n = sendfile(dst_fd, src_fd, &in, len);
+		if(n >= 0)
+			return n;
+		if(errno != ENOSYS && errno != EINVAL)
+			return -1;
+		DEBUG("sendfile: %s, falling back to read/write",
+			strerror(errno));
+		use_sendfile = false;
+	}
+#endif
+
+	static char buf[64 * 1024];
+	if(len > sizeof(buf))
+		len = sizeof(buf);
+	ssize_t n = pread(src_fd, buf, len, offset);
+	if(n <= 0)
+		return n;
+
+	ssize_t written = 0;
+	while(written < n)
+	{
+		ssize_t w = pwrite(dst_fd, buf + written, n - written,
+			offset + written);
+		if(w == -1)
+			return -1;
+		written += w;
+	}
+	return n;
+}
+
+static int
+fm_open_file(struct file_mover_job *job, struct file_mover_entry *e)
+{
+	int error = 0;
+	char *src = fm_path(job->source, e->path);
+	char *dst = fm_path(job->tmp_target, e->path);
+	return_val_if_fail(src && dst, ENOMEM);
+
+	job->src_fd = open(src, O_RDONLY);
+	if(job->src_fd == -1 || fstat(job->src_fd, &job->src_st) != 0)
+	{
+		error = errno;
+		WARNING("%s: %s", src, strerror(error));
+	}
+	else
+	{
+		job->dst_fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC,
+			job->src_st.st_mode & 0777);
+		/* Extending the file to its full size leaves any regions we
+		 * don't write as holes. */
+		if(job->dst_fd == -1 ||
+		   ftruncate(job->dst_fd, job->src_st.st_size) != 0)
+		{
+			error = errno;
+			WARNING("%s: %s", dst, strerror(error));
+		}
+	}
+
+	job->offset = 0;
+	job->writeback_start = job->writeback_end = 0;
+	free(src);
+	free(dst);
+	return error;
+}
+
+static int
+fm_close_file(struct file_mover_job *job)
+{
+	int error = 0;
+
+	struct timeval tv[2] = {
+		{ .tv_sec = job->src_st.st_atime, .tv_usec = 0 },
+		{ .tv_sec = job->src_st.st_mtime, .tv_usec = 0 }
+	};
+	if(futimes(job->dst_fd, tv) != 0)
+		WARNING("futimes: %s", strerror(errno));
+
+	if(fsync(job->dst_fd) != 0)
+	{
+		error = errno;
+		WARNING("fsync: %s", strerror(error));
+	}
+	else
+		fm_carry_over_tth(job);
+
+	if(close(job->dst_fd) != 0 && error == 0)
+		error = errno;
+	close(job->src_fd);
+	job->dst_fd = -1;
+	job->src_fd = -1;
+
+	return error;
+}
+
+/* Starts writing back the chunk just copied, and waits for the previous
+ * one, which has had a round of the event loop to complete. This keeps the
+ * amount of dirty data small, so the fsync when the file is done doesn't
+ * stall the event loop while a whole file is written out. */
+static void
+fm_writeback(struct file_mover_job *job, off_t start)
+{
+#ifdef SYNC_FILE_RANGE_WRITE
+	if(job->writeback_end > job->writeback_start)
+		sync_file_range(job->dst_fd, job->writeback_start,
+			job->writeback_end - job->writeback_start,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+			SYNC_FILE_RANGE_WAIT_AFTER);
+
+	/* errors are reported by fsync */
+	if(job->offset > start)
+		sync_file_range(job->dst_fd, start, job->offset - start,
+			SYNC_FILE_RANGE_WRITE);
+	job->writeback_start = start;
+	job->writeback_end = job->offset;
+#endif
+}
+
+/* Copies at most FILE_MOVER_CHUNK_SIZE bytes of the current file, skipping
+ * holes. Returns 0 or an errno value. */
+static int
+fm_copy_chunk(struct file_mover_job *job)
+{
+	off_t size = job->src_st.st_size;
+	size_t budget = FILE_MOVER_CHUNK_SIZE;
+	off_t start = job->offset;
+
+	while(budget > 0 && job->offset < size)
+	{
+		off_t data = job->offset;
+		off_t hole = size;
+#ifdef SEEK_DATA
+		data = lseek(job->src_fd, job->offset, SEEK_DATA);
+		if(data == -1)
+		{
+			if(errno == ENXIO)
+				data = size; /* only a hole left */
+			else
+				data = job->offset; /* not supported */
+		}
+		else
+		{
+			hole = lseek(job->src_fd, data, SEEK_HOLE);
+			if(hole == -1)
+				hole = size;
+		}
+#endif
+		/* skipped holes count as done */
+		job->bytes_done += data - job->offset;
+		job->offset = data;
+		if(job->offset >= size)
+			break;
+
+		size_t len = hole - data;
+		if(len > budget)
+			len = budget;
+
+		ssize_t n = fm_copy_range(job->src_fd, job->dst_fd,
+			job->offset, len);
+		if(n == -1)
+		{
+			WARNING("copy failed: %s", strerror(errno));
+			return errno;
+		}
+		if(n == 0)
+		{
+			WARNING("unexpected end of file (file truncated?)");
+			return EIO;
+		}
+
+		job->offset += n;
+		job->bytes_done += n;
+		budget -= n;
+	}
+
+	fm_writeback(job, start);
+
+	if(job->offset >= size)
+	{
+		job->index++;
+		return fm_close_file(job);
+	}
+
+	return 0;
+}
+
+/* Creates the next directory, or copies a chunk of the next file.
+ * Returns 0 or an errno value. */
+static int
+fm_step(struct file_mover_job *job)
+{
+	if(job->src_fd == -1)
+	{
+		struct file_mover_entry *e = &job->entries[job->index];
+
+		if(e->is_directory)
+		{
+			char *dst = fm_path(job->tmp_target, e->path);
+			return_val_if_fail(dst, ENOMEM);
+			int error = 0;
+			if(mkdir(dst, 0755) != 0 && errno != EEXIST)
+			{
+				error = errno;
+				WARNING("%s: %s", dst, strerror(error));
+			}
+			free(dst);
+			job->index++;
+			return error;
+		}
+
+		int error = fm_open_file(job, e);
+		if(error)
+			return error;
+	}
+
+	return fm_copy_chunk(job);
+}
+
+static void
+fm_send_progress(struct file_mover_job *job)
+{
+	job->last_progress = time(0);
+	ui_send_move_progress(NULL, job->target,
+		job->bytes_done, job->total_bytes);
+}
+
+static void
+fm_finish_job(struct file_mover_job *job, int error)
+{
+	if(job->src_fd != -1)
+		close(job->src_fd);
+	if(job->dst_fd != -1)
+		close(job->dst_fd);
+	job->src_fd = job->dst_fd = -1;
+
+	if(error == 0 && rename(job->tmp_target, job->target) != 0)
+	{
+		error = errno;
+		WARNING("%s: %s", job->target, strerror(error));
+	}
+
+	if(error == 0)
+	{
+		INFO("moved [%s] to [%s]", job->source, job->target);
+		fm_send_progress(job);
+		fm_remove_entries(job, job->source);
+	}
+	else
+	{
+		WARNING("failed to move [%s]: %s",
+			job->source, strerror(error));
+		fm_remove_entries(job, job->tmp_target);
+	}
+
+	TAILQ_REMOVE(&fm_jobs, job, link);
+
+	if(job->done_func)
+		job->done_func(job->source, job->target, error,
+			job->user_data);
+
+	fm_job_free(job);
+}
+
+EP_EVENT_CALLBACK(fm_event_func)
+
+static void
+fm_schedule(void)
+{
+	if(TAILQ_EMPTY(&fm_jobs))
+		return;
+
+	if(!event_initialized(&fm_event))
+		evtimer_set(&fm_event, EP_PROFILED(fm_event_func), NULL);
+
+	struct timeval tv = {.tv_sec = 0, .tv_usec = 0};
+	evtimer_add(&fm_event, &tv);
+}
+
+static void
+fm_event_func(int fd, short why, void *data)
+{
+	struct file_mover_job *job = TAILQ_FIRST(&fm_jobs);
+	if(job == NULL)
+		return;
+
+	int error = fm_step(job);
+	if(error || (job->index == job->nentries && job->src_fd == -1))
+		fm_finish_job(job, error);
+	else if(time(0) != job->last_progress)
+		fm_send_progress(job);
+
+	fm_schedule();
+}
+
+/* Moves source to target. If they are on different devices, the move is
+ * done asynchronously. The done_func is called exactly once, when the move
+ * is finished or has failed.
+ *
+ * Returns 0 if the move was done or started, or -1 on error.
+ */
+int
+file_mover_move(const char *source, const char *target,
+	file_mover_done_func_t done_func, void *user_data)
+{
+	return_val_if_fail(source, -1);
+	return_val_if_fail(target, -1);
+
+	if(rename(source, target) == 0)
+	{
+		if(done_func)
+			done_func(source, target, 0, user_data);
+		return 0;
+	}
+
+	if(errno != EXDEV)
+	{
+		if(done_func)
+			done_func(source, target, errno, user_data);
+		return -1;
+	}
+
+	struct file_mover_job *job = calloc(1, sizeof(struct file_mover_job));
+	job->source = strdup(source);
+	job->target = strdup(target);
+	job->done_func = done_func;
+	job->user_data = user_data;
+	job->src_fd = -1;
+	job->dst_fd = -1;
+
+	/* copy to a hidden name, so the share scanner ignores it */
+	const char *basename = strrchr(target, '/');
+	if(basename++ == NULL)
+		basename = target;
+	if(asprintf(&job->tmp_target, "%.*s.%s.moving",
+		(int)(basename - target), target, basename) == -1)
+		job->tmp_target = NULL;
+
+	int error = job->tmp_target ? fm_scan(job, "") : ENOMEM;
+	if(error == 0 && job->nentries == 0)
+		error = ENOENT;
+	if(error)
+	{
+		if(done_func)
+			done_func(source, target, error, user_data);
+		fm_job_free(job);
+		return -1;
+	}
+
+	INFO("moving [%s] to [%s] across devices, %u entries, %"PRIu64" bytes",
+		source, target, job->nentries, job->total_bytes);
+
+	TAILQ_INSERT_TAIL(&fm_jobs, job, link);
+	fm_schedule();
+
+	return 0;
+}
+
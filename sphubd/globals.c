@@ -36,4 +36,8 @@ char *global_id_lock = 0;
  */
 bool global_move_partial_directories = false;
 
+/* If true, downloaded data bypasses the page cache (see download_writer.h).
+ */
+bool global_download_direct_io = false;
+
 void *global_tth_store = 0;
@@ -23,6 +23,7 @@ extern char *global_id_generator;
 extern char *global_id_lock;
 
 extern bool global_move_partial_directories;
+extern bool global_download_direct_io;
 
 extern void *global_tth_store;
 
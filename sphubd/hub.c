@@ -44,6 +44,8 @@
 #include "sphubd.h"
 #include "xstr.h"
 #include "extip.h"
+#include "event_profile.h"
+#include "trace.h"
 
 static void hub_schedule_reconnect_event(hub_t *hub);
 
@@ -63,6 +65,8 @@ static void hub_send_keep_alive(int fd, short condition, void *data)
     hub_set_idle_timeout(hub);
 }
 
+EP_EVENT_CALLBACK(hub_send_keep_alive)
+
 void hub_set_idle_timeout(hub_t *hub)
 {
     if(event_initialized(&hub->idle_timeout_event))
@@ -71,7 +75,7 @@ void hub_set_idle_timeout(hub_t *hub)
     }
     else
     {
-        evtimer_set(&hub->idle_timeout_event, hub_send_keep_alive, hub);
+        evtimer_set(&hub->idle_timeout_event, EP_PROFILED(hub_send_keep_alive), hub);
     }
 
     struct timeval tv = {.tv_sec = 300, .tv_usec = 0};
@@ -101,6 +105,8 @@ int hub_send_string(hub_t *hub, const char *string)
     return_val_if_fail(hub->fd != -1, -1);
 
     print_command(string, "-> (fd %i)", hub->fd);
+    trace_line(TRACE_HUB, TRACE_OUT, hub->fd, string);
+    bw_charge_control(BW_UPLOAD, strlen(string));
     return bufferevent_write(hub->bufev, (void *)string, strlen(string));
 }
 
@@ -514,6 +520,8 @@ hub_reconnect_event_func(int fd, short why, void *data)
 	hub->password, hub->encoding);
 }
 
+EP_EVENT_CALLBACK(hub_reconnect_event_func)
+
 static void
 hub_schedule_reconnect_event(hub_t *hub)
 {
@@ -548,7 +556,8 @@ hub_schedule_reconnect_event(hub_t *hub)
     }
     else
     {
-        evtimer_set(&hub->reconnect_event, hub_reconnect_event_func, hub);
+        evtimer_set(&hub->reconnect_event,
+                EP_PROFILED(hub_reconnect_event_func), hub);
     }
 
     struct timeval tv = {.tv_sec = interval, .tv_usec = 0};
@@ -566,6 +575,8 @@ hub_close_connection(hub_t *hub)
         /* no */
 
         DEBUG("closing down hub on fd %d (address %s)", hub->fd, hub->address);
+        if(hub->fd != -1 && trace_enabled())
+            trace_write(TRACE_HUB, TRACE_CLOSE, hub->fd, "", 0);
         if(hub->bufev)
         {
             bufferevent_free(hub->bufev);
@@ -698,10 +709,12 @@ static void myinfo_updater(int fd, short condition, void *data)
     hub_start_myinfo_updater();
 }
 
+EP_EVENT_CALLBACK(myinfo_updater)
+
 void hub_start_myinfo_updater(void)
 {
     static struct event ev;
-    evtimer_set(&ev, myinfo_updater, &ev);
+    evtimer_set(&ev, EP_PROFILED(myinfo_updater), &ev);
     struct timeval tv = {.tv_sec = 4, .tv_usec = 0};
     evtimer_add(&ev, &tv);
 }
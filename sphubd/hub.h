@@ -29,8 +29,11 @@
 #include <stdint.h>
 
 #include "user.h"
+#include "bandwidth.h"
+#include "rate_meter.h"
 
-#define HUB_USER_NHASH 509
+/* smallest size of a hub user table, it doubles as users log in */
+#define HUB_USER_TABLE_MIN 16
 
 /* user-command types */
 #define UC_TYPE_SEPARATOR 0
@@ -77,6 +80,15 @@ struct hub_user_command
     char *command;
 };
 
+/* An open addressing table of users, keyed by nick. */
+typedef struct hub_user_table hub_user_table_t;
+struct hub_user_table
+{
+    user_t **slots;
+    unsigned size; /* a power of two, or 0 */
+    unsigned count;
+};
+
 typedef struct hub hub_t;
 struct hub
 {
@@ -111,7 +123,9 @@ struct hub
     bool is_registered;
     bool got_lock;
 
-    LIST_HEAD(, user) users[HUB_USER_NHASH];
+    hub_user_table_t users;
+    user_arena_t *user_arena;
+    bool listed; /* in the hub list, and the users in the nick index */
 
     char *myinfo_string;
     int sent_user_commands;
@@ -121,15 +135,34 @@ struct hub
     int num_messages;
     int num_user_commands;
     char *encoding;
+
+    /* bandwidth limits for transfers with users on this hub */
+    bw_bucket_t bw[2];
+
+    /* transfer rates with users on this hub */
+    rate_meter_t rate[2];
 };
 
-typedef enum {SLOT_NONE, SLOT_FREE, SLOT_EXTRA, SLOT_NORMAL} slot_state_t;
+typedef enum {SLOT_NONE, SLOT_FREE, SLOT_EXTRA, SLOT_NORMAL, SLOT_MINI}
+    slot_state_t;
+
+/* Files up to this size may get one of HUB_SLOT_MINI_MAX mini slots when
+ * all normal slots are taken. */
+#define HUB_SLOT_MINI_SIZE (256 * 1024)
+#define HUB_SLOT_MINI_MAX 3
+
+/* seconds a denied peer keeps its place in the slot queue */
+#define HUB_SLOT_WAIT_TIMEOUT 120
+
+/* default for hub_set_slot_min_rate, in bytes per second */
+#define HUB_SLOT_MIN_RATE 2048
 
 #include "search_listener.h"
 
 /* hub_cmd.c
  */
 void hub_attach_io_channel(hub_t *hub, int fd);
+int hub_dispatch_command(hub_t *hub, char *cmdstr);
 
 /* hub_list.c
  */
@@ -137,6 +170,10 @@ void hub_list_init(void);
 hub_t *hub_new(void);
 unsigned hub_user_hash(const char *nick);
 user_t *hub_lookup_user(hub_t *hub, const char *nick);
+void hub_add_user(hub_t *hub, user_t *user);
+void hub_remove_user(hub_t *hub, user_t *user);
+void hub_foreach_user(hub_t *hub,
+        void (*func)(user_t *user, void *user_data), void *user_data);
 void hub_free(hub_t *hub);
 void hub_list_add(hub_t *hub);
 void hub_list_remove(hub_t *hub);
@@ -171,6 +208,12 @@ void hub_set_slots(int slots, bool per_hub);
 void hub_update_slots(void);
 int hub_slots_free(void);
 int hub_slots_total(void);
+unsigned hub_slot_queue_position(const char *nick);
+unsigned hub_slot_waiters(void);
+void hub_expire_slot_waiters(time_t now);
+void hub_set_slot_min_rate(unsigned rate);
+unsigned hub_slot_min_rate(void);
+bool hub_slot_reclaim(unsigned rate, time_t now);
 
 /* hub.c
  */
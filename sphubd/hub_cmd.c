@@ -42,6 +42,9 @@
 #include "rx.h"
 #include "xstr.h"
 #include "extip.h"
+#include "event_profile.h"
+#include "trace.h"
+#include "share_partial.h"
 
 typedef struct hub_search_data hub_search_data_t;
 struct hub_search_data
@@ -57,6 +60,7 @@ struct hub_search_data
         } active;
         char *nick;
     } dest;
+    unsigned nresults;
 };
 
 static int hub_get_nicklist(hub_t *hub)
@@ -73,6 +77,8 @@ static int hub_search_match_callback(const share_search_t *search,
     char *response = 0;
     int num_returned_bytes;
 
+    hsd->nresults++;
+
     char *virtual_path = share_local_to_virtual_path(global_share, file);
 
     DEBUG("sending SR for %s", virtual_path);
@@ -118,7 +124,8 @@ static int hub_search_match_callback(const share_search_t *search,
     }
     else
     { /* searching nick is active, send results directly via UDP */
-        if(hsd->dest.active.fd == -1)
+        /* a replayed trace is never sent anywhere */
+        if(hsd->dest.active.fd == -1 && !trace_replaying)
         {
             hsd->dest.active.fd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
 
@@ -141,9 +148,20 @@ static int hub_search_match_callback(const share_search_t *search,
         {
             size_t len = strlen(response_encoded);
 
-            rc = sendto(hsd->dest.active.fd, response_encoded, len, 0,
-                    (const struct sockaddr *)&hsd->dest.active.addr,
-                    sizeof(struct sockaddr_in));
+            if(trace_enabled())
+            {
+                trace_write(TRACE_UDP, TRACE_OUT, hsd->dest.active.fd,
+                        response_encoded, len);
+            }
+
+            if(trace_replaying)
+                rc = len;
+            else
+                rc = sendto(hsd->dest.active.fd, response_encoded, len, 0,
+                        (const struct sockaddr *)&hsd->dest.active.addr,
+                        sizeof(struct sockaddr_in));
+            if(rc > 0)
+                bw_charge_control(BW_UPLOAD, rc);
             free(response_encoded);
         }
 
@@ -185,9 +203,9 @@ static int hub_cmd_Quit(void *data, int argc, char **argv)
             /* abort current transfer with logged out nick */
             cc_close_connection(cc);
         }
-        LIST_REMOVE(user, link);
+        ui_send_user_event(NULL, UI_USER_LOGOUT, hub, user->nick);
+        hub_remove_user(hub, user);
         user_free(user);
-        ui_send_user_logout(NULL, hub->address, argv[0]);
     }
     return 0;
 }
@@ -216,44 +234,31 @@ static int hub_cmd_MyINFO(void *opaque_param, int argc, char **argv)
 {
     hub_t *hub = (hub_t *)opaque_param;
 
-    user_t *new_user = user_new_from_myinfo(argv[0], hub);
+    user_myinfo_t info;
+    if(!user_parse_myinfo(argv[0], &info))
+        return 0;
 
-    if(new_user)
-    {
-        user_t *user = hub_lookup_user(hub, new_user->nick);
-        if(user)
-        {
-            /* need to merge the operator status */
-            new_user->is_operator = user->is_operator;
-
-            ui_send_user_update(NULL,
-                    hub->address, new_user->nick, new_user->description,
-                    new_user->tag, new_user->speed, new_user->email,
-                    new_user->shared_size, new_user->is_operator,
-                    new_user->extra_slots);
-            if(new_user->tag &&
-               strstr(new_user->tag, ",M:A,") != 0 && user->passive)
-            {
-                /* reset passive flag */
-                new_user->passive = false;
-            }
+    char nick[info.nick_len + 1];
+    memcpy(nick, info.nick, info.nick_len);
+    nick[info.nick_len] = 0;
 
-            /* remove the old user */
-            LIST_REMOVE(user, link);
-            user_free(user);
-        }
-        else
+    user_t *user = hub_lookup_user(hub, nick);
+    if(user)
+    {
+        /* update the existing user in place, keeping the operator status */
+        if(user_update_from_myinfo(user, &info))
+            ui_send_user_event(NULL, UI_USER_UPDATE, hub, user->nick);
+        if(user->tag && strstr(user->tag, ",M:A,") != 0 && user->passive)
         {
-            ui_send_user_login(NULL,
-                    hub->address, new_user->nick, new_user->description,
-                    new_user->tag, new_user->speed, new_user->email,
-                    new_user->shared_size, new_user->is_operator,
-                    new_user->extra_slots);
+            /* reset passive flag */
+            user->passive = false;
         }
-
-        /* insert the new user */
-        LIST_INSERT_HEAD(&hub->users[hub_user_hash(new_user->nick)],
-                new_user, link);
+    }
+    else
+    {
+        user = user_new_from_parsed_myinfo(&info, hub);
+        hub_add_user(hub, user);
+        ui_send_user_event(NULL, UI_USER_LOGIN, hub, user->nick);
     }
 
     return 0;
@@ -456,6 +461,7 @@ static int hub_cmd_Search(void *data, int argc, char **argv)
     hub_search_data_t hsd;
     hsd.hub = hub;
     hsd.passive = s->passive;
+    hsd.nresults = 0;
     if(hsd.passive)
     {
         hsd.dest.nick = s->nick;
@@ -478,6 +484,14 @@ static int hub_cmd_Search(void *data, int argc, char **argv)
 
     share_search(global_share, s, hub_search_match_callback, &hsd);
 
+    if(s->tth && hsd.nresults == 0)
+    {
+        /* we may have verified parts of a file we're downloading */
+        share_partial_t *sp = share_partial_shared(s->tth);
+        if(sp)
+            hub_search_match_callback(s, share_partial_file(sp), s->tth, &hsd);
+    }
+
     if(!hsd.passive && hsd.dest.active.fd != -1)
     {
         close(hsd.dest.active.fd);
@@ -552,18 +566,12 @@ static int hub_cmd_OpList(void *data, int argc, char **argv)
             if(user)
             {
                 user->is_operator = true;
-                LIST_INSERT_HEAD(&hub->users[hub_user_hash(user->nick)],
-                        user, link);
+                hub_add_user(hub, user);
             }
         }
 
         if(update_op_status)
-        {
-            ui_send_user_update(NULL,
-                    hub->address, user->nick, user->description, user->tag,
-                    user->speed, user->email, user->shared_size,
-                    user->is_operator, user->extra_slots);
-        }
+            ui_send_user_event(NULL, UI_USER_UPDATE, hub, user->nick);
     }
     arg_free(ops);
 
@@ -629,12 +637,6 @@ static int hub_cmd_UserIP(void *data, int argc, char **argv)
     return 0;
 }
 
-static int hub_cmd_SR(void *data, int argc, char **argv)
-{
-    search_listener_handle_response(global_search_listener, argv[0]);
-    return 0;
-}
-
 static int hub_cmd_Supports(void *data, int argc, char **argv)
 {
     hub_t *hub = data;
@@ -839,7 +841,6 @@ static cmd_t hub_cmds[] = {
     {"$Supports", hub_cmd_Supports, 1},
     {"$Search", hub_cmd_Search, -1},
     {"$MultiSearch", hub_cmd_Search, -1},
-    {"$SR", hub_cmd_SR, -1},
     {"$ConnectToMe", hub_cmd_ConnectToMe, 2},
     {"$RevConnectToMe", hub_cmd_RevConnectToMe, 2},
     {"$To:", hub_cmd_To, -1},
@@ -868,6 +869,14 @@ int hub_dispatch_command(hub_t *hub, char *cmdstr)
     {
         rc = hub_cmd_Lock(hub, cmdstr + 6);
     }
+    else if(strncmp(cmdstr, "$SR ", 4) == 0)
+    {
+        /* Passive search responses are parsed straight from the hub's
+         * encoding, the same way as responses received by UDP.
+         */
+        search_listener_handle_response(global_search_listener, cmdstr);
+        rc = 0;
+    }
     else
     {
         char *cmdstr_utf8 = str_legacy_to_utf8_lossy(cmdstr, hub->encoding);
@@ -931,6 +940,7 @@ static void hub_in_event(struct bufferevent *bufev, void *data)
             break;
         }
         print_command(cmd, "<- (fd %d)", hub->fd);
+        trace_line(TRACE_HUB, TRACE_IN, hub->fd, cmd);
         int rc = hub_dispatch_command(hub, cmd);
         free(cmd);
         if(rc != 0)
@@ -952,14 +962,25 @@ static void hub_err_event(struct bufferevent *bufev, short why, void *data)
     hub_close_connection(hub);
 }
 
+EP_BUFFER_CALLBACK(hub_in_event)
+EP_BUFFER_CALLBACK(hub_out_event)
+EP_ERROR_CALLBACK(hub_err_event)
+
 void hub_attach_io_channel(hub_t *hub, int fd)
 {
     io_set_blocking(fd, 0);
 
     hub->fd = fd;
 
+    if(trace_enabled())
+    {
+        trace_printf(TRACE_HUB, TRACE_OPEN, fd, "%s %s %d %s",
+                hub->address, hub->me->nick, hub->me->passive, hub->encoding);
+    }
+
     DEBUG("adding hub on fd %d to main loop", fd);
-    hub->bufev = bufferevent_new(fd, hub_in_event, hub_out_event, hub_err_event, hub);
+    hub->bufev = bufferevent_new(fd, EP_PROFILED(hub_in_event),
+            EP_PROFILED(hub_out_event), EP_PROFILED(hub_err_event), hub);
     bufferevent_enable(hub->bufev, EV_READ | EV_WRITE);
 }
 
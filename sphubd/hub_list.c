@@ -31,6 +31,11 @@
 static int myinfo_need_update = false;
 static LIST_HEAD(, hub) hub_list_head;
 
+/* Users of all hubs in the hub list, by nick. If a nick is logged in on
+ * several hubs, the others are chained on the same_nick link.
+ */
+static hub_user_table_t hub_nick_index;
+
 static void hub_handle_external_ip_notification(nc_t *nc, const char *channel,
 	nc_external_ip_detected_t *info,
 	void *user_data)
@@ -51,20 +56,158 @@ void hub_list_init(void)
 		hub_handle_external_ip_notification, NULL);
 }
 
+/* FNV-1a */
 unsigned hub_user_hash(const char *nick)
 {
-    const char *p = nick;
-    unsigned h = *p;
+    const unsigned char *p;
+    unsigned h = 2166136261U;
+
+    for(p = (const unsigned char *)nick; *p; p++)
+    {
+        h ^= *p;
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+/* Returns the slot of the user with the nick, or the empty slot where it
+ * would be inserted. The table must not be empty.
+ */
+static unsigned hub_user_table_find(const hub_user_table_t *table,
+        const char *nick, unsigned hash)
+{
+    unsigned mask = table->size - 1;
+    unsigned i = hash & mask;
+
+    for(; table->slots[i]; i = (i + 1) & mask)
+    {
+        user_t *user = table->slots[i];
+        if(user->nick_hash == hash && strcmp(user->nick, nick) == 0)
+            break;
+    }
+
+    return i;
+}
+
+static user_t *hub_user_table_lookup(const hub_user_table_t *table,
+        const char *nick)
+{
+    if(table->count == 0)
+        return NULL;
+    return table->slots[hub_user_table_find(table, nick,
+            hub_user_hash(nick))];
+}
+
+static void hub_user_table_resize(hub_user_table_t *table, unsigned size)
+{
+    user_t **old_slots = table->slots;
+    unsigned old_size = table->size;
+
+    table->slots = calloc(size, sizeof(user_t *));
+    table->size = size;
+
+    unsigned i;
+    for(i = 0; i < old_size; i++)
+    {
+        user_t *user = old_slots[i];
+        if(user)
+            table->slots[hub_user_table_find(table, user->nick,
+                    user->nick_hash)] = user;
+    }
+
+    free(old_slots);
+}
+
+/* The user must not already be in the table. */
+static void hub_user_table_insert(hub_user_table_t *table, user_t *user)
+{
+    /* keep the load factor below 0.7 */
+    if((table->count + 1) * 10 > table->size * 7)
+    {
+        hub_user_table_resize(table,
+                table->size ? table->size * 2 : HUB_USER_TABLE_MIN);
+    }
+
+    table->slots[hub_user_table_find(table, user->nick, user->nick_hash)] =
+        user;
+    table->count++;
+}
+
+static void hub_user_table_remove_slot(hub_user_table_t *table, unsigned i)
+{
+    unsigned mask = table->size - 1;
+    unsigned j = i;
+
+    /* Shift back the following users that would no longer be found past
+     * the emptied slot, so no tombstones are needed.
+     */
+    table->slots[i] = NULL;
+    for(;;)
+    {
+        j = (j + 1) & mask;
+        user_t *user = table->slots[j];
+        if(user == NULL)
+            break;
+
+        unsigned k = user->nick_hash & mask;
+        if(i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+
+        table->slots[i] = user;
+        table->slots[j] = NULL;
+        i = j;
+    }
+
+    table->count--;
+
+    if(table->size > HUB_USER_TABLE_MIN && table->count * 8 < table->size)
+        hub_user_table_resize(table, table->size / 2);
+}
+
+static void hub_index_user(user_t *user)
+{
+    user_t *first = hub_user_table_lookup(&hub_nick_index, user->nick);
+    if(first)
+    {
+        user->same_nick = first->same_nick;
+        first->same_nick = user;
+    }
+    else
+    {
+        user->same_nick = NULL;
+        hub_user_table_insert(&hub_nick_index, user);
+    }
+}
+
+static void hub_unindex_user(user_t *user)
+{
+    unsigned i = hub_user_table_find(&hub_nick_index, user->nick,
+            user->nick_hash);
+    user_t *first = hub_nick_index.slots[i];
+    return_if_fail(first);
 
-    if(h)
+    if(first == user)
+    {
+        if(user->same_nick)
+            hub_nick_index.slots[i] = user->same_nick;
+        else
+            hub_user_table_remove_slot(&hub_nick_index, i);
+    }
+    else
     {
-        for(p += 1; *p; p++)
+        user_t **p;
+        for(p = &first->same_nick; *p; p = &(*p)->same_nick)
         {
-            h = (h << 5) - h + *p;
+            if(*p == user)
+            {
+                *p = user->same_nick;
+                break;
+            }
         }
     }
 
-    return h % HUB_USER_NHASH;
+    user->same_nick = NULL;
 }
 
 hub_t *hub_new(void)
@@ -76,11 +219,7 @@ hub_t *hub_new(void)
     TAILQ_INIT(&hub->user_commands_head);
     hub->encoding = strdup("WINDOWS-1252");
 
-    int i;
-    for(i = 0; i < HUB_USER_NHASH; i++)
-    {
-        LIST_INIT(&hub->users[i]);
-    }
+    hub->user_arena = user_arena_new();
 
     return hub;
 }
@@ -91,19 +230,21 @@ void hub_free(hub_t *hub)
     if(hub)
     {
         /* free all users */
-        int i;
-        for(i = 0; i < HUB_USER_NHASH; i++)
+        unsigned i;
+        for(i = 0; i < hub->users.size; i++)
         {
-            user_t *user, *next;
-            for(user = LIST_FIRST(&hub->users[i]); user; user = next)
+            user_t *user = hub->users.slots[i];
+            if(user)
             {
-                next = LIST_NEXT(user, link);
-                LIST_REMOVE(user, link);
+                if(hub->listed)
+                    hub_unindex_user(user);
                 user_free(user);
             }
         }
-        
+        free(hub->users.slots);
+
         user_free(hub->me);
+        user_arena_free(hub->user_arena);
         free(hub->hubname);
         free(hub->hubip);
         free(hub->password);
@@ -119,12 +260,30 @@ void hub_free(hub_t *hub)
 void hub_list_add(hub_t *hub)
 {
     LIST_INSERT_HEAD(&hub_list_head, hub, next);
+    hub->listed = true;
+
+    unsigned i;
+    for(i = 0; i < hub->users.size; i++)
+    {
+        if(hub->users.slots[i])
+            hub_index_user(hub->users.slots[i]);
+    }
+
     hub_update_slots();
 }
 
 void hub_list_remove(hub_t *hub)
 {
     LIST_REMOVE(hub, next);
+    hub->listed = false;
+
+    unsigned i;
+    for(i = 0; i < hub->users.size; i++)
+    {
+        if(hub->users.slots[i])
+            hub_unindex_user(hub->users.slots[i]);
+    }
+
     hub_update_slots();
 }
 
@@ -181,30 +340,51 @@ hub_t *hub_find_by_fd(int fd)
 
 user_t *hub_lookup_user(hub_t *hub, const char *nick)
 {
-    user_t *user;
-    LIST_FOREACH(user, &hub->users[hub_user_hash(nick)], link)
-    {
-        if(strcmp(user->nick, nick) == 0)
-        {
-            return user;
-        }
-    }
+    return hub_user_table_lookup(&hub->users, nick);
+}
 
-    return NULL;
+void hub_add_user(hub_t *hub, user_t *user)
+{
+    return_if_fail(hub);
+    return_if_fail(user);
+
+    user->nick_hash = hub_user_hash(user->nick);
+    hub_user_table_insert(&hub->users, user);
+    if(hub->listed)
+        hub_index_user(user);
 }
 
-hub_t *hub_find_by_nick(const char *nick)
+/* Removes the user from the hub, but doesn't free it. */
+void hub_remove_user(hub_t *hub, user_t *user)
 {
-    hub_t *hub;
-    LIST_FOREACH(hub, &hub_list_head, next)
+    return_if_fail(hub);
+    return_if_fail(user);
+
+    unsigned i = hub_user_table_find(&hub->users, user->nick,
+            user->nick_hash);
+    return_if_fail(hub->users.slots[i] == user);
+
+    if(hub->listed)
+        hub_unindex_user(user);
+    hub_user_table_remove_slot(&hub->users, i);
+}
+
+/* The function must not add or remove users. */
+void hub_foreach_user(hub_t *hub,
+        void (*func)(user_t *user, void *user_data), void *user_data)
+{
+    unsigned i;
+    for(i = 0; i < hub->users.size; i++)
     {
-        if(hub_lookup_user(hub, nick) != NULL)
-        {
-            return hub;
-        }
+        if(hub->users.slots[i])
+            func(hub->users.slots[i], user_data);
     }
+}
 
-    return NULL;
+hub_t *hub_find_by_nick(const char *nick)
+{
+    user_t *user = hub_user_table_lookup(&hub_nick_index, nick);
+    return user ? user->hub : NULL;
 }
 
 hub_t *hub_find_encoding_by_nick(const char *nick, char **nick_utf8_ptr)
@@ -392,3 +572,122 @@ int hub_count_operator(void)
     return c.operator;
 }
 
+
+#ifdef TEST
+
+#include <stdio.h>
+#include "unit_test.h"
+
+#define NUSERS 5000
+
+static void count_user(user_t *user, void *user_data)
+{
+    int *n = user_data;
+    (*n)++;
+}
+
+int main(void)
+{
+    sp_log_set_level("debug");
+
+    hub_list_init();
+
+    hub_t *ahub = hub_new();
+    fail_unless(ahub);
+    ahub->address = strdup("ahub");
+    hub_list_add(ahub);
+
+    hub_t *bhub = hub_new();
+    fail_unless(bhub);
+    bhub->address = strdup("bhub");
+
+    fail_unless(hub_lookup_user(ahub, "nobody") == NULL);
+    fail_unless(hub_find_by_nick("nobody") == NULL);
+
+    int i;
+    char nick[32];
+    for(i = 0; i < NUSERS; i++)
+    {
+        snprintf(nick, sizeof(nick), "user%d", i);
+        hub_add_user(ahub, user_new(nick, NULL, NULL, NULL, NULL, 0, ahub));
+    }
+    fail_unless(ahub->users.count == NUSERS);
+    fail_unless((ahub->users.size & (ahub->users.size - 1)) == 0);
+    fail_unless(ahub->users.count * 10 <= ahub->users.size * 7);
+
+    for(i = 0; i < NUSERS; i++)
+    {
+        snprintf(nick, sizeof(nick), "user%d", i);
+        user_t *user = hub_lookup_user(ahub, nick);
+        fail_unless(user);
+        fail_unless(strcmp(user->nick, nick) == 0);
+        fail_unless(hub_find_by_nick(nick) == ahub);
+    }
+
+    int n = 0;
+    hub_foreach_user(ahub, count_user, &n);
+    fail_unless(n == NUSERS);
+
+    /* users of hubs not in the hub list are not in the nick index */
+    hub_add_user(bhub, user_new("buser", NULL, NULL, NULL, NULL, 0, bhub));
+    hub_add_user(bhub, user_new("user17", NULL, NULL, NULL, NULL, 0, bhub));
+    fail_unless(hub_lookup_user(bhub, "buser"));
+    fail_unless(hub_find_by_nick("buser") == NULL);
+    hub_list_add(bhub);
+    fail_unless(hub_find_by_nick("buser") == bhub);
+
+    /* a nick logged in on both hubs */
+    fail_unless(hub_find_by_nick("user17"));
+    user_t *user = hub_lookup_user(ahub, "user17");
+    hub_remove_user(ahub, user);
+    user_free(user);
+    fail_unless(hub_find_by_nick("user17") == bhub);
+    fail_unless(hub_lookup_user(ahub, "user17") == NULL);
+
+    /* remove every other user, the rest must still be found */
+    for(i = 0; i < NUSERS; i += 2)
+    {
+        snprintf(nick, sizeof(nick), "user%d", i);
+        user = hub_lookup_user(ahub, nick);
+        fail_unless(user);
+        hub_remove_user(ahub, user);
+        user_free(user);
+    }
+    for(i = 0; i < NUSERS; i++)
+    {
+        snprintf(nick, sizeof(nick), "user%d", i);
+        user = hub_lookup_user(ahub, nick);
+        if(i % 2 == 0 || i == 17)
+            fail_unless(user == NULL);
+        else
+            fail_unless(user && hub_find_by_nick(nick) == ahub);
+    }
+
+    /* the table shrinks as users log out */
+    for(i = 1; i < NUSERS; i += 2)
+    {
+        snprintf(nick, sizeof(nick), "user%d", i);
+        user = hub_lookup_user(ahub, nick);
+        if(user)
+        {
+            hub_remove_user(ahub, user);
+            user_free(user);
+        }
+    }
+    fail_unless(ahub->users.count == 0);
+    fail_unless(ahub->users.size == HUB_USER_TABLE_MIN);
+    fail_unless(hub_find_by_nick("user1") == NULL);
+
+    hub_list_remove(bhub);
+    fail_unless(hub_find_by_nick("buser") == NULL);
+    fail_unless(hub_find_by_nick("user17") == NULL);
+    hub_free(bhub);
+
+    hub_list_remove(ahub);
+    hub_free(ahub);
+
+    return 0;
+}
+
+#endif
+
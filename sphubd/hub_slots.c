@@ -14,6 +14,12 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sys_queue.h"
+
 #include "hub.h"
 #include "log.h"
 #include "extra_slots.h"
@@ -22,6 +28,105 @@ static int configured_slots = 2;
 static int total_slots = 0;
 static bool per_hub_flag = true;
 static int used_slots = 0;
+static int used_mini_slots = 0;
+static unsigned slot_min_rate = HUB_SLOT_MIN_RATE;
+
+/* Peers that were denied a slot, in the order they first asked. A free
+ * slot goes to the first waiter that asks again, so slots are not handed
+ * out to whoever happens to reconnect fastest. Waiters that don't ask
+ * again within HUB_SLOT_WAIT_TIMEOUT seconds lose their place.
+ */
+struct slot_waiter
+{
+    TAILQ_ENTRY(slot_waiter) link;
+    char *nick;
+    time_t last_request;
+};
+
+static TAILQ_HEAD(, slot_waiter) slot_waiters =
+    TAILQ_HEAD_INITIALIZER(slot_waiters);
+static unsigned nslot_waiters = 0;
+
+static void hub_slot_waiter_free(struct slot_waiter *w)
+{
+    TAILQ_REMOVE(&slot_waiters, w, link);
+    nslot_waiters--;
+    free(w->nick);
+    free(w);
+}
+
+void hub_expire_slot_waiters(time_t now)
+{
+    struct slot_waiter *w, *next;
+    for(w = TAILQ_FIRST(&slot_waiters); w; w = next)
+    {
+        next = TAILQ_NEXT(w, link);
+        if(now - w->last_request > HUB_SLOT_WAIT_TIMEOUT)
+        {
+            DEBUG("nick %s no longer waiting for a slot", w->nick);
+            hub_slot_waiter_free(w);
+        }
+    }
+}
+
+/* Returns the waiter for nick and sets *position to its 0-based position
+ * in the queue. Returns NULL and sets *position to the length of the
+ * queue if the nick is not waiting.
+ */
+static struct slot_waiter *hub_find_slot_waiter(const char *nick,
+        unsigned *position)
+{
+    struct slot_waiter *w;
+    *position = 0;
+    TAILQ_FOREACH(w, &slot_waiters, link)
+    {
+        if(strcmp(w->nick, nick) == 0)
+            return w;
+        (*position)++;
+    }
+    return NULL;
+}
+
+/* Returns the 1-based position of nick in the slot queue, or 0 if the nick
+ * is not waiting for a slot.
+ */
+unsigned hub_slot_queue_position(const char *nick)
+{
+    unsigned position;
+    if(hub_find_slot_waiter(nick, &position) == NULL)
+        return 0;
+    return position + 1;
+}
+
+unsigned hub_slot_waiters(void)
+{
+    return nslot_waiters;
+}
+
+/* Normal slots with transfers slower than this (in bytes per second) are
+ * reclaimed when other peers are waiting. 0 never reclaims slots.
+ */
+void hub_set_slot_min_rate(unsigned rate)
+{
+    slot_min_rate = rate;
+}
+
+unsigned hub_slot_min_rate(void)
+{
+    return slot_min_rate;
+}
+
+/* Returns true if a normal slot used by an upload at rate bytes per second
+ * should be given to a waiting peer. Waiters that have given up don't
+ * count.
+ */
+bool hub_slot_reclaim(unsigned rate, time_t now)
+{
+    if(slot_min_rate == 0 || rate >= slot_min_rate)
+        return false;
+    hub_expire_slot_waiters(now);
+    return nslot_waiters > 0;
+}
 
 void hub_free_upload_slot(hub_t *hub, const char *nick, slot_state_t slot_state)
 {
@@ -31,6 +136,14 @@ void hub_free_upload_slot(hub_t *hub, const char *nick, slot_state_t slot_state)
             INFO("removing extra upload slot for nick %s", nick);
             extra_slots_grant(nick, -1);
             break;
+        case SLOT_MINI:
+            used_mini_slots--;
+            if(used_mini_slots < 0)
+            {
+                WARNING("INTERNAL ERROR: used_mini_slots < 0");
+                used_mini_slots = 0;
+            }
+            break;
         case SLOT_NORMAL:
 	    used_slots--;
 
@@ -50,9 +163,11 @@ void hub_free_upload_slot(hub_t *hub, const char *nick, slot_state_t slot_state)
     }
 }
 
-/* Returns 0 if a normal slot is available and was allocated. Returns 1 if a
- * free slot was granted (either for a filelist, small file or an extra granted
- * slot). Returns -1 if no slot was available.
+/* Returns SLOT_NORMAL if a normal slot is available and was allocated,
+ * SLOT_FREE for filelists and small files, SLOT_EXTRA for an extra granted
+ * slot, and SLOT_MINI for a short file when the normal slots are taken.
+ * Returns SLOT_NONE if no slot was available, and queues the nick for the
+ * next free slot (see hub_slot_queue_position).
  */
 slot_state_t hub_request_upload_slot(hub_t *hub, const char *nick,
         const char *filename, uint64_t size)
@@ -69,12 +184,38 @@ slot_state_t hub_request_upload_slot(hub_t *hub, const char *nick,
         return SLOT_EXTRA;
     }
 
-    if(used_slots >= total_slots)
+    time_t now = time(0);
+    hub_expire_slot_waiters(now);
+
+    /* free slots are kept for the peers queued before this one */
+    unsigned position;
+    struct slot_waiter *w = hub_find_slot_waiter(nick, &position);
+    if(used_slots + (int)position >= total_slots)
     {
-	INFO("no free slots left");
-	return SLOT_NONE;
+        if(size <= HUB_SLOT_MINI_SIZE && used_mini_slots < HUB_SLOT_MINI_MAX)
+        {
+            used_mini_slots++;
+            INFO("allowing mini upload slot for file %s", filename);
+            return SLOT_MINI;
+        }
+
+        if(w == NULL)
+        {
+            w = calloc(1, sizeof(struct slot_waiter));
+            w->nick = strdup(nick);
+            TAILQ_INSERT_TAIL(&slot_waiters, w, link);
+            nslot_waiters++;
+        }
+        w->last_request = now;
+
+        INFO("no free slots left, nick %s is queued at position %u",
+                nick, position + 1);
+        return SLOT_NONE;
     }
 
+    if(w)
+        hub_slot_waiter_free(w);
+
     used_slots++;
     INFO("allocating one upload slot for file %s: %d used, %d free",
 	    filename, used_slots, total_slots - used_slots);
@@ -150,6 +291,52 @@ void check_slots(hub_t *ahub)
     ss = hub_request_upload_slot(ahub, "nicke3", "filename3", 345678);
     fail_unless(ss == SLOT_NONE);
 
+    /* nicke3 is queued, and keeps its place when asking again */
+    fail_unless(hub_slot_waiters() == 1);
+    fail_unless(hub_slot_queue_position("nicke3") == 1);
+    fail_unless(hub_slot_queue_position("nicke") == 0);
+    ss = hub_request_upload_slot(ahub, "nicke4", "filename4", 345678);
+    fail_unless(ss == SLOT_NONE);
+    fail_unless(hub_slot_queue_position("nicke4") == 2);
+
+    /* a freed slot is kept for the first nick in the queue */
+    hub_free_upload_slot(ahub, "nicke2", SLOT_NORMAL);
+    ss = hub_request_upload_slot(ahub, "nicke4", "filename4", 345678);
+    fail_unless(ss == SLOT_NONE);
+    ss = hub_request_upload_slot(ahub, "nicke3", "filename3", 345678);
+    fail_unless(ss == SLOT_NORMAL);
+    fail_unless(hub_slot_queue_position("nicke3") == 0);
+    fail_unless(hub_slot_queue_position("nicke4") == 1);
+    fail_unless(hub_slots_free() == 0);
+
+    /* short files get mini slots while the normal slots are taken */
+    ss = hub_request_upload_slot(ahub, "m1", "small1", 100*1024);
+    fail_unless(ss == SLOT_MINI);
+    ss = hub_request_upload_slot(ahub, "m2", "small2", HUB_SLOT_MINI_SIZE);
+    fail_unless(ss == SLOT_MINI);
+    ss = hub_request_upload_slot(ahub, "m3", "small3", 100*1024);
+    fail_unless(ss == SLOT_MINI);
+    ss = hub_request_upload_slot(ahub, "m4", "small4", 100*1024);
+    fail_unless(ss == SLOT_NONE);
+    hub_free_upload_slot(ahub, "m1", SLOT_MINI);
+    ss = hub_request_upload_slot(ahub, "m4", "small4", 100*1024);
+    fail_unless(ss == SLOT_MINI);
+    hub_free_upload_slot(ahub, "m2", SLOT_MINI);
+    hub_free_upload_slot(ahub, "m3", SLOT_MINI);
+    hub_free_upload_slot(ahub, "m4", SLOT_MINI);
+    fail_unless(hub_slots_free() == 0);
+
+    /* slow uploads are reclaimed while someone is waiting */
+    fail_unless(hub_slot_reclaim(HUB_SLOT_MIN_RATE - 1, time(0)));
+    fail_unless(!hub_slot_reclaim(HUB_SLOT_MIN_RATE, time(0)));
+
+    /* a stale waiter doesn't cause a reclaim */
+    fail_unless(!hub_slot_reclaim(0, time(0) + HUB_SLOT_WAIT_TIMEOUT + 1));
+
+    /* waiters lose their place if they don't ask again */
+    fail_unless(hub_slot_waiters() == 0);
+    fail_unless(hub_slot_queue_position("nicke4") == 0);
+
     /* back to all free slots */
     hub_free_upload_slot(ahub, "nicke", SLOT_NORMAL);
     hub_free_upload_slot(ahub, "nicke", SLOT_NONE);
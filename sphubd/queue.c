@@ -26,7 +26,6 @@
 #include "xstr.h"
 #include "log.h"
 #include "notifications.h"
-#include "quote.h"
 
 extern struct queue_store *q_store;
 
@@ -232,7 +231,7 @@ int queue_add_filelist(const char *nick, bool auto_matched_filelist)
 
 	TAILQ_INSERT_TAIL(&q_store->filelists, qf, link);
 	if(!q_store->loading)
-	    queue_db_print_add_filelist(q_store->fp, qf);
+	    queue_db_log_add_filelist(qf);
         nc_send_filelist_added_notification(nc_default(), nick, qf->priority);
     }
 
@@ -278,7 +277,7 @@ queue_remove_source(const char *target_filename, const char *nick)
             DEBUG("removing source [%s], target [%s]",
                     nick, qs->target_filename);
 	    if(!q_store->loading)
-		queue_db_print_remove_source(q_store->fp, qs);
+		queue_db_log_remove_source(qs);
 
             nc_send_queue_source_removed_notification(nc_default(),
                     qs->target_filename, nick);
@@ -356,11 +355,7 @@ void queue_set_priority(const char *target_filename, unsigned priority)
     {
 	qt->priority = priority;
 	if(!q_store->loading)
-	{
-	    char *tmp = str_quote_backslash(target_filename, ":");
-	    fprintf(q_store->fp, "=P:%s:%u\n", tmp, priority);
-	    free(tmp);
-	}
+	    queue_db_log_set_priority(target_filename, priority);
 
 	nc_send_queue_priority_changed_notification(nc_default(),
 	    target_filename, priority);
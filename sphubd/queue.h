@@ -25,6 +25,7 @@
 #include <stdio.h>
 #include <time.h>
 #include <stdbool.h>
+#include <event.h>
 
 typedef struct queue_target queue_target_t;
 struct queue_target
@@ -79,11 +80,26 @@ struct queue_directory
 
 struct queue_store
 {
-	FILE *fp;
-	unsigned line_number;
+	int fd;
 	bool loading;
 	unsigned sequence;
 
+	unsigned nrecords; /* number of records in the log */
+	unsigned next_compact_check;
+
+	struct evbuffer *record; /* record being encoded */
+	struct evbuffer *pending; /* records not yet written to the log */
+	bool group_commit;
+	struct event commit_event;
+
+	/* state of an ongoing compaction */
+	bool compacting;
+	int snapshot_fd;
+	struct evbuffer *snapshot; /* snapshot not yet written */
+	struct evbuffer *snapshot_tail; /* records logged since the snapshot */
+	unsigned snapshot_nrecords;
+	struct event compact_event;
+
 	TAILQ_HEAD(, queue_target) targets;
 	TAILQ_HEAD(, queue_source) sources;
 	TAILQ_HEAD(, queue_filelist) filelists;
@@ -129,12 +145,14 @@ int queue_add_target(queue_target_t *qt);
 int queue_db_remove_target(const char *target_filename);
 int queue_remove_target(const char *target_filename);
 
-int queue_db_print_add_target(FILE *fp, struct queue_target *qt);
-int queue_db_print_add_source(FILE *fp, struct queue_source *qs);
-int queue_db_print_remove_source(FILE *fp, struct queue_source *qs);
-int queue_db_print_add_filelist(FILE *fp, struct queue_filelist *qf);
-int queue_db_print_add_directory(FILE *fp, struct queue_directory *qd);
-int queue_db_print_set_resolved(FILE *fp, struct queue_directory *qd);
+void queue_db_enable_group_commit(void);
+void queue_db_log_add_target(struct queue_target *qt);
+void queue_db_log_add_source(struct queue_source *qs);
+void queue_db_log_remove_source(struct queue_source *qs);
+void queue_db_log_add_filelist(struct queue_filelist *qf);
+void queue_db_log_add_directory(struct queue_directory *qd);
+void queue_db_log_set_resolved(struct queue_directory *qd);
+void queue_db_log_set_priority(const char *target_filename, int priority);
 
 int queue_add_source(const char *nick, const char *target_filename,
         const char *source_filename);
@@ -29,6 +29,7 @@
 #include "log.h"
 #include "queue.h"
 #include "search_listener.h"
+#include "event_profile.h"
 
 #define QUEUE_MAX_RECENT_SEARCHES 30
 
@@ -131,6 +132,8 @@ static char *queue_auto_search_get_tth(void)
 
 #ifndef TEST
 
+EP_EVENT_CALLBACK(queue_auto_search_sources_event_func)
+
 void queue_schedule_auto_search_sources(int enable)
 {
     static struct event ev;
@@ -141,7 +144,8 @@ void queue_schedule_auto_search_sources(int enable)
     }
     else if(enable)
     {
-        evtimer_set(&ev, queue_auto_search_sources_event_func, NULL);
+        evtimer_set(&ev, EP_PROFILED(queue_auto_search_sources_event_func),
+                NULL);
     }
 
     if(enable)
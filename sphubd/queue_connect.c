@@ -30,6 +30,7 @@
 
 #include "queue.h"
 #include "log.h"
+#include "event_profile.h"
 
 struct trigger_entry
 {
@@ -199,6 +200,8 @@ static void queue_trigger_connect_event_func(int fd, short why, void *data)
     queue_connect_schedule_trigger(callback_function);
 }
 
+EP_EVENT_CALLBACK(queue_trigger_connect_event_func)
+
 void queue_connect_schedule_trigger(queue_connect_callback_t callback_function)
 {
     static struct event queue_trigger_event;
@@ -210,7 +213,7 @@ void queue_connect_schedule_trigger(queue_connect_callback_t callback_function)
     else
     {
         evtimer_set(&queue_trigger_event,
-                queue_trigger_connect_event_func,
+                EP_PROFILED(queue_trigger_connect_event_func),
                 callback_function);
     }
 
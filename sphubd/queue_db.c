@@ -16,6 +16,9 @@
 
 #include "sys_queue.h"
 
+#include <sys/types.h>
+#include <sys/stat.h>
+
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,6 +26,9 @@
 #include <fcntl.h>
 #include <string.h>
 #include <inttypes.h>
+#include <unistd.h>
+
+#include <event.h>
 
 #include "xstr.h"
 #include "globals.h"
@@ -31,12 +37,309 @@
 #include "notifications.h"
 #include "quote.h"
 #include "compat.h"
+#include "event_profile.h"
 
 #define QUEUE_DB_FILENAME "queue2.db"
 
+/* The queue database is a log of binary records, each prefixed with a 32-bit
+ * length and a CRC-32 of the payload (both little endian). It starts with a
+ * snapshot of the queue, records appended since then are replayed on top of
+ * it. A torn or corrupt record at the end of the log is truncated on load.
+ */
+#define QUEUE_DB_MAGIC "SPQDB\0\0\1"
+#define QUEUE_DB_MAGIC_SIZE 8
+#define QUEUE_DB_HEADER_SIZE 8
+#define QUEUE_DB_MAX_RECORD_SIZE (64 * 1024)
+
+/* The log is compacted into a new snapshot when it holds this many times
+ * more records than are needed to describe the live queue.
+ */
+#define QUEUE_DB_COMPACT_RATIO 2
+#define QUEUE_DB_COMPACT_MIN_RECORDS 4096
+
+/* bytes of the new snapshot written per event loop iteration */
+#define QUEUE_DB_COMPACT_CHUNK_SIZE (512 * 1024)
+
+enum queue_db_record_type
+{
+	QUEUE_DB_ADD_TARGET = 1,
+	QUEUE_DB_REMOVE_TARGET,
+	QUEUE_DB_ADD_SOURCE,
+	QUEUE_DB_REMOVE_SOURCE,
+	QUEUE_DB_ADD_FILELIST,
+	QUEUE_DB_REMOVE_FILELIST,
+	QUEUE_DB_ADD_DIRECTORY,
+	QUEUE_DB_REMOVE_DIRECTORY,
+	QUEUE_DB_SET_RESOLVED,
+	QUEUE_DB_SET_PRIORITY
+};
+
+struct queue_db_reader
+{
+	const unsigned char *p;
+	size_t left;
+	bool error;
+};
+
 struct queue_store *q_store = NULL;
 
-static void queue_db_normalize(void);
+static void queue_db_save(void);
+static void queue_db_commit(void);
+
+static uint32_t
+queue_db_crc32(const void *data, size_t len)
+{
+	static uint32_t table[256];
+	static bool table_initialized = false;
+
+	if(!table_initialized)
+	{
+		uint32_t i, j, c;
+		for(i = 0; i < 256; i++)
+		{
+			c = i;
+			for(j = 0; j < 8; j++)
+				c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+		table_initialized = true;
+	}
+
+	const unsigned char *p = data;
+	uint32_t crc = 0xFFFFFFFF;
+	while(len--)
+		crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+	return crc ^ 0xFFFFFFFF;
+}
+
+static void
+queue_db_put_type(struct evbuffer *buf, enum queue_db_record_type type)
+{
+	unsigned char b = type;
+	evbuffer_add(buf, &b, 1);
+}
+
+static void
+queue_db_put_u32(struct evbuffer *buf, uint32_t v)
+{
+	unsigned char b[4] = {v, v >> 8, v >> 16, v >> 24};
+	evbuffer_add(buf, b, sizeof(b));
+}
+
+static void
+queue_db_put_u64(struct evbuffer *buf, uint64_t v)
+{
+	queue_db_put_u32(buf, v & 0xFFFFFFFF);
+	queue_db_put_u32(buf, v >> 32);
+}
+
+static void
+queue_db_put_string(struct evbuffer *buf, const char *s)
+{
+	/* Strings are stored with their nul terminator so they can be used
+	 * in place when replaying. NULL is stored as length 0.
+	 */
+	uint32_t len = s ? strlen(s) + 1 : 0;
+	queue_db_put_u32(buf, len);
+	if(len)
+		evbuffer_add(buf, s, len);
+}
+
+static uint32_t
+queue_db_get_u32(struct queue_db_reader *r)
+{
+	if(r->left < 4)
+	{
+		r->error = true;
+		return 0;
+	}
+
+	uint32_t v = r->p[0] | (r->p[1] << 8) | (r->p[2] << 16) |
+		((uint32_t)r->p[3] << 24);
+	r->p += 4;
+	r->left -= 4;
+
+	return v;
+}
+
+static uint64_t
+queue_db_get_u64(struct queue_db_reader *r)
+{
+	uint64_t lo = queue_db_get_u32(r);
+	uint64_t hi = queue_db_get_u32(r);
+
+	return lo | (hi << 32);
+}
+
+static const char *
+queue_db_get_string(struct queue_db_reader *r)
+{
+	uint32_t len = queue_db_get_u32(r);
+	if(r->error || len == 0)
+		return NULL;
+
+	if(len > r->left || r->p[len - 1] != '\0')
+	{
+		r->error = true;
+		return NULL;
+	}
+
+	const char *s = (const char *)r->p;
+	r->p += len;
+	r->left -= len;
+
+	return s;
+}
+
+/* The encoding functions below build the payload of a single record in
+ * q_store->record.
+ */
+
+static void
+queue_db_encode_add_target(struct queue_target *qt)
+{
+	struct evbuffer *rec = q_store->record;
+
+	queue_db_put_type(rec, QUEUE_DB_ADD_TARGET);
+	queue_db_put_string(rec, qt->filename);
+	queue_db_put_string(rec, qt->target_directory);
+	queue_db_put_u64(rec, qt->size);
+	queue_db_put_string(rec, qt->tth);
+	queue_db_put_u32(rec, qt->flags);
+	queue_db_put_u64(rec, qt->ctime);
+	queue_db_put_u32(rec, qt->priority);
+	queue_db_put_u32(rec, qt->seq);
+}
+
+static void
+queue_db_encode_add_source(struct queue_source *qs)
+{
+	struct evbuffer *rec = q_store->record;
+
+	queue_db_put_type(rec, QUEUE_DB_ADD_SOURCE);
+	queue_db_put_string(rec, qs->nick);
+	queue_db_put_string(rec, qs->target_filename);
+	queue_db_put_string(rec, qs->source_filename);
+}
+
+static void
+queue_db_encode_remove_source(struct queue_source *qs)
+{
+	struct evbuffer *rec = q_store->record;
+
+	queue_db_put_type(rec, QUEUE_DB_REMOVE_SOURCE);
+	queue_db_put_string(rec, qs->target_filename);
+	queue_db_put_string(rec, qs->nick);
+}
+
+static void
+queue_db_encode_add_filelist(struct queue_filelist *qf)
+{
+	struct evbuffer *rec = q_store->record;
+
+	queue_db_put_type(rec, QUEUE_DB_ADD_FILELIST);
+	queue_db_put_string(rec, qf->nick);
+	queue_db_put_u32(rec, qf->flags);
+}
+
+static void
+queue_db_encode_add_directory(struct queue_directory *qd)
+{
+	struct evbuffer *rec = q_store->record;
+
+	queue_db_put_type(rec, QUEUE_DB_ADD_DIRECTORY);
+	queue_db_put_string(rec, qd->target_directory);
+	queue_db_put_string(rec, qd->nick);
+	queue_db_put_string(rec, qd->source_directory);
+}
+
+static void
+queue_db_encode_set_resolved(struct queue_directory *qd)
+{
+	struct evbuffer *rec = q_store->record;
+
+	queue_db_put_type(rec, QUEUE_DB_SET_RESOLVED);
+	queue_db_put_string(rec, qd->target_directory);
+	queue_db_put_u32(rec, qd->nfiles);
+}
+
+static void
+queue_db_encode_set_priority(const char *target_filename, int priority)
+{
+	struct evbuffer *rec = q_store->record;
+
+	queue_db_put_type(rec, QUEUE_DB_SET_PRIORITY);
+	queue_db_put_string(rec, target_filename);
+	queue_db_put_u32(rec, priority);
+}
+
+/* used for the remove records, which only carry a name */
+static void
+queue_db_encode_name(enum queue_db_record_type type, const char *name)
+{
+	struct evbuffer *rec = q_store->record;
+
+	queue_db_put_type(rec, type);
+	queue_db_put_string(rec, name);
+}
+
+/* Appends the record in q_store->record, with length and checksum, to buf.
+ */
+static void
+queue_db_frame_record(struct evbuffer *buf)
+{
+	struct evbuffer *rec = q_store->record;
+	size_t len = EVBUFFER_LENGTH(rec);
+
+	queue_db_put_u32(buf, len);
+	queue_db_put_u32(buf, queue_db_crc32(EVBUFFER_DATA(rec), len));
+	evbuffer_add(buf, EVBUFFER_DATA(rec), len);
+}
+
+static void
+queue_db_schedule(struct event *ev)
+{
+	if(!evtimer_pending(ev, NULL))
+	{
+		struct timeval tv = {.tv_sec = 0, .tv_usec = 0};
+		evtimer_add(ev, &tv);
+	}
+}
+
+/* Logs the record in q_store->record. With group commit enabled, all records
+ * logged during one event loop iteration are written and synced together.
+ */
+static void
+queue_db_append_record(void)
+{
+	queue_db_frame_record(q_store->pending);
+	q_store->nrecords++;
+
+	/* records logged while compacting must also end up in the new log */
+	if(q_store->compacting)
+	{
+		queue_db_frame_record(q_store->snapshot_tail);
+		q_store->snapshot_nrecords++;
+	}
+
+	evbuffer_drain(q_store->record, EVBUFFER_LENGTH(q_store->record));
+
+	if(q_store->group_commit)
+		queue_db_schedule(&q_store->commit_event);
+	else
+		queue_db_commit();
+}
+
+/* Adds the record in q_store->record to the snapshot being built.
+ */
+static void
+queue_db_snapshot_record(void)
+{
+	queue_db_frame_record(q_store->snapshot);
+	q_store->snapshot_nrecords++;
+	evbuffer_drain(q_store->record, EVBUFFER_LENGTH(q_store->record));
+}
 
 static void
 queue_parse_add_target(char *buf, size_t len)
@@ -203,21 +506,27 @@ queue_parse_remove_source(char *buf, size_t len)
 	queue_remove_source(target_filename, nick);
 }
 
+/* Imports a queue database in the old text format.
+ */
 static void
-queue_load(void)
+queue_db_load_text(const char *filename)
 {
-	return_if_fail(q_store);
-	return_if_fail(q_store->fp);
+	FILE *fp = fopen(filename, "r");
+	if(fp == NULL)
+	{
+		ERROR("%s: %s", filename, strerror(errno));
+		return;
+	}
 
-	rewind(q_store->fp);
 	q_store->loading = true;
 
+	unsigned line_number = 0;
 	int ntargets = 0, nsources = 0, nfilelists = 0, ndirectories = 0;
 	char *buf, *lbuf = NULL;
 	size_t len;
-	while((buf = fgetln(q_store->fp, &len)) != NULL)
+	while((buf = fgetln(fp, &len)) != NULL)
 	{
-		q_store->line_number++;
+		line_number++;
 
 		if(buf[len - 1] == '\n')
 			buf[len - 1] = 0;
@@ -286,35 +595,500 @@ queue_load(void)
 		}
 		else
 		{
-			ERROR("unknown directive on line %u",
-				q_store->line_number);
+			ERROR("unknown directive on line %u", line_number);
 		}
 	}
 	free(lbuf);
+	fclose(fp);
 
-	INFO("loaded %i targets, %i sources, %i filelists, %i directories (%u lines)",
-		ntargets, nsources, nfilelists, ndirectories, q_store->line_number);
+	INFO("imported %i targets, %i sources, %i filelists, %i directories (%u lines)",
+		ntargets, nsources, nfilelists, ndirectories, line_number);
 
 	q_store->loading = false;
 }
 
+/* Replays a single record. Returns the record type, or -1 if the record
+ * couldn't be decoded.
+ */
+static int
+queue_db_replay_record(const unsigned char *payload, size_t len)
+{
+	struct queue_db_reader r = {.p = payload + 1, .left = len - 1};
+	const char *s1, *s2, *s3;
+	uint64_t size, ctime;
+	unsigned flags, priority, seq;
+
+	switch(payload[0])
+	{
+	case QUEUE_DB_ADD_TARGET:
+		s1 = queue_db_get_string(&r);
+		s2 = queue_db_get_string(&r);
+		size = queue_db_get_u64(&r);
+		s3 = queue_db_get_string(&r);
+		flags = queue_db_get_u32(&r);
+		ctime = queue_db_get_u64(&r);
+		priority = queue_db_get_u32(&r);
+		seq = queue_db_get_u32(&r);
+		if(r.error || s1 == NULL)
+			return -1;
+		queue_target_t *qt = queue_target_add(s1, s3 && *s3 ? s3 : NULL,
+			s2, size, flags, priority, seq);
+		if(qt)
+			qt->ctime = ctime;
+		break;
+	case QUEUE_DB_REMOVE_TARGET:
+		s1 = queue_db_get_string(&r);
+		if(r.error || s1 == NULL)
+			return -1;
+		queue_remove_target(s1);
+		break;
+	case QUEUE_DB_ADD_SOURCE:
+		s1 = queue_db_get_string(&r);
+		s2 = queue_db_get_string(&r);
+		s3 = queue_db_get_string(&r);
+		if(r.error || s1 == NULL || s2 == NULL || s3 == NULL)
+			return -1;
+		queue_add_source(s1, s2, s3);
+		break;
+	case QUEUE_DB_REMOVE_SOURCE:
+		s1 = queue_db_get_string(&r);
+		s2 = queue_db_get_string(&r);
+		if(r.error || s1 == NULL || s2 == NULL)
+			return -1;
+		queue_remove_source(s1, s2);
+		break;
+	case QUEUE_DB_ADD_FILELIST:
+		s1 = queue_db_get_string(&r);
+		flags = queue_db_get_u32(&r);
+		if(r.error || s1 == NULL)
+			return -1;
+		queue_add_filelist(s1, (flags & QUEUE_TARGET_AUTO_MATCHED) ==
+			QUEUE_TARGET_AUTO_MATCHED);
+		break;
+	case QUEUE_DB_REMOVE_FILELIST:
+		s1 = queue_db_get_string(&r);
+		if(r.error || s1 == NULL)
+			return -1;
+		queue_remove_filelist(s1);
+		break;
+	case QUEUE_DB_ADD_DIRECTORY:
+		s1 = queue_db_get_string(&r);
+		s2 = queue_db_get_string(&r);
+		s3 = queue_db_get_string(&r);
+		if(r.error || s1 == NULL || s2 == NULL || s3 == NULL)
+			return -1;
+		queue_db_add_directory(s1, s2, s3);
+		break;
+	case QUEUE_DB_REMOVE_DIRECTORY:
+		s1 = queue_db_get_string(&r);
+		if(r.error || s1 == NULL)
+			return -1;
+		queue_remove_directory(s1);
+		break;
+	case QUEUE_DB_SET_RESOLVED:
+		s1 = queue_db_get_string(&r);
+		flags = queue_db_get_u32(&r);
+		if(r.error || s1 == NULL)
+			return -1;
+		queue_db_set_resolved(s1, flags);
+		break;
+	case QUEUE_DB_SET_PRIORITY:
+		s1 = queue_db_get_string(&r);
+		priority = queue_db_get_u32(&r);
+		if(r.error || s1 == NULL)
+			return -1;
+		queue_set_priority(s1, priority);
+		break;
+	default:
+		return -1;
+	}
+
+	return payload[0];
+}
+
+/* Loads the queue database from q_store->fd. Returns 1 if the file is in
+ * the old text format, 0 if it was loaded (or empty) and -1 on errors.
+ */
+static int
+queue_db_load(void)
+{
+	struct stat stbuf;
+	if(fstat(q_store->fd, &stbuf) != 0)
+	{
+		ERROR("fstat: %s", strerror(errno));
+		return -1;
+	}
+
+	size_t size = stbuf.st_size;
+	if(size == 0)
+	{
+		/* a new database */
+		evbuffer_add(q_store->pending, QUEUE_DB_MAGIC, QUEUE_DB_MAGIC_SIZE);
+		queue_db_commit();
+		return 0;
+	}
+
+	unsigned char *data = malloc(size);
+	return_val_if_fail(data, -1);
+
+	size_t nread = 0;
+	while(nread < size)
+	{
+		ssize_t n = pread(q_store->fd, data + nread, size - nread, nread);
+		if(n <= 0)
+		{
+			if(n == -1 && errno == EINTR)
+				continue;
+			ERROR("failed to read queue database: %s",
+				n == 0 ? "unexpected end of file" : strerror(errno));
+			free(data);
+			return -1;
+		}
+		nread += n;
+	}
+
+	if(size < QUEUE_DB_MAGIC_SIZE ||
+	   memcmp(data, QUEUE_DB_MAGIC, QUEUE_DB_MAGIC_SIZE) != 0)
+	{
+		free(data);
+		return 1;
+	}
+
+	q_store->loading = true;
+
+	int ntargets = 0, nsources = 0, nfilelists = 0, ndirectories = 0;
+	size_t offset = QUEUE_DB_MAGIC_SIZE;
+	while(offset < size)
+	{
+		struct queue_db_reader hdr = {.p = data + offset,
+			.left = size - offset};
+		uint32_t len = queue_db_get_u32(&hdr);
+		uint32_t crc = queue_db_get_u32(&hdr);
+
+		if(hdr.error || len == 0 || len > QUEUE_DB_MAX_RECORD_SIZE ||
+		   len > hdr.left)
+		{
+			WARNING("incomplete record at offset %zu in queue database",
+				offset);
+			break;
+		}
+
+		if(queue_db_crc32(hdr.p, len) != crc)
+		{
+			WARNING("checksum mismatch at offset %zu in queue database",
+				offset);
+			break;
+		}
+
+		switch(queue_db_replay_record(hdr.p, len))
+		{
+		case QUEUE_DB_ADD_TARGET: ntargets++; break;
+		case QUEUE_DB_REMOVE_TARGET: ntargets--; break;
+		case QUEUE_DB_ADD_SOURCE: nsources++; break;
+		case QUEUE_DB_REMOVE_SOURCE: nsources--; break;
+		case QUEUE_DB_ADD_FILELIST: nfilelists++; break;
+		case QUEUE_DB_REMOVE_FILELIST: nfilelists--; break;
+		case QUEUE_DB_ADD_DIRECTORY: ndirectories++; break;
+		case QUEUE_DB_REMOVE_DIRECTORY: ndirectories--; break;
+		case -1:
+			ERROR("invalid record at offset %zu in queue database",
+				offset);
+			break;
+		}
+
+		q_store->nrecords++;
+		offset += QUEUE_DB_HEADER_SIZE + len;
+	}
+	free(data);
+
+	q_store->loading = false;
+
+	if(offset < size)
+	{
+		/* Probably a partial write from a crash. Records after a bad
+		 * one can't be trusted either, so cut the log here.
+		 */
+		WARNING("truncating queue database, discarding %zu bytes",
+			size - offset);
+		if(ftruncate(q_store->fd, offset) != 0)
+			ERROR("ftruncate: %s", strerror(errno));
+	}
+
+	INFO("loaded %i targets, %i sources, %i filelists, %i directories (%u records)",
+		ntargets, nsources, nfilelists, ndirectories, q_store->nrecords);
+
+	return 0;
+}
+
+static char *
+queue_db_filename(const char *suffix)
+{
+	char *filename;
+	if(asprintf(&filename, "%s/%s%s", global_working_directory,
+		QUEUE_DB_FILENAME, suffix) == -1)
+	{
+		return NULL;
+	}
+	return filename;
+}
+
+/* Writes len bytes from the head of buf to fd, draining what was written.
+ */
+static int
+queue_db_write(int fd, struct evbuffer *buf, size_t len)
+{
+	while(len > 0)
+	{
+		ssize_t n = write(fd, EVBUFFER_DATA(buf), len);
+		if(n == -1)
+		{
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		evbuffer_drain(buf, n);
+		len -= n;
+	}
+
+	return 0;
+}
+
+static unsigned
+queue_db_count_live_records(void)
+{
+	unsigned n = 0;
+
+	struct queue_target *qt;
+	TAILQ_FOREACH(qt, &q_store->targets, link)
+		n++;
+	struct queue_source *qs;
+	TAILQ_FOREACH(qs, &q_store->sources, link)
+		n++;
+	struct queue_filelist *qf;
+	TAILQ_FOREACH(qf, &q_store->filelists, link)
+		n++;
+	struct queue_directory *qd;
+	TAILQ_FOREACH(qd, &q_store->directories, link)
+		n += 2;
+
+	return n;
+}
+
 static void
-queue_db_open_logfile(void)
+queue_db_end_compaction(void)
 {
-	return_if_fail(q_store);
+	if(q_store->snapshot_fd != -1)
+		close(q_store->snapshot_fd);
+	q_store->snapshot_fd = -1;
+	evbuffer_free(q_store->snapshot);
+	q_store->snapshot = NULL;
+	evbuffer_free(q_store->snapshot_tail);
+	q_store->snapshot_tail = NULL;
+	q_store->compacting = false;
+}
+
+static void
+queue_db_abort_compaction(const char *what)
+{
+	ERROR("compacting queue database failed: %s: %s",
+		what, strerror(errno));
+
+	char *tmpfile = queue_db_filename(".tmp");
+	if(tmpfile)
+		unlink(tmpfile);
+	free(tmpfile);
+
+	queue_db_end_compaction();
+	q_store->next_compact_check = q_store->nrecords +
+		QUEUE_DB_COMPACT_MIN_RECORDS;
+}
+
+static void
+queue_db_finish_compaction(void)
+{
+	/* Flush records logged since the snapshot was taken to the old log.
+	 * They are already in the tail of the new one, so whatever couldn't
+	 * be written must not be written to the new log again.
+	 */
+	queue_db_commit();
+	evbuffer_drain(q_store->pending, EVBUFFER_LENGTH(q_store->pending));
+
+	if(queue_db_write(q_store->snapshot_fd, q_store->snapshot_tail,
+		EVBUFFER_LENGTH(q_store->snapshot_tail)) != 0)
+	{
+		queue_db_abort_compaction("write");
+		return;
+	}
+
+	if(fsync(q_store->snapshot_fd) != 0)
+	{
+		queue_db_abort_compaction("fsync");
+		return;
+	}
+
+	char *tmpfile = queue_db_filename(".tmp");
+	char *filename = queue_db_filename("");
+	int rc = rename(tmpfile, filename);
+	free(tmpfile);
+	free(filename);
+	if(rc != 0)
+	{
+		queue_db_abort_compaction("rename");
+		return;
+	}
+
+	close(q_store->fd);
+	q_store->fd = q_store->snapshot_fd;
+	q_store->snapshot_fd = -1;
+	q_store->nrecords = q_store->snapshot_nrecords;
+	queue_db_end_compaction();
+
+	q_store->next_compact_check = q_store->nrecords +
+		(q_store->nrecords > QUEUE_DB_COMPACT_MIN_RECORDS ?
+		 q_store->nrecords : QUEUE_DB_COMPACT_MIN_RECORDS);
+
+	INFO("compacted queue database to %u records", q_store->nrecords);
+}
+
+/* Writes the next chunk of the new snapshot, finishes the compaction when
+ * the whole snapshot is written.
+ */
+static void
+queue_db_compact_step(void)
+{
+	size_t len = EVBUFFER_LENGTH(q_store->snapshot);
+	if(len > QUEUE_DB_COMPACT_CHUNK_SIZE)
+		len = QUEUE_DB_COMPACT_CHUNK_SIZE;
+
+	if(queue_db_write(q_store->snapshot_fd, q_store->snapshot, len) != 0)
+	{
+		queue_db_abort_compaction("write");
+		return;
+	}
+
+	if(EVBUFFER_LENGTH(q_store->snapshot) > 0)
+	{
+		if(q_store->group_commit)
+			queue_db_schedule(&q_store->compact_event);
+	}
+	else
+		queue_db_finish_compaction();
+}
+
+static void
+queue_db_compact_event(int fd, short why, void *data)
+{
+	if(q_store && q_store->compacting)
+		queue_db_compact_step();
+}
+
+/* Replaces the log with a snapshot of the live queue. The snapshot is
+ * encoded in memory up front and written out in chunks from the event loop,
+ * so large queues don't block it. Without group commit (ie, outside
+ * sphubd) it completes before returning.
+ */
+static void
+queue_db_start_compaction(void)
+{
+	char *tmpfile = queue_db_filename(".tmp");
+	return_if_fail(tmpfile);
+
+	int fd = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if(fd == -1)
+	{
+		ERROR("%s: %s", tmpfile, strerror(errno));
+		free(tmpfile);
+		q_store->next_compact_check = q_store->nrecords +
+			QUEUE_DB_COMPACT_MIN_RECORDS;
+		return;
+	}
+	free(tmpfile);
+
+	DEBUG("compacting queue database with %u records", q_store->nrecords);
+
+	q_store->snapshot_fd = fd;
+	q_store->snapshot = evbuffer_new();
+	q_store->snapshot_tail = evbuffer_new();
+	q_store->snapshot_nrecords = 0;
+
+	evbuffer_add(q_store->snapshot, QUEUE_DB_MAGIC, QUEUE_DB_MAGIC_SIZE);
+	queue_db_save();
+
+	q_store->compacting = true;
+
+	if(q_store->group_commit)
+		queue_db_schedule(&q_store->compact_event);
+	else
+	{
+		while(q_store->compacting)
+			queue_db_compact_step();
+	}
+}
+
+static void
+queue_db_maybe_compact(void)
+{
+	if(q_store->compacting ||
+	   q_store->nrecords < q_store->next_compact_check)
+		return;
+
+	unsigned nlive = queue_db_count_live_records();
+	if(q_store->nrecords > QUEUE_DB_COMPACT_RATIO * nlive)
+		queue_db_start_compaction();
+	else
+		q_store->next_compact_check = q_store->nrecords +
+			(nlive > QUEUE_DB_COMPACT_MIN_RECORDS ?
+			 nlive : QUEUE_DB_COMPACT_MIN_RECORDS);
+}
+
+/* Writes all pending records to the log.
+ */
+static void
+queue_db_commit(void)
+{
+	size_t len = EVBUFFER_LENGTH(q_store->pending);
+	if(len == 0)
+		return;
+
+	if(q_store->fd == -1)
+	{
+		evbuffer_drain(q_store->pending, len);
+		return;
+	}
+
+	if(queue_db_write(q_store->fd, q_store->pending, len) != 0)
+	{
+		/* the rest is retried on the next commit */
+		ERROR("failed to write queue database: %s", strerror(errno));
+		return;
+	}
+
+	if(q_store->group_commit && fsync(q_store->fd) != 0)
+		WARNING("failed to sync queue database: %s", strerror(errno));
+
+	queue_db_maybe_compact();
+}
+
+static void
+queue_db_commit_event(int fd, short why, void *data)
+{
+	if(q_store)
+		queue_db_commit();
+}
 
-	if(q_store->fp)
-		fclose(q_store->fp);
+EP_EVENT_CALLBACK(queue_db_commit_event)
+EP_EVENT_CALLBACK(queue_db_compact_event)
 
-	DEBUG("opening databases in file %s", QUEUE_DB_FILENAME);
-	char *qlog_filename;
-	int num_returned_bytes = asprintf(&qlog_filename, "%s/%s", global_working_directory, QUEUE_DB_FILENAME);
-	if (num_returned_bytes == -1)
-        DEBUG("asprintf did not return anything");
-	q_store->fp = fopen(qlog_filename, "a+");
-	if(q_store->fp == NULL)
-		ERROR("%s: %s", qlog_filename, strerror(errno));
-	free(qlog_filename);
+void
+queue_db_enable_group_commit(void)
+{
+	return_if_fail(q_store);
+
+	evtimer_set(&q_store->commit_event,
+		EP_PROFILED(queue_db_commit_event), NULL);
+	evtimer_set(&q_store->compact_event,
+		EP_PROFILED(queue_db_compact_event), NULL);
+	q_store->group_commit = true;
 }
 
 void
@@ -324,19 +1098,42 @@ queue_init(void)
 
 	q_store = calloc(1, sizeof(struct queue_store));
 	q_store->sequence = 1;
+	q_store->snapshot_fd = -1;
+	q_store->next_compact_check = QUEUE_DB_COMPACT_MIN_RECORDS;
+	q_store->record = evbuffer_new();
+	q_store->pending = evbuffer_new();
 
 	TAILQ_INIT(&q_store->targets);
 	TAILQ_INIT(&q_store->sources);
 	TAILQ_INIT(&q_store->filelists);
 	TAILQ_INIT(&q_store->directories);
 
-	queue_db_open_logfile();
+	char *filename = queue_db_filename("");
+	DEBUG("opening queue database %s", filename);
+	q_store->fd = open(filename, O_RDWR | O_CREAT | O_APPEND, 0644);
+	if(q_store->fd == -1)
+	{
+		ERROR("%s: %s", filename, strerror(errno));
+		free(filename);
+		return;
+	}
 
-	return_if_fail(q_store->fp);
-	queue_load();
+	if(queue_db_load() == 1)
+	{
+		INFO("converting queue database to binary format");
+		queue_db_load_text(filename);
 
-	/* set the log file line buffered */
-	setvbuf(q_store->fp, NULL, _IOLBF, 0);
+		int old_fd = q_store->fd;
+		queue_db_start_compaction();
+		if(q_store->fd == old_fd)
+		{
+			/* don't append binary records to the old text file */
+			ERROR("failed to convert queue database, changes won't be saved");
+			close(q_store->fd);
+			q_store->fd = -1;
+		}
+	}
+	free(filename);
 }
 
 void
@@ -395,10 +1192,30 @@ queue_close(void)
 
 	INFO("closing queue");
 
-	queue_db_normalize();
+	queue_db_commit();
 
-	fclose(q_store->fp);
-	q_store->fp = NULL;
+	if(q_store->group_commit)
+	{
+		event_del(&q_store->commit_event);
+		event_del(&q_store->compact_event);
+		q_store->group_commit = false;
+	}
+
+	/* finish any compaction in progress, or compact now if the log has
+	 * any dead records */
+	if(q_store->compacting)
+	{
+		while(q_store->compacting)
+			queue_db_compact_step();
+	}
+	else if(q_store->fd != -1 &&
+		q_store->nrecords > queue_db_count_live_records())
+	{
+		queue_db_start_compaction();
+	}
+
+	if(q_store->fd != -1)
+		close(q_store->fd);
 
 	struct queue_target *qt;
 	while((qt = TAILQ_FIRST(&q_store->targets)) != NULL)
@@ -416,6 +1233,8 @@ queue_close(void)
 	while((qd = TAILQ_FIRST(&q_store->directories)) != NULL)
 		queue_directory_free(qd);
 
+	evbuffer_free(q_store->record);
+	evbuffer_free(q_store->pending);
 	free(q_store);
 	q_store = NULL;
 
@@ -566,7 +1385,7 @@ queue_target_add(const char *target_filename,
 
 	if(!q_store->loading)
 	{
-		queue_db_print_add_target(q_store->fp, qt);
+		queue_db_log_add_target(qt);
 
 		/* notify UI:s */
 		nc_send_queue_target_added_notification(nc_default(),
@@ -610,7 +1429,7 @@ queue_add_source(const char *nick, const char *target_filename,
 		TAILQ_INSERT_TAIL(&q_store->sources, qs, link);
 
 		if(!q_store->loading)
-			queue_db_print_add_source(q_store->fp, qs);
+			queue_db_log_add_source(qs);
 	}
 	else
 	{
@@ -637,9 +1456,8 @@ queue_remove_filelist(const char *nick)
 
 		if(!q_store->loading)
 		{
-			char *tmp = str_quote_backslash(nick, ":");
-			fprintf(q_store->fp, "-F:%s\n", tmp);
-			free(tmp);
+			queue_db_encode_name(QUEUE_DB_REMOVE_FILELIST, nick);
+			queue_db_append_record();
 		}
 
 		/* notify ui:s */
@@ -664,9 +1482,9 @@ queue_db_remove_target(const char *target_filename)
 
 		if(!q_store->loading)
 		{
-			char *tmp = str_quote_backslash(target_filename, ":");
-			fprintf(q_store->fp, "-T:%s\n", tmp);
-			free(tmp);
+			queue_db_encode_name(QUEUE_DB_REMOVE_TARGET,
+				target_filename);
+			queue_db_append_record();
 		}
 
 		/* notify ui:s */
@@ -745,7 +1563,7 @@ queue_remove_sources(const char *target_filename)
 				qs->nick, qs->target_filename);
 
 			if(!q_store->loading)
-				queue_db_print_remove_source(q_store->fp, qs);
+				queue_db_log_remove_source(qs);
 			queue_source_free(qs);
 		}
 	}
@@ -772,7 +1590,7 @@ queue_remove_sources_by_nick(const char *nick)
 			nick, qs->target_filename);
 
 		if(!q_store->loading)
-			queue_db_print_remove_source(q_store->fp, qs);
+			queue_db_log_remove_source(qs);
 
 		nc_send_queue_source_removed_notification(nc_default(),
 			qs->target_filename, nick);
@@ -809,7 +1627,7 @@ queue_db_add_directory(const char *target_directory,
 	qd->source_directory = strdup(source_directory);
 
 	if(!q_store->loading)
-		queue_db_print_add_directory(q_store->fp, qd);
+		queue_db_log_add_directory(qd);
 }
 
 int
@@ -824,9 +1642,8 @@ queue_db_remove_directory(const char *target_directory)
 
 	if(!q_store->loading)
 	{
-		char *tmp = str_quote_backslash(target_directory, ":");
-		fprintf(q_store->fp, "-D:%s\n", tmp);
-		free(tmp);
+		queue_db_encode_name(QUEUE_DB_REMOVE_DIRECTORY, target_directory);
+		queue_db_append_record();
 	}
 
 	/* notify ui:s */
@@ -883,7 +1700,7 @@ queue_db_set_resolved(const char *target_directory, unsigned nfiles)
 
 		/* log resolved and number of files in the directory */
 		if(!q_store->loading)
-			queue_db_print_set_resolved(q_store->fp, qd);
+			queue_db_log_set_resolved(qd);
 	}
 }
 
@@ -900,197 +1717,298 @@ queue_target_duplicate(struct queue_target *qt)
 	return qt_dup;
 }
 
-int
-queue_db_print_add_target(FILE *fp, struct queue_target *qt)
+void
+queue_db_log_add_target(struct queue_target *qt)
 {
-	return_val_if_fail(fp, -1);
-	return_val_if_fail(qt, -1);
-
-	char *tmp1 = str_quote_backslash(qt->filename, ":");
-	char *tmp2 = str_quote_backslash(qt->target_directory, ":");
+	return_if_fail(qt);
 
-	int rc = fprintf(fp,
-		"+T:%s:%s:%"PRIu64":%s:%u:%lu:%i:%u\n",
-		tmp1,
-		tmp2 ? tmp2 : "",
-		qt->size,
-		qt->tth ? qt->tth : "",
-		qt->flags,
-		(unsigned long)qt->ctime,
-		qt->priority,
-		qt->seq);
-
-	free(tmp1);
-	free(tmp2);
-
-	return rc;
+	queue_db_encode_add_target(qt);
+	queue_db_append_record();
 }
 
-int
-queue_db_print_add_source(FILE *fp, struct queue_source *qs)
+void
+queue_db_log_add_source(struct queue_source *qs)
 {
-	return_val_if_fail(fp, -1);
-	return_val_if_fail(qs, -1);
-
-	char *tmp1 = str_quote_backslash(qs->nick, ":");
-	char *tmp2 = str_quote_backslash(qs->target_filename, ":");
-	char *tmp3 = str_quote_backslash(qs->source_filename, ":");
-	int rc = fprintf(fp, "+S:%s:%s:%s\n", tmp1, tmp2, tmp3);
-	free(tmp1);
-	free(tmp2);
-	free(tmp3);
+	return_if_fail(qs);
 
-	return rc;
+	queue_db_encode_add_source(qs);
+	queue_db_append_record();
 }
 
-int
-queue_db_print_remove_source(FILE *fp, struct queue_source *qs)
+void
+queue_db_log_remove_source(struct queue_source *qs)
 {
-	return_val_if_fail(fp, -1);
-	return_val_if_fail(qs, -1);
-
-	char *tmp1 = str_quote_backslash(qs->target_filename, ":");
-	char *tmp2 = str_quote_backslash(qs->nick, ":");
-	int rc = fprintf(q_store->fp, "-S:%s:%s\n", tmp1, tmp2);
-	free(tmp1);
-	free(tmp2);
+	return_if_fail(qs);
 
-	return rc;
+	queue_db_encode_remove_source(qs);
+	queue_db_append_record();
 }
 
-int
-queue_db_print_add_filelist(FILE *fp, struct queue_filelist *qf)
+void
+queue_db_log_add_filelist(struct queue_filelist *qf)
 {
-	return_val_if_fail(fp, -1);
-	return_val_if_fail(qf, -1);
-
-	char *tmp = str_quote_backslash(qf->nick, ":");
-	int rc = fprintf(fp, "+F:%s:%i\n", tmp, qf->flags);
-	free(tmp);
+	return_if_fail(qf);
 
-	return rc;
+	queue_db_encode_add_filelist(qf);
+	queue_db_append_record();
 }
 
-int
-queue_db_print_add_directory(FILE *fp, struct queue_directory *qd)
+void
+queue_db_log_add_directory(struct queue_directory *qd)
 {
-	return_val_if_fail(fp, -1);
-	return_val_if_fail(qd, -1);
-
-	char *tmp1 = str_quote_backslash(qd->target_directory, ":");
-	char *tmp2 = str_quote_backslash(qd->nick, ":");
-	char *tmp3 = str_quote_backslash(qd->source_directory, ":");
-	int rc = fprintf(fp, "+D:%s:%s:%s\n", tmp1, tmp2, tmp3);
-	free(tmp1);
-	free(tmp2);
-	free(tmp3);
+	return_if_fail(qd);
 
-	return rc;
+	queue_db_encode_add_directory(qd);
+	queue_db_append_record();
 }
 
-int
-queue_db_print_set_resolved(FILE *fp, struct queue_directory *qd)
+void
+queue_db_log_set_resolved(struct queue_directory *qd)
 {
-	return_val_if_fail(fp, -1);
-	return_val_if_fail(qd, -1);
+	return_if_fail(qd);
 
-	int rc = 0;
 	if((qd->flags & QUEUE_DIRECTORY_RESOLVED) == QUEUE_DIRECTORY_RESOLVED)
 	{
-		char *tmp = str_quote_backslash(qd->target_directory, ":");
-		rc = fprintf(fp, "=R:%s:%u\n", tmp, qd->nfiles);
-		free(tmp);
+		queue_db_encode_set_resolved(qd);
+		queue_db_append_record();
 	}
+}
+
+void
+queue_db_log_set_priority(const char *target_filename, int priority)
+{
+	return_if_fail(target_filename);
 
-	return rc;
+	queue_db_encode_set_priority(target_filename, priority);
+	queue_db_append_record();
 }
 
-static int
-queue_db_save(FILE *fp)
+/* Encodes the live queue into q_store->snapshot.
+ */
+static void
+queue_db_save(void)
 {
-	return_val_if_fail(fp, -1);
-	return_val_if_fail(q_store, -1);
-	return_val_if_fail(!q_store->loading, -1);
+	return_if_fail(q_store);
+	return_if_fail(!q_store->loading);
 
 	/* save targets */
 	struct queue_target *qt;
 	TAILQ_FOREACH(qt, &q_store->targets, link)
 	{
-		if(queue_db_print_add_target(fp, qt) < 0)
-			return -1;
+		queue_db_encode_add_target(qt);
+		queue_db_snapshot_record();
 	}
 
 	/* save sources */
 	struct queue_source *qs;
 	TAILQ_FOREACH(qs, &q_store->sources, link)
 	{
-		if(queue_db_print_add_source(fp, qs) < 0)
-			return -1;
+		queue_db_encode_add_source(qs);
+		queue_db_snapshot_record();
 	}
 
 	/* save filelists */
 	struct queue_filelist *qf;
 	TAILQ_FOREACH(qf, &q_store->filelists, link)
 	{
-		if(queue_db_print_add_filelist(fp, qf) < 0)
-			return -1;
+		queue_db_encode_add_filelist(qf);
+		queue_db_snapshot_record();
 	}
 
-	/* save directories */
+	/* Save directories. Unresolved directories must be kept too, now
+	 * that the log is compacted while running.
+	 */
 	struct queue_directory *qd;
 	TAILQ_FOREACH(qd, &q_store->directories, link)
 	{
-		if(qd->nleft > 0)
+		bool resolved = (qd->flags & QUEUE_DIRECTORY_RESOLVED) ==
+			QUEUE_DIRECTORY_RESOLVED;
+		if(qd->nleft > 0 || !resolved)
 		{
-			queue_db_print_add_directory(fp, qd);
-			queue_db_print_set_resolved(fp, qd);
+			queue_db_encode_add_directory(qd);
+			queue_db_snapshot_record();
+			if(resolved)
+			{
+				queue_db_encode_set_resolved(qd);
+				queue_db_snapshot_record();
+			}
 		}
 	}
+}
 
-	return 0;
+#ifdef TEST
+
+#include "unit_test.h"
+
+#define TEST_DIR "/tmp/sp-queue_db-test.d"
+#define TEST_TTH "IP4CTCABTUE6ZHZLFS2OP5W7EMN3LMFS65H7D2Y"
+
+static off_t
+test_db_size(void)
+{
+	struct stat stbuf;
+	fail_unless(stat(TEST_DIR "/" QUEUE_DB_FILENAME, &stbuf) == 0);
+	return stbuf.st_size;
 }
 
 static void
-queue_db_normalize(void)
+test_reset(void)
 {
-	INFO("normalizing queue database");
+	system("/bin/rm -rf " TEST_DIR);
+	system("mkdir " TEST_DIR);
+}
 
-	char *tmpfile;
-	int num_returned_bytes;
-	num_returned_bytes = asprintf(&tmpfile, "%s/%s.tmp", global_working_directory, QUEUE_DB_FILENAME);
-	if (num_returned_bytes == -1)
-            DEBUG("asprintf did not return anything");
-	FILE *tmp_fp = fopen(tmpfile, "w"); /* truncate existing file */
-	if (tmp_fp == NULL) {
-		ERROR("failed to open temporary queue database: %s", strerror(errno));
-		free(tmpfile);
-		return;
+/* Mutations are replayed from the log after a restart. */
+static void
+test_replay(void)
+{
+	test_reset();
+	queue_init();
+	fail_unless(queue_target_add("file.img", TEST_TTH, NULL,
+		17471142, 0, 3, 0) != NULL);
+	fail_unless(queue_add_source("nick", "file.img", "remote\\file.img") == 0);
+	fail_unless(queue_add_source("nick2", "file.img", "remote\\file.img") == 0);
+	queue_set_priority("file.img", 1);
+	queue_db_add_directory("dir", "nick", "remote\\dir");
+	queue_close();
+
+	queue_init();
+	queue_target_t *qt = queue_lookup_target("file.img");
+	fail_unless(qt);
+	fail_unless(qt->size == 17471142);
+	fail_unless(strcmp(qt->tth, TEST_TTH) == 0);
+	fail_unless(qt->priority == 1);
+	fail_unless(queue_has_source_for_nick("nick2"));
+	queue_directory_t *qd = queue_db_lookup_directory("dir");
+	fail_unless(qd);
+	fail_unless(strcmp(qd->source_directory, "remote\\dir") == 0);
+
+	queue_remove_sources_by_nick("nick2");
+	queue_close();
+
+	queue_init();
+	fail_unless(queue_lookup_target("file.img"));
+	fail_unless(!queue_has_source_for_nick("nick2"));
+	fail_unless(queue_has_source_for_nick("nick"));
+	queue_close();
+}
+
+/* A torn record at the end of the log is discarded. */
+static void
+test_torn_tail(void)
+{
+	test_reset();
+	queue_init();
+	fail_unless(queue_target_add("file.img", TEST_TTH, NULL,
+		17471142, 0, 3, 0) != NULL);
+	queue_close();
+
+	off_t size = test_db_size();
+
+	queue_init();
+	fail_unless(queue_target_add("file2.img", TEST_TTH, NULL,
+		4711, 0, 3, 0) != NULL);
+	queue_close();
+
+	/* cut the last record in half */
+	fail_unless(truncate(TEST_DIR "/" QUEUE_DB_FILENAME,
+		size + (test_db_size() - size) / 2) == 0);
+
+	queue_init();
+	fail_unless(queue_lookup_target("file.img"));
+	fail_unless(queue_lookup_target("file2.img") == NULL);
+	queue_close();
+	fail_unless(test_db_size() == size);
+
+	/* a corrupted record is discarded too */
+	FILE *fp = fopen(TEST_DIR "/" QUEUE_DB_FILENAME, "r+");
+	fail_unless(fp);
+	fseek(fp, -1, SEEK_END);
+	fputc('x', fp);
+	fclose(fp);
+
+	queue_init();
+	fail_unless(queue_lookup_target("file.img") == NULL);
+	queue_close();
+}
+
+/* The old text format is converted. */
+static void
+test_convert_text(void)
+{
+	test_reset();
+	FILE *fp = fopen(TEST_DIR "/" QUEUE_DB_FILENAME, "w");
+	fail_unless(fp);
+	fprintf(fp, "+T:file.img::17471142:" TEST_TTH ":0:1189015224:3:1\n");
+	fprintf(fp, "+S:nick:file.img:remote\\\\file.img\n");
+	fprintf(fp, "=P:file.img:2\n");
+	fclose(fp);
+
+	queue_init();
+	queue_target_t *qt = queue_lookup_target("file.img");
+	fail_unless(qt);
+	fail_unless(qt->priority == 2);
+	fail_unless(queue_has_source_for_nick("nick"));
+	queue_close();
+
+	char magic[QUEUE_DB_MAGIC_SIZE];
+	fp = fopen(TEST_DIR "/" QUEUE_DB_FILENAME, "r");
+	fail_unless(fp);
+	fail_unless(fread(magic, 1, sizeof(magic), fp) == sizeof(magic));
+	fclose(fp);
+	fail_unless(memcmp(magic, QUEUE_DB_MAGIC, QUEUE_DB_MAGIC_SIZE) == 0);
+
+	queue_init();
+	fail_unless(queue_lookup_target("file.img"));
+	queue_close();
+}
+
+/* The log is compacted when it's mostly dead records. */
+static void
+test_compact(void)
+{
+	test_reset();
+	queue_init();
+	fail_unless(queue_target_add("keep.img", TEST_TTH, NULL,
+		1, 0, 3, 0) != NULL);
+
+	int i;
+	for(i = 0; i < 2 * QUEUE_DB_COMPACT_MIN_RECORDS; i++)
+	{
+		char *filename;
+		fail_unless(asprintf(&filename, "file-%i.img", i) != -1);
+		fail_unless(queue_target_add(filename, NULL, NULL,
+			i, 0, 3, 0) != NULL);
+		queue_remove_target(filename);
+		free(filename);
 	}
 
-	int rc = queue_db_save(tmp_fp);
-	if (fclose(tmp_fp) == 0) {
-		if (rc != 0) {
-			free(tmpfile);
-			return;
-		}
+	fail_unless(q_store->nrecords < 2 * QUEUE_DB_COMPACT_MIN_RECORDS);
+	queue_close();
 
-		char *qlog_filename;
-		num_returned_bytes = asprintf(&qlog_filename, "%s/%s", global_working_directory, QUEUE_DB_FILENAME);
-		if (num_returned_bytes == -1)
-            DEBUG("asprintf did not return anything");
+	queue_init();
+	fail_unless(q_store->nrecords == 1);
+	fail_unless(queue_lookup_target("keep.img"));
+	fail_unless(queue_lookup_target("file-0.img") == NULL);
+	queue_close();
+}
 
-		INFO("atomically replacing queue database");
+int
+main(void)
+{
+	sp_log_set_level("debug");
 
-		if(rename(tmpfile, qlog_filename) != 0) 
-		{
-			ERROR("rename: %s", strerror(errno));
-		}
-		free(qlog_filename);
+	global_working_directory = TEST_DIR;
 
-		queue_db_open_logfile();
-	}
-	else
-		WARNING("failed to close file: %s", strerror(errno));
-	free(tmpfile);
+	test_replay();
+	test_torn_tail();
+	test_convert_text();
+	test_compact();
+
+	system("/bin/rm -rf " TEST_DIR);
+
+	return 0;
 }
 
+#endif
+
@@ -30,6 +30,7 @@
 #include "xstr.h"
 
 #include "ui.h"
+#include "event_profile.h"
 
 static bool queue_match_search_response = true;
 static bool queue_auto_download_filelists = true;
@@ -101,6 +102,8 @@ static void queue_match_filelist_event(int fd, short why, void *data)
     }
 }
 
+EP_EVENT_CALLBACK(queue_match_filelist_event)
+
 static void queue_match_filelist_schedule_event(
         queue_match_filelist_data_t *udata)
 {
@@ -108,7 +111,8 @@ static void queue_match_filelist_schedule_event(
 
     if(!event_initialized(&udata->ev))
     {
-        evtimer_set(&udata->ev, queue_match_filelist_event, udata);
+        evtimer_set(&udata->ev, EP_PROFILED(queue_match_filelist_event),
+                udata);
         event_priority_set(&udata->ev, 2);
     }
 
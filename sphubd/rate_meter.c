@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2008 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "rate_meter.h"
+
+/* exp(-RM_TICK / window) for the 1, 10 and 60 second windows */
+static const double rm_decay[RM_NWINDOWS] = {
+    0.904837418035959573, 0.990049833749168054, 0.998334721450938752
+};
+
+static rate_meter_t rm_global_meters[2];
+
+static double rm_pow(double x, uint64_t n)
+{
+    double result = 1.0;
+    while(n && result > 0.0)
+    {
+        if(n & 1)
+            result *= x;
+        x *= x;
+        n >>= 1;
+    }
+    return result;
+}
+
+/* Folds the ticks that are over at NOW into the averages. */
+static void rm_advance(rate_meter_t *rm, uint64_t now)
+{
+    if(rm->tick_start == 0 || now < rm->tick_start + RM_TICK)
+        return;
+
+    uint64_t nticks = (now - rm->tick_start) / RM_TICK;
+    double tick_rate = (double)rm->pending * (1000000.0 / RM_TICK);
+
+    int i;
+    for(i = 0; i < RM_NWINDOWS; i++)
+    {
+        double d = rm_decay[i];
+
+        /* the tick with the pending bytes... */
+        rm->rate[i] = rm->rate[i] * d + tick_rate * (1.0 - d);
+        rm->weight[i] = rm->weight[i] * d + (1.0 - d);
+
+        /* ...and idle ticks after it */
+        if(nticks > 1)
+        {
+            double dn = rm_pow(d, nticks - 1);
+            rm->rate[i] *= dn;
+            rm->weight[i] = 1.0 - (1.0 - rm->weight[i]) * dn;
+        }
+    }
+
+    rm->pending = 0;
+    rm->tick_start += nticks * RM_TICK;
+}
+
+void rm_add(rate_meter_t *rm, uint64_t now, size_t nbytes)
+{
+    if(rm->tick_start == 0)
+        rm->tick_start = now ? now : 1;
+    else
+        rm_advance(rm, now);
+
+    rm->pending += nbytes;
+    rm->total += nbytes;
+}
+
+unsigned rm_rate(rate_meter_t *rm, uint64_t now, rm_window_t window)
+{
+    rm_advance(rm, now);
+
+    if(rm->weight[window] <= 0.0)
+        return 0;
+
+    double rate = rm->rate[window] / rm->weight[window];
+    return rate < 4294967295.0 ? (unsigned)(rate + 0.5) : 4294967295U;
+}
+
+rate_meter_t *rm_global(bw_direction_t dir)
+{
+    return &rm_global_meters[dir];
+}
+
+#ifdef TEST
+
+#include "unit_test.h"
+
+int main(void)
+{
+    rate_meter_t rm = {0};
+    uint64_t now = 5000000;
+
+    /* nothing is measured before the first bytes */
+    fail_unless(rm_rate(&rm, now, RM_1S) == 0);
+
+    /* 100 KiB/s in 1 KiB writes */
+    int i;
+    for(i = 0; i < 2000; i++)
+    {
+        rm_add(&rm, now, 1024);
+        now += 10000;
+    }
+    fail_unless(rm.total == 2000 * 1024);
+
+    /* a short meter averages over the time it has been running */
+    unsigned rate = rm_rate(&rm, now, RM_60S);
+    fail_unless(rate > 100 * 1024 * 99 / 100 && rate < 100 * 1024 * 101 / 100);
+    rate = rm_rate(&rm, now, RM_1S);
+    fail_unless(rate > 100 * 1024 * 99 / 100 && rate < 100 * 1024 * 101 / 100);
+
+    /* a stall shows up in the short window first */
+    now += 3000000;
+    fail_unless(rm_rate(&rm, now, RM_1S) < 100 * 1024 / 10);
+    rate = rm_rate(&rm, now, RM_10S);
+    fail_unless(rate > 100 * 1024 / 2 && rate < 100 * 1024);
+    fail_unless(rm_rate(&rm, now, RM_60S) > 100 * 1024 * 8 / 10);
+
+    /* long idle times decay to zero */
+    now += 3600ULL * 1000000;
+    fail_unless(rm_rate(&rm, now, RM_60S) == 0);
+
+    /* a burst within a single tick */
+    rate_meter_t burst = {0};
+    rm_add(&burst, now, 50000);
+    fail_unless(rm_rate(&burst, now, RM_10S) == 0);
+    fail_unless(rm_rate(&burst, now + RM_TICK, RM_10S) == 500000);
+
+    fail_unless(rm_global(BW_UPLOAD) != rm_global(BW_DOWNLOAD));
+
+    return 0;
+}
+
+#endif
+
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2008 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef _rate_meter_h_
+#define _rate_meter_h_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bandwidth.h"
+
+/* Transfer rate meters.
+ *
+ * A meter keeps exponentially weighted moving averages of the transfer
+ * rate over 1, 10 and 60 seconds. Bytes are collected in ticks of
+ * RM_TICK microseconds, and each tick is folded into the averages when
+ * it is over, so idle time decays the rates even if nothing is added.
+ * Until a meter has been running for a whole window, the average is
+ * taken over the time it has been running, so new transfers don't start
+ * out at a rate near zero.
+ *
+ * Meters start with the first bytes added. Times are in microseconds
+ * from ep_now().
+ */
+
+#define RM_TICK 100000
+
+typedef enum
+{
+    RM_1S,
+    RM_10S,
+    RM_60S,
+    RM_NWINDOWS
+} rm_window_t;
+
+typedef struct rate_meter rate_meter_t;
+struct rate_meter
+{
+    uint64_t tick_start; /* 0 if the meter has not started */
+    uint64_t pending; /* bytes in the current tick */
+    uint64_t total;
+    double rate[RM_NWINDOWS]; /* bytes per second */
+    double weight[RM_NWINDOWS]; /* how much of the window has been seen */
+};
+
+void rm_add(rate_meter_t *rm, uint64_t now, size_t nbytes);
+
+/* Returns the average rate over the window, in bytes per second. */
+unsigned rm_rate(rate_meter_t *rm, uint64_t now, rm_window_t window);
+
+/* global meters, summing all transfers in each direction */
+rate_meter_t *rm_global(bw_direction_t dir);
+
+#endif
+
@@ -20,11 +20,15 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
+#include <stdbool.h>
+#include <inttypes.h>
 
 #include "nfkc.h"
 #include "encoding.h"
@@ -32,46 +36,207 @@
 #include "nmdc.h"
 #include "notifications.h"
 #include "queue.h"
-#include "rx.h"
 #include "search_listener.h"
 #include "ui.h"
 #include "log.h"
 #include "xstr.h"
+#include "event_profile.h"
+#include "trace.h"
 
 int search_listener_handle_response(search_listener_t *sl, const char *buf);
 
-static void sl_in_event(int fd, short condition, void *data)
+/* limits the datagrams handled per wakeup so a flood of responses can't
+ * starve the other connections */
+#define SL_MAX_BATCHES_PER_EVENT 8
+
+struct sl_batch
 {
-    static char buf[1500];
-    struct sockaddr_in fromaddr;
-    unsigned int fromlen = sizeof(fromaddr);
-    ssize_t bytes_read = recvfrom(fd, buf, sizeof(buf), 0,
-            (struct sockaddr *)&fromaddr, &fromlen);
-    if(bytes_read == -1)
-    {
-        WARNING("recvfrom: %s", strerror(errno));
-        return;
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr msgs[SL_BATCH_SIZE];
+# ifdef SO_RXQ_OVFL
+    char control[SL_BATCH_SIZE][CMSG_SPACE(sizeof(uint32_t))];
+# endif
+#endif
+    struct iovec iov[SL_BATCH_SIZE];
+    struct sockaddr_in addrs[SL_BATCH_SIZE];
+    socklen_t addrlens[SL_BATCH_SIZE];
+    size_t lengths[SL_BATCH_SIZE];
+    bool truncated[SL_BATCH_SIZE];
+    char buffers[SL_BATCH_SIZE][SL_DATAGRAM_SIZE + 1];
+};
+
+static struct sl_batch *sl_batch_new(void)
+{
+    struct sl_batch *batch = calloc(1, sizeof(struct sl_batch));
+
+    int i;
+    for(i = 0; i < SL_BATCH_SIZE; i++)
+    {
+        batch->iov[i].iov_base = batch->buffers[i];
+        batch->iov[i].iov_len = SL_DATAGRAM_SIZE;
+#ifdef HAVE_RECVMMSG
+        struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+        hdr->msg_name = &batch->addrs[i];
+        hdr->msg_iov = &batch->iov[i];
+        hdr->msg_iovlen = 1;
+#endif
     }
 
-    if(bytes_read)
+    return batch;
+}
+
+#if defined(HAVE_RECVMMSG) && defined(SO_RXQ_OVFL)
+/* The kernel attaches its running count of datagrams dropped on the socket
+ * to each datagram received.
+ */
+static void sl_update_kernel_drops(search_listener_t *sl, struct msghdr *hdr)
+{
+    struct cmsghdr *cmsg;
+    for(cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg))
     {
-        if(bytes_read == 4 && strncmp(buf, "ping", 4) == 0)
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+        {
+            uint32_t drops;
+            memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+            if(drops != sl->kernel_drops)
+            {
+                uint32_t ndropped = drops - sl->kernel_drops;
+                DEBUG("kernel dropped %u search responses", ndropped);
+                sl->stats.dropped += ndropped;
+                sl->kernel_drops = drops;
+            }
+        }
+    }
+}
+#endif
+
+/* Reads up to SL_BATCH_SIZE pending datagrams into the batch buffers.
+ * Returns the number of datagrams read, 0 if none were pending or -1 on
+ * error.
+ */
+static int sl_receive_batch(search_listener_t *sl)
+{
+    struct sl_batch *batch = sl->batch;
+    int n;
+
+#ifdef HAVE_RECVMMSG
+    int i;
+    for(i = 0; i < SL_BATCH_SIZE; i++)
+    {
+        struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+        hdr->msg_namelen = sizeof(batch->addrs[i]);
+# ifdef SO_RXQ_OVFL
+        hdr->msg_control = batch->control[i];
+        hdr->msg_controllen = sizeof(batch->control[i]);
+# endif
+        hdr->msg_flags = 0;
+    }
+
+    n = recvmmsg(sl->fd, batch->msgs, SL_BATCH_SIZE, MSG_DONTWAIT, NULL);
+    if(n == -1)
+    {
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+        WARNING("recvmmsg: %s", strerror(errno));
+        return -1;
+    }
+
+    for(i = 0; i < n; i++)
+    {
+        struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+        batch->lengths[i] = batch->msgs[i].msg_len;
+        batch->addrlens[i] = hdr->msg_namelen;
+        batch->truncated[i] = (hdr->msg_flags & MSG_TRUNC) != 0;
+# ifdef SO_RXQ_OVFL
+        sl_update_kernel_drops(sl, hdr);
+# endif
+    }
+#else
+    for(n = 0; n < SL_BATCH_SIZE; n++)
+    {
+        batch->addrlens[n] = sizeof(batch->addrs[n]);
+        ssize_t bytes_read = recvfrom(sl->fd, batch->buffers[n],
+                SL_DATAGRAM_SIZE, 0,
+                (struct sockaddr *)&batch->addrs[n], &batch->addrlens[n]);
+        if(bytes_read == -1)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                break;
+            WARNING("recvfrom: %s", strerror(errno));
+            return n ? n : -1;
+        }
+        batch->lengths[n] = bytes_read;
+        /* can't tell a truncated datagram from one that filled the buffer */
+        batch->truncated[n] = (bytes_read == SL_DATAGRAM_SIZE);
+    }
+#endif
+
+    return n;
+}
+
+static void sl_handle_batch(search_listener_t *sl, int n)
+{
+    struct sl_batch *batch = sl->batch;
+
+    int i;
+    for(i = 0; i < n; i++)
+    {
+        char *buf = batch->buffers[i];
+        size_t len = batch->lengths[i];
+
+        if(batch->truncated[i])
+        {
+            DEBUG("dropping truncated search response");
+            sl->stats.truncated++;
+            continue;
+        }
+
+        if(len == 4 && strncmp(buf, "ping", 4) == 0)
         {
             DEBUG("received ping, sending pong");
-            if(sendto(fd, "pong", 4, 0,
-                        (const struct sockaddr *)&fromaddr, fromlen) == -1)
+            if(sendto(sl->fd, "pong", 4, 0,
+                        (const struct sockaddr *)&batch->addrs[i],
+                        batch->addrlens[i]) == -1)
             {
                 WARNING("sendto(pong): %s", strerror(errno));
             }
         }
-        else
+        else if(len)
         {
-            buf[bytes_read] = 0;
-            search_listener_handle_response(data, buf);
+            buf[len] = 0;
+            if(trace_enabled())
+                trace_write(TRACE_UDP, TRACE_IN, sl->fd, buf, len);
+            search_listener_handle_response(sl, buf);
         }
     }
 }
 
+static void sl_in_event(int fd, short condition, void *data)
+{
+    search_listener_t *sl = data;
+    uint64_t burst = 0;
+
+    int i;
+    for(i = 0; i < SL_MAX_BATCHES_PER_EVENT; i++)
+    {
+        int n = sl_receive_batch(sl);
+        if(n <= 0)
+            break;
+
+        sl->stats.batches++;
+        sl->stats.datagrams += n;
+        burst += n;
+
+        sl_handle_batch(sl, n);
+
+        if(n < SL_BATCH_SIZE)
+            break;
+    }
+
+    if(burst > sl->stats.max_burst)
+        sl->stats.max_burst = burst;
+}
+
 void search_listener_close(search_listener_t *sl)
 {
     if(sl)
@@ -85,6 +250,9 @@ void search_listener_close(search_listener_t *sl)
         {
             close(sl->fd);
         }
+        sl_forget_search(sl, 0);
+        search_matcher_free(sl->matcher);
+        free(sl->batch);
         free(sl);
     }
 }
@@ -92,11 +260,22 @@ void search_listener_close(search_listener_t *sl)
 static search_listener_t *search_listener_create(void)
 {
     search_listener_t *sl = calloc(1, sizeof(search_listener_t));
-    TAILQ_INIT(&sl->search_request_head);
+
+    int i;
+    for(i = 0; i < SL_ID_NHASH; i++)
+        LIST_INIT(&sl->requests_by_id[i]);
+    for(i = 0; i < SL_WHEEL_SLOTS; i++)
+        LIST_INIT(&sl->wheel[i]);
+    sl->current_tick = time(NULL) / SL_WHEEL_TICK;
+
+    sl->matcher = search_matcher_new();
+    sl->fd = -1;
 
     return sl;
 }
 
+EP_EVENT_CALLBACK(sl_in_event)
+
 search_listener_t *search_listener_new(int port)
 {
     search_listener_t *sl = search_listener_create();
@@ -112,7 +291,7 @@ search_listener_t *search_listener_new(int port)
     if(fd == -1)
     {
         WARNING("socket(): %s", strerror(errno));
-        free(sl);
+        search_listener_close(sl);
         return NULL;
     }
 
@@ -127,12 +306,31 @@ search_listener_t *search_listener_new(int port)
         WARNING("unable to enable local address reuse (ignored)");
     }
 
+    int rcvbuf = SL_RECEIVE_BUFFER_SIZE;
+    if(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) == -1)
+    {
+        WARNING("unable to set UDP receive buffer size (ignored)");
+    }
+    socklen_t optlen = sizeof(rcvbuf);
+    if(getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &optlen) == 0)
+    {
+        DEBUG("UDP receive buffer is %i bytes", rcvbuf);
+    }
+
+#if defined(HAVE_RECVMMSG) && defined(SO_RXQ_OVFL)
+    /* have the kernel report dropped datagrams */
+    if(setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) == -1)
+    {
+        WARNING("unable to enable drop counting (ignored)");
+    }
+#endif
+
     INFO("Binding UDP port %i for search responses", port);
     if(bind(fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) != 0)
     {
         WARNING("Unable to bind UDP port %i: %s", port, strerror(errno));
         close(fd);
-        free(sl);
+        search_listener_close(sl);
         return NULL;
     }
 
@@ -140,73 +338,194 @@ search_listener_t *search_listener_new(int port)
 
     if(io_set_blocking(sl->fd, 0) != 0)
     {
-        close(fd);
-        free(sl);
+        search_listener_close(sl);
         return NULL;
     }
 
+    sl->batch = sl_batch_new();
+
     DEBUG("adding search listener on file descriptor %i", fd);
 
-    event_set(&sl->in_event, fd, EV_READ|EV_PERSIST, sl_in_event, sl);
+    event_set(&sl->in_event, fd, EV_READ|EV_PERSIST,
+            EP_PROFILED(sl_in_event), sl);
     event_add(&sl->in_event, NULL);
 
     return sl;
 }
 
-int search_result_matches_request(const char *filename, uint64_t size, const char *tth,
-        search_request_t *sreq)
+/* fields longer than this are copied to the heap for conversion */
+#define SL_FIELD_BUFSIZE 256
+
+static bool sl_is_digit(char c)
 {
-    char *xfilename;
-    int i;
+    return c >= '0' && c <= '9';
+}
 
-    return_val_if_fail(sreq, 0);
+static bool sl_is_address_char(char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+        (c >= 'A' && c <= 'Z') || c == '-' || c == '_' || c == '.' || c == ':';
+}
 
-    if(sreq->tth)
+/* Parses the digits in [p, end), saturating like strtoull. */
+static uint64_t sl_parse_number(const char *p, const char *end)
+{
+    uint64_t value = 0;
+    for(; p < end; p++)
     {
-        if(tth && strcmp(tth, sreq->tth) == 0)
-            return 1;
-        return 0;
+        unsigned digit = *p - '0';
+        if(value > (UINT64_MAX - digit) / 10)
+            return UINT64_MAX;
+        value = value * 10 + digit;
     }
+    return value;
+}
 
-    return_val_if_fail(filename, 0);
+/* Parses a non-empty run of digits, returns a pointer past the digits or
+ * NULL if there were none.
+ */
+static const char *sl_scan_number(const char *p, const char *end,
+        uint64_t *value)
+{
+    const char *start = p;
+    while(p < end && sl_is_digit(*p))
+        p++;
+    if(p == start)
+        return NULL;
+    *value = sl_parse_number(start, p);
+    return p;
+}
 
-    /* ensure composed form. */
-    char *filename_utf8_composed = g_utf8_normalize(filename, -1, G_NORMALIZE_DEFAULT_COMPOSE);
-    xfilename = g_utf8_casefold(filename_utf8_composed, -1);
-    free(filename_utf8_composed);
+static void sl_set_field(sl_field_t *field, const char *start, const char *end)
+{
+    field->ptr = start;
+    field->len = end - start;
+}
 
-    for(i = 0; i < sreq->words->argc; i++)
+/* Splits a search response into its fields in a single pass, without
+ * copying. The format is either
+ *
+ *   <nick> <filename>0x05<size> <open>/<total>0x05<hubname> (<hub address>)
+ *
+ * for files, or
+ *
+ *   <nick> <directory> <open>/<total>0x05<hubname> (<hub address>)
+ *
+ * for directories. The hub name is replaced by TTH:<tth> when the client
+ * knows the TTH of the file. A leading "$SR " and anything after the first
+ * '|' are ignored.
+ *
+ * Returns false if the response is malformed.
+ */
+bool sl_tokenize_response(const char *buf, search_response_fields_t *fields)
+{
+    return_val_if_fail(buf, false);
+    return_val_if_fail(fields, false);
+
+    if(str_has_prefix(buf, "$SR "))
+        buf += 4;
+    while(*buf == ' ')
+        ++buf;
+
+    const char *end = strchr(buf, '|');
+    if(end == NULL)
+        end = buf + strlen(buf);
+
+    /* Directory responses have a single 0x05 separator. */
+    int x5 = 0;
+    const char *p;
+    for(p = buf; p < end; p++)
     {
-        if(strstr(xfilename, sreq->words->argv[i]) == 0)
-            break;
+        if(*p == 0x05)
+            x5++;
     }
-    free(xfilename);
+    fields->is_directory = (x5 == 1);
 
-    if(i == sreq->words->argc)
+    const char *space = memchr(buf, ' ', end - buf);
+    if(space == NULL || space == buf)
+        return false;
+    sl_set_field(&fields->nick, buf, space);
+    p = space + 1;
+
+    const char *x = memchr(p, 0x05, end - p);
+    if(x == NULL)
+        return false;
+
+    if(fields->is_directory)
     {
-        /* we got a match on the filename, now check the size
-         */
-        switch(sreq->size_restriction)
+        /* the slots are right before the 0x05, scan backwards */
+        const char *q = x;
+        while(q > p && sl_is_digit(q[-1]))
+            q--;
+        if(q == x || q == p || q[-1] != '/')
+            return false;
+        fields->totalslots = sl_parse_number(q, x);
+
+        const char *slash = q - 1;
+        q = slash;
+        while(q > p && sl_is_digit(q[-1]))
+            q--;
+        if(q == slash || q - 1 <= p || q[-1] != ' ')
+            return false;
+        fields->openslots = sl_parse_number(q, slash);
+
+        sl_set_field(&fields->filename, p, q - 1);
+        fields->size = 0;
+    }
+    else
+    {
+        if(x == p)
+            return false;
+        sl_set_field(&fields->filename, p, x);
+
+        p = sl_scan_number(x + 1, end, &fields->size);
+        if(p == NULL || p == end || *p++ != ' ')
+            return false;
+        p = sl_scan_number(p, end, &fields->openslots);
+        if(p == NULL || p == end || *p++ != '/')
+            return false;
+        p = sl_scan_number(p, end, &fields->totalslots);
+        if(p == NULL || p == end || *p != 0x05)
+            return false;
+        x = p;
+    }
+
+    /* The hub address is the last parenthesized run of address characters,
+     * everything before it is the hub name.
+     */
+    const char *rest = x + 1;
+    const char *q;
+    for(q = end; q > rest; q--)
+    {
+        if(q[-1] != ')')
+            continue;
+
+        const char *close = q - 1;
+        const char *open = close;
+        while(open > rest && sl_is_address_char(open[-1]))
+            open--;
+        if(open > rest && open < close && open[-1] == '(')
         {
-            case SHARE_SIZE_MIN:
-                if(size < sreq->real_size)
-                    return 0;
-                break;
-            case SHARE_SIZE_MAX:
-                if(size > sreq->real_size)
-                    return 0;
-                break;
-            case SHARE_SIZE_EQUAL:
-                if(size != sreq->real_size)
-                    return 0;
-                break;
-            case SHARE_SIZE_NONE:
-                break;
+            sl_set_field(&fields->hubname, rest, open - 1);
+            sl_set_field(&fields->hub_address, open, close);
+            return true;
         }
-        return 1;
+        q = open + 1;
     }
 
-    return 0;
+    return false;
+}
+
+/* Copies a field into buf as a nul-terminated string. Returns buf, or a
+ * heap copy that the caller must free if the field doesn't fit.
+ */
+static char *sl_field_string(const sl_field_t *field, char *buf, size_t size)
+{
+    if(field->len >= size)
+        return xstrndup(field->ptr, field->len);
+    memcpy(buf, field->ptr, field->len);
+    buf[field->len] = 0;
+    return buf;
 }
 
 search_response_t *sl_parse_response(const char *buf)
@@ -215,141 +534,93 @@ search_response_t *sl_parse_response(const char *buf)
 
     DEBUG("parsing [%s]", buf);
 
-    if(str_has_prefix(buf, "$SR "))
-        buf += 4;
-    while(*buf == ' ')
-        ++buf;
-
-    char *delim = strchr(buf, '|');
-    char *xbuf = 0;
-    if(delim)
-        xbuf = xstrndup(buf, delim - buf);
-    else
-        xbuf = xstrdup(buf);
-
-    int i, x5 = 0;
-    int is_directory;
-
-    /* count number of 0x05's in the search response in order to decide if it's
-     * a directory or file response.
-     */
-    for(i = 0; xbuf[i]; i++)
+    search_response_fields_t fields;
+    if(!sl_tokenize_response(buf, &fields))
     {
-        if(xbuf[i] == 0x05)
-            x5++;
+        INFO("malformed search response: [%s]", buf);
+        return NULL;
     }
-    is_directory = (x5 == 1 ? 1 : 0);
 
-    const void *rx = NULL;
-    if(is_directory)
+    char tmp[SL_FIELD_BUFSIZE];
+    char *str;
+
+    /* Need to find the associated hub in order to determine what
+     * encoding to use.
+     */
+    str = sl_field_string(&fields.hub_address, tmp, sizeof(tmp));
+    hub_t *hub = hub_find_by_address(str);
+    if(str != tmp)
+        free(str);
+
+    char *nick_utf8 = NULL;
+    str = sl_field_string(&fields.nick, tmp, sizeof(tmp));
+    if(hub == NULL)
     {
-        static const void *rx_dir = NULL;
-        if(rx_dir == NULL)
+        hub = hub_find_encoding_by_nick(str, &nick_utf8);
+        if(hub == NULL)
         {
-            rx_dir = rx_compile("([^ ]+) (.+) ([0-9]+)/([0-9]+)\x05(.*)\\(([-0-9a-zA-Z_.:]+)\\)\\|?");
+            WARNING("unknown hub address '%.*s'"
+                    " in search response (skipping)",
+                    (int)fields.hub_address.len, fields.hub_address.ptr);
+            if(str != tmp)
+                free(str);
+            return NULL;
         }
-        rx = rx_dir;
     }
     else
     {
-        static const void *rx_file = NULL;
-        if(rx_file == NULL)
-        {
-            rx_file = rx_compile("([^ ]+) ([^\x05]+)\x05([0-9]+) ([0-9]+)/([0-9]+)\x05(.*)\\(([-0-9a-zA-Z_.:]+)\\)\\|?");
-        }
-        rx = rx_file;
+        nick_utf8 = str_convert_to_unescaped_utf8(str, hub->encoding);
     }
-    return_val_if_fail(rx, NULL);
+    if(str != tmp)
+        free(str);
 
-    search_response_t *resp = NULL;
-    rx_subs_t *subs = rx_search_precompiled(xbuf, rx);
-    if(subs && \
-            ((subs->nsubs == 6 && is_directory) || \
-             (subs->nsubs == 7 && !is_directory)))
+    if(nick_utf8 == NULL)
     {
-        /* regexp matched */
+        WARNING("no valid nick in search response (skipping)");
+        return NULL;
+    }
 
-        char *nick = subs->subs[0];
-        char *filename = subs->subs[1];
+    search_response_t *resp = calloc(1, sizeof(search_response_t));
+    resp->nick = nick_utf8;
 
-        if(nick && filename)
-        {
-            /* Need to find the associated hub in order to determine what
-             * encoding to use.
-             */
-            char *hub_address = subs->subs[6 - is_directory];
-            char *nick_utf8 = 0;
-            hub_t *hub = hub_find_by_address(hub_address);
-            if(hub == 0)
-            {
-                hub = hub_find_encoding_by_nick(nick, &nick_utf8);
-                if(hub == NULL)
-                {
-                    WARNING("unknown hub address '%s'"
-                            " in search response (skipping)", hub_address);
-                    rx_free_subs(subs);
-                    free(xbuf);
-                    return NULL;
-                }
-            }
-            else
-            {
-                nick_utf8 = str_convert_to_unescaped_utf8(nick, hub->encoding);
-            }
+    str = sl_field_string(&fields.filename, tmp, sizeof(tmp));
+    resp->filename = str_legacy_to_utf8(str, hub->encoding);
+    if(str != tmp)
+        free(str);
 
-            if(nick_utf8 == NULL)
-            {
-                WARNING("no valid nick in search response (skipping)");
-                rx_free_subs(subs);
-                free(xbuf);
-                return NULL;
-            }
-            
-            resp = calloc(1, sizeof(search_response_t));
+    if(resp->filename == NULL)
+    {
+        sl_response_free(resp);
+        return NULL;
+    }
 
-            resp->nick = nick_utf8;
-            resp->filename = str_legacy_to_utf8(filename, hub->encoding);
+    resp->hub = hub;
+    resp->openslots = fields.openslots;
+    resp->totalslots = fields.totalslots;
 
-            if(resp->filename == NULL)
-            {
-                free(resp);
-                free(nick_utf8);
-                rx_free_subs(subs);
-                free(xbuf);
-                return NULL;
-            }
-            
-            resp->hub = hub;
-            resp->openslots = strtoull(subs->subs[3 - is_directory], 0, 10);
-            resp->totalslots = strtoull(subs->subs[4 - is_directory], 0, 10);
-
-            resp->type = SHARE_TYPE_DIRECTORY;
-            resp->size = 0;
-            if(!is_directory)
-            {
-                resp->type = share_filetype(filename);
-                resp->size = strtoull(subs->subs[2], 0, 10);
-            }
+    resp->type = SHARE_TYPE_DIRECTORY;
+    resp->size = 0;
+    if(!fields.is_directory)
+    {
+        resp->type = share_filetype(resp->filename);
+        resp->size = fields.size;
+    }
 
-            if(strncmp(subs->subs[5 - is_directory], "TTH:", 4) == 0)
-            {
-                resp->tth = str_trim_end_inplace(xstrdup(subs->subs[5 - is_directory] + 4), NULL);
-            }
+    if(fields.hubname.len >= 4 && strncmp(fields.hubname.ptr, "TTH:", 4) == 0)
+    {
+        const char *tth = fields.hubname.ptr + 4;
+        const char *tth_end = fields.hubname.ptr + fields.hubname.len;
+        while(tth_end > tth && strchr(" \t\n\r", tth_end[-1]))
+            tth_end--;
+        resp->tth = xstrndup(tth, tth_end - tth);
 
-            if(resp->tth && !valid_tth(resp->tth))
-            {
-                WARNING("invalid TTH in search response [%s]", xbuf);
-                sl_response_free(resp);
-                resp = NULL;
-            }
+        if(!valid_tth(resp->tth))
+        {
+            WARNING("invalid TTH in search response [%s]", buf);
+            sl_response_free(resp);
+            return NULL;
         }
-        rx_free_subs(subs);
-    }
-    else
-    {
-        INFO("regexp failed on: [%s]", xbuf);
     }
-    free(xbuf);
 
     return resp;
 }
@@ -365,6 +636,73 @@ void sl_response_free(search_response_t *resp)
     }
 }
 
+static unsigned sl_id_hash(int id)
+{
+    return (unsigned)id % SL_ID_NHASH;
+}
+
+/* Postpones expiry of a request. The request is moved to its new slot
+ * only when its old slot comes up.
+ */
+static void sl_touch_request(search_listener_t *sl, search_request_t *sreq)
+{
+    sreq->expire_tick = sl->current_tick +
+        (SL_REQUEST_TIMEOUT + SL_WHEEL_TICK - 1) / SL_WHEEL_TICK;
+}
+
+static void sl_remove_request(search_listener_t *sl, search_request_t *sreq)
+{
+    DEBUG("forgetting search ID %i", sreq->id);
+    LIST_REMOVE(sreq, id_link);
+    LIST_REMOVE(sreq, wheel_link);
+    search_matcher_remove(sl->matcher, sreq);
+    sl_request_free(sreq);
+    sl->nrequests--;
+}
+
+/* Advances the timing wheel to <now>, forgetting requests that haven't
+ * matched any responses for SL_REQUEST_TIMEOUT seconds.
+ */
+void sl_expire_requests(search_listener_t *sl, time_t now)
+{
+    return_if_fail(sl);
+
+    unsigned now_tick = now / SL_WHEEL_TICK;
+    unsigned nticks = now_tick - sl->current_tick;
+    if((int)nticks <= 0)
+        return;
+    if(nticks > SL_WHEEL_SLOTS)
+        nticks = SL_WHEEL_SLOTS;
+    sl->current_tick = now_tick;
+
+    unsigned tick;
+    for(tick = now_tick - nticks + 1; tick != now_tick + 1; tick++)
+    {
+        unsigned slot = tick % SL_WHEEL_SLOTS;
+        search_request_t *sreq = LIST_FIRST(&sl->wheel[slot]);
+        LIST_INIT(&sl->wheel[slot]);
+
+        while(sreq)
+        {
+            search_request_t *next = LIST_NEXT(sreq, wheel_link);
+            if((int)(sreq->expire_tick - now_tick) <= 0)
+            {
+                /* relinked so sl_remove_request can unlink it */
+                LIST_INSERT_HEAD(&sl->wheel[slot], sreq, wheel_link);
+                DEBUG("search ID %i expired", sreq->id);
+                sl_remove_request(sl, sreq);
+            }
+            else
+            {
+                LIST_INSERT_HEAD(
+                        &sl->wheel[sreq->expire_tick % SL_WHEEL_SLOTS],
+                        sreq, wheel_link);
+            }
+            sreq = next;
+        }
+    }
+}
+
 int search_listener_handle_response(search_listener_t *sl, const char *buf)
 {
     return_val_if_fail(sl, -1);
@@ -377,21 +715,16 @@ int search_listener_handle_response(search_listener_t *sl, const char *buf)
         return 1;
     }
 
-    /* Go through the list of search requests and find a matching search
-     * ID. The list is traversed backwards, so if there are multiple
-     * matches, the last search is used. */
+    /* If there are multiple matching requests, the last search is used. */
     int search_id = 0;
-    struct search_request *sreq;
-    TAILQ_FOREACH_REVERSE(sreq, &sl->search_request_head,
-            search_request_list, link)
+    sl_expire_requests(sl, time(NULL));
+    search_request_t *sreq = search_matcher_match(sl->matcher,
+            resp->filename, resp->size, resp->tth);
+    if(sreq)
     {
-        if(search_result_matches_request(resp->filename, resp->size,
-                    resp->tth, sreq))
-        {
-            DEBUG("Found search ID %i", sreq->id);
-            search_id = sreq->id;
-            break;
-        }
+        DEBUG("Found search ID %i", sreq->id);
+        search_id = sreq->id;
+        sl_touch_request(sl, sreq);
     }
 
     resp->id = search_id;
@@ -412,6 +745,12 @@ search_request_t *search_listener_create_search_request(const char *words,
 {
     return_val_if_fail(words, NULL);
 
+    if(trace_enabled())
+    {
+        trace_printf(TRACE_SEARCH, TRACE_OUT, 0, "%d %d %d %"PRIu64" %s",
+                id, type, size_restriction, size, words);
+    }
+
     search_request_t *sreq = calloc(1, sizeof(search_request_t));
 
     char *words_unescaped = nmdc_unescape(words);
@@ -515,52 +854,49 @@ void search_listener_add_request(search_listener_t *sl, search_request_t *reques
     return_if_fail(sl);
     return_if_fail(request);
 
-    if(request->id == -1)
-    {
-        /* search id -1 is used internally for auto-searching alternative
-         * sources (see queue_auto_search_sources_event_func)
-         *
-         * Place those requests in the beginning of the list so they are
-         * searched last when matching responses, so we don't interfere with
-         * manual searches from the UI.
-         */
-        TAILQ_INSERT_HEAD(&sl->search_request_head, request, link);
-    }
-    else
-    {
-        TAILQ_INSERT_TAIL(&sl->search_request_head, request, link);
-    }
+    sl_expire_requests(sl, time(NULL));
+
+    LIST_INSERT_HEAD(&sl->requests_by_id[sl_id_hash(request->id)],
+            request, id_link);
+    sl_touch_request(sl, request);
+    LIST_INSERT_HEAD(&sl->wheel[request->expire_tick % SL_WHEEL_SLOTS],
+            request, wheel_link);
+    sl->nrequests++;
+
+    /* search id -1 is used internally for auto-searching alternative
+     * sources (see queue_auto_search_sources_event_func)
+     *
+     * Those requests are matched last, so we don't interfere with manual
+     * searches from the UI.
+     */
+    search_matcher_add(sl->matcher, request, request->id == -1);
 }
 
 void sl_forget_search(search_listener_t *sl, int search_id)
 {
-    struct search_request *sreq;
+    struct search_request *sreq, *next;
 
     if(sl == NULL)
         return;
 
     if(search_id == 0)
     {
-        while((sreq = TAILQ_FIRST(&sl->search_request_head)) != NULL)
+        int i;
+        for(i = 0; i < SL_ID_NHASH; i++)
         {
-            DEBUG("forgetting search ID %i", sreq->id);
-            TAILQ_REMOVE(&sl->search_request_head, sreq, link);
-            sl_request_free(sreq);
+            while((sreq = LIST_FIRST(&sl->requests_by_id[i])) != NULL)
+                sl_remove_request(sl, sreq);
         }
     }
     else
     {
-        struct search_request *next;
-        for(sreq = TAILQ_FIRST(&sl->search_request_head); sreq; sreq = next)
+        unsigned bucket = sl_id_hash(search_id);
+        for(sreq = LIST_FIRST(&sl->requests_by_id[bucket]); sreq; sreq = next)
         {
-            next = TAILQ_NEXT(sreq, link);
+            next = LIST_NEXT(sreq, id_link);
             if(sreq->id == search_id)
-            {
-                DEBUG("forgetting search ID %i", sreq->id);
-                TAILQ_REMOVE(&sl->search_request_head, sreq, link);
-                sl_request_free(sreq);
-            }
-        }   
+                sl_remove_request(sl, sreq);
+        }
     }
 }
 
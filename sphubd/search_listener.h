@@ -32,12 +32,17 @@
 
 #include "args.h"
 #include "share.h"
+#include "search_matcher.h"
+
+struct sm_request;
 
 typedef struct search_request search_request_t;
 struct search_request
 {
-    TAILQ_ENTRY(search_request) link;
-    
+    LIST_ENTRY(search_request) id_link;
+    LIST_ENTRY(search_request) wheel_link;
+    unsigned expire_tick;
+
     share_size_restriction_t size_restriction;
     uint64_t search_size; /* the size we're searching for (sent to hub) */
     uint64_t real_size;   /* the real size we're looking for (to
@@ -47,9 +52,34 @@ struct search_request
     arg_t *words;        /* always in utf-8 composed form */
     int id;
     char *tth;
+
+    struct sm_request *matcher_entry;
 };
 
 #include "hub.h"
+/* A search response split into its fields. The fields point into the
+ * parsed buffer and are not nul-terminated.
+ */
+typedef struct sl_field sl_field_t;
+struct sl_field
+{
+    const char *ptr;
+    size_t len;
+};
+
+typedef struct search_response_fields search_response_fields_t;
+struct search_response_fields
+{
+    sl_field_t nick;
+    sl_field_t filename;
+    sl_field_t hubname;     /* hub name, or TTH:<tth> */
+    sl_field_t hub_address;
+    uint64_t size;
+    uint64_t openslots;
+    uint64_t totalslots;
+    bool is_directory;
+};
+
 typedef struct search_response search_response_t;
 struct search_response
 {
@@ -64,13 +94,55 @@ struct search_response
     hub_t *hub;
 };
 
+/* Datagrams are read in batches of SL_BATCH_SIZE. Datagrams longer than
+ * SL_DATAGRAM_SIZE are truncated and dropped.
+ */
+#define SL_BATCH_SIZE 32
+#define SL_DATAGRAM_SIZE 2048
+
+/* socket receive buffer, large enough to absorb the burst of responses
+ * following a search in a big hub */
+#define SL_RECEIVE_BUFFER_SIZE (1024 * 1024)
+
+typedef struct search_listener_stats search_listener_stats_t;
+struct search_listener_stats
+{
+    uint64_t datagrams;
+    uint64_t batches;
+    uint64_t max_burst;  /* most datagrams read in one wakeup */
+    uint64_t truncated;
+    uint64_t dropped;    /* dropped by the kernel, when reported */
+};
+
+/* Search requests are forgotten after SL_REQUEST_TIMEOUT seconds without
+ * matching responses. Expiry is tracked on a timing wheel with
+ * SL_WHEEL_SLOTS slots of SL_WHEEL_TICK seconds each.
+ */
+#define SL_REQUEST_TIMEOUT (15 * 60)
+#define SL_WHEEL_TICK 30
+#define SL_WHEEL_SLOTS 64
+
+/* number of buckets in the search id index */
+#define SL_ID_NHASH 67
+
+struct sl_batch;
+
 typedef struct search_listener search_listener_t;
 
 struct search_listener
 {
     struct event in_event;
     int fd;
-    TAILQ_HEAD(search_request_list, search_request) search_request_head;
+    LIST_HEAD(, search_request) requests_by_id[SL_ID_NHASH];
+    unsigned nrequests;
+    search_matcher_t *matcher;
+
+    LIST_HEAD(, search_request) wheel[SL_WHEEL_SLOTS];
+    unsigned current_tick;
+
+    struct sl_batch *batch;
+    uint32_t kernel_drops;
+    search_listener_stats_t stats;
 };
 
 search_listener_t *search_listener_new(int port);
@@ -83,8 +155,10 @@ search_request_t *search_listener_create_search_request(const char *words,
         int id);
 int search_listener_handle_response(search_listener_t *sl, const char *buf);
 void sl_response_free(search_response_t *resp);
+bool sl_tokenize_response(const char *buf, search_response_fields_t *fields);
 search_response_t *sl_parse_response(const char *buf);
 void sl_forget_search(search_listener_t *sl, int search_id);
+void sl_expire_requests(search_listener_t *sl, time_t now);
 void sl_request_free(search_request_t *sreq);
 
 #endif
@@ -19,9 +19,13 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 
 #include "search_listener.h"
 #include "notifications.h"
+#include "rx.h"
+#include "xstr.h"
 #include "unit_test.h"
 
 static int got_response = 0;
@@ -53,6 +57,159 @@ void handle_search_response_notification(nc_t *nc, const char *channel,
     }
 }
 
+static bool field_equals(const sl_field_t *field, const char *str)
+{
+    return str && strlen(str) == field->len &&
+        memcmp(field->ptr, str, field->len) == 0;
+}
+
+/* Checks the tokenizer against the regexps it replaced. */
+static void check_tokenizer(const char *buf)
+{
+    search_response_fields_t fields;
+    bool ok = sl_tokenize_response(buf, &fields);
+
+    if(str_has_prefix(buf, "$SR "))
+        buf += 4;
+    while(*buf == ' ')
+        ++buf;
+    char *xbuf = xstrndup(buf, strcspn(buf, "|"));
+
+    int i, x5 = 0;
+    for(i = 0; xbuf[i]; i++)
+    {
+        if(xbuf[i] == 0x05)
+            x5++;
+    }
+    int is_directory = (x5 == 1);
+
+    static const void *rx_dir = NULL, *rx_file = NULL;
+    if(rx_dir == NULL)
+    {
+        rx_dir = rx_compile("([^ ]+) (.+) ([0-9]+)/([0-9]+)\x05(.*)\\(([-0-9a-zA-Z_.:]+)\\)\\|?");
+        rx_file = rx_compile("([^ ]+) ([^\x05]+)\x05([0-9]+) ([0-9]+)/([0-9]+)\x05(.*)\\(([-0-9a-zA-Z_.:]+)\\)\\|?");
+    }
+
+    rx_subs_t *subs = rx_search_precompiled(xbuf, is_directory ? rx_dir : rx_file);
+    bool rx_ok = subs && subs->nsubs == 7 - is_directory;
+
+    /* The regexps also match a response that only becomes valid when
+     * leading fields are skipped, the tokenizer rejects those.
+     */
+    size_t nicklen = strcspn(xbuf, " ");
+    if(rx_ok && (strlen(subs->subs[0]) != nicklen ||
+                strncmp(subs->subs[0], xbuf, nicklen) != 0))
+    {
+        rx_ok = false;
+        fail_unless(!ok);
+    }
+
+    fail_unless(ok == rx_ok);
+    if(ok)
+    {
+        fail_unless(fields.is_directory == is_directory);
+        fail_unless(field_equals(&fields.nick, subs->subs[0]));
+        fail_unless(field_equals(&fields.filename, subs->subs[1]));
+        if(!is_directory)
+            fail_unless(fields.size == strtoull(subs->subs[2], NULL, 10));
+        fail_unless(fields.openslots ==
+                strtoull(subs->subs[3 - is_directory], NULL, 10));
+        fail_unless(fields.totalslots ==
+                strtoull(subs->subs[4 - is_directory], NULL, 10));
+        fail_unless(field_equals(&fields.hubname, subs->subs[5 - is_directory]));
+        fail_unless(field_equals(&fields.hub_address,
+                    subs->subs[6 - is_directory]));
+    }
+
+    rx_free_subs(subs);
+    free(xbuf);
+}
+
+static const char *fuzz_corpus[] = {
+    "$SR [Tele2]foo c:\\example file[test].zip\x05" "68458636 3/3\x05TTH:FAKEDTTHTOPROTECTTHEINNOCENTADSEGCVBFRX (127.13.2.230:2345)|",
+    "gazonk spclient\\hublist_test.c\x05" "2539 3/3\x05TTH:QBVGSER2GIH34DOZ4WDWU5QOCZIS7RLHAA5NAPI (127.0.0.1:6666)|",
+    "$SR [FOO]bar files\\directory\\filename 3/3\x05[BAR]Silly Hub (1.2.3.4:4111)|",
+    "$SR fsdewck-O -=mTv=-\\hip hop\\foo.mp3\x05" "6979308 1/3\x05TTH:6YLV6XTDAZAIGHQTZ7MBULCBNCY7W3EITECFWEQ (1.2.3.4:4111)|9.19.174)|C5U4A (11.9.19.174)|",
+    "$SR nick dir with (parens) 12 0/10\x05hub (name) (hub.example.org:411)",
+    "$SR nick a\x05" "1 2/3\x05(x) (y) (z)",
+    "$SR   nick  two  spaces\x05" "99999999999999999999999 1/1\x05 (a:1)",
+    "$SR nick file\x05" "1 2/3\x05\x05 (a:1)",
+    "$SR nick \x05" "1 2/3\x05 (a:1)",
+    "$SR nick  1/2\x05 (a:1)",
+    "$SR nick dir 1/\x05 (a:1)",
+    "$SR ni\x05" "ck file\x05" "1 2/3\x05 (a:1)",
+    "$SR nick file\x05" "1 2/3\x05()",
+    "$SR nick file\x05" "1 2/3\x05(a:1",
+    "$SR",
+    "$SR ",
+    "",
+    "|",
+    "\x05\x05",
+};
+
+/* Cheap deterministic generator, so failures can be reproduced. */
+static unsigned fuzz_next(unsigned *state)
+{
+    *state = *state * 1103515245 + 12345;
+    return (*state >> 16) & 0x7FFF;
+}
+
+static void fuzz_tokenizer(void)
+{
+    static const char alphabet[] = " \x05/()|:.0123456789aZ\x80\xff";
+    unsigned state = 1;
+    char buf[512];
+
+    /* most mutations are rejected, don't log each one */
+    sp_log_set_level("none");
+
+    int n;
+    for(n = 0; n < 200000; n++)
+    {
+        const char *seed = fuzz_corpus[fuzz_next(&state) %
+            (sizeof(fuzz_corpus) / sizeof(fuzz_corpus[0]))];
+        size_t len = strlen(seed);
+        memcpy(buf, seed, len);
+
+        int nmutations = 1 + fuzz_next(&state) % 4;
+        int i;
+        for(i = 0; i < nmutations; i++)
+        {
+            size_t pos = len ? fuzz_next(&state) % len : 0;
+            char c = alphabet[fuzz_next(&state) % (sizeof(alphabet) - 1)];
+            switch(fuzz_next(&state) % 4)
+            {
+                case 0: /* replace */
+                    if(len)
+                        buf[pos] = c;
+                    break;
+                case 1: /* insert */
+                    if(len < sizeof(buf) - 1)
+                    {
+                        memmove(buf + pos + 1, buf + pos, len - pos);
+                        buf[pos] = c;
+                        len++;
+                    }
+                    break;
+                case 2: /* delete */
+                    if(len)
+                    {
+                        memmove(buf + pos, buf + pos + 1, len - pos - 1);
+                        len--;
+                    }
+                    break;
+                case 3: /* truncate */
+                    len = pos;
+                    break;
+            }
+        }
+        buf[len] = 0;
+
+        check_tokenizer(buf);
+        sl_response_free(sl_parse_response(buf));
+    }
+}
+
 int main(void)
 {
     search_listener_t *sl = search_listener_new(0); /* create a passive search listener */
@@ -117,6 +274,67 @@ int main(void)
     search_listener_handle_response(sl, search_response_string);
     fail_unless(got_response == 1);
 
+    /* the TTH request still matches after the first one is forgotten */
+    sl_forget_search(sl, 1);
+    got_response = 0;
+    search_listener_handle_response(sl, search_response_string);
+    fail_unless(got_response == 1);
+
+    sl_forget_search(sl, 0);
+    got_response = 0;
+    search_listener_handle_response(sl, search_response_string);
+    fail_unless(got_response == 0);
+    fail_unless(sl->nrequests == 0);
+
+    /* forgetting a search id leaves other searches alone, even in the
+     * same bucket of the id index */
+    sl_forget_search(sl, 0);
+    int id;
+    for(id = 1; id <= 3 * SL_ID_NHASH; id++)
+    {
+        request = search_listener_create_search_request("ample zip", 0,
+                SHARE_SIZE_NONE, SHARE_TYPE_ANY, id);
+        search_listener_add_request(sl, request);
+    }
+    sl_forget_search(sl, 3 * SL_ID_NHASH);
+    fail_unless(sl->nrequests == 3 * SL_ID_NHASH - 1);
+    sl_forget_search(sl, 3 * SL_ID_NHASH);
+    fail_unless(sl->nrequests == 3 * SL_ID_NHASH - 1);
+    got_response = 0;
+    search_listener_handle_response(sl, search_response_string);
+    fail_unless(got_response == 1);
+    sl_forget_search(sl, 0);
+    fail_unless(sl->nrequests == 0);
+
+    /* requests expire when they haven't matched for a while */
+    time_t now = time(NULL);
+    request = search_listener_create_search_request("ample zip", 0,
+            SHARE_SIZE_NONE, SHARE_TYPE_ANY, 3);
+    search_listener_add_request(sl, request);
+    request = search_listener_create_search_request("no match", 0,
+            SHARE_SIZE_NONE, SHARE_TYPE_ANY, 4);
+    search_listener_add_request(sl, request);
+
+    sl_expire_requests(sl, now + SL_REQUEST_TIMEOUT / 2);
+    fail_unless(sl->nrequests == 2);
+    got_response = 0;
+    search_listener_handle_response(sl, search_response_string);
+    fail_unless(got_response == 1);
+
+    /* the matching request was postponed */
+    sl_expire_requests(sl, now + SL_REQUEST_TIMEOUT + 2 * SL_WHEEL_TICK);
+    fail_unless(sl->nrequests == 1);
+    got_response = 0;
+    search_listener_handle_response(sl, search_response_string);
+    fail_unless(got_response == 1);
+
+    /* a long gap sweeps the whole wheel */
+    sl_expire_requests(sl, now + 100 * SL_REQUEST_TIMEOUT);
+    fail_unless(sl->nrequests == 0);
+    got_response = 0;
+    search_listener_handle_response(sl, search_response_string);
+    fail_unless(got_response == 0);
+
     search_response_t *resp = sl_parse_response("gazonk spclient\\hublist_test.c2539 3/3TTH:QBVGSER2GIH34DOZ4WDWU5QOCZIS7RLHAA5NAPI (127.0.0.1:6666)|");
     fail_unless(resp);
     sl_response_free(resp);
@@ -170,6 +388,13 @@ int main(void)
     fail_unless(strcmp(request->tth, tth) == 0);
     fail_unless(request->words == NULL);
 
+    int i;
+    for(i = 0; i < sizeof(fuzz_corpus) / sizeof(fuzz_corpus[0]); i++)
+    {
+        check_tokenizer(fuzz_corpus[i]);
+    }
+    fuzz_tokenizer();
+
     return 0;
 }
 
@@ -0,0 +1,688 @@
+/*
+ * Copyright (c) 2008 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "nfkc.h"
+#include "log.h"
+#include "xstr.h"
+#include "sys_queue.h"
+#include "sys_tree.h"
+#include "search_listener.h"
+#include "search_matcher.h"
+
+/* the trie is rebuilt when more than this many words are unused, and they
+ * outnumber the words in use */
+#define SM_MAX_DEAD_PATTERNS 32
+
+struct sm_node
+{
+    int first_child;
+    int sibling;
+    int fail;       /* longest proper suffix that is also in the trie */
+    int output;     /* pattern ending at this node, or -1 */
+    int dict;       /* nearest node on the fail chain with an output, or -1 */
+    unsigned char c;
+};
+
+struct sm_pattern
+{
+    char *word;
+    struct sm_request **refs;  /* requests containing this word */
+    int nrefs;
+    int refs_size;
+    unsigned stamp;
+};
+
+struct sm_request
+{
+    search_request_t *sreq;
+    int64_t priority;
+
+    int *patterns;      /* distinct, non-empty words */
+    int npatterns;
+
+    /* number of words seen in the current scan */
+    unsigned stamp;
+    int hits;
+
+    struct sm_tth *tth;
+    LIST_ENTRY(sm_request) link;
+};
+
+/* the TTH requests for one TTH */
+struct sm_tth
+{
+    RB_ENTRY(sm_tth) link;
+    char *tth;
+    LIST_HEAD(, sm_request) requests;
+};
+
+RB_HEAD(sm_tth_tree, sm_tth);
+
+struct search_matcher
+{
+    struct sm_node *nodes;
+    int nnodes;
+    int nodes_size;
+    bool dirty;  /* failure links must be recomputed */
+
+    struct sm_pattern *patterns;
+    int npatterns;
+    int patterns_size;
+    int ndead;
+
+    unsigned stamp;
+    int64_t head_seq;
+    int64_t tail_seq;
+
+    LIST_HEAD(, sm_request) word_requests;
+    LIST_HEAD(, sm_request) wildcard_requests;
+    struct sm_tth_tree tth_requests;
+};
+
+static int sm_tth_cmp(struct sm_tth *a, struct sm_tth *b)
+{
+    return strcmp(a->tth, b->tth);
+}
+
+RB_PROTOTYPE(sm_tth_tree, sm_tth, link, sm_tth_cmp);
+RB_GENERATE(sm_tth_tree, sm_tth, link, sm_tth_cmp);
+
+bool search_request_size_matches(const search_request_t *sreq, uint64_t size)
+{
+    switch(sreq->size_restriction)
+    {
+        case SHARE_SIZE_MIN:
+            return size >= sreq->real_size;
+        case SHARE_SIZE_MAX:
+            return size <= sreq->real_size;
+        case SHARE_SIZE_EQUAL:
+            return size == sreq->real_size;
+        case SHARE_SIZE_NONE:
+            break;
+    }
+    return true;
+}
+
+static int sm_new_node(search_matcher_t *sm, unsigned char c)
+{
+    if(sm->nnodes == sm->nodes_size)
+    {
+        sm->nodes_size = sm->nodes_size ? sm->nodes_size * 2 : 64;
+        sm->nodes = realloc(sm->nodes,
+                sm->nodes_size * sizeof(struct sm_node));
+    }
+
+    struct sm_node *node = &sm->nodes[sm->nnodes];
+    node->first_child = -1;
+    node->sibling = -1;
+    node->fail = 0;
+    node->output = -1;
+    node->dict = -1;
+    node->c = c;
+
+    return sm->nnodes++;
+}
+
+static int sm_child(const search_matcher_t *sm, int node, unsigned char c)
+{
+    int child;
+    for(child = sm->nodes[node].first_child; child != -1;
+            child = sm->nodes[child].sibling)
+    {
+        if(sm->nodes[child].c == c)
+            return child;
+    }
+    return -1;
+}
+
+/* Adds a word to the trie, returns its pattern number. The failure links
+ * are recomputed before the next scan.
+ */
+static int sm_insert_word(search_matcher_t *sm, const char *word)
+{
+    int node = 0;
+    const unsigned char *p;
+    for(p = (const unsigned char *)word; *p; p++)
+    {
+        int child = sm_child(sm, node, *p);
+        if(child == -1)
+        {
+            child = sm_new_node(sm, *p);
+            sm->nodes[child].sibling = sm->nodes[node].first_child;
+            sm->nodes[node].first_child = child;
+            sm->dirty = true;
+        }
+        node = child;
+    }
+
+    if(sm->nodes[node].output != -1)
+    {
+        return sm->nodes[node].output;
+    }
+
+    if(sm->npatterns == sm->patterns_size)
+    {
+        sm->patterns_size = sm->patterns_size ? sm->patterns_size * 2 : 16;
+        sm->patterns = realloc(sm->patterns,
+                sm->patterns_size * sizeof(struct sm_pattern));
+    }
+
+    struct sm_pattern *pattern = &sm->patterns[sm->npatterns];
+    memset(pattern, 0, sizeof(struct sm_pattern));
+    pattern->word = xstrdup(word);
+    sm->nodes[node].output = sm->npatterns;
+    sm->ndead++; /* until referenced */
+    sm->dirty = true;
+
+    return sm->npatterns++;
+}
+
+static void sm_pattern_add_ref(search_matcher_t *sm, int n,
+        struct sm_request *req)
+{
+    struct sm_pattern *pattern = &sm->patterns[n];
+
+    if(pattern->nrefs == pattern->refs_size)
+    {
+        pattern->refs_size = pattern->refs_size ? pattern->refs_size * 2 : 4;
+        pattern->refs = realloc(pattern->refs,
+                pattern->refs_size * sizeof(struct sm_request *));
+    }
+    if(pattern->nrefs++ == 0)
+        sm->ndead--;
+    pattern->refs[pattern->nrefs - 1] = req;
+}
+
+static void sm_pattern_remove_ref(search_matcher_t *sm, int n,
+        struct sm_request *req)
+{
+    struct sm_pattern *pattern = &sm->patterns[n];
+
+    int i;
+    for(i = 0; i < pattern->nrefs; i++)
+    {
+        if(pattern->refs[i] == req)
+        {
+            pattern->refs[i] = pattern->refs[--pattern->nrefs];
+            if(pattern->nrefs == 0)
+                sm->ndead++;
+            break;
+        }
+    }
+}
+
+static void sm_add_words(search_matcher_t *sm, struct sm_request *req)
+{
+    arg_t *words = req->sreq->words;
+
+    req->patterns = calloc(words->argc, sizeof(int));
+    req->npatterns = 0;
+
+    int i;
+    for(i = 0; i < words->argc; i++)
+    {
+        /* an empty word matches anything */
+        if(words->argv[i][0] == 0)
+            continue;
+
+        int n = sm_insert_word(sm, words->argv[i]);
+
+        int j;
+        for(j = 0; j < req->npatterns; j++)
+        {
+            if(req->patterns[j] == n)
+                break;
+        }
+        if(j == req->npatterns)
+        {
+            req->patterns[req->npatterns++] = n;
+            sm_pattern_add_ref(sm, n, req);
+        }
+    }
+}
+
+static void sm_reset_trie(search_matcher_t *sm)
+{
+    int i;
+    for(i = 0; i < sm->npatterns; i++)
+    {
+        free(sm->patterns[i].word);
+        free(sm->patterns[i].refs);
+    }
+    sm->npatterns = 0;
+    sm->ndead = 0;
+
+    sm->nnodes = 0;
+    sm_new_node(sm, 0); /* root */
+    sm->dirty = true;
+}
+
+/* Drops unused words by building a new trie from the requests. */
+static void sm_rebuild(search_matcher_t *sm)
+{
+    DEBUG("rebuilding search matcher (%i of %i words unused)",
+            sm->ndead, sm->npatterns);
+
+    sm_reset_trie(sm);
+
+    struct sm_request *req;
+    LIST_FOREACH(req, &sm->word_requests, link)
+    {
+        free(req->patterns);
+        sm_add_words(sm, req);
+    }
+}
+
+/* Breadth first computation of the failure and dictionary links. */
+static void sm_build_links(search_matcher_t *sm)
+{
+    int *queue = malloc(sm->nnodes * sizeof(int));
+    int head = 0, tail = 0;
+
+    sm->nodes[0].fail = 0;
+    sm->nodes[0].dict = -1;
+
+    int child;
+    for(child = sm->nodes[0].first_child; child != -1;
+            child = sm->nodes[child].sibling)
+    {
+        sm->nodes[child].fail = 0;
+        sm->nodes[child].dict = -1;
+        queue[tail++] = child;
+    }
+
+    while(head < tail)
+    {
+        int node = queue[head++];
+
+        for(child = sm->nodes[node].first_child; child != -1;
+                child = sm->nodes[child].sibling)
+        {
+            unsigned char c = sm->nodes[child].c;
+            int f = sm->nodes[node].fail;
+            int next;
+            while((next = sm_child(sm, f, c)) == -1 && f != 0)
+                f = sm->nodes[f].fail;
+
+            int fail = (next == -1 ? 0 : next);
+            sm->nodes[child].fail = fail;
+            sm->nodes[child].dict = (sm->nodes[fail].output != -1 ?
+                    fail : sm->nodes[fail].dict);
+            queue[tail++] = child;
+        }
+    }
+
+    free(queue);
+    sm->dirty = false;
+}
+
+search_matcher_t *search_matcher_new(void)
+{
+    search_matcher_t *sm = calloc(1, sizeof(search_matcher_t));
+
+    LIST_INIT(&sm->word_requests);
+    LIST_INIT(&sm->wildcard_requests);
+    RB_INIT(&sm->tth_requests);
+    sm_reset_trie(sm);
+
+    return sm;
+}
+
+static void sm_request_free(struct sm_request *req)
+{
+    req->sreq->matcher_entry = NULL;
+    free(req->patterns);
+    free(req);
+}
+
+void search_matcher_free(search_matcher_t *sm)
+{
+    if(sm == NULL)
+        return;
+
+    struct sm_request *req;
+    while((req = LIST_FIRST(&sm->word_requests)) != NULL)
+    {
+        LIST_REMOVE(req, link);
+        sm_request_free(req);
+    }
+    while((req = LIST_FIRST(&sm->wildcard_requests)) != NULL)
+    {
+        LIST_REMOVE(req, link);
+        sm_request_free(req);
+    }
+    struct sm_tth *entry;
+    while((entry = RB_MIN(sm_tth_tree, &sm->tth_requests)) != NULL)
+    {
+        while((req = LIST_FIRST(&entry->requests)) != NULL)
+        {
+            LIST_REMOVE(req, link);
+            sm_request_free(req);
+        }
+        RB_REMOVE(sm_tth_tree, &sm->tth_requests, entry);
+        free(entry->tth);
+        free(entry);
+    }
+
+    sm_reset_trie(sm);
+    free(sm->nodes);
+    free(sm->patterns);
+    free(sm);
+}
+
+void search_matcher_add(search_matcher_t *sm, search_request_t *sreq,
+        bool low_priority)
+{
+    return_if_fail(sm);
+    return_if_fail(sreq);
+    return_if_fail(sreq->matcher_entry == NULL);
+
+    struct sm_request *req = calloc(1, sizeof(struct sm_request));
+    req->sreq = sreq;
+    req->priority = low_priority ? --sm->head_seq : ++sm->tail_seq;
+    sreq->matcher_entry = req;
+
+    if(sreq->tth)
+    {
+        struct sm_tth key = {.tth = sreq->tth};
+        struct sm_tth *entry = RB_FIND(sm_tth_tree, &sm->tth_requests, &key);
+        if(entry == NULL)
+        {
+            entry = calloc(1, sizeof(struct sm_tth));
+            entry->tth = xstrdup(sreq->tth);
+            LIST_INIT(&entry->requests);
+            RB_INSERT(sm_tth_tree, &sm->tth_requests, entry);
+        }
+        req->tth = entry;
+        LIST_INSERT_HEAD(&entry->requests, req, link);
+        return;
+    }
+
+    if(sreq->words)
+        sm_add_words(sm, req);
+
+    if(req->npatterns == 0)
+        LIST_INSERT_HEAD(&sm->wildcard_requests, req, link);
+    else
+        LIST_INSERT_HEAD(&sm->word_requests, req, link);
+}
+
+void search_matcher_remove(search_matcher_t *sm, search_request_t *sreq)
+{
+    return_if_fail(sm);
+    return_if_fail(sreq);
+
+    struct sm_request *req = sreq->matcher_entry;
+    if(req == NULL)
+        return;
+
+    LIST_REMOVE(req, link);
+
+    if(req->tth)
+    {
+        if(LIST_EMPTY(&req->tth->requests))
+        {
+            RB_REMOVE(sm_tth_tree, &sm->tth_requests, req->tth);
+            free(req->tth->tth);
+            free(req->tth);
+        }
+    }
+    else
+    {
+        int i;
+        for(i = 0; i < req->npatterns; i++)
+            sm_pattern_remove_ref(sm, req->patterns[i], req);
+    }
+
+    sm_request_free(req);
+
+    if(sm->ndead > SM_MAX_DEAD_PATTERNS && sm->ndead * 2 > sm->npatterns)
+        sm_rebuild(sm);
+}
+
+static void sm_next_stamp(search_matcher_t *sm)
+{
+    if(++sm->stamp != 0)
+        return;
+
+    /* wrapped, clear all old stamps */
+    int i;
+    for(i = 0; i < sm->npatterns; i++)
+        sm->patterns[i].stamp = 0;
+    struct sm_request *req;
+    LIST_FOREACH(req, &sm->word_requests, link)
+        req->stamp = 0;
+    sm->stamp = 1;
+}
+
+static void sm_scan(search_matcher_t *sm, const char *text, uint64_t size,
+        struct sm_request **best)
+{
+    if(sm->dirty)
+        sm_build_links(sm);
+    sm_next_stamp(sm);
+
+    int node = 0;
+    const unsigned char *p;
+    for(p = (const unsigned char *)text; *p; p++)
+    {
+        int next;
+        while((next = sm_child(sm, node, *p)) == -1 && node != 0)
+            node = sm->nodes[node].fail;
+        node = (next == -1 ? 0 : next);
+
+        int out = (sm->nodes[node].output != -1 ? node : sm->nodes[node].dict);
+        for(; out > 0; out = sm->nodes[out].dict)
+        {
+            struct sm_pattern *pattern = &sm->patterns[sm->nodes[out].output];
+            if(pattern->stamp == sm->stamp)
+                continue;
+            pattern->stamp = sm->stamp;
+
+            int i;
+            for(i = 0; i < pattern->nrefs; i++)
+            {
+                struct sm_request *req = pattern->refs[i];
+                if(req->stamp != sm->stamp)
+                {
+                    req->stamp = sm->stamp;
+                    req->hits = 0;
+                }
+                if(++req->hits == req->npatterns &&
+                        (*best == NULL || req->priority > (*best)->priority) &&
+                        search_request_size_matches(req->sreq, size))
+                {
+                    *best = req;
+                }
+            }
+        }
+    }
+}
+
+search_request_t *search_matcher_match(search_matcher_t *sm,
+        const char *filename, uint64_t size, const char *tth)
+{
+    return_val_if_fail(sm, NULL);
+
+    struct sm_request *best = NULL;
+
+    struct sm_request *req;
+
+    if(tth && !RB_EMPTY(&sm->tth_requests))
+    {
+        struct sm_tth key = {.tth = (char *)tth};
+        struct sm_tth *entry = RB_FIND(sm_tth_tree, &sm->tth_requests, &key);
+        if(entry)
+        {
+            LIST_FOREACH(req, &entry->requests, link)
+            {
+                if(best == NULL || req->priority > best->priority)
+                    best = req;
+            }
+        }
+    }
+
+    LIST_FOREACH(req, &sm->wildcard_requests, link)
+    {
+        if((best == NULL || req->priority > best->priority) &&
+                search_request_size_matches(req->sreq, size))
+        {
+            best = req;
+        }
+    }
+
+    if(filename && !LIST_EMPTY(&sm->word_requests))
+    {
+        /* ensure composed form, matching the search words */
+        char *composed = g_utf8_normalize(filename, -1,
+                G_NORMALIZE_DEFAULT_COMPOSE);
+        if(composed)
+        {
+            char *casefolded = g_utf8_casefold(composed, -1);
+            free(composed);
+            if(casefolded)
+            {
+                sm_scan(sm, casefolded, size, &best);
+                free(casefolded);
+            }
+        }
+    }
+
+    return best ? best->sreq : NULL;
+}
+
+#ifdef TEST
+
+#include "unit_test.h"
+
+static search_request_t *make_request(const char *words, const char *tth,
+        share_size_restriction_t restriction, uint64_t size, int id)
+{
+    search_request_t *sreq = calloc(1, sizeof(search_request_t));
+    if(tth)
+        sreq->tth = xstrdup(tth);
+    else
+        sreq->words = arg_create(words, "$", 0);
+    sreq->size_restriction = restriction;
+    sreq->real_size = size;
+    sreq->id = id;
+    return sreq;
+}
+
+static void free_request(search_request_t *sreq)
+{
+    arg_free(sreq->words);
+    free(sreq->tth);
+    free(sreq);
+}
+
+static int match_id(search_matcher_t *sm, const char *filename,
+        uint64_t size, const char *tth)
+{
+    search_request_t *sreq = search_matcher_match(sm, filename, size, tth);
+    return sreq ? sreq->id : 0;
+}
+
+int main(void)
+{
+    sp_log_set_level("debug");
+
+    search_matcher_t *sm = search_matcher_new();
+    fail_unless(sm);
+    fail_unless(match_id(sm, "anything", 0, NULL) == 0);
+
+    search_request_t *r1 = make_request("ample$zip", NULL,
+            SHARE_SIZE_NONE, 0, 1);
+    search_matcher_add(sm, r1, false);
+    fail_unless(match_id(sm, "c:\\Example File.ZIP", 0, NULL) == 1);
+    fail_unless(match_id(sm, "c:\\example.rar", 0, NULL) == 0);
+
+    /* overlapping words, and a word that is a suffix of another */
+    search_request_t *r2 = make_request("he$she$hers", NULL,
+            SHARE_SIZE_MIN, 100, 2);
+    search_matcher_add(sm, r2, false);
+    fail_unless(match_id(sm, "ushers", 100, NULL) == 2);
+    fail_unless(match_id(sm, "ushers", 99, NULL) == 0);
+    fail_unless(match_id(sm, "usher", 100, NULL) == 0);
+
+    /* the most recently added request wins */
+    search_request_t *r3 = make_request("zip", NULL, SHARE_SIZE_NONE, 0, 3);
+    search_matcher_add(sm, r3, false);
+    fail_unless(match_id(sm, "example.zip", 0, NULL) == 3);
+
+    /* ...except low priority requests */
+    search_request_t *r4 = make_request("example", NULL,
+            SHARE_SIZE_NONE, 0, -1);
+    search_matcher_add(sm, r4, true);
+    fail_unless(match_id(sm, "example.zip", 0, NULL) == 3);
+    fail_unless(match_id(sm, "example.rar", 0, NULL) == -1);
+
+    /* a TTH request only matches on TTH */
+    const char *tth = "QBVGSER2GIH34DOZ4WDWU5QOCZIS7RLHAA5NAPI";
+    search_request_t *r5 = make_request(NULL, tth, SHARE_SIZE_NONE, 0, 5);
+    search_matcher_add(sm, r5, false);
+    fail_unless(match_id(sm, "example.zip", 0, tth) == 5);
+    fail_unless(match_id(sm, "foo", 0, tth) == 5);
+    fail_unless(match_id(sm, tth, 0, NULL) == 0);
+    fail_unless(match_id(sm, "example.zip", 0,
+                "ASDFSER2GIH34DOZ4WDWU5QOCZIS7RLHAA5NAPI") == 3);
+
+    search_matcher_remove(sm, r3);
+    free_request(r3);
+    fail_unless(match_id(sm, "example.zip", 0, NULL) == 1);
+    search_matcher_remove(sm, r5);
+    free_request(r5);
+    fail_unless(match_id(sm, "foo", 0, tth) == 0);
+
+    /* many short-lived requests, forces rebuilds of the trie */
+    search_request_t *r42 = NULL;
+    int i;
+    for(i = 0; i < 500; i++)
+    {
+        char *words;
+        asprintf(&words, "word%i$common", i);
+        search_request_t *r = make_request(words, NULL,
+                SHARE_SIZE_NONE, 0, 1000 + i);
+        free(words);
+        search_matcher_add(sm, r, false);
+        fail_unless(match_id(sm, "a common word42 file", 0, NULL) ==
+                (i == 4 ? 1004 : i >= 42 ? 1042 : 0));
+        if(i == 42)
+            r42 = r;
+        else
+        {
+            search_matcher_remove(sm, r);
+            free_request(r);
+        }
+    }
+    fail_unless(match_id(sm, "common word42", 0, NULL) == 1042);
+    fail_unless(match_id(sm, "example.zip", 0, NULL) == 1);
+    fail_unless(match_id(sm, "ushers", 100, NULL) == 2);
+
+    search_matcher_free(sm);
+    free_request(r1);
+    free_request(r2);
+    free_request(r4);
+    free_request(r42);
+
+    return 0;
+}
+
+#endif
+
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2008 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _search_matcher_h_
+#define _search_matcher_h_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Routes search responses to the outstanding search requests.
+ *
+ * The words of all requests are kept in one Aho-Corasick automaton, so a
+ * filename is matched against every request in a single scan. TTH
+ * requests are looked up by TTH. If several requests match, the one with
+ * the highest priority wins: requests added later have higher priority,
+ * except low priority requests which rank below all others.
+ */
+
+struct search_request;
+
+typedef struct search_matcher search_matcher_t;
+
+search_matcher_t *search_matcher_new(void);
+void search_matcher_free(search_matcher_t *sm);
+
+void search_matcher_add(search_matcher_t *sm, struct search_request *sreq,
+        bool low_priority);
+void search_matcher_remove(search_matcher_t *sm, struct search_request *sreq);
+
+bool search_request_size_matches(const struct search_request *sreq,
+        uint64_t size);
+
+/* Returns the matching request with the highest priority, or NULL. The
+ * filename is normalized and casefolded here.
+ */
+struct search_request *search_matcher_match(search_matcher_t *sm,
+        const char *filename, uint64_t size, const char *tth);
+
+#endif
+
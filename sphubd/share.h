@@ -34,6 +34,8 @@
 
 #define SHARE_INODE_BUCKETS 509
 
+#define SHARE_STAT_TO_INODE(st) (uint64_t)(((uint64_t)st->st_size << 32) | st->st_ino)
+
 typedef struct share_mountpoint share_mountpoint_t;
 
 typedef struct share_search share_search_t;
@@ -164,6 +166,7 @@ int share_save(share_t *share, unsigned int type);
 
 /* in share_tth.c */
 void share_tth_init_notifications(share_t *share);
+int share_add_hashed_file(share_t *share, const char *local_path);
 
 
 struct tthdb_data *share_get_leafdata(struct share *share, const char *virtual_path);
@@ -0,0 +1,335 @@
+/*
+ * Copyright (c) 2008 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sys_queue.h"
+#include "base32.h"
+#include "globals.h"
+#include "log.h"
+#include "queue.h"
+#include "share_partial.h"
+#include "tigertree.h"
+
+struct share_partial
+{
+    LIST_ENTRY(share_partial) link;
+
+    char *tth;
+    char *target_filename; /* relative to the incomplete directory */
+    uint64_t size;
+
+    uint64_t leafsize;
+    unsigned nleaves;
+    unsigned char *leaves;
+    unsigned char *verified; /* one bit per leaf */
+
+    /* data from this offset on may still be buffered by the downloader */
+    uint64_t written;
+
+    share_file_t file;
+};
+
+static LIST_HEAD(, share_partial) share_partials =
+    LIST_HEAD_INITIALIZER(share_partials);
+
+/* search results for incomplete files are shown relative to the
+ * incomplete directory */
+static share_mountpoint_t share_partial_mountpoint = {
+    .virtual_root = "",
+};
+
+static void share_partial_free(share_partial_t *sp)
+{
+    if(sp)
+    {
+        free(sp->tth);
+        free(sp->target_filename);
+        free(sp->leaves);
+        free(sp->verified);
+        free(sp);
+    }
+}
+
+share_partial_t *share_partial_lookup(const char *tth)
+{
+    return_val_if_fail(tth, NULL);
+
+    share_partial_t *sp;
+    LIST_FOREACH(sp, &share_partials, link)
+    {
+        if(strcmp(sp->tth, tth) == 0)
+            return sp;
+    }
+
+    return NULL;
+}
+
+share_partial_t *share_partial_add(const char *tth,
+        const char *target_filename, uint64_t size,
+        const void *leafdata, unsigned leafdata_len)
+{
+    return_val_if_fail(tth, NULL);
+    return_val_if_fail(target_filename, NULL);
+    return_val_if_fail(leafdata, NULL);
+
+    unsigned nleaves = leafdata_len / TIGERSIZE;
+    if(nleaves == 0 || leafdata_len % TIGERSIZE != 0 || size == 0)
+    {
+        WARNING("invalid leaf data for TTH %s", tth);
+        return NULL;
+    }
+
+    /* leaves cover a power of two number of blocks */
+    uint64_t leafsize = BLOCKSIZE;
+    while(leafsize * nleaves < size)
+        leafsize *= 2;
+    if((size + leafsize - 1) / leafsize != nleaves)
+    {
+        WARNING("%u leaves don't fit a file of %"PRIu64" bytes",
+                nleaves, size);
+        return NULL;
+    }
+
+    unsigned char root[TIGERSIZE];
+    tt_root_from_leaves(leafdata, nleaves, root);
+    char *root_base32 = base32_encode(root, TIGERSIZE);
+    bool matches = (strcmp(root_base32, tth) == 0);
+    free(root_base32);
+    if(!matches)
+    {
+        WARNING("leaf data doesn't match TTH %s", tth);
+        return NULL;
+    }
+
+    share_partial_remove(tth);
+
+    share_partial_t *sp = calloc(1, sizeof(share_partial_t));
+    sp->tth = strdup(tth);
+    sp->target_filename = strdup(target_filename);
+    sp->size = size;
+    sp->leafsize = leafsize;
+    sp->nleaves = nleaves;
+    sp->leaves = malloc(leafdata_len);
+    memcpy(sp->leaves, leafdata, leafdata_len);
+    sp->verified = calloc((nleaves + 7) / 8, 1);
+    sp->written = UINT64_MAX;
+
+    sp->file.mp = &share_partial_mountpoint;
+    sp->file.partial_path = sp->target_filename;
+    sp->file.type = share_filetype(target_filename);
+    sp->file.size = size;
+
+    LIST_INSERT_HEAD(&share_partials, sp, link);
+
+    DEBUG("sharing verified parts of [%s], %u leaves of %"PRIu64" bytes",
+            target_filename, nleaves, leafsize);
+
+    return sp;
+}
+
+void share_partial_remove(const char *tth)
+{
+    share_partial_t *sp = share_partial_lookup(tth);
+    if(sp)
+    {
+        LIST_REMOVE(sp, link);
+        share_partial_free(sp);
+    }
+}
+
+share_partial_t *share_partial_shared(const char *tth)
+{
+    share_partial_t *sp = share_partial_lookup(tth);
+    if(sp == NULL)
+        return NULL;
+
+    queue_target_t *qt = queue_lookup_target_by_tth(tth);
+    if(qt == NULL || strcmp(qt->filename, sp->target_filename) != 0)
+    {
+        /* removed from the queue */
+        share_partial_remove(tth);
+        return NULL;
+    }
+
+    unsigned leaf;
+    for(leaf = 0; leaf < sp->nleaves; leaf++)
+    {
+        if(share_partial_available(sp, leaf * sp->leafsize) > 0)
+            return sp;
+    }
+
+    return NULL;
+}
+
+uint64_t share_partial_leafsize(const share_partial_t *sp)
+{
+    return sp->leafsize;
+}
+
+bool share_partial_check_leaf(share_partial_t *sp, unsigned leaf,
+        const void *hash)
+{
+    return_val_if_fail(leaf < sp->nleaves, false);
+
+    if(memcmp(sp->leaves + leaf * TIGERSIZE, hash, TIGERSIZE) != 0)
+    {
+        sp->verified[leaf / 8] &= ~(1 << (leaf % 8));
+        return false;
+    }
+
+    sp->verified[leaf / 8] |= 1 << (leaf % 8);
+    return true;
+}
+
+void share_partial_set_written(share_partial_t *sp, uint64_t end)
+{
+    sp->written = end;
+}
+
+uint64_t share_partial_available(const share_partial_t *sp, uint64_t offset)
+{
+    uint64_t end = offset;
+    unsigned leaf = offset / sp->leafsize;
+
+    while(leaf < sp->nleaves && (sp->verified[leaf / 8] & (1 << (leaf % 8))))
+    {
+        uint64_t leaf_end = (uint64_t)(leaf + 1) * sp->leafsize;
+        if(leaf_end > sp->size)
+            leaf_end = sp->size;
+        if(leaf_end > sp->written)
+            break;
+        end = leaf_end;
+        leaf++;
+    }
+
+    return end - offset;
+}
+
+char *share_partial_local_path(const share_partial_t *sp)
+{
+    char *local_path = 0;
+    int num_returned_bytes = asprintf(&local_path, "%s/%s",
+            global_incomplete_directory, sp->target_filename);
+    if (num_returned_bytes == -1)
+        DEBUG("asprintf did not return anything");
+    return local_path;
+}
+
+share_file_t *share_partial_file(share_partial_t *sp)
+{
+    return &sp->file;
+}
+
+#ifdef TEST
+
+#include "unit_test.h"
+
+#define TEST_SIZE (5 * 64 * 1024 + 1000)
+
+int main(void)
+{
+    sp_log_set_level("debug");
+
+    global_working_directory = "/tmp/sp-share_partial-test.d";
+    system("/bin/rm -rf /tmp/sp-share_partial-test.d");
+    system("mkdir /tmp/sp-share_partial-test.d");
+    queue_init();
+
+    unsigned char *data = malloc(TEST_SIZE);
+    unsigned i;
+    for(i = 0; i < TEST_SIZE; i++)
+        data[i] = i * 13 + (i >> 10);
+
+    TT_CONTEXT ctx;
+    tt_init(&ctx, 64 * 1024);
+    tt_update(&ctx, data, TEST_SIZE);
+    tt_digest(&ctx, NULL);
+    char *tth = tt_base32(&ctx);
+    fail_unless(ctx.leaves_len == 6 * TIGERSIZE);
+
+    /* leaf data must hash to the TTH */
+    fail_unless(share_partial_add("LWPNACQDBZRYXW3VHJVCJ64QBZNGHOHHHZWCLNQ",
+                "file", TEST_SIZE, ctx.leaves, ctx.leaves_len) == NULL);
+    fail_unless(share_partial_add(tth, "file", 100 * 64 * 1024,
+                ctx.leaves, ctx.leaves_len) == NULL);
+
+    share_partial_t *sp = share_partial_add(tth, "file", TEST_SIZE,
+            ctx.leaves, ctx.leaves_len);
+    fail_unless(sp);
+    fail_unless(share_partial_lookup(tth) == sp);
+    fail_unless(share_partial_leafsize(sp) == 64 * 1024);
+
+    /* only verified leaves are available */
+    fail_unless(share_partial_available(sp, 0) == 0);
+    for(i = 0; i < 6; i++)
+    {
+        unsigned len = i < 5 ? 64 * 1024 : 1000;
+        unsigned char hash[TIGERSIZE];
+        TT_CONTEXT leaf;
+        tt_init(&leaf, 0);
+        tt_update(&leaf, data + i * 64 * 1024, len);
+        tt_digest(&leaf, hash);
+        if(i != 2)
+            fail_unless(share_partial_check_leaf(sp, i, hash));
+    }
+    /* a mismatch clears the leaf */
+    fail_unless(!share_partial_check_leaf(sp, 3, ctx.leaves));
+    fail_unless(share_partial_available(sp, 0) == 2 * 64 * 1024);
+    fail_unless(share_partial_available(sp, 100) == 2 * 64 * 1024 - 100);
+    fail_unless(share_partial_available(sp, 2 * 64 * 1024) == 0);
+    fail_unless(share_partial_available(sp, 3 * 64 * 1024) == 0);
+    fail_unless(share_partial_available(sp, 4 * 64 * 1024) ==
+            64 * 1024 + 1000);
+
+    /* data not yet written isn't available */
+    share_partial_set_written(sp, 64 * 1024 + 1);
+    fail_unless(share_partial_available(sp, 0) == 64 * 1024);
+    share_partial_set_written(sp, UINT64_MAX);
+
+    /* only shared while the target is queued */
+    fail_unless(share_partial_shared(tth) == NULL);
+    fail_unless(share_partial_lookup(tth) == NULL);
+    sp = share_partial_add(tth, "file", TEST_SIZE,
+            ctx.leaves, ctx.leaves_len);
+    fail_unless(sp);
+    fail_unless(queue_add("nick", "remote\\file", TEST_SIZE, "file", tth) == 0);
+    fail_unless(share_partial_shared(tth) == NULL); /* nothing verified */
+    fail_unless(share_partial_check_leaf(sp, 5, ctx.leaves + 5 * TIGERSIZE));
+    fail_unless(share_partial_shared(tth) == sp);
+
+    share_file_t *f = share_partial_file(sp);
+    fail_unless(f->size == TEST_SIZE);
+    fail_unless(strcmp(f->partial_path, "file") == 0);
+
+    share_partial_remove(tth);
+    fail_unless(share_partial_lookup(tth) == NULL);
+
+    tt_destroy(&ctx);
+    free(tth);
+    free(data);
+    queue_close();
+    system("/bin/rm -rf /tmp/sp-share_partial-test.d");
+
+    return 0;
+}
+
+#endif
+
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2008 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef _share_partial_h_
+#define _share_partial_h_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "share.h"
+
+/* Shares the verified parts of incomplete downloads.
+ *
+ * When the TTH leaves of a queued file are known, downloaded data is
+ * checked leaf by leaf. Other peers can then get the verified leaves by
+ * TTH while we are still downloading the rest. Only whole leaves that
+ * have been written to disk are served.
+ */
+
+/* smaller files are not worth fetching the leaves for */
+#define SHARE_PARTIAL_MIN_SIZE (4 * 1024 * 1024)
+
+typedef struct share_partial share_partial_t;
+
+/* Adds the target with the given leaf data, which must hash to the TTH.
+ * Returns NULL if it doesn't.
+ */
+share_partial_t *share_partial_add(const char *tth,
+        const char *target_filename, uint64_t size,
+        const void *leafdata, unsigned leafdata_len);
+void share_partial_remove(const char *tth);
+
+share_partial_t *share_partial_lookup(const char *tth);
+
+/* Returns the entry if it is still in the download queue and has verified
+ * data to share, otherwise NULL.
+ */
+share_partial_t *share_partial_shared(const char *tth);
+
+uint64_t share_partial_leafsize(const share_partial_t *sp);
+
+/* Compares the hash of downloaded data with the leaf, and marks the leaf
+ * as verified if they match. Returns true on a match.
+ */
+bool share_partial_check_leaf(share_partial_t *sp, unsigned leaf,
+        const void *hash);
+
+/* Data from offset END on may not be on disk yet. UINT64_MAX means that
+ * everything downloaded has been written.
+ */
+void share_partial_set_written(share_partial_t *sp, uint64_t end);
+
+/* Returns the number of verified bytes that can be served from OFFSET. */
+uint64_t share_partial_available(const share_partial_t *sp, uint64_t offset);
+
+/* Returns the path of the incomplete file, should be freed by caller. */
+char *share_partial_local_path(const share_partial_t *sp);
+
+/* Returns a share file to use in search results. */
+share_file_t *share_partial_file(share_partial_t *sp);
+
+#endif
+
@@ -21,41 +21,106 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#ifdef __linux__
+# include <sys/syscall.h>
+#endif
 
 #include <event.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include "share.h"
 #include "nfkc.h"
+#include "io.h"
 #include "log.h"
 #include "notifications.h"
 
 #include "globals.h"
 #include "ui_send.h"
+#include "event_profile.h"
+
+/* Directories are read by a pool of worker threads. The workers only do
+ * filesystem I/O (open, getdents and fstatat relative to the directory fd)
+ * and never touch the share, the TTH store or any other sphubd state. The
+ * results are queued as batches and handed back to the main loop through a
+ * pipe, where they are inserted into the share exactly as before.
+ */
+
+#define SHARE_SCAN_NTHREADS 4
+
+/* max number of directory entries returned in one batch */
+#define SHARE_SCAN_BATCH_SIZE 256
+
+/* batches start this small and grow, most directories are small */
+#define SHARE_SCAN_BATCH_INITIAL_SIZE 8
+
+/* max number of batches processed in each event */
+#define SHARE_SCAN_BATCHES_PER_EVENT 16
+
+typedef struct share_scan_state share_scan_state_t;
 
 typedef struct share_scan_directory share_scan_directory_t;
 struct share_scan_directory
 {
-    LIST_ENTRY(share_scan_directory) link;
+    TAILQ_ENTRY(share_scan_directory) link;
+    share_scan_state_t *ctx;
     char *dirpath;
 };
 
-typedef struct share_scan_state share_scan_state_t;
+typedef struct share_scan_entry share_scan_entry_t;
+struct share_scan_entry
+{
+    char *filename;
+    int error; /* errno from fstatat, or 0 */
+    bool is_directory;
+    struct stat stbuf;
+};
+
+typedef struct share_scan_batch share_scan_batch_t;
+struct share_scan_batch
+{
+    TAILQ_ENTRY(share_scan_batch) link;
+    share_scan_state_t *ctx;
+    char *dirpath;
+    int error; /* errno from opening or reading the directory, or 0 */
+    bool last; /* true for the last batch of a directory */
+    unsigned nentries;
+    unsigned size; /* number of allocated entries */
+    share_scan_entry_t entries[];
+};
+
 struct share_scan_state
 {
-    LIST_HEAD(, share_scan_directory) directories;
     share_t *share;
     struct event ev;
     share_mountpoint_t *mp;
+
+    /* number of directories queued or being read by a worker */
+    unsigned npending;
 };
 
-#define SHARE_STAT_TO_INODE(st) (uint64_t)(((uint64_t)st->st_size << 32) | st->st_ino)
+typedef struct share_scanner share_scanner_t;
+struct share_scanner
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* protected by the lock */
+    TAILQ_HEAD(, share_scan_directory) directories;
+    TAILQ_HEAD(, share_scan_batch) batches;
+
+    /* a byte is written for each queued batch */
+    int notify_fd[2];
+    struct event notify_ev;
+};
 
-static void share_scan_schedule_event(share_scan_state_t *ctx);
+static share_scanner_t *scanner = NULL;
 
 static int share_skip_file(const char *filename)
 {
@@ -254,154 +319,418 @@ static char *share_scan_absolute_path(const char *dirpath,
     return filepath;
 }
 
-static void share_scan_push_directory(share_scan_state_t *ctx,
+/***** worker threads *****/
+
+static share_scan_batch_t *share_scan_batch_new(share_scan_state_t *ctx,
         const char *dirpath)
 {
-    share_scan_directory_t *d = calloc(1, sizeof(share_scan_directory_t));
-    d->dirpath = strdup(dirpath);
+    share_scan_batch_t *batch = malloc(sizeof(share_scan_batch_t) +
+            SHARE_SCAN_BATCH_INITIAL_SIZE * sizeof(share_scan_entry_t));
+    batch->ctx = ctx;
+    batch->dirpath = strdup(dirpath);
+    batch->error = 0;
+    batch->last = false;
+    batch->nentries = 0;
+    batch->size = SHARE_SCAN_BATCH_INITIAL_SIZE;
+    return batch;
+}
 
-    LIST_INSERT_HEAD(&ctx->directories, d, link);
+static void share_scan_batch_free(share_scan_batch_t *batch)
+{
+    unsigned i;
+    for(i = 0; i < batch->nentries; i++)
+        free(batch->entries[i].filename);
+    free(batch->dirpath);
+    free(batch);
 }
 
-/* Scans the files in the given directory and adds found files. Pushes any
- * subdirectories found to the ctx->directories stack. */
-static void share_scan_context(share_scan_state_t *ctx,
-        const char *dirpath)
+/* Hands over a batch to the main loop. */
+static void share_scan_post_batch(share_scanner_t *s, share_scan_batch_t *batch)
 {
-    DIR *fsdir;
-    struct dirent *dp;
+    pthread_mutex_lock(&s->lock);
+    TAILQ_INSERT_TAIL(&s->batches, batch, link);
+    pthread_mutex_unlock(&s->lock);
 
-    if(strcmp(dirpath, global_incomplete_directory) == 0)
+    /* Blocks if the main loop is too far behind, which is what we want. */
+    while(write(s->notify_fd[1], "", 1) == -1 && errno == EINTR)
+        ;
+}
+
+/* Called by a worker thread for each entry in a directory. May post the
+ * current batch and replace it with a new one. Must not log or touch any
+ * shared state.
+ */
+static void share_scan_visit(share_scanner_t *s, share_scan_batch_t **batchp,
+        int dirfd, const char *filename, int d_type)
+{
+    if(share_skip_file(filename))
+        return;
+
+    share_scan_batch_t *batch = *batchp;
+    if(batch->nentries == SHARE_SCAN_BATCH_SIZE)
     {
-	INFO("Refused to share incomplete download directory [%s]",
-	    dirpath);
+        *batchp = share_scan_batch_new(batch->ctx, batch->dirpath);
+        share_scan_post_batch(s, batch);
+        batch = *batchp;
+    }
+    else if(batch->nentries == batch->size)
+    {
+        unsigned size = batch->size * 2;
+        if(size > SHARE_SCAN_BATCH_SIZE)
+            size = SHARE_SCAN_BATCH_SIZE;
+        batch = realloc(batch, sizeof(share_scan_batch_t) +
+                size * sizeof(share_scan_entry_t));
+        batch->size = size;
+        *batchp = batch;
+    }
 
-	ui_send_status_message(NULL, NULL,
-	    "Refused to share incomplete download directory '%s'",
-	    dirpath);
+    share_scan_entry_t *e = &batch->entries[batch->nentries++];
+    e->filename = strdup(filename);
+    e->error = 0;
+    e->is_directory = false;
 
-	return;
+#ifdef DT_DIR
+    if(d_type == DT_DIR)
+    {
+        /* no need to stat directories */
+        e->is_directory = true;
+        return;
     }
-    /* DEBUG("scanning directory [%s]", dirpath); */
+#endif
+
+    /* follows symlinks, like stat() */
+    if(fstatat(dirfd, filename, &e->stbuf, 0) != 0)
+        e->error = errno;
+    else if(S_ISDIR(e->stbuf.st_mode))
+        e->is_directory = true;
+}
+
+#ifdef SYS_getdents64
+struct share_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
 
-    fsdir = opendir(dirpath);
-    if(fsdir == 0)
+static void share_scan_read_directory(share_scanner_t *s,
+        share_scan_state_t *ctx, const char *dirpath)
+{
+    share_scan_batch_t *batch = share_scan_batch_new(ctx, dirpath);
+
+    int dirfd = open(dirpath, O_RDONLY | O_DIRECTORY);
+    if(dirfd == -1)
     {
-        WARNING("%s: %s", dirpath, strerror(errno));
+        batch->error = errno;
+        batch->last = true;
+        share_scan_post_batch(s, batch);
         return;
     }
 
-    while((dp = readdir(fsdir)) != NULL)
+#ifdef SYS_getdents64
+    /* Read entries in large chunks, fewer round trips on network mounts. */
+    char buf[32 * 1024];
+    for(;;)
     {
-        const char *filename = dp->d_name;
-        if(share_skip_file(filename))
+        long n = syscall(SYS_getdents64, dirfd, buf, sizeof(buf));
+        if(n == -1)
         {
-            /* INFO("- skipping file %s/%s", dirpath, filename); */
-            continue;
+            batch->error = errno;
+            break;
         }
+        if(n == 0)
+            break;
 
-        char *filepath = share_scan_absolute_path(dirpath, filename);
-        if(filepath == NULL)
-            continue;
-
-        struct stat stbuf;
-        if(stat(filepath, &stbuf) == 0)
+        long pos;
+        for(pos = 0; pos < n; )
         {
-            if(S_ISDIR(stbuf.st_mode))
-            {
-                share_scan_push_directory(ctx, filepath);
-            }
-            else if(S_ISREG(stbuf.st_mode))
-            {
-                if(stbuf.st_size == 0)
-                    INFO("- skipping zero-sized file '%s'", filepath);
-                else
-                    share_scan_add_file(ctx, filepath, &stbuf);
-            }
-            else /* neither directory nor regular file */
-            {
-                INFO("- skipping file %s (not a regular file)", filename);
-            }
+            struct share_dirent64 *dp = (struct share_dirent64 *)(buf + pos);
+            share_scan_visit(s, &batch, dirfd, dp->d_name, dp->d_type);
+            pos += dp->d_reclen;
         }
-        else
+    }
+    close(dirfd);
+#else
+    DIR *fsdir = fdopendir(dirfd);
+    if(fsdir == NULL)
+    {
+        batch->error = errno;
+        close(dirfd);
+    }
+    else
+    {
+        struct dirent *dp;
+        while((dp = readdir(fsdir)) != NULL)
         {
-            /* stat failed */
-            WARNING("%s: %s", filepath, strerror(errno));
+#ifdef DT_DIR
+            share_scan_visit(s, &batch, dirfd, dp->d_name, dp->d_type);
+#else
+            share_scan_visit(s, &batch, dirfd, dp->d_name, 0);
+#endif
         }
-
-        free(filepath);
+        closedir(fsdir);
     }
-    closedir(fsdir);
+#endif
+
+    batch->last = true;
+    share_scan_post_batch(s, batch);
 }
 
-static void share_scan_event(int fd, short why, void *user_data)
+static void *share_scan_worker(void *arg)
 {
-    share_scan_state_t *ctx = user_data;
-    int i;
+    share_scanner_t *s = arg;
 
-    /* check if the share currently being scanned has been removed */
-    if(ctx->mp->removed)
+    for(;;)
     {
-	WARNING("aborting scanning of removed share [%s]", ctx->mp->local_root);
-	share_remove_mountpoint(ctx->share, ctx->mp);
-	ctx->share->scanning--;
-	free(ctx);
+        pthread_mutex_lock(&s->lock);
+        while(TAILQ_EMPTY(&s->directories))
+            pthread_cond_wait(&s->cond, &s->lock);
+        share_scan_directory_t *d = TAILQ_FIRST(&s->directories);
+        TAILQ_REMOVE(&s->directories, d, link);
+        pthread_mutex_unlock(&s->lock);
+
+        share_scan_read_directory(s, d->ctx, d->dirpath);
+
+        free(d->dirpath);
+        free(d);
+    }
+
+    return NULL;
+}
+
+/***** main loop side *****/
+
+static void share_scan_push_directory(share_scan_state_t *ctx,
+        const char *dirpath)
+{
+    if(strcmp(dirpath, global_incomplete_directory) == 0)
+    {
+	INFO("Refused to share incomplete download directory [%s]",
+	    dirpath);
+
+	ui_send_status_message(NULL, NULL,
+	    "Refused to share incomplete download directory '%s'",
+	    dirpath);
+
 	return;
     }
 
-    /* Scan 5 directories in each event. */
-    for(i = 0; i < 5; i++)
+    share_scan_directory_t *d = calloc(1, sizeof(share_scan_directory_t));
+    d->ctx = ctx;
+    d->dirpath = strdup(dirpath);
+
+    ctx->npending++;
+
+    pthread_mutex_lock(&scanner->lock);
+    TAILQ_INSERT_TAIL(&scanner->directories, d, link);
+    pthread_cond_signal(&scanner->cond);
+    pthread_mutex_unlock(&scanner->lock);
+}
+
+/* Removes directories of an aborted scan that no worker has picked up yet. */
+static void share_scan_cancel_directories(share_scan_state_t *ctx)
+{
+    share_scan_directory_t *d, *next;
+
+    pthread_mutex_lock(&scanner->lock);
+    for(d = TAILQ_FIRST(&scanner->directories); d; d = next)
     {
-        share_scan_directory_t *d = LIST_FIRST(&ctx->directories);
-        if(d == NULL)
+        next = TAILQ_NEXT(d, link);
+        if(d->ctx == ctx)
         {
-            INFO("Done scanning directory [%s]", ctx->mp->local_root);
-	    INFO("bloom filter is %.1f%% filled",
-		bloom_filled_percent(ctx->share->bloom));
-            nc_send_share_scan_finished_notification(nc_default(),
-                    ctx->mp->local_root);
-            ctx->share->uptodate = false;
-            ctx->mp->scan_in_progress = false;
-            free(ctx);
-
-	    ctx->share->scanning--;
-	    return_if_fail(ctx->share->scanning >= 0);
-
-            return;
+            TAILQ_REMOVE(&scanner->directories, d, link);
+            ctx->npending--;
+            free(d->dirpath);
+            free(d);
         }
+    }
+    pthread_mutex_unlock(&scanner->lock);
+}
 
-        char *dirpath = d->dirpath;
-        LIST_REMOVE(d, link);
-        free(d);
-
-        share_scan_context(ctx, dirpath);
-        free(dirpath);
+static void share_scan_finish(share_scan_state_t *ctx)
+{
+    if(ctx->mp->removed)
+    {
+	WARNING("aborted scanning of removed share [%s]", ctx->mp->local_root);
+	share_remove_mountpoint(ctx->share, ctx->mp);
+    }
+    else
+    {
+	INFO("Done scanning directory [%s]", ctx->mp->local_root);
+	INFO("bloom filter is %.1f%% filled",
+	    bloom_filled_percent(ctx->share->bloom));
+	nc_send_share_scan_finished_notification(nc_default(),
+		ctx->mp->local_root);
+	ctx->share->uptodate = false;
+	ctx->mp->scan_in_progress = false;
     }
 
-    share_scan_schedule_event(ctx);
+    ctx->share->scanning--;
+    return_if_fail(ctx->share->scanning >= 0);
+
+    if(event_initialized(&ctx->ev))
+	event_del(&ctx->ev);
+    free(ctx);
 }
 
-static void share_scan_schedule_event(share_scan_state_t *ctx)
+/* Adds the files found in one batch and pushes any subdirectories. */
+static void share_scan_handle_batch(share_scan_batch_t *batch)
 {
-    if(event_initialized(&ctx->ev))
+    share_scan_state_t *ctx = batch->ctx;
+    unsigned i;
+
+    /* check if the share currently being scanned has been removed */
+    if(ctx->mp->removed)
     {
-        event_del(&ctx->ev);
+	share_scan_cancel_directories(ctx);
     }
     else
     {
-        evtimer_set(&ctx->ev, share_scan_event, ctx);
+	if(batch->error)
+	    WARNING("%s: %s", batch->dirpath, strerror(batch->error));
+
+	for(i = 0; i < batch->nentries; i++)
+	{
+	    share_scan_entry_t *e = &batch->entries[i];
+
+	    char *filepath = share_scan_absolute_path(batch->dirpath,
+		e->filename);
+	    if(filepath == NULL)
+		continue;
+
+	    if(e->error)
+	    {
+		/* stat failed */
+		WARNING("%s: %s", filepath, strerror(e->error));
+	    }
+	    else if(e->is_directory)
+	    {
+		share_scan_push_directory(ctx, filepath);
+	    }
+	    else if(S_ISREG(e->stbuf.st_mode))
+	    {
+		if(e->stbuf.st_size == 0)
+		    INFO("- skipping zero-sized file '%s'", filepath);
+		else
+		    share_scan_add_file(ctx, filepath, &e->stbuf);
+	    }
+	    else /* neither directory nor regular file */
+	    {
+		INFO("- skipping file %s (not a regular file)", e->filename);
+	    }
+
+	    free(filepath);
+	}
+    }
+
+    if(batch->last)
+	ctx->npending--;
+    share_scan_batch_free(batch);
+
+    if(ctx->npending == 0)
+	share_scan_finish(ctx);
+}
+
+static void share_scan_event(int fd, short why, void *user_data)
+{
+    char buf[SHARE_SCAN_BATCHES_PER_EVENT];
+
+    /* One byte per batch, so we never process more than
+     * SHARE_SCAN_BATCHES_PER_EVENT batches before returning to the event
+     * loop. Any remaining bytes makes the event fire again. */
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if(n <= 0)
+        return;
+
+    while(n--)
+    {
+        pthread_mutex_lock(&scanner->lock);
+        share_scan_batch_t *batch = TAILQ_FIRST(&scanner->batches);
+        if(batch)
+            TAILQ_REMOVE(&scanner->batches, batch, link);
+        pthread_mutex_unlock(&scanner->lock);
+
+        return_if_fail(batch);
+        share_scan_handle_batch(batch);
     }
+}
+
+EP_EVENT_CALLBACK(share_scan_event)
+
+static int share_scanner_init(void)
+{
+    if(scanner)
+        return 0;
+
+    share_scanner_t *s = calloc(1, sizeof(share_scanner_t));
+    if(pipe(s->notify_fd) != 0)
+    {
+        WARNING("pipe: %s", strerror(errno));
+        free(s);
+        return -1;
+    }
+    io_set_blocking(s->notify_fd[0], 0);
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    TAILQ_INIT(&s->directories);
+    TAILQ_INIT(&s->batches);
 
-    struct timeval tv = {.tv_sec = 0, .tv_usec = 0};
-    event_add(&ctx->ev, &tv);
+    int i;
+    for(i = 0; i < SHARE_SCAN_NTHREADS; i++)
+    {
+        pthread_t thread;
+        int rc = pthread_create(&thread, NULL, share_scan_worker, s);
+        if(rc != 0)
+        {
+            WARNING("failed to start scanner thread: %s", strerror(rc));
+            break;
+        }
+        pthread_detach(thread);
+    }
+
+    if(i == 0)
+    {
+        /* try again on the next scan */
+        pthread_cond_destroy(&s->cond);
+        pthread_mutex_destroy(&s->lock);
+        close(s->notify_fd[0]);
+        close(s->notify_fd[1]);
+        free(s);
+        return -1;
+    }
+    DEBUG("started %i scanner threads", i);
+
+    event_set(&s->notify_ev, s->notify_fd[0], EV_READ | EV_PERSIST,
+            EP_PROFILED(share_scan_event), NULL);
+    event_add(&s->notify_ev, NULL);
+
+    /* only published once there are workers to scan the directories */
+    scanner = s;
+
+    return 0;
 }
 
+/* Used when there is nothing to scan. */
+static void share_scan_finish_event(int fd, short why, void *user_data)
+{
+    share_scan_finish(user_data);
+}
+
+EP_EVENT_CALLBACK(share_scan_finish_event)
+
 int share_scan(share_t *share, share_mountpoint_t *mp)
 {
     return_val_if_fail(share, -1);
     return_val_if_fail(mp, -1);
     return_val_if_fail(!mp->scan_in_progress, -1);
 
+    if(share_scanner_init() != 0)
+        return -1;
+
     /* Keep a counter to indicate for the myinfo update event that
      * we should wait until rescanning is done. Otherwise we risk
      * sending out a too low share size that gets us kicked.
@@ -410,7 +739,6 @@ int share_scan(share_t *share, share_mountpoint_t *mp)
 
     share_scan_state_t *ctx = calloc(1, sizeof(share_scan_state_t));
 
-    LIST_INIT(&ctx->directories);
     ctx->share = share;
     ctx->mp = mp;
 
@@ -419,8 +747,14 @@ int share_scan(share_t *share, share_mountpoint_t *mp)
     mp->scan_in_progress = true;
 
     share_scan_push_directory(ctx, mp->local_root);
-    share_scan_schedule_event(ctx);
+
+    if(ctx->npending == 0)
+    {
+        /* don't send the finished notification before we return */
+        evtimer_set(&ctx->ev, EP_PROFILED(share_scan_finish_event), ctx);
+        struct timeval tv = {.tv_sec = 0, .tv_usec = 0};
+        evtimer_add(&ctx->ev, &tv);
+    }
 
     return 0;
 }
-
@@ -194,6 +194,7 @@ share_search_t *share_search_parse_nmdc(const char *command,
             free(port_or_user);
             goto error;
         }
+        free(port_or_user);
     }
 
     int size_restricted = (*command == 'T');
@@ -143,6 +143,88 @@ fail:
     share_file_free(file);
 }
 
+/* Adds a file that already has a valid TTH in the TTH store (eg, a finished
+ * download that was hashed while downloading) directly to the hashed tree,
+ * without waiting for a rescan. Returns 0 if the file was added.
+ */
+int share_add_hashed_file(share_t *share, const char *local_path)
+{
+    return_val_if_fail(share, -1);
+    return_val_if_fail(local_path, -1);
+
+    share_mountpoint_t *mp = share_lookup_local_root(share, local_path);
+    if(mp == NULL || mp->scan_in_progress)
+    {
+	/* not shared, or the scanner will find it */
+	return -1;
+    }
+
+    if(share_lookup_file(share, local_path) ||
+       share_lookup_unhashed_file(share, local_path))
+    {
+	return -1;
+    }
+
+    struct stat stbuf;
+    if(stat(local_path, &stbuf) != 0)
+    {
+	WARNING("%s: %s", local_path, strerror(errno));
+	return -1;
+    }
+    if(!S_ISREG(stbuf.st_mode) || stbuf.st_size == 0)
+	return -1;
+
+    uint64_t inode = SHARE_STAT_TO_INODE((&stbuf));
+
+    struct tth_inode *ti = tth_store_lookup_inode(global_tth_store, inode);
+    if(ti == NULL || ti->mtime != stbuf.st_mtime)
+	return -1;
+
+    struct tth_entry *te = tth_store_lookup(global_tth_store, ti->tth);
+    if(te == NULL)
+	return -1;
+
+    if(share_lookup_file_by_inode(share, inode))
+	return -1;
+
+    mp->stats.ntotfiles++;
+    mp->stats.totsize += stbuf.st_size;
+
+    if(te->active_inode && te->active_inode != inode &&
+       share_lookup_file_by_inode(share, te->active_inode))
+    {
+	/* duplicate of an already shared file */
+	mp->stats.nduplicates++;
+	mp->stats.dupsize += stbuf.st_size;
+	return -1;
+    }
+    tth_store_set_active_inode(global_tth_store, ti->tth, inode);
+
+    share_file_t *file = calloc(1, sizeof(share_file_t));
+    file->partial_path = strdup(local_path + strlen(mp->local_root));
+    file->mp = mp;
+    file->type = share_filetype(file->partial_path);
+    file->size = stbuf.st_size;
+    file->inode = inode;
+
+    RB_INSERT(file_tree, &share->files, file);
+    share_add_to_inode_table(share, file);
+
+    mp->stats.nfiles++;
+    mp->stats.size += file->size;
+
+    char *filename = strrchr(file->partial_path, '/');
+    if(filename++ == NULL)
+	filename = file->partial_path;
+    bloom_add_filename(share->bloom, filename);
+
+    share->uptodate = false;
+
+    DEBUG("added hashed file [%s] with TTH %s", local_path, ti->tth);
+
+    return 0;
+}
+
 void share_tth_init_notifications(share_t *share)
 {
     nc_add_tth_available_observer(nc_default(),
@@ -370,6 +370,7 @@ int main(int argc, char **argv)
 
     sp_daemonize();
     sp_write_pid(working_directory, "sphashd");
+    sp_log_start_flusher();
 
     event_init();
 
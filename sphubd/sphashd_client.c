@@ -32,6 +32,7 @@
 #include "notifications.h"
 #include "sphashd_client.h"
 #include "globals.h"
+#include "event_profile.h"
 
 /* Request this many files each time we need to feed the hashing server */
 #define HASH_BATCH_SIZE 100
@@ -298,6 +299,10 @@ static void hs_handle_did_remove_share_notification(
 	}
 }
 
+EP_BUFFER_CALLBACK(hs_in_event)
+EP_BUFFER_CALLBACK(hs_out_event)
+EP_ERROR_CALLBACK(hs_err_event)
+
 int hs_start(void)
 {
     char *sphashd_socket_filename = 0;
@@ -330,7 +335,8 @@ int hs_start(void)
 
     DEBUG("adding hashing server on file descriptor %d", fd);
     global_hash_server->bufev = bufferevent_new(fd,
-            hs_in_event, hs_out_event, hs_err_event, global_hash_server);
+            EP_PROFILED(hs_in_event), EP_PROFILED(hs_out_event),
+            EP_PROFILED(hs_err_event), global_hash_server);
     bufferevent_enable(global_hash_server->bufev, EV_READ | EV_WRITE);
 
     /* register handler for share scan finished notification */
@@ -44,6 +44,9 @@
 #include "log.h"
 #include "extra_slots.h"
 #include "extip.h"
+#include "file_mover.h"
+#include "event_profile.h"
+#include "trace.h"
 
 void init(int fd, short why, void *data);
 
@@ -55,6 +58,8 @@ static void handle_share_rescan_event(int fd, short why, void *data)
     set_share_rescan_interval(-1);
 }
 
+EP_EVENT_CALLBACK(handle_share_rescan_event)
+
 void set_share_rescan_interval(int interval)
 {
     static struct event share_rescan_event;
@@ -66,7 +71,8 @@ void set_share_rescan_interval(int interval)
     }
     else
     {
-        evtimer_set(&share_rescan_event, handle_share_rescan_event, NULL);
+        evtimer_set(&share_rescan_event,
+                EP_PROFILED(handle_share_rescan_event), NULL);
     }
 
     if(interval < 0)
@@ -143,6 +149,8 @@ void download_trigger(int fd, short why, void *data)
     evtimer_add(data, &tv);
 }
 
+EP_EVENT_CALLBACK(cc_accept_connection)
+
 /* Start (or restart) the client listener on the given port. Returns 0 on
  * success, or -1 on failure. Specify port == 0 to close client listener.
  */
@@ -183,7 +191,7 @@ int start_client_listener(int port)
         DEBUG("adding client connection listener on file descriptor %d",
                 client_listener_fd);
         event_set(&client_listener_event, client_listener_fd,
-                EV_READ|EV_PERSIST, cc_accept_connection, NULL);
+                EV_READ|EV_PERSIST, EP_PROFILED(cc_accept_connection), NULL);
         event_add(&client_listener_event, NULL);
         started = 1;
         current_port = port;
@@ -265,6 +273,34 @@ void shutdown_sphubd(void)
     event_loopexit(NULL);
 }
 
+static void handle_download_moved(const char *source, const char *target,
+        int error, void *user_data)
+{
+    char *remove_directory = user_data;
+
+    if(error)
+    {
+        ui_send_status_message(NULL, NULL, "Unable to move file %s: %s",
+                source, strerror(error));
+    }
+    else
+    {
+        /* The file was hashed while downloading, share it right away.
+         * Files in moved directories are picked up by the next scan
+         * without rehashing. */
+        share_add_hashed_file(global_share, target);
+
+        if(remove_directory && rmdir(remove_directory) != 0)
+        {
+            ui_send_status_message(NULL, NULL,
+                    "Unable to remove directory %s: %s",
+                    remove_directory, strerror(errno));
+        }
+    }
+
+    free(remove_directory);
+}
+
 static void handle_download_finished_notification(nc_t *nc, const char *channel,
         nc_download_finished_t *notification, void *user_data)
 {
@@ -279,7 +315,14 @@ static void handle_download_finished_notification(nc_t *nc, const char *channel,
 
     if(strcmp(global_incomplete_directory, global_download_directory) == 0)
     {
-        /* same directory */
+        /* same directory, no need to move, but share it if possible */
+        char *path = 0;
+        if(asprintf(&path, "%s/%s", global_download_directory,
+                    notification->filename) != -1)
+        {
+            share_add_hashed_file(global_share, path);
+            free(path);
+        }
         return;
     }
 
@@ -342,42 +385,31 @@ static void handle_download_finished_notification(nc_t *nc, const char *channel,
 
     DEBUG("moving [%s] to download directory [%s]", source, target);
 
-    /* FIXME: using rename() to move the file assumes the incomplete and
-     * download directory reside on the same device.
-     */
-    if(rename(source, target) != 0)
-    {
-        ui_send_status_message(NULL, NULL, "Unable to move file %s: %s",
-                source, strerror(errno));
-    }
-    else
+    /* If this was the last file of a directory download, the (filesystem)
+     * directory in the incomplete directory is removed when done. */
+    char *remove_directory = NULL;
+    if(qd && qd->nleft == 1 && global_move_partial_directories)
     {
-        if(qd && qd->nleft == 1 && global_move_partial_directories)
-        {
-            /* the directory is complete, remove the (filesystem) directory */
-            char *target_directory;
-            num_returned_bytes = asprintf(&target_directory, "%s/%s", global_incomplete_directory, qd->target_directory);
-            if (num_returned_bytes == -1)
-                DEBUG("asprintf did not return anything");
-            if(rmdir(target_directory) != 0)
-            {
-                ui_send_status_message(NULL, NULL,
-                        "Unable to remove directory %s: %s",
-                        target_directory, strerror(errno));
-            }
-            free(target_directory);
-        }
+        num_returned_bytes = asprintf(&remove_directory, "%s/%s", global_incomplete_directory, qd->target_directory);
+        if (num_returned_bytes == -1)
+            DEBUG("asprintf did not return anything");
     }
 
+    /* If the incomplete and download directories are on different devices,
+     * the move is done asynchronously. */
+    file_mover_move(source, target, handle_download_moved, remove_directory);
+
     free(target);
     free(source);
 }
 
+EP_EVENT_CALLBACK(init)
+
 void schedule_init(void)
 {
     /* schedule initialization (database initialization, etc.) */
     static struct event init_event;
-    evtimer_set(&init_event, init, NULL);
+    evtimer_set(&init_event, EP_PROFILED(init), NULL);
     struct timeval tv = {.tv_sec = 0, .tv_usec = 0};
     evtimer_add(&init_event, &tv);
 }
@@ -403,6 +435,7 @@ void init(int fd, short why, void *data)
 
     case 3:
 	queue_init();
+	queue_db_enable_group_commit();
 	break;
 
     case 4:
@@ -433,6 +466,9 @@ void init(int fd, short why, void *data)
     schedule_init();
 }
 
+EP_EVENT_CALLBACK(ui_accept_connection)
+EP_EVENT_CALLBACK(download_trigger)
+
 int main(int argc, char **argv)
 {
     /* if non-positive, don't listen for UI connections on a TCP socket */
@@ -441,10 +477,11 @@ int main(int argc, char **argv)
     argv0_path = get_exec_path(argv[0]);
 
     int foreground = 0;
+    const char *trace_filename = NULL;
 
     const char *debug_level = "message";
     int c;
-    while((c = getopt(argc, argv, "w:d:fp:h")) != EOF)
+    while((c = getopt(argc, argv, "w:d:fp:t:h")) != EOF)
     {
         switch(c)
         {
@@ -460,10 +497,14 @@ int main(int argc, char **argv)
             case 'f':
                 foreground = 1;
                 break;
+            case 't':
+                trace_filename = optarg;
+                break;
             case 'h':
                 printf("syntax: sphubd -d <none|warning|message|info|debug>\n"
                         "               -w <working directory>\n"
                         "               -p <ui listen port>\n"
+                        "               -t <protocol trace file>\n"
 			"               -f\n");
                 return 2;
             case '?':
@@ -499,6 +540,9 @@ int main(int argc, char **argv)
     INFO("starting up, version = %s, log level = %s",
             VERSION, debug_level);
 
+    if(trace_filename)
+        trace_open(trace_filename);
+
     /* Put ourselves in the background
      */
     if(!foreground && sp_daemonize() != 0)
@@ -507,6 +551,7 @@ int main(int argc, char **argv)
         exit(1);
     }
     sp_write_pid(global_working_directory, "sphubd");
+    sp_log_start_flusher();
 
     /* Initialize the event library */
     event_init();
@@ -516,6 +561,9 @@ int main(int argc, char **argv)
     INFO("using libevent version %s, method %s",
             event_get_version(), event_get_method());
 
+    /* log callbacks that stall the event loop */
+    ep_start_lag_monitor();
+
     /* install signal handlers
      */
     struct event sigterm_event;
@@ -551,7 +599,7 @@ int main(int argc, char **argv)
     DEBUG("adding local UI listener on file descriptor %d", ui_fd);
     struct event ui_connect_event;
     event_set(&ui_connect_event, ui_fd, EV_READ|EV_PERSIST,
-            ui_accept_connection, NULL);
+            EP_PROFILED(ui_accept_connection), NULL);
     event_add(&ui_connect_event, NULL);
 
     if(ui_tcp_port > 0)
@@ -563,7 +611,7 @@ int main(int argc, char **argv)
             DEBUG("adding remote UI listener on file descriptor %d", ui_tcp_fd);
             struct event ui_tcp_connect_event;
             event_set(&ui_tcp_connect_event, ui_tcp_fd, EV_READ|EV_PERSIST,
-                    ui_accept_connection, NULL);
+                    EP_PROFILED(ui_accept_connection), NULL);
             event_add(&ui_tcp_connect_event, NULL);
         }
         else
@@ -582,7 +630,7 @@ int main(int argc, char **argv)
 
     DEBUG("starting download trigger");
     struct event download_trigger_event;
-    evtimer_set(&download_trigger_event, download_trigger,
+    evtimer_set(&download_trigger_event, EP_PROFILED(download_trigger),
             &download_trigger_event);
     struct timeval tv = {.tv_sec = 1, .tv_usec = 0};
     evtimer_add(&download_trigger_event, &tv);
@@ -607,6 +655,7 @@ int main(int argc, char **argv)
     tth_store_close();
     queue_close();
     extra_slots_close();
+    trace_close();
 
     free(global_working_directory);
     free(argv0_path);
@@ -0,0 +1,332 @@
+/*
+ * Copyright (c) 2008 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "trace.h"
+#include "log.h"
+#include "event_profile.h"
+
+/* buffered data is written at least this often */
+#define TRACE_FLUSH_INTERVAL 1000000 /* microseconds */
+
+bool trace_active = false;
+bool trace_replaying = false;
+
+static FILE *trace_fp = NULL;
+static uint64_t trace_last_usec;
+static uint64_t trace_last_flush;
+
+int trace_open(const char *filename)
+{
+    trace_close();
+
+    trace_fp = fopen(filename, "w");
+    if(trace_fp == NULL)
+    {
+        WARNING("%s: %s", filename, strerror(errno));
+        return -1;
+    }
+    setvbuf(trace_fp, NULL, _IOFBF, 64 * 1024);
+    fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_LEN, trace_fp);
+    /* sphubd forks when daemonizing; an unflushed magic would be written
+     * by both processes */
+    fflush(trace_fp);
+
+    trace_last_usec = trace_last_flush = ep_now();
+    trace_active = true;
+    INFO("writing protocol trace to %s", filename);
+
+    return 0;
+}
+
+void trace_close(void)
+{
+    if(trace_fp)
+    {
+        fclose(trace_fp);
+        trace_fp = NULL;
+    }
+    trace_active = false;
+}
+
+static void trace_put_varint(uint64_t value)
+{
+    while(value >= 0x80)
+    {
+        putc((value & 0x7F) | 0x80, trace_fp);
+        value >>= 7;
+    }
+    putc(value, trace_fp);
+}
+
+void trace_write(trace_source_t source, trace_type_t type, unsigned conn,
+        const char *data, size_t len)
+{
+    if(trace_fp == NULL)
+        return;
+
+    uint64_t now = ep_now();
+    trace_put_varint(now - trace_last_usec);
+    trace_last_usec = now;
+
+    putc(source | type << 4, trace_fp);
+    trace_put_varint(conn);
+    trace_put_varint(len);
+    fwrite(data, 1, len, trace_fp);
+
+    if(now - trace_last_flush >= TRACE_FLUSH_INTERVAL)
+    {
+        fflush(trace_fp);
+        trace_last_flush = now;
+    }
+
+    if(ferror(trace_fp))
+    {
+        WARNING("failed to write protocol trace, tracing disabled");
+        trace_close();
+    }
+}
+
+void trace_printf(trace_source_t source, trace_type_t type, unsigned conn,
+        const char *fmt, ...)
+{
+    if(trace_fp == NULL)
+        return;
+
+    char *data = 0;
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vasprintf(&data, fmt, ap);
+    va_end(ap);
+
+    if(len != -1)
+    {
+        trace_write(source, type, conn, data, len);
+        free(data);
+    }
+}
+
+struct trace_reader
+{
+    FILE *fp;
+    uint64_t usec;
+    char *data;
+    size_t size;
+};
+
+trace_reader_t *trace_reader_open(const char *filename)
+{
+    FILE *fp = fopen(filename, "r");
+    if(fp == NULL)
+        return NULL;
+
+    char magic[TRACE_MAGIC_LEN];
+    if(fread(magic, 1, TRACE_MAGIC_LEN, fp) != TRACE_MAGIC_LEN ||
+       memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0)
+    {
+        fclose(fp);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    trace_reader_t *reader = calloc(1, sizeof(trace_reader_t));
+    reader->fp = fp;
+
+    return reader;
+}
+
+void trace_reader_close(trace_reader_t *reader)
+{
+    if(reader)
+    {
+        fclose(reader->fp);
+        free(reader->data);
+        free(reader);
+    }
+}
+
+static int trace_get_varint(FILE *fp, uint64_t *value)
+{
+    uint64_t v = 0;
+    int shift;
+    for(shift = 0; shift < 64; shift += 7)
+    {
+        int c = getc(fp);
+        if(c == EOF)
+            return -1;
+        v |= (uint64_t)(c & 0x7F) << shift;
+        if((c & 0x80) == 0)
+        {
+            *value = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int trace_read(trace_reader_t *reader, trace_record_t *record)
+{
+    uint64_t delta, conn, len;
+
+    int c = getc(reader->fp);
+    if(c == EOF)
+        return 0;
+    ungetc(c, reader->fp);
+
+    if(trace_get_varint(reader->fp, &delta) != 0)
+        return -1;
+    int kind = getc(reader->fp);
+    if(kind == EOF)
+        return -1;
+    if(trace_get_varint(reader->fp, &conn) != 0 ||
+       trace_get_varint(reader->fp, &len) != 0 ||
+       len > SIZE_MAX - 1)
+        return -1;
+
+    if(len + 1 > reader->size)
+    {
+        char *data = realloc(reader->data, len + 1);
+        if(data == NULL)
+            return -1;
+        reader->data = data;
+        reader->size = len + 1;
+    }
+    if(fread(reader->data, 1, len, reader->fp) != len)
+        return -1;
+    reader->data[len] = 0;
+
+    reader->usec += delta;
+    record->usec = reader->usec;
+    record->source = kind & 0x0F;
+    record->type = kind >> 4;
+    record->conn = conn;
+    record->data = reader->data;
+    record->len = len;
+
+    return 1;
+}
+
+#ifdef TEST
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "unit_test.h"
+
+int main(void)
+{
+    sp_log_set_level("debug");
+
+    char filename[] = "/tmp/trace_test.XXXXXX";
+    int fd = mkstemp(filename);
+    fail_unless(fd != -1);
+    close(fd);
+
+    /* nothing is written unless the trace is open */
+    fail_unless(!trace_enabled());
+    trace_line(TRACE_HUB, TRACE_IN, 3, "$Lock foo|");
+
+    fail_unless(trace_open(filename) == 0);
+    fail_unless(trace_enabled());
+    trace_printf(TRACE_HUB, TRACE_OPEN, 3, "%s %s", "hub.example.com", "me");
+    trace_line(TRACE_HUB, TRACE_IN, 3, "$Search Hub:foo F?T?0?1?bar");
+    char big[300];
+    memset(big, 'x', sizeof(big));
+    trace_write(TRACE_UDP, TRACE_OUT, 200, big, sizeof(big));
+    trace_write(TRACE_CLIENT, TRACE_CLOSE, 4, "", 0);
+    trace_close();
+    fail_unless(!trace_enabled());
+
+    trace_reader_t *reader = trace_reader_open(filename);
+    fail_unless(reader);
+
+    trace_record_t rec;
+    fail_unless(trace_read(reader, &rec) == 1);
+    fail_unless(rec.source == TRACE_HUB && rec.type == TRACE_OPEN);
+    fail_unless(rec.conn == 3);
+    fail_unless(strcmp(rec.data, "hub.example.com me") == 0);
+    uint64_t usec = rec.usec;
+
+    fail_unless(trace_read(reader, &rec) == 1);
+    fail_unless(rec.type == TRACE_IN);
+    fail_unless(rec.len == strlen("$Search Hub:foo F?T?0?1?bar"));
+    fail_unless(strcmp(rec.data, "$Search Hub:foo F?T?0?1?bar") == 0);
+    fail_unless(rec.usec >= usec);
+
+    /* multi-byte varints */
+    fail_unless(trace_read(reader, &rec) == 1);
+    fail_unless(rec.source == TRACE_UDP && rec.type == TRACE_OUT);
+    fail_unless(rec.conn == 200);
+    fail_unless(rec.len == sizeof(big));
+    fail_unless(memcmp(rec.data, big, sizeof(big)) == 0);
+
+    fail_unless(trace_read(reader, &rec) == 1);
+    fail_unless(rec.source == TRACE_CLIENT && rec.type == TRACE_CLOSE);
+    fail_unless(rec.len == 0 && rec.data[0] == 0);
+
+    fail_unless(trace_read(reader, &rec) == 0);
+    trace_reader_close(reader);
+
+    /* a truncated trace is detected */
+    struct stat sb;
+    fail_unless(stat(filename, &sb) == 0);
+    fail_unless(truncate(filename, sb.st_size - 1) == 0);
+    reader = trace_reader_open(filename);
+    fail_unless(reader);
+    int i;
+    for(i = 0; i < 3; i++)
+        fail_unless(trace_read(reader, &rec) == 1);
+    fail_unless(trace_read(reader, &rec) == -1);
+    trace_reader_close(reader);
+
+    /* not a trace */
+    fail_unless(truncate(filename, 0) == 0);
+    fail_unless(trace_reader_open(filename) == NULL);
+
+    /* a process forked after opening the trace (like the daemonizing
+     * parent) doesn't write the magic again when it exits */
+    fail_unless(trace_open(filename) == 0);
+    pid_t pid = fork();
+    fail_unless(pid != -1);
+    if(pid == 0)
+        exit(0);
+    int status;
+    fail_unless(waitpid(pid, &status, 0) == pid);
+    fail_unless(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    trace_line(TRACE_HUB, TRACE_IN, 5, "$Hello me|");
+    trace_close();
+
+    reader = trace_reader_open(filename);
+    fail_unless(reader);
+    fail_unless(trace_read(reader, &rec) == 1);
+    fail_unless(rec.source == TRACE_HUB && rec.type == TRACE_IN);
+    fail_unless(rec.conn == 5);
+    fail_unless(strcmp(rec.data, "$Hello me|") == 0);
+    fail_unless(trace_read(reader, &rec) == 0);
+    trace_reader_close(reader);
+
+    unlink(filename);
+
+    return 0;
+}
+
+#endif
+
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2008 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _trace_h_
+#define _trace_h_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Binary protocol trace.
+ *
+ * When enabled (sphubd -t <file>), every line sent or received on hub,
+ * client and UDP connections is appended to a trace file, together with
+ * a timestamp and a connection id. The trace can be fed back into the
+ * command handlers with trace_tool.
+ *
+ * The file starts with TRACE_MAGIC, followed by records:
+ *
+ *   varint  microseconds since the previous record
+ *   byte    source | type << 4
+ *   varint  connection id (the file descriptor)
+ *   varint  length
+ *   bytes   data
+ *
+ * Varints are little-endian base 128.
+ */
+
+#define TRACE_MAGIC "SPTRACE1"
+#define TRACE_MAGIC_LEN 8
+
+typedef enum
+{
+    TRACE_HUB = 1,
+    TRACE_CLIENT = 2,
+    TRACE_UDP = 3,
+    TRACE_SEARCH = 4 /* search requests that responses are matched against */
+} trace_source_t;
+
+typedef enum
+{
+    TRACE_IN = 0,
+    TRACE_OUT = 1,
+    TRACE_OPEN = 2, /* data describes the connection */
+    TRACE_CLOSE = 3
+} trace_type_t;
+
+extern bool trace_active;
+
+/* true while trace_tool replays a trace; nothing is sent by UDP */
+extern bool trace_replaying;
+
+#define trace_enabled() (trace_active)
+
+int trace_open(const char *filename);
+void trace_close(void);
+void trace_write(trace_source_t source, trace_type_t type, unsigned conn,
+        const char *data, size_t len);
+void trace_printf(trace_source_t source, trace_type_t type, unsigned conn,
+        const char *fmt, ...)
+    __attribute__ (( format(printf, 4, 5) ));
+
+#define trace_line(source, type, conn, string) do { \
+        if(trace_enabled()) \
+            trace_write(source, type, conn, string, strlen(string)); \
+    } while(0)
+
+typedef struct trace_record trace_record_t;
+struct trace_record
+{
+    uint64_t usec; /* since the start of the trace */
+    trace_source_t source;
+    trace_type_t type;
+    unsigned conn;
+    char *data; /* nul-terminated, valid until the next trace_read */
+    size_t len;
+};
+
+typedef struct trace_reader trace_reader_t;
+
+trace_reader_t *trace_reader_open(const char *filename);
+void trace_reader_close(trace_reader_t *reader);
+
+/* Returns 1 if a record was read, 0 at end of file and -1 if the trace is
+ * corrupt or truncated.
+ */
+int trace_read(trace_reader_t *reader, trace_record_t *record);
+
+#endif
+
@@ -0,0 +1,462 @@
+/*
+ * Copyright (c) 2008 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Replays a protocol trace written by sphubd -t.
+ *
+ * Received hub, client and UDP lines are fed to the same command handlers
+ * as in sphubd, against a local share and without any network
+ * connections. Connections are attached to the read end of a pipe and
+ * their output is discarded. Lines that would make us connect somewhere ($ConnectToMe,
+ * $ForceMove) are skipped.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include <event.h>
+
+#include "client.h"
+#include "extra_slots.h"
+#include "globals.h"
+#include "hub.h"
+#include "log.h"
+#include "notifications.h"
+#include "queue.h"
+#include "queue_match.h"
+#include "search_listener.h"
+#include "share.h"
+#include "sphubd.h"
+#include "trace.h"
+#include "tthdb.h"
+#include "xstr.h"
+#include "event_profile.h"
+
+#define TRACE_NSOURCES 5
+#define TRACE_NTYPES 4
+
+static const char *source_names[TRACE_NSOURCES] = {
+    "?", "hub", "client", "udp", "search"
+};
+
+/* local file descriptors of connections, indexed by trace connection id */
+static int *replay_fds = NULL;
+static unsigned replay_nfds = 0;
+
+static int num_shares = 0;
+
+static uint64_t nrecords[TRACE_NSOURCES][TRACE_NTYPES];
+static uint64_t usec_spent[TRACE_NSOURCES];
+static uint64_t nskipped = 0;
+static uint64_t bytes_discarded = 0;
+
+/* sphubd.c isn't linked in */
+void set_share_rescan_interval(int interval)
+{
+}
+
+int start_client_listener(int port)
+{
+    return 0;
+}
+
+int start_search_listener(int port)
+{
+    return 0;
+}
+
+void shutdown_sphubd(void)
+{
+}
+
+static int replay_lookup_fd(unsigned conn)
+{
+    return conn < replay_nfds ? replay_fds[conn] : -1;
+}
+
+static int replay_open_fd(unsigned conn)
+{
+    /* something the event backend accepts, nothing is read or written */
+    int fds[2];
+    if(pipe(fds) != 0)
+    {
+        WARNING("pipe: %s", strerror(errno));
+        return -1;
+    }
+    close(fds[1]);
+    int fd = fds[0];
+
+    if(conn >= replay_nfds)
+    {
+        unsigned n = conn + 16;
+        replay_fds = realloc(replay_fds, n * sizeof(int));
+        while(replay_nfds < n)
+            replay_fds[replay_nfds++] = -1;
+    }
+
+    /* any connection still mapped to a reused descriptor is gone */
+    unsigned i;
+    for(i = 0; i < replay_nfds; i++)
+    {
+        if(replay_fds[i] == fd)
+            replay_fds[i] = -1;
+    }
+    replay_fds[conn] = fd;
+
+    return fd;
+}
+
+static void replay_forget_fd(unsigned conn)
+{
+    if(conn < replay_nfds)
+        replay_fds[conn] = -1;
+}
+
+static void replay_discard_output(struct bufferevent *bufev)
+{
+    struct evbuffer *output = EVBUFFER_OUTPUT(bufev);
+    bytes_discarded += EVBUFFER_LENGTH(output);
+    evbuffer_drain(output, EVBUFFER_LENGTH(output));
+}
+
+/* The event loop doesn't run while replaying, so output is never written.
+ */
+static void replay_discard_all_output(void)
+{
+    unsigned i;
+    for(i = 0; i < replay_nfds; i++)
+    {
+        int fd = replay_fds[i];
+        if(fd == -1)
+            continue;
+
+        hub_t *hub = hub_find_by_fd(fd);
+        if(hub && hub->bufev)
+        {
+            replay_discard_output(hub->bufev);
+            continue;
+        }
+
+        cc_t *cc = cc_find_by_fd(fd);
+        if(cc && cc->bufev)
+            replay_discard_output(cc->bufev);
+    }
+}
+
+static void replay_hub(trace_record_t *rec)
+{
+    hub_t *hub = NULL;
+    int fd = replay_lookup_fd(rec->conn);
+    if(fd != -1)
+        hub = hub_find_by_fd(fd);
+
+    if(rec->type == TRACE_OPEN)
+    {
+        char address[256], nick[256], encoding[64];
+        int passive;
+        if(sscanf(rec->data, "%255s %255s %d %63s",
+                    address, nick, &passive, encoding) != 4)
+        {
+            WARNING("invalid hub description [%s]", rec->data);
+            nskipped++;
+            return;
+        }
+
+        if((fd = replay_open_fd(rec->conn)) == -1)
+            return;
+
+        hub = hub_new();
+        hub->me = user_new(nick, NULL, "", "", "", 0ULL, hub);
+        hub->me->passive = passive;
+        hub->address = strdup(address);
+        hub->hubip = strdup("127.0.0.1");
+        hub_set_encoding(hub, encoding);
+        hub_list_add(hub);
+        hub_attach_io_channel(hub, fd);
+    }
+    else if(hub == NULL)
+    {
+        nskipped++;
+    }
+    else if(rec->type == TRACE_CLOSE)
+    {
+        hub->expected_disconnect = true;
+        hub_close_connection(hub);
+        replay_forget_fd(rec->conn);
+    }
+    else if(rec->type == TRACE_IN)
+    {
+        if(str_has_prefix(rec->data, "$ConnectToMe ") ||
+           str_has_prefix(rec->data, "$ForceMove "))
+        {
+            nskipped++;
+            return;
+        }
+        hub_dispatch_command(hub, rec->data);
+    }
+}
+
+static void replay_client(trace_record_t *rec)
+{
+    cc_t *cc = NULL;
+    int fd = replay_lookup_fd(rec->conn);
+    if(fd != -1)
+        cc = cc_find_by_fd(fd);
+
+    if(rec->type == TRACE_OPEN)
+    {
+        char direction[4], address[256];
+        if(sscanf(rec->data, "%3s %255s", direction, address) != 2)
+        {
+            WARNING("invalid client description [%s]", rec->data);
+            nskipped++;
+            return;
+        }
+
+        hub_t *hub = NULL;
+        if(strcmp(address, "-") != 0)
+            hub = hub_find_by_address(address);
+        bool incoming = strcmp(direction, "in") == 0 || hub == NULL;
+
+        if((fd = replay_open_fd(rec->conn)) == -1)
+            return;
+        cc_add_channel(fd, incoming, hub, NULL);
+    }
+    else if(cc == NULL)
+    {
+        nskipped++;
+    }
+    else if(rec->type == TRACE_CLOSE)
+    {
+        cc_close_connection(cc);
+        replay_forget_fd(rec->conn);
+    }
+    else if(rec->type == TRACE_IN && strcmp(rec->data, "ping") != 0)
+    {
+        /* same as cc_in_event */
+        int rc = client_execute_command(fd, cc, rec->data);
+        if(rc < 0 && cc_find_by_fd(fd) == cc)
+            cc_close_connection(cc);
+    }
+}
+
+static void replay_search(trace_record_t *rec)
+{
+    int id, type, size_restriction, n = 0;
+    uint64_t size;
+    if(sscanf(rec->data, "%d %d %d %"SCNu64" %n",
+                &id, &type, &size_restriction, &size, &n) != 4 || n == 0)
+    {
+        WARNING("invalid search request [%s]", rec->data);
+        nskipped++;
+        return;
+    }
+
+    search_request_t *sreq = search_listener_create_search_request(
+            rec->data + n, size, size_restriction, type, id);
+    if(sreq)
+        search_listener_add_request(global_search_listener, sreq);
+}
+
+static void replay_record(trace_record_t *rec)
+{
+    if(rec->source < TRACE_HUB || rec->source >= TRACE_NSOURCES ||
+       rec->type >= TRACE_NTYPES)
+    {
+        nskipped++;
+        return;
+    }
+    nrecords[rec->source][rec->type]++;
+
+    /* our own output is produced again by the replay */
+    if(rec->type == TRACE_OUT && rec->source != TRACE_SEARCH)
+        return;
+
+    uint64_t start = ep_now();
+
+    switch(rec->source)
+    {
+        case TRACE_HUB:
+            replay_hub(rec);
+            break;
+        case TRACE_CLIENT:
+            replay_client(rec);
+            break;
+        case TRACE_UDP:
+            if(rec->type == TRACE_IN)
+                search_listener_handle_response(global_search_listener,
+                        rec->data);
+            break;
+        case TRACE_SEARCH:
+            replay_search(rec);
+            break;
+    }
+
+    replay_discard_all_output();
+    usec_spent[rec->source] += ep_now() - start;
+}
+
+static void handle_share_scan_finished_notification(nc_t *nc,
+        const char *channel, nc_share_scan_finished_t *data, void *user_data)
+{
+    INFO("done scanning %s", data->path);
+    num_shares--;
+}
+
+static void print_stats(uint64_t total_usec, uint64_t trace_usec)
+{
+    int i;
+    uint64_t total = 0;
+
+    printf("%-8s %10s %10s %10s %10s %12s\n",
+            "source", "in", "out", "open", "close", "time (ms)");
+    for(i = TRACE_HUB; i < TRACE_NSOURCES; i++)
+    {
+        printf("%-8s %10"PRIu64" %10"PRIu64" %10"PRIu64" %10"PRIu64
+                " %12.1f\n", source_names[i],
+                nrecords[i][TRACE_IN], nrecords[i][TRACE_OUT],
+                nrecords[i][TRACE_OPEN], nrecords[i][TRACE_CLOSE],
+                usec_spent[i] / 1000.0);
+        int j;
+        for(j = 0; j < TRACE_NTYPES; j++)
+            total += nrecords[i][j];
+    }
+
+    printf("replayed %"PRIu64" records (%"PRIu64" skipped) in %.1f ms,"
+            " traced over %.1f s\n",
+            total, nskipped, total_usec / 1000.0, trace_usec / 1e6);
+    if(total_usec)
+        printf("%.0f records/s, %"PRIu64" bytes of output discarded\n",
+                total * 1e6 / total_usec, bytes_discarded);
+}
+
+int main(int argc, char **argv)
+{
+    const char *debug_level = "warning";
+    int c;
+    char **shared_paths = calloc(argc, sizeof(char *));
+    int nshared_paths = 0;
+
+    while((c = getopt(argc, argv, "w:d:s:h")) != EOF)
+    {
+        switch(c)
+        {
+            case 'w':
+                global_working_directory = verify_working_directory(optarg);
+                break;
+            case 'd':
+                debug_level = optarg;
+                break;
+            case 's':
+                shared_paths[nshared_paths++] = optarg;
+                break;
+            case 'h':
+                printf("syntax: trace_tool [-h] [-w DIR] [-d level]"
+                        " [-s shared path] ... tracefile\n");
+                return 0;
+            case '?':
+            default:
+                return 2;
+        }
+    }
+
+    if(optind != argc - 1)
+    {
+        fprintf(stderr, "no trace file given\n");
+        return 2;
+    }
+
+    if(global_working_directory == NULL)
+        global_working_directory = strdup("/tmp");
+    global_incomplete_directory = global_working_directory;
+    global_download_directory = global_working_directory;
+    global_id_generator = strdup("ShakesPeer");
+    global_id_tag = strdup("SP");
+    global_id_lock = strdup("ShakesPeer");
+    global_id_version = strdup("trace");
+
+    sp_log_set_level(debug_level);
+
+    trace_reader_t *reader = trace_reader_open(argv[optind]);
+    if(reader == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    event_init();
+
+    hub_list_init();
+    cc_list_init();
+    ui_list_init();
+    extra_slots_init();
+    tth_store_init();
+    queue_init();
+    queue_match_init();
+
+    global_share = share_new();
+    assert(global_share);
+    share_tth_init_notifications(global_share);
+    global_search_listener = search_listener_new(0);
+
+    /* scan the share before replaying, so it's searchable */
+    nc_add_share_scan_finished_observer(nc_default(),
+            handle_share_scan_finished_notification, NULL);
+    int i;
+    for(i = 0; i < nshared_paths; i++)
+    {
+        str_trim_end_inplace(shared_paths[i], "/");
+        if(share_add(global_share, shared_paths[i]) == 0)
+            num_shares++;
+    }
+    while(num_shares > 0)
+        event_loop(EVLOOP_ONCE);
+
+    trace_replaying = true;
+
+    trace_record_t rec;
+    int rc;
+    uint64_t start = ep_now();
+    uint64_t trace_usec = 0;
+    while((rc = trace_read(reader, &rec)) == 1)
+    {
+        replay_record(&rec);
+        trace_usec = rec.usec;
+    }
+    uint64_t total_usec = ep_now() - start;
+
+    if(rc == -1)
+        fprintf(stderr, "%s: trace is truncated or corrupt\n", argv[optind]);
+
+    trace_reader_close(reader);
+    print_stats(total_usec, trace_usec);
+
+    cc_close_all_connections();
+    hub_close_all_connections();
+    tth_store_close();
+    queue_close();
+    extra_slots_close();
+    free(shared_paths);
+    free(replay_fds);
+
+    return rc == -1 ? 1 : 0;
+}
+
@@ -44,6 +44,14 @@
 #include "xstr.h"
 #include "dstring.h"
 #include "extip.h"
+#include "event_profile.h"
+
+static void ui_queue_user_login(user_t *user, void *user_data)
+{
+    ui_t *ui = user_data;
+
+    ui_send_user_event(ui, UI_USER_LOGIN, user->hub, user->nick);
+}
 
 static void ui_send_hub_state(hub_t *hub, void *user_data)
 {
@@ -54,17 +62,7 @@ static void ui_send_hub_state(hub_t *hub, void *user_data)
 
     DEBUG("sending nick list on hub '%s' to file descriptor %d",
             hub->address, hub->fd);
-    int i;
-    for(i = 0; i < HUB_USER_NHASH; i++)
-    {
-        user_t *user;
-        LIST_FOREACH(user, &hub->users[i], link)
-        {
-            ui_send_user_login(ui, hub->address, user->nick,
-                    user->description, user->tag, user->speed, user->email,
-                    user->shared_size, user->is_operator, user->extra_slots);
-        }
-    }
+    hub_foreach_user(hub, ui_queue_user_login, ui);
 
     DEBUG("sending user-commands");
     hub_user_command_t *uc;
@@ -222,8 +220,15 @@ static void ui_in_event(struct bufferevent *bufev, void *data)
     }
 }
 
+/* Called when the output has drained below the low water mark. User
+ * events held back by congestion are sent now, others wait for the timer.
+ */
 static void ui_out_event(struct bufferevent *bufev, void *data)
 {
+    ui_t *ui = data;
+
+    if(ui->user_queue_held)
+        ui_flush_user_events(ui);
 }
 
 static void ui_err_event(struct bufferevent *bufev, short why, void *data)
@@ -803,6 +808,57 @@ static int ui_cb_set_auto_search(ui_t *ui, int enabled)
     return 0;
 }
 
+static int ui_cb_set_download_direct_io(ui_t *ui, int enabled)
+{
+    global_download_direct_io = enabled;
+    return 0;
+}
+
+/* Bandwidth limits are in bytes per second, 0 means unlimited. */
+static int ui_cb_set_bandwidth_limit(ui_t *ui,
+        unsigned int upload, unsigned int download)
+{
+    bw_set_global_limit(BW_UPLOAD, upload);
+    bw_set_global_limit(BW_DOWNLOAD, download);
+    return 0;
+}
+
+static int ui_cb_set_hub_bandwidth_limit(ui_t *ui, const char *hub_address,
+        unsigned int upload, unsigned int download)
+{
+    hub_t *hub = hub_find_by_address(hub_address);
+    if(hub == 0)
+        WARNING("hub not found: '%s'", hub_address);
+    else
+    {
+        bw_bucket_set_rate(&hub->bw[BW_UPLOAD], upload);
+        bw_bucket_set_rate(&hub->bw[BW_DOWNLOAD], download);
+    }
+    return 0;
+}
+
+static int ui_cb_set_connection_bandwidth_limit(ui_t *ui,
+        unsigned int upload, unsigned int download)
+{
+    cc_set_bandwidth_limit(BW_UPLOAD, upload);
+    cc_set_bandwidth_limit(BW_DOWNLOAD, download);
+    return 0;
+}
+
+/* 0 disables the cache */
+static int ui_cb_set_upload_cache_size(ui_t *ui, unsigned int megabytes)
+{
+    uc_set_size((uint64_t)megabytes * 1024 * 1024);
+    return 0;
+}
+
+/* 0 never reclaims slots from slow uploads */
+static int ui_cb_set_slot_min_rate(ui_t *ui, unsigned int bytes_per_sec)
+{
+    hub_set_slot_min_rate(bytes_per_sec);
+    return 0;
+}
+
 static int ui_cb_set_hash_prio(ui_t *ui, unsigned int prio)
 {
     hs_set_prio(prio);
@@ -847,6 +903,77 @@ static int ui_cb_expect_shared_paths(ui_t *ui, int expected_shared_paths)
 	return 0;
 }
 
+static void ui_send_event_stats_for_probe(ep_probe_t *probe, void *user_data)
+{
+    ui_t *ui = user_data;
+
+    char *histogram = ep_histogram_string(probe);
+    ui_send_event_stats(ui, probe->name, probe->count, probe->total_usec,
+            probe->max_usec, histogram);
+    free(histogram);
+}
+
+static int ui_cb_event_stats(ui_t *ui)
+{
+    ep_foreach_probe(ui_send_event_stats_for_probe, ui);
+    return 0;
+}
+
+static int ui_cb_slow_callback_threshold(ui_t *ui, unsigned int msec)
+{
+    ep_set_slow_threshold(msec);
+    return 0;
+}
+
+static int ui_cb_search_listener_stats(ui_t *ui)
+{
+    search_listener_t *sl = global_search_listener;
+    if(sl)
+    {
+        ui_send_search_listener_stats(ui, sl->stats.datagrams,
+                sl->stats.batches, sl->stats.max_burst,
+                sl->stats.truncated, sl->stats.dropped);
+    }
+    return 0;
+}
+
+static void ui_send_transfer_rates_for(ui_t *ui, const char *hub_address,
+        rate_meter_t *rate)
+{
+    uint64_t now = ep_now();
+    ui_send_transfer_rates(ui, hub_address,
+            rm_rate(&rate[BW_UPLOAD], now, RM_1S),
+            rm_rate(&rate[BW_UPLOAD], now, RM_10S),
+            rm_rate(&rate[BW_UPLOAD], now, RM_60S),
+            rm_rate(&rate[BW_DOWNLOAD], now, RM_1S),
+            rm_rate(&rate[BW_DOWNLOAD], now, RM_10S),
+            rm_rate(&rate[BW_DOWNLOAD], now, RM_60S));
+}
+
+static void ui_send_transfer_rates_for_hub(hub_t *hub, void *user_data)
+{
+    ui_send_transfer_rates_for(user_data, hub->address, hub->rate);
+}
+
+/* Sends the rates of each hub, and the totals with an empty hub address. */
+static int ui_cb_transfer_rates(ui_t *ui)
+{
+    hub_foreach(ui_send_transfer_rates_for_hub, ui);
+
+    rate_meter_t total[2];
+    total[BW_UPLOAD] = *rm_global(BW_UPLOAD);
+    total[BW_DOWNLOAD] = *rm_global(BW_DOWNLOAD);
+    ui_send_transfer_rates_for(ui, "", total);
+
+    return 0;
+}
+
+static int ui_cb_set_user_batching(ui_t *ui, int enabled)
+{
+    ui->user_batching = enabled;
+    return 0;
+}
+
 void ui_send_state_event(int fd, short condition, void *data)
 {
     ui_t *ui = data;
@@ -863,6 +990,11 @@ void ui_send_state_event(int fd, short condition, void *data)
 	ui_send_state(ui);
 }
 
+EP_BUFFER_CALLBACK(ui_in_event)
+EP_BUFFER_CALLBACK(ui_out_event)
+EP_ERROR_CALLBACK(ui_err_event)
+EP_EVENT_CALLBACK(ui_send_state_event)
+
 void ui_accept_connection(int fd, short condition, void *data)
 {
     int afd = io_accept_connection(fd);
@@ -915,13 +1047,27 @@ void ui_accept_connection(int fd, short condition, void *data)
     ui->cb_set_download_directory = ui_cb_set_download_directory;
     ui->cb_set_incomplete_directory = ui_cb_set_incomplete_directory;
     ui->cb_expect_shared_paths = ui_cb_expect_shared_paths;
+    ui->cb_event_stats = ui_cb_event_stats;
+    ui->cb_slow_callback_threshold = ui_cb_slow_callback_threshold;
+    ui->cb_search_listener_stats = ui_cb_search_listener_stats;
+    ui->cb_set_user_batching = ui_cb_set_user_batching;
+    ui->cb_set_download_direct_io = ui_cb_set_download_direct_io;
+    ui->cb_set_bandwidth_limit = ui_cb_set_bandwidth_limit;
+    ui->cb_set_hub_bandwidth_limit = ui_cb_set_hub_bandwidth_limit;
+    ui->cb_set_connection_bandwidth_limit =
+        ui_cb_set_connection_bandwidth_limit;
+    ui->cb_set_upload_cache_size = ui_cb_set_upload_cache_size;
+    ui->cb_transfer_rates = ui_cb_transfer_rates;
+    ui->cb_set_slot_min_rate = ui_cb_set_slot_min_rate;
 
     /* add the channel to the list of connected uis.  */
     DEBUG("adding new ui on file descriptor %d", afd);
 
     /* add the channel to the event loop */
     ui->bufev = bufferevent_new(ui->fd,
-            ui_in_event, ui_out_event, ui_err_event, ui);
+            EP_PROFILED(ui_in_event), EP_PROFILED(ui_out_event),
+            EP_PROFILED(ui_err_event), ui);
+    bufferevent_setwatermark(ui->bufev, EV_WRITE, UI_OUTPUT_LOW_WATER, 0);
     bufferevent_enable(ui->bufev, EV_READ | EV_WRITE);
 
     ui_add(ui);
@@ -929,7 +1075,7 @@ void ui_accept_connection(int fd, short condition, void *data)
     ui_send_init_completion(ui, global_init_completion);
     ui_send_port(ui, global_port);
 
-    evtimer_set(&ui->send_state_event, ui_send_state_event, ui);
+    evtimer_set(&ui->send_state_event, EP_PROFILED(ui_send_state_event), ui);
     struct timeval tv = {.tv_sec = 0, .tv_usec = 0};
     evtimer_add(&ui->send_state_event, &tv);
 }
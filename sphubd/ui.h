@@ -26,6 +26,22 @@
 #include "hub.h"
 #include "ui_cmd.h"
 #include "ui_send.h"
+#include "ui_user_queue.h"
+
+/* User list events are queued and coalesced for this long before they
+ * are sent to a UI.
+ */
+#define UI_USER_FLUSH_INTERVAL 100 /* milliseconds */
+
+/* max number of users in a user-login-batch */
+#define UI_USER_BATCH_SIZE 256
+
+/* Queued user list events are held back while this much output is
+ * waiting to be written to a UI, until it has drained below the low water
+ * mark.
+ */
+#define UI_OUTPUT_HIGH_WATER (256 * 1024)
+#define UI_OUTPUT_LOW_WATER (64 * 1024)
 
 void ui_list_init(void);
 
@@ -44,5 +60,9 @@ int ui_send_command(ui_t *ui, const char *fmt, ...)
 
 void ui_schedule_share_stats_update(void);
 
+void ui_send_user_event(ui_t *ui, ui_user_event_t event, hub_t *hub,
+        const char *nick);
+void ui_flush_user_events(ui_t *ui);
+
 #endif
 
@@ -19,6 +19,7 @@
  */
 
 #include <assert.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -33,6 +34,10 @@
 #include "notifications.h"
 #include "hub.h"
 #include "globals.h"
+#include "event_profile.h"
+#include "dstring.h"
+#include "xstr.h"
+#include "spclient.h"
 
 LIST_HEAD(, ui) ui_list_head;
 
@@ -48,13 +53,15 @@ void ui_share_stats_update_event(int fd, short why, void *user_data)
     ui_send_share_stats_for_root(NULL, NULL);
 }
 
+EP_EVENT_CALLBACK(ui_share_stats_update_event)
+
 void ui_schedule_share_stats_update(void)
 {
     static struct event ev;
 
     if(!event_initialized(&ev))
     {
-        evtimer_set(&ev, ui_share_stats_update_event, NULL);
+        evtimer_set(&ev, EP_PROFILED(ui_share_stats_update_event), NULL);
     }
 
     if(!event_pending(&ev, EV_TIMEOUT, NULL))
@@ -222,10 +229,7 @@ static void handle_extra_slot_granted_notification(nc_t *nc,
         if(user)
         {
             user->extra_slots = notification->extra_slots;
-            ui_send_user_update(NULL, hub->address, notification->nick,
-		    user->description,
-                    user->tag, user->speed, user->email, user->shared_size,
-                    user->is_operator, user->extra_slots);
+            ui_send_user_event(NULL, UI_USER_UPDATE, hub, user->nick);
         }
     }
 }
@@ -282,6 +286,11 @@ void ui_free(ui_t *ui)
 {
     if(ui)
     {
+        if(ui->user_queue)
+        {
+            evtimer_del(&ui->user_flush_event);
+            ui_user_queue_free(ui->user_queue);
+        }
         free(ui);
     }
 }
@@ -343,3 +352,166 @@ int ui_send_command(ui_t *ui, const char *fmt, ...)
     return 0;
 }
 
+static bool ui_output_congested(ui_t *ui)
+{
+    return EVBUFFER_LENGTH(EVBUFFER_OUTPUT(ui->bufev)) >= UI_OUTPUT_HIGH_WATER;
+}
+
+static void ui_user_flush_event(int fd, short why, void *data)
+{
+    ui_flush_user_events(data);
+}
+
+EP_EVENT_CALLBACK(ui_user_flush_event)
+
+static void ui_queue_user_event(ui_t *ui, ui_user_event_t event,
+        const char *hub_address, const char *nick)
+{
+    if(ui->user_queue == NULL)
+    {
+        ui->user_queue = ui_user_queue_new();
+        evtimer_set(&ui->user_flush_event,
+                EP_PROFILED(ui_user_flush_event), ui);
+    }
+
+    ui_user_queue_add(ui->user_queue, event, hub_address, nick);
+
+    /* a congested ui is flushed from the write callback instead */
+    if(!event_pending(&ui->user_flush_event, EV_TIMEOUT, NULL) &&
+            !ui_output_congested(ui))
+    {
+        struct timeval tv = {.tv_sec = 0,
+            .tv_usec = UI_USER_FLUSH_INTERVAL * 1000};
+        evtimer_add(&ui->user_flush_event, &tv);
+    }
+}
+
+/* Queues a user login, update or logout to be sent to the ui, or to all
+ * uis if ui is NULL. The user's current info is looked up when the queue
+ * is flushed.
+ */
+void ui_send_user_event(ui_t *ui, ui_user_event_t event, hub_t *hub,
+        const char *nick)
+{
+    return_if_fail(hub);
+    return_if_fail(nick);
+
+    if(ui)
+    {
+        ui_queue_user_event(ui, event, hub->address, nick);
+    }
+    else
+    {
+        LIST_FOREACH(ui, &ui_list_head, next)
+        {
+            ui_queue_user_event(ui, event, hub->address, nick);
+        }
+    }
+}
+
+typedef struct ui_user_batch ui_user_batch_t;
+struct ui_user_batch
+{
+    char *hub_address;
+    unsigned count;
+    dstring_t *users;
+};
+
+static void ui_user_batch_send(ui_t *ui, ui_user_batch_t *batch)
+{
+    if(batch->count > 0)
+    {
+        ui_send_user_login_batch(ui, batch->hub_address, batch->count,
+                batch->users->string);
+        free(batch->hub_address);
+        batch->hub_address = NULL;
+        batch->count = 0;
+        dstring_free(batch->users, 1);
+        batch->users = NULL;
+    }
+}
+
+static void ui_user_batch_add(ui_t *ui, ui_user_batch_t *batch,
+        user_t *user)
+{
+    if(batch->count > 0 && strcmp(batch->hub_address, user->hub->address) != 0)
+        ui_user_batch_send(ui, batch);
+
+    if(batch->count == 0)
+    {
+        batch->hub_address = xstrdup(user->hub->address);
+        batch->users = dstring_new(NULL);
+    }
+    else
+        dstring_append(batch->users, SP_BATCH_RECORD_SEP);
+
+    sp_user_batch_append(batch->users, user->nick, user->description,
+            user->tag, user->speed, user->email, user->shared_size,
+            user->is_operator, user->extra_slots);
+
+    if(++batch->count >= UI_USER_BATCH_SIZE)
+        ui_user_batch_send(ui, batch);
+}
+
+/* Sends the queued user events to the ui, until its output is congested.
+ * Logins are sent in batches if the ui has enabled user batching.
+ */
+void ui_flush_user_events(ui_t *ui)
+{
+    if(ui->user_queue == NULL)
+        return;
+
+    ui_user_batch_t batch = {.hub_address = NULL, .count = 0, .users = NULL};
+    ui->user_queue_held = 0;
+
+    ui_user_entry_t *entry;
+    while((entry = ui_user_queue_first(ui->user_queue)) != NULL)
+    {
+        if(batch.count == 0 && ui_output_congested(ui))
+        {
+            DEBUG("ui on fd %d congested, holding back %u user events",
+                    ui->fd, ui_user_queue_length(ui->user_queue));
+            ui->user_queue_held = 1;
+            break;
+        }
+
+        if(entry->event == UI_USER_LOGOUT)
+        {
+            ui_user_batch_send(ui, &batch);
+            ui_send_user_logout(ui, entry->hub_address, entry->nick);
+        }
+        else
+        {
+            /* the hub may have been disconnected since */
+            hub_t *hub = hub_find_by_address(entry->hub_address);
+            user_t *user = hub ? hub_lookup_user(hub, entry->nick) : NULL;
+            if(user == NULL)
+            {
+                /* ignore */
+            }
+            else if(entry->event == UI_USER_LOGIN && ui->user_batching)
+            {
+                ui_user_batch_add(ui, &batch, user);
+            }
+            else
+            {
+                ui_user_batch_send(ui, &batch);
+                if(entry->event == UI_USER_LOGIN)
+                    ui_send_user_login(ui, hub->address, user->nick,
+                            user->description, user->tag, user->speed,
+                            user->email, user->shared_size,
+                            user->is_operator, user->extra_slots);
+                else
+                    ui_send_user_update(ui, hub->address, user->nick,
+                            user->description, user->tag, user->speed,
+                            user->email, user->shared_size,
+                            user->is_operator, user->extra_slots);
+            }
+        }
+
+        ui_user_queue_remove(ui->user_queue, entry);
+    }
+
+    ui_user_batch_send(ui, &batch);
+}
+
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2008 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ui_user_queue.h"
+#include "log.h"
+#include "xstr.h"
+
+RB_HEAD(ui_user_tree, ui_user_entry);
+
+struct ui_user_queue
+{
+    struct ui_user_tree entries;
+    TAILQ_HEAD(, ui_user_entry) order;
+    unsigned length;
+    unsigned coalesced; /* events merged into an already queued one */
+};
+
+static int ui_user_entry_cmp(ui_user_entry_t *a, ui_user_entry_t *b)
+{
+    int rc = strcmp(a->hub_address, b->hub_address);
+    if(rc == 0)
+        rc = strcmp(a->nick, b->nick);
+    return rc;
+}
+
+RB_PROTOTYPE(ui_user_tree, ui_user_entry, node, ui_user_entry_cmp);
+RB_GENERATE(ui_user_tree, ui_user_entry, node, ui_user_entry_cmp);
+
+ui_user_queue_t *ui_user_queue_new(void)
+{
+    ui_user_queue_t *queue = calloc(1, sizeof(ui_user_queue_t));
+    RB_INIT(&queue->entries);
+    TAILQ_INIT(&queue->order);
+    return queue;
+}
+
+void ui_user_queue_free(ui_user_queue_t *queue)
+{
+    if(queue)
+    {
+        ui_user_entry_t *entry;
+        while((entry = TAILQ_FIRST(&queue->order)) != NULL)
+            ui_user_queue_remove(queue, entry);
+        free(queue);
+    }
+}
+
+/* Merges a new event for a user into the queued one. The UI knows about
+ * a user if a queued update or logout is pending for it, but not if a
+ * login is pending. Returns -1 if the events cancel out.
+ */
+static int ui_user_coalesce(ui_user_event_t queued, ui_user_event_t event)
+{
+    switch(queued)
+    {
+        case UI_USER_LOGIN:
+            if(event == UI_USER_LOGOUT)
+                return -1;
+            return UI_USER_LOGIN;
+        case UI_USER_UPDATE:
+            return event;
+        case UI_USER_LOGOUT:
+        default:
+            if(event == UI_USER_LOGOUT)
+                return UI_USER_LOGOUT;
+            /* logged in again before the logout was sent */
+            return UI_USER_UPDATE;
+    }
+}
+
+void ui_user_queue_add(ui_user_queue_t *queue, ui_user_event_t event,
+        const char *hub_address, const char *nick)
+{
+    return_if_fail(queue);
+    return_if_fail(hub_address);
+    return_if_fail(nick);
+
+    ui_user_entry_t find;
+    find.hub_address = (char *)hub_address;
+    find.nick = (char *)nick;
+
+    ui_user_entry_t *entry = RB_FIND(ui_user_tree, &queue->entries, &find);
+    if(entry)
+    {
+        queue->coalesced++;
+        int merged = ui_user_coalesce(entry->event, event);
+        if(merged == -1)
+            ui_user_queue_remove(queue, entry);
+        else
+            entry->event = merged;
+        return;
+    }
+
+    entry = calloc(1, sizeof(ui_user_entry_t));
+    entry->event = event;
+    entry->hub_address = xstrdup(hub_address);
+    entry->nick = xstrdup(nick);
+    RB_INSERT(ui_user_tree, &queue->entries, entry);
+    TAILQ_INSERT_TAIL(&queue->order, entry, link);
+    queue->length++;
+}
+
+ui_user_entry_t *ui_user_queue_first(ui_user_queue_t *queue)
+{
+    return TAILQ_FIRST(&queue->order);
+}
+
+/* Removes and frees the entry. */
+void ui_user_queue_remove(ui_user_queue_t *queue, ui_user_entry_t *entry)
+{
+    RB_REMOVE(ui_user_tree, &queue->entries, entry);
+    TAILQ_REMOVE(&queue->order, entry, link);
+    queue->length--;
+    free(entry->hub_address);
+    free(entry->nick);
+    free(entry);
+}
+
+unsigned ui_user_queue_length(ui_user_queue_t *queue)
+{
+    return queue->length;
+}
+
+unsigned ui_user_queue_coalesced(ui_user_queue_t *queue)
+{
+    return queue->coalesced;
+}
+
+#ifdef TEST
+
+#include "unit_test.h"
+
+int main(void)
+{
+    sp_log_set_level("debug");
+
+    ui_user_queue_t *queue = ui_user_queue_new();
+    fail_unless(queue);
+    fail_unless(ui_user_queue_first(queue) == NULL);
+
+    /* repeated updates for the same user are merged into the login */
+    ui_user_queue_add(queue, UI_USER_LOGIN, "hub1", "foo");
+    ui_user_queue_add(queue, UI_USER_LOGIN, "hub1", "bar");
+    ui_user_queue_add(queue, UI_USER_UPDATE, "hub1", "foo");
+    ui_user_queue_add(queue, UI_USER_UPDATE, "hub1", "foo");
+    ui_user_queue_add(queue, UI_USER_LOGIN, "hub2", "foo");
+    fail_unless(ui_user_queue_length(queue) == 3);
+    fail_unless(ui_user_queue_coalesced(queue) == 2);
+
+    ui_user_entry_t *entry = ui_user_queue_first(queue);
+    fail_unless(entry);
+    fail_unless(strcmp(entry->nick, "foo") == 0);
+    fail_unless(strcmp(entry->hub_address, "hub1") == 0);
+    fail_unless(entry->event == UI_USER_LOGIN);
+    entry = TAILQ_NEXT(entry, link);
+    fail_unless(strcmp(entry->nick, "bar") == 0);
+    entry = TAILQ_NEXT(entry, link);
+    fail_unless(strcmp(entry->hub_address, "hub2") == 0);
+
+    /* a user logging out before the login was sent is never sent */
+    ui_user_queue_add(queue, UI_USER_LOGOUT, "hub1", "bar");
+    fail_unless(ui_user_queue_length(queue) == 2);
+
+    /* flush the queue */
+    while((entry = ui_user_queue_first(queue)) != NULL)
+        ui_user_queue_remove(queue, entry);
+    fail_unless(ui_user_queue_length(queue) == 0);
+
+    /* the UI knows about these users now */
+    ui_user_queue_add(queue, UI_USER_UPDATE, "hub1", "foo");
+    ui_user_queue_add(queue, UI_USER_LOGOUT, "hub1", "foo");
+    entry = ui_user_queue_first(queue);
+    fail_unless(entry->event == UI_USER_LOGOUT);
+    ui_user_queue_add(queue, UI_USER_LOGIN, "hub1", "foo");
+    fail_unless(entry->event == UI_USER_UPDATE);
+    fail_unless(ui_user_queue_length(queue) == 1);
+
+    ui_user_queue_free(queue);
+
+    return 0;
+}
+
+#endif
+
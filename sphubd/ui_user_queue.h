@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2008 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _ui_user_queue_h_
+#define _ui_user_queue_h_
+
+#include "sys_queue.h"
+#include "sys_tree.h"
+
+/* User list events waiting to be sent to a UI.
+ *
+ * There is at most one entry per user: a new event for a user that is
+ * already queued is merged with the queued one. Entries are kept in the
+ * order their users were first queued.
+ */
+
+typedef enum
+{
+    UI_USER_LOGIN,
+    UI_USER_UPDATE,
+    UI_USER_LOGOUT
+} ui_user_event_t;
+
+typedef struct ui_user_entry ui_user_entry_t;
+struct ui_user_entry
+{
+    RB_ENTRY(ui_user_entry) node;
+    TAILQ_ENTRY(ui_user_entry) link;
+    ui_user_event_t event;
+    char *hub_address;
+    char *nick;
+};
+
+typedef struct ui_user_queue ui_user_queue_t;
+
+ui_user_queue_t *ui_user_queue_new(void);
+void ui_user_queue_free(ui_user_queue_t *queue);
+void ui_user_queue_add(ui_user_queue_t *queue, ui_user_event_t event,
+        const char *hub_address, const char *nick);
+ui_user_entry_t *ui_user_queue_first(ui_user_queue_t *queue);
+void ui_user_queue_remove(ui_user_queue_t *queue, ui_user_entry_t *entry);
+unsigned ui_user_queue_length(ui_user_queue_t *queue);
+unsigned ui_user_queue_coalesced(ui_user_queue_t *queue);
+
+#endif
+
@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2008 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sys_queue.h"
+#include "sys_tree.h"
+
+#include "log.h"
+#include "upload_cache.h"
+
+struct uc_block
+{
+    RB_ENTRY(uc_block) link;
+    TAILQ_ENTRY(uc_block) lru;
+    uc_file_t file;
+    uint64_t index;
+    char *data;
+    size_t len;
+    unsigned refcount;
+};
+
+static int uc_block_cmp(struct uc_block *a, struct uc_block *b)
+{
+    if(a->file.ino != b->file.ino)
+        return a->file.ino < b->file.ino ? -1 : 1;
+    if(a->file.dev != b->file.dev)
+        return a->file.dev < b->file.dev ? -1 : 1;
+    if(a->file.size != b->file.size)
+        return a->file.size < b->file.size ? -1 : 1;
+    if(a->file.mtime != b->file.mtime)
+        return a->file.mtime < b->file.mtime ? -1 : 1;
+    if(a->index != b->index)
+        return a->index < b->index ? -1 : 1;
+    return 0;
+}
+
+RB_HEAD(uc_block_tree, uc_block);
+RB_PROTOTYPE(uc_block_tree, uc_block, link, uc_block_cmp);
+RB_GENERATE(uc_block_tree, uc_block, link, uc_block_cmp);
+
+static struct uc_block_tree uc_blocks = RB_INITIALIZER(&uc_blocks);
+
+/* least recently used first */
+static TAILQ_HEAD(, uc_block) uc_lru = TAILQ_HEAD_INITIALIZER(uc_lru);
+
+static uint64_t uc_size = UC_DEFAULT_SIZE;
+static uint64_t uc_used;
+static unsigned uc_nblocks;
+static uint64_t uc_hits;
+static uint64_t uc_misses;
+
+void uc_file_init(uc_file_t *file, const struct stat *st)
+{
+    memset(file, 0, sizeof(*file));
+    file->dev = st->st_dev;
+    file->ino = st->st_ino;
+    file->size = st->st_size;
+    file->mtime = st->st_mtime;
+}
+
+static void uc_block_free(struct uc_block *block)
+{
+    RB_REMOVE(uc_block_tree, &uc_blocks, block);
+    TAILQ_REMOVE(&uc_lru, block, lru);
+    uc_used -= block->len;
+    uc_nblocks--;
+    free(block->data);
+    free(block);
+}
+
+/* Evicts unreferenced blocks until there is room for nbytes more. Blocks
+ * in use are kept, so the cache may temporarily grow beyond its size.
+ */
+static void uc_evict(uint64_t nbytes)
+{
+    struct uc_block *block, *next;
+    for(block = TAILQ_FIRST(&uc_lru); block && uc_used + nbytes > uc_size;
+            block = next)
+    {
+        next = TAILQ_NEXT(block, lru);
+        if(block->refcount == 0)
+            uc_block_free(block);
+    }
+}
+
+void uc_set_size(uint64_t size)
+{
+    uc_size = size;
+    uc_evict(0);
+}
+
+uint64_t uc_get_size(void)
+{
+    return uc_size;
+}
+
+void uc_flush(void)
+{
+    uint64_t size = uc_size;
+    uc_set_size(0);
+    uc_size = size;
+}
+
+unsigned uc_stats(uint64_t *hits, uint64_t *misses)
+{
+    if(hits)
+        *hits = uc_hits;
+    if(misses)
+        *misses = uc_misses;
+    return uc_nblocks;
+}
+
+static struct uc_block *uc_read_block(const uc_file_t *file, int fd,
+        uint64_t index)
+{
+    uint64_t start = index * UC_BLOCK_SIZE;
+    size_t len = UC_BLOCK_SIZE;
+    if(start + len > file->size)
+        len = file->size - start;
+
+    char *data = malloc(len);
+    if(data == NULL)
+        return NULL;
+
+    size_t done = 0;
+    while(done < len)
+    {
+        ssize_t rc = pread(fd, data + done, len - done, start + done);
+        if(rc == -1 && errno == EINTR)
+            continue;
+        if(rc <= 0)
+        {
+            /* the file was truncated after it was opened */
+            if(rc == 0)
+                errno = EIO;
+            free(data);
+            return NULL;
+        }
+        done += rc;
+    }
+
+#ifdef POSIX_FADV_WILLNEED
+    /* let the kernel start reading the next block in the background */
+    if(start + len < file->size)
+        posix_fadvise(fd, start + len, UC_BLOCK_SIZE, POSIX_FADV_WILLNEED);
+#endif
+
+    uc_evict(len);
+
+    struct uc_block *block = calloc(1, sizeof(struct uc_block));
+    block->file = *file;
+    block->index = index;
+    block->data = data;
+    block->len = len;
+    RB_INSERT(uc_block_tree, &uc_blocks, block);
+    TAILQ_INSERT_TAIL(&uc_lru, block, lru);
+    uc_used += len;
+    uc_nblocks++;
+
+    return block;
+}
+
+/* Returns a referenced block of the file, or NULL on error.
+ */
+static struct uc_block *uc_get(const uc_file_t *file, int fd, uint64_t index)
+{
+    struct uc_block key;
+    key.file = *file;
+    key.index = index;
+
+    struct uc_block *block = RB_FIND(uc_block_tree, &uc_blocks, &key);
+    if(block)
+    {
+        uc_hits++;
+        TAILQ_REMOVE(&uc_lru, block, lru);
+        TAILQ_INSERT_TAIL(&uc_lru, block, lru);
+    }
+    else
+    {
+        uc_misses++;
+        block = uc_read_block(file, fd, index);
+        if(block == NULL)
+            return NULL;
+    }
+
+    block->refcount++;
+    return block;
+}
+
+void uc_release(uc_block_t *block)
+{
+    if(block == NULL)
+        return;
+
+    return_if_fail(block->refcount > 0);
+    block->refcount--;
+    if(block->refcount == 0 && uc_used > uc_size)
+        uc_evict(0);
+}
+
+ssize_t uc_read(uc_block_t **blockp, const uc_file_t *file, int fd,
+        uint64_t offset, void *buf, size_t nbytes)
+{
+    if(offset >= file->size)
+        return 0;
+
+    struct uc_block key;
+    key.file = *file;
+    key.index = offset / UC_BLOCK_SIZE;
+
+    struct uc_block *block = *blockp;
+    if(block && uc_block_cmp(block, &key) != 0)
+    {
+        uc_release(block);
+        *blockp = block = NULL;
+    }
+
+    if(block == NULL)
+    {
+        if(uc_size == 0)
+            return pread(fd, buf, nbytes, offset);
+
+        block = uc_get(file, fd, key.index);
+        if(block == NULL)
+            return -1;
+        *blockp = block;
+    }
+
+    size_t pos = offset - key.index * UC_BLOCK_SIZE;
+    if(nbytes > block->len - pos)
+        nbytes = block->len - pos;
+    memcpy(buf, block->data + pos, nbytes);
+
+    return nbytes;
+}
+
+#ifdef TEST
+
+#include <stdio.h>
+
+#include "unit_test.h"
+
+static unsigned char test_byte(uint64_t offset)
+{
+    return (offset * 7 + (offset >> 13)) & 0xFF;
+}
+
+int main(void)
+{
+    sp_log_set_level("debug");
+
+    const char *filename = "/tmp/upload_cache_test.tmp";
+    uint64_t size = 3 * UC_BLOCK_SIZE + 1234;
+
+    FILE *fp = fopen(filename, "w");
+    fail_unless(fp);
+    uint64_t i;
+    for(i = 0; i < size; i++)
+        fputc(test_byte(i), fp);
+    fclose(fp);
+
+    int fd = open(filename, O_RDONLY);
+    fail_unless(fd != -1);
+    struct stat st;
+    fail_unless(fstat(fd, &st) == 0);
+    uc_file_t file;
+    uc_file_init(&file, &st);
+
+    /* two readers at different offsets read the whole file */
+    uc_block_t *a = NULL, *b = NULL;
+    uint64_t apos = 0, bpos = UC_BLOCK_SIZE + 100;
+    char buf[8192];
+    while(apos < size || bpos < size)
+    {
+        ssize_t n = uc_read(&a, &file, fd, apos, buf, sizeof(buf));
+        if(apos < size)
+        {
+            fail_unless(n > 0);
+            for(i = 0; i < n; i++)
+                fail_unless((unsigned char)buf[i] == test_byte(apos + i));
+            apos += n;
+        }
+        else
+            fail_unless(n == 0);
+
+        n = uc_read(&b, &file, fd, bpos, buf, sizeof(buf));
+        if(bpos < size)
+        {
+            fail_unless(n > 0);
+            fail_unless((unsigned char)buf[0] == test_byte(bpos));
+            bpos += n;
+        }
+    }
+
+    /* each block was only read once */
+    uint64_t hits, misses;
+    fail_unless(uc_stats(&hits, &misses) == 4);
+    fail_unless(misses == 4);
+    fail_unless(hits == 3);
+
+    /* the last block is in use, all others can be evicted */
+    uc_set_size(UC_BLOCK_SIZE);
+    fail_unless(uc_stats(NULL, NULL) == 1);
+    uc_release(a);
+    uc_release(b);
+    fail_unless(uc_stats(NULL, NULL) == 1);
+
+    /* blocks are evicted in LRU order */
+    uc_set_size(2 * UC_BLOCK_SIZE);
+    a = NULL;
+    fail_unless(uc_read(&a, &file, fd, 0, buf, 1) == 1);
+    uc_release(a);
+    a = NULL;
+    fail_unless(uc_read(&a, &file, fd, UC_BLOCK_SIZE, buf, 1) == 1);
+    uc_release(a);
+    fail_unless(uc_stats(&hits, &misses) == 2);
+    fail_unless(misses == 6);
+    a = NULL;
+    fail_unless(uc_read(&a, &file, fd, 0, buf, 1) == 1);
+    uc_release(a);
+    fail_unless(uc_stats(&hits, &misses) == 2);
+    fail_unless(misses == 6);
+
+    /* a modified file doesn't match the cached blocks */
+    uc_file_t modified = file;
+    modified.mtime++;
+    a = NULL;
+    fail_unless(uc_read(&a, &modified, fd, 0, buf, 1) == 1);
+    fail_unless(uc_stats(&hits, &misses) == 2);
+    fail_unless(misses == 7);
+    uc_release(a);
+
+    /* a truncated file is an error */
+    modified.size = size + UC_BLOCK_SIZE;
+    a = NULL;
+    fail_unless(uc_read(&a, &modified, fd, size, buf, 1) == -1);
+    fail_unless(a == NULL);
+
+    /* reads bypass the cache when disabled */
+    uc_set_size(0);
+    fail_unless(uc_stats(NULL, NULL) == 0);
+    fail_unless(uc_read(&a, &file, fd, 5, buf, 10) == 10);
+    fail_unless((unsigned char)buf[0] == test_byte(5));
+    fail_unless(a == NULL);
+    fail_unless(uc_stats(NULL, NULL) == 0);
+
+    close(fd);
+    unlink(filename);
+
+    return 0;
+}
+
+#endif
+
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2008 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef _upload_cache_h_
+#define _upload_cache_h_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Block cache for uploaded files.
+ *
+ * Files are read in large blocks that are shared by all connections
+ * uploading the same file, so popular content is read from disk once no
+ * matter how many peers want it, and peers at different offsets don't
+ * evict each other's pages. Blocks are reference counted by the
+ * connections reading them, and unreferenced blocks are evicted in LRU
+ * order when the cache grows beyond its size.
+ *
+ * Blocks are keyed on inode, size and modification time, so a modified
+ * file never returns stale data.
+ */
+
+/* the unit of caching, and the size of each read from disk */
+#define UC_BLOCK_SIZE (1024 * 1024)
+
+#define UC_DEFAULT_SIZE (32 * 1024 * 1024)
+
+typedef struct uc_file uc_file_t;
+struct uc_file
+{
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+};
+
+typedef struct uc_block uc_block_t;
+
+void uc_file_init(uc_file_t *file, const struct stat *st);
+
+/* Sets the cache size in bytes. A size of 0 disables the cache. */
+void uc_set_size(uint64_t size);
+uint64_t uc_get_size(void);
+
+/* Reads at most nbytes bytes at offset into buf, via the cache if enabled.
+ * *blockp holds the reader's current block (initially NULL), which stays
+ * referenced between calls until released with uc_release.
+ *
+ * Returns the number of bytes read, 0 at end-of-file, or -1 on error.
+ */
+ssize_t uc_read(uc_block_t **blockp, const uc_file_t *file, int fd,
+        uint64_t offset, void *buf, size_t nbytes);
+
+void uc_release(uc_block_t *block);
+
+/* Releases all unreferenced blocks. */
+void uc_flush(void);
+
+/* Returns the number of cached blocks, and the number of block lookups
+ * that were found in the cache and that had to be read from disk.
+ */
+unsigned uc_stats(uint64_t *hits, uint64_t *misses);
+
+#endif
+
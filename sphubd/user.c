@@ -24,11 +24,111 @@
 
 #include "xstr.h"
 #include "extra_slots.h"
-#include "rx.h"
+#include "intern.h"
 #include "log.h"
 #include "user.h"
 #include "hub.h"
 
+/* user records are allocated this many at a time */
+#define USER_ARENA_CHUNK 128
+
+struct user_arena_chunk
+{
+    struct user_arena_chunk *next;
+    user_t users[USER_ARENA_CHUNK];
+};
+
+/* Each hub allocates its user records from an arena, so the thousands of
+ * records of a large hub don't each need their own malloc. Freed records
+ * are reused, and everything is released with the hub.
+ */
+struct user_arena
+{
+    struct user_arena_chunk *chunks;
+    LIST_HEAD(, user) free_users;
+};
+
+user_arena_t *user_arena_new(void)
+{
+    user_arena_t *arena = calloc(1, sizeof(user_arena_t));
+    LIST_INIT(&arena->free_users);
+    return arena;
+}
+
+void user_arena_free(user_arena_t *arena)
+{
+    if(arena)
+    {
+        struct user_arena_chunk *chunk, *next;
+        for(chunk = arena->chunks; chunk; chunk = next)
+        {
+            next = chunk->next;
+            free(chunk);
+        }
+        free(arena);
+    }
+}
+
+static user_t *user_alloc(hub_t *hub)
+{
+    user_arena_t *arena = hub ? hub->user_arena : NULL;
+    if(arena == NULL)
+        return calloc(1, sizeof(user_t));
+
+    if(LIST_EMPTY(&arena->free_users))
+    {
+        struct user_arena_chunk *chunk =
+            malloc(sizeof(struct user_arena_chunk));
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+
+        int i;
+        for(i = 0; i < USER_ARENA_CHUNK; i++)
+            LIST_INSERT_HEAD(&arena->free_users, &chunk->users[i], link);
+    }
+
+    user_t *user = LIST_FIRST(&arena->free_users);
+    LIST_REMOVE(user, link);
+    memset(user, 0, sizeof(user_t));
+    user->arena = arena;
+
+    return user;
+}
+
+static void user_set_nick(user_t *user, const char *nick, size_t len)
+{
+    if(len < USER_NICK_INLINE)
+    {
+        memcpy(user->nick_buf, nick, len);
+        user->nick_buf[len] = 0;
+        user->nick = user->nick_buf;
+    }
+    else
+    {
+        user->nick = xstrndup(nick, len);
+    }
+}
+
+/* Replaces an interned field if it changed. Returns true if it did. */
+static bool user_update_field(const char **field, const char *str, size_t len)
+{
+    if(str == NULL)
+    {
+        if(*field == NULL)
+            return false;
+        intern_release(*field);
+        *field = NULL;
+        return true;
+    }
+
+    if(*field && strncmp(*field, str, len) == 0 && (*field)[len] == 0)
+        return false;
+
+    intern_release(*field);
+    *field = intern_stringn(str, len);
+    return true;
+}
+
 /* All strings assumed to be in UTF-8 already
  */
 user_t *user_new(const char *nick, const char *tag,
@@ -37,23 +137,18 @@ user_t *user_new(const char *nick, const char *tag,
 {
     return_val_if_fail(nick, NULL);
 
-    user_t *user = calloc(1, sizeof(user_t));
+    user_t *user = user_alloc(hub);
 
-    user->nick = strdup(nick);
-    if(user->nick == NULL)
-    {
-        free(user);
-        return NULL;
-    }
+    user_set_nick(user, nick, strlen(nick));
 
-    user->tag = xstrdup(tag);
+    user->tag = intern_string(tag);
 
-    user->speed = xstrdup(speed);
-    user->description = xstrdup(description);
+    user->speed = intern_string(speed);
+    user->description = intern_string(description);
 
     if(email && email[0])
     {
-        user->email = strdup(email);
+        user->email = intern_string(email);
     }
 
     user->shared_size = shared_size;
@@ -66,90 +161,144 @@ user_t *user_new(const char *nick, const char *tag,
     return user;
 }
 
-user_t *user_new_from_myinfo(const char *myinfo, hub_t *hub)
+/* Splits a $MyINFO into its fields, without copying. */
+bool user_parse_myinfo(const char *myinfo, user_myinfo_t *info)
 {
+    return_val_if_fail(myinfo, false);
+    return_val_if_fail(info, false);
+
     if(str_has_prefix(myinfo, "$MyINFO "))
         myinfo += 8;
 
     if(strncmp(myinfo, "$ALL ", 5) != 0)
-        return NULL;
+        return false;
     myinfo += 5;
 
-    char *nick = NULL;
-    char *speed = NULL;
-    char *email = NULL;
-    char *tag = NULL;
-    char *desc = NULL;
-    char *size_str = NULL;
-    uint64_t size = 0ULL;
-
     size_t n = strcspn(myinfo, " ");
     if(n == 0 || myinfo[n] != ' ')
-        goto error;
-    nick = xstrndup(myinfo, n);
+        return false;
+    info->nick = myinfo;
+    info->nick_len = n;
     myinfo += n + 1;
 
     n = strcspn(myinfo, "$");
     if(myinfo[n] != '$')
-        goto error;
-    desc = xstrndup(myinfo, n);
+        return false;
+    info->description = myinfo;
+    info->description_len = n;
     myinfo += n + 1;
     myinfo += strspn(myinfo, "AP \x05");
     if(*myinfo != '$')
-        goto error;
+        return false;
     myinfo++;
 
-    char *e = desc ? strrchr(desc, '<') : NULL;
-    if(e)
+    /* the tag is the last '<' of the description and everything after it */
+    info->tag = NULL;
+    info->tag_len = 0;
+    const char *e;
+    for(e = info->description + info->description_len;
+            e > info->description; e--)
     {
-        if(e == desc)
+        if(e[-1] == '<')
         {
-            tag = desc;
-            desc = NULL;
-        }
-        else
-        {
-            tag = strdup(e);
-            *e = 0; /* truncate description: remove tag */
+            info->tag = e - 1;
+            info->tag_len = info->description + info->description_len -
+                info->tag;
+            info->description_len = info->tag - info->description;
+            if(info->description_len == 0)
+                info->description = NULL;
+            break;
         }
     }
 
     n = strcspn(myinfo, "$\x01");
-    speed = xstrndup(myinfo, n);
-    str_trim_end_inplace(speed, " ");
+    info->speed = myinfo;
+    info->speed_len = n;
+    while(info->speed_len > 0 && info->speed[info->speed_len - 1] == ' ')
+        info->speed_len--;
     myinfo += n;
     myinfo += strspn(myinfo, " \x01");
 
     if(*myinfo != '$')
-        goto error;
+        return false;
     myinfo++;
 
     n = strcspn(myinfo, "$");
-    email = xstrndup(myinfo, n);
-    myinfo += n + 1;
+    info->email = myinfo;
+    info->email_len = n;
+    myinfo += n;
+    if(*myinfo)
+        myinfo++;
 
-    n = strcspn(myinfo, "$");
-    size_str = xstrndup(myinfo, n);
-    size = strtoull(size_str, NULL, 10);
+    info->shared_size = strtoull(myinfo, NULL, 10);
+
+    return true;
+}
+
+user_t *user_new_from_parsed_myinfo(const user_myinfo_t *info, hub_t *hub)
+{
+    return_val_if_fail(info, NULL);
 
-    user_t *user = user_new(nick, tag, speed, desc, email, size, hub);
-    free(nick);
-    free(speed);
-    free(email);
-    free(tag);
-    free(desc);
-    free(size_str);
+    user_t *user = user_alloc(hub);
+
+    user_set_nick(user, info->nick, info->nick_len);
+    user_update_field(&user->description, info->description,
+            info->description_len);
+    user_update_field(&user->tag, info->tag, info->tag_len);
+    user_update_field(&user->speed, info->speed, info->speed_len);
+    if(info->email_len)
+        user_update_field(&user->email, info->email, info->email_len);
+
+    user->shared_size = info->shared_size;
+    user->hub = hub;
+    user->passive = false;
+    user->is_operator = false;
+
+    user->extra_slots = extra_slots_get_for_user(user->nick);
 
     return user;
+}
+
+user_t *user_new_from_myinfo(const char *myinfo, hub_t *hub)
+{
+    user_myinfo_t info;
+    if(!user_parse_myinfo(myinfo, &info))
+        return NULL;
+    return user_new_from_parsed_myinfo(&info, hub);
+}
+
+/* Updates a user in place from a new $MyINFO for the same nick. Only the
+ * fields that changed are touched, a MyINFO that only changes the share
+ * size doesn't allocate anything. Returns true if anything changed.
+ */
+bool user_update_from_myinfo(user_t *user, const user_myinfo_t *info)
+{
+    return_val_if_fail(user, false);
+    return_val_if_fail(info, false);
 
-error:
-    free(nick);
-    free(speed);
-    free(email);
-    free(tag);
-    free(desc);
-    free(size_str);
-    return NULL;
+    bool changed = false;
+
+    changed |= user_update_field(&user->description, info->description,
+            info->description_len);
+    changed |= user_update_field(&user->tag, info->tag, info->tag_len);
+    changed |= user_update_field(&user->speed, info->speed, info->speed_len);
+    changed |= user_update_field(&user->email,
+            info->email_len ? info->email : NULL, info->email_len);
+
+    if(user->shared_size != info->shared_size)
+    {
+        user->shared_size = info->shared_size;
+        changed = true;
+    }
+
+    unsigned extra_slots = extra_slots_get_for_user(user->nick);
+    if(user->extra_slots != extra_slots)
+    {
+        user->extra_slots = extra_slots;
+        changed = true;
+    }
+
+    return changed;
 }
 
 void user_free(void *data)
@@ -157,13 +306,17 @@ void user_free(void *data)
     user_t *user = data;
     if(user)
     {
-        free(user->nick);
-        free(user->tag);
-        free(user->speed);
-        free(user->description);
-        free(user->email);
+        if(user->nick != user->nick_buf)
+            free(user->nick);
+        intern_release(user->tag);
+        intern_release(user->speed);
+        intern_release(user->description);
+        intern_release(user->email);
         free(user->ip);
-        free(user);
+        if(user->arena)
+            LIST_INSERT_HEAD(&user->arena->free_users, user, link);
+        else
+            free(user);
     }
 }
 
@@ -177,21 +330,20 @@ void user_set_ip(user_t *user, const char *ip)
 void user_set_speed(user_t *user, const char *speed)
 {
     return_if_fail(user);
-    free(user->speed);
-    user->speed = xstrdup(speed);
+    intern_release(user->speed);
+    user->speed = intern_string(speed);
 }
 
 void user_set_description(user_t *user, const char *description)
 {
     return_if_fail(user);
-    free(user->description);
-    user->description = xstrdup(description);
+    intern_release(user->description);
+    user->description = intern_string(description);
 }
 
 void user_set_email(user_t *user, const char *email)
 {
     return_if_fail(user);
-    free(user->email);
-    user->email = xstrdup(email);
+    intern_release(user->email);
+    user->email = intern_string(email);
 }
-
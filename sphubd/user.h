@@ -22,32 +22,69 @@
 #define _user_h_
 
 #include "sys_queue.h"
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
 struct hub;
 
+/* nicks shorter than this are stored in the user record */
+#define USER_NICK_INLINE 24
+
+/* A parsed $MyINFO. The fields point into the parsed string and are not
+ * nul-terminated.
+ */
+typedef struct user_myinfo user_myinfo_t;
+struct user_myinfo
+{
+    const char *nick;
+    size_t nick_len;
+    const char *description;    /* NULL if there's only a tag */
+    size_t description_len;
+    const char *tag;            /* NULL if there's no tag */
+    size_t tag_len;
+    const char *speed;
+    size_t speed_len;
+    const char *email;
+    size_t email_len;
+    uint64_t shared_size;
+};
+
+typedef struct user_arena user_arena_t;
+
 typedef struct user user_t;
 struct user
 {
     LIST_ENTRY(user) link;
 
     char *nick;
-    char *tag;
-    char *speed;
-    char *description;
-    char *email;
+    /* tag, speed, description and email are interned, see intern.h */
+    const char *tag;
+    const char *speed;
+    const char *description;
+    const char *email;
     uint64_t shared_size;
     bool is_operator;
     bool passive;
     struct hub *hub;
     char *ip;
     unsigned int extra_slots;
+
+    user_arena_t *arena;
+    unsigned nick_hash;
+    struct user *same_nick; /* the same nick on another hub */
+    char nick_buf[USER_NICK_INLINE];
 };
 
+user_arena_t *user_arena_new(void);
+void user_arena_free(user_arena_t *arena);
+
 user_t *user_new(const char *nick, const char *tag, const char *speed, const char *description,
         const char *email, uint64_t shared_size, struct hub *hub);
+bool user_parse_myinfo(const char *myinfo, user_myinfo_t *info);
+user_t *user_new_from_parsed_myinfo(const user_myinfo_t *info, struct hub *hub);
 user_t *user_new_from_myinfo(const char *myinfo, struct hub *hub);
+bool user_update_from_myinfo(user_t *user, const user_myinfo_t *info);
 void user_free(void *data);
 void user_set_ip(user_t *user, const char *ip);
 void user_set_speed(user_t *user, const char *speed);
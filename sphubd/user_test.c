@@ -19,15 +19,11 @@
  */
 
 #include "user.h"
+#include "hub.h"
+#include "intern.h"
 #include "unit_test.h"
 #include "log.h"
 
-/* ouch! */
-int extra_slots_get_for_user(const char *nick)
-{
-    return 0;
-}
-
 int main(void)
 {
     sp_log_set_level("debug");
@@ -46,11 +42,17 @@ int main(void)
     fail_unless(user1->hub == NULL);
     fail_unless(user1->ip == NULL);
 
-    user_t *user2 = user_new_from_myinfo("$MyINFO $ALL user2 description$ $LAN(T1)$email@address$98734513452$|", (void *)0xDEADBEEF);
+    hub_t *hub = hub_new();
+    fail_unless(hub);
+
+    user_t *user2 = user_new_from_myinfo("$MyINFO $ALL user2 description$ $LAN(T1)$email@address$98734513452$|", hub);
     fail_unless(user2);
     fail_unless(strcmp(user2->description, "description") == 0);
     fail_unless(strcmp(user2->email, "email@address") == 0);
-    fail_unless(user2->hub == (void *)0xDEADBEEF);
+    fail_unless(user2->hub == hub);
+    fail_unless(user2->arena == hub->user_arena);
+    fail_unless(user2->nick == user2->nick_buf);
+    fail_unless(user2->speed == user1->speed);
     fail_unless(strcmp(user1->speed, "LAN(T1)") == 0);
 
     /* nick in utf-8 */
@@ -84,15 +86,52 @@ int main(void)
     user_t *user10 = user_new_from_myinfo("$MyINFO $ALL kurtgoran $A$$$100424222195$|", NULL);
     fail_unless(user10);
 
+    /* only the share size changed */
+    user_myinfo_t info;
+    fail_unless(user_parse_myinfo("$MyINFO $ALL user2 description$ $LAN(T1)$email@address$98734513453$|", &info));
+    const char *description = user2->description;
+    fail_unless(user_update_from_myinfo(user2, &info));
+    fail_unless(user2->shared_size == 98734513453LL);
+    fail_unless(user2->description == description);
+    fail_unless(user_update_from_myinfo(user2, &info) == false);
+
+    /* a tag was added and the email removed */
+    fail_unless(user_parse_myinfo("$ALL user2 description<++ V:0.668,M:A,H:1/0/0,S:3>$ $LAN(T1)$$98734513453$|", &info));
+    fail_unless(user_update_from_myinfo(user2, &info));
+    fail_unless(strcmp(user2->description, "description") == 0);
+    fail_unless(strcmp(user2->tag, "<++ V:0.668,M:A,H:1/0/0,S:3>") == 0);
+    fail_unless(user2->tag == user1->tag);
+    fail_unless(user2->email == NULL);
+
+    /* long nicks don't fit in the record */
+    user_t *user11 = user_new_from_myinfo("$MyINFO $ALL a_rather_long_nick_for_a_user $ $LAN(T1)$$0$|", hub);
+    fail_unless(user11);
+    fail_unless(user11->nick != user11->nick_buf);
+    fail_unless(strcmp(user11->nick, "a_rather_long_nick_for_a_user") == 0);
+    fail_unless(user11->description && user11->description[0] == 0);
+
+    /* freed records are reused */
+    user_free(user11);
+    user_t *user12 = user_new("user12", NULL, NULL, NULL, NULL, 0, hub);
+    fail_unless(user12 == user11);
+    user_free(user12);
+
+    fail_unless(user_parse_myinfo("$MyINFO $ALL nick$ $LAN(T1)$$0$|", &info) == false);
+    fail_unless(user_parse_myinfo("$MyINFO $ALL nick desc", &info) == false);
+
     user_free(user1);
     user_free(user2);
     user_free(user3);
     user_free(user4);
+    user_free(user5);
     user_free(user6);
     user_free(user7);
     user_free(user8);
     user_free(user9);
     user_free(user10);
+    hub_free(hub);
+
+    fail_unless(intern_count() == 0);
 
     return 0;
 }
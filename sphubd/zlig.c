@@ -0,0 +1,327 @@
+/*
+ * Copyright (c) 2008 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "zlig.h"
+#include "log.h"
+
+struct zlig
+{
+    z_stream strm;
+    bool deflating;
+    bool bypassed;
+    bool probed;
+};
+
+zlig_t *zlig_deflate_new(void)
+{
+    zlig_t *z = calloc(1, sizeof(zlig_t));
+    z->deflating = true;
+    if(deflateInit(&z->strm, Z_DEFAULT_COMPRESSION) != Z_OK)
+    {
+        WARNING("deflateInit: %s", z->strm.msg ? z->strm.msg : "failed");
+        free(z);
+        return NULL;
+    }
+    return z;
+}
+
+zlig_t *zlig_inflate_new(void)
+{
+    zlig_t *z = calloc(1, sizeof(zlig_t));
+    if(inflateInit(&z->strm) != Z_OK)
+    {
+        WARNING("inflateInit: %s", z->strm.msg ? z->strm.msg : "failed");
+        free(z);
+        return NULL;
+    }
+    return z;
+}
+
+void zlig_free(zlig_t *z)
+{
+    if(z)
+    {
+        if(z->deflating)
+            deflateEnd(&z->strm);
+        else
+            inflateEnd(&z->strm);
+        free(z);
+    }
+}
+
+/* Switches to stored blocks if the first data didn't compress. */
+static void zlig_probe(zlig_t *z)
+{
+    if(z->probed || z->strm.total_in < ZLIG_PROBE_SIZE)
+        return;
+
+    /* deflate holds back up to a block of output, flush it to see the
+     * real compressed size */
+    unsigned avail_in = z->strm.avail_in;
+    z->strm.avail_in = 0;
+    int rc = deflate(&z->strm, Z_BLOCK);
+    z->strm.avail_in = avail_in;
+    if((rc != Z_OK && rc != Z_BUF_ERROR) || z->strm.avail_out == 0)
+    {
+        /* not enough output space, try again next time */
+        return;
+    }
+
+    z->probed = true;
+    if(z->strm.total_out * 100 < z->strm.total_in * ZLIG_BYPASS_RATIO)
+        return;
+
+    rc = deflateParams(&z->strm, Z_NO_COMPRESSION, Z_DEFAULT_STRATEGY);
+    if(rc == Z_OK)
+    {
+        DEBUG("incompressible data, bypassing compression");
+        z->bypassed = true;
+    }
+    else
+    {
+        z->probed = false;
+    }
+}
+
+int zlig_deflate(zlig_t *z, const void *in, size_t *inlen,
+        void *out, size_t *outlen, bool finish)
+{
+    z->strm.next_in = (Bytef *)in;
+    z->strm.avail_in = *inlen;
+    z->strm.next_out = out;
+    z->strm.avail_out = *outlen;
+
+    zlig_probe(z);
+
+    int rc = deflate(&z->strm, finish ? Z_FINISH : Z_NO_FLUSH);
+
+    *inlen -= z->strm.avail_in;
+    *outlen -= z->strm.avail_out;
+
+    if(rc == Z_STREAM_END)
+        return 1;
+    if(rc == Z_OK || rc == Z_BUF_ERROR)
+        return 0;
+
+    WARNING("deflate: %s", z->strm.msg ? z->strm.msg : "failed");
+    return -1;
+}
+
+int zlig_flush(zlig_t *z, void *out, size_t *outlen)
+{
+    z->strm.next_in = NULL;
+    z->strm.avail_in = 0;
+    z->strm.next_out = out;
+    z->strm.avail_out = *outlen;
+
+    int rc = deflate(&z->strm, Z_SYNC_FLUSH);
+
+    *outlen -= z->strm.avail_out;
+
+    if(rc == Z_OK || rc == Z_BUF_ERROR)
+        return z->strm.avail_out == 0 ? 0 : 1;
+
+    WARNING("deflate: %s", z->strm.msg ? z->strm.msg : "failed");
+    return -1;
+}
+
+int zlig_inflate(zlig_t *z, const void *in, size_t *inlen,
+        void *out, size_t *outlen)
+{
+    z->strm.next_in = (Bytef *)in;
+    z->strm.avail_in = *inlen;
+    z->strm.next_out = out;
+    z->strm.avail_out = *outlen;
+
+    int rc = inflate(&z->strm, Z_NO_FLUSH);
+
+    *inlen -= z->strm.avail_in;
+    *outlen -= z->strm.avail_out;
+
+    if(rc == Z_STREAM_END)
+        return 1;
+    if(rc == Z_OK || rc == Z_BUF_ERROR)
+        return 0;
+
+    WARNING("inflate: %s", z->strm.msg ? z->strm.msg : "failed");
+    return -1;
+}
+
+bool zlig_bypassed(const zlig_t *z)
+{
+    return z->bypassed;
+}
+
+uint64_t zlig_total_plain(const zlig_t *z)
+{
+    return z->deflating ? z->strm.total_in : z->strm.total_out;
+}
+
+uint64_t zlig_total_compressed(const zlig_t *z)
+{
+    return z->deflating ? z->strm.total_out : z->strm.total_in;
+}
+
+unsigned zlig_ratio(const zlig_t *z)
+{
+    uint64_t plain = zlig_total_plain(z);
+    if(plain == 0)
+        return 100;
+    return zlig_total_compressed(z) * 100 / plain;
+}
+
+#ifdef TEST
+
+#include "unit_test.h"
+
+/* Compresses LEN bytes in chunks of CHUNK, inflates the result in small
+ * pieces and checks that the data comes back. Returns the compressor.
+ */
+static void roundtrip(const char *data, size_t len, size_t chunk,
+        bool expect_bypass)
+{
+    zlig_t *def = zlig_deflate_new();
+    fail_unless(def);
+
+    size_t cap = len + len / 10 + 1024;
+    char *compressed = malloc(cap);
+    size_t clen = 0;
+    size_t off = 0;
+    int rc = 0;
+    while(rc == 0)
+    {
+        size_t n = len - off < chunk ? len - off : chunk;
+        size_t outlen = 4096 < cap - clen ? 4096 : cap - clen;
+        rc = zlig_deflate(def, data + off, &n, compressed + clen, &outlen,
+                off + n == len);
+        fail_unless(rc >= 0);
+        off += n;
+        clen += outlen;
+    }
+    fail_unless(off == len);
+    fail_unless(zlig_total_plain(def) == len);
+    fail_unless(zlig_total_compressed(def) == clen);
+    fail_unless(zlig_bypassed(def) == expect_bypass);
+    zlig_free(def);
+
+    /* trailing data after the stream is left alone */
+    memcpy(compressed + clen, "$ADCSND", 7);
+
+    zlig_t *inf = zlig_inflate_new();
+    fail_unless(inf);
+    char *plain = malloc(len + 1);
+    size_t plen = 0;
+    off = 0;
+    rc = 0;
+    while(rc == 0)
+    {
+        size_t n = clen + 7 - off < 100 ? clen + 7 - off : 100;
+        size_t outlen = len + 1 - plen < 3000 ? len + 1 - plen : 3000;
+        rc = zlig_inflate(inf, compressed + off, &n, plain + plen, &outlen);
+        fail_unless(rc >= 0);
+        fail_unless(n > 0 || outlen > 0);
+        off += n;
+        plen += outlen;
+    }
+    fail_unless(off == clen);
+    fail_unless(plen == len);
+    fail_unless(memcmp(plain, data, len) == 0);
+    fail_unless(zlig_total_plain(inf) == len);
+    zlig_free(inf);
+
+    free(plain);
+    free(compressed);
+}
+
+int main(void)
+{
+    sp_log_set_level("debug");
+
+    size_t len = 300000;
+    char *text = malloc(len);
+    size_t i;
+    for(i = 0; i < len; i++)
+        text[i] = "the quick brown fox jumps over the lazy dog\n"[i % 44];
+    roundtrip(text, len, 8192, false);
+    roundtrip(text, 10, 8192, false);
+    roundtrip(text, 0, 8192, false);
+
+    /* random data is sent stored after the probe */
+    char *noise = malloc(len);
+    srandom(42);
+    for(i = 0; i < len; i++)
+        noise[i] = random();
+    roundtrip(noise, len, 8192, true);
+    roundtrip(noise, len, 100000, true);
+
+    int rc;
+    zlig_t *z = zlig_deflate_new();
+    fail_unless(zlig_ratio(z) == 100);
+    size_t n = len, outlen = len;
+    char *out = malloc(len);
+    fail_unless(zlig_deflate(z, text, &n, out, &outlen, true) == 1);
+    fail_unless(zlig_ratio(z) < 5);
+    zlig_free(z);
+
+    /* a flush hands out everything compressed so far, even if it's held
+     * back in small pieces */
+    z = zlig_deflate_new();
+    n = len;
+    outlen = len;
+    fail_unless(zlig_deflate(z, text, &n, out, &outlen, false) == 0);
+    fail_unless(n == len);
+    size_t clen = outlen;
+    do
+    {
+        outlen = 10 < len - clen ? 10 : len - clen;
+        rc = zlig_flush(z, out + clen, &outlen);
+        fail_unless(rc >= 0);
+        clen += outlen;
+    } while(rc == 0);
+    zlig_free(z);
+
+    z = zlig_inflate_new();
+    char *plain = malloc(len);
+    n = clen;
+    outlen = len;
+    fail_unless(zlig_inflate(z, out, &n, plain, &outlen) == 0);
+    fail_unless(n == clen);
+    fail_unless(outlen == len);
+    fail_unless(memcmp(plain, text, len) == 0);
+    zlig_free(z);
+    free(plain);
+
+    /* garbage doesn't inflate */
+    z = zlig_inflate_new();
+    n = 100;
+    outlen = len;
+    fail_unless(zlig_inflate(z, noise, &n, out, &outlen) == -1);
+    zlig_free(z);
+
+    free(out);
+    free(noise);
+    free(text);
+
+    return 0;
+}
+
+#endif
+
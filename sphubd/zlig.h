@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2008 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef _zlig_h_
+#define _zlig_h_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Streaming zlib compression for transfers (the ZLIG extension, requested
+ * with the ZL1 flag to $ADCGET).
+ *
+ * The compressor watches the first ZLIG_PROBE_SIZE bytes. If they don't
+ * shrink below ZLIG_BYPASS_RATIO percent, the rest of the stream is sent
+ * in stored blocks, which the peer inflates as usual but which cost us
+ * next to no CPU time.
+ */
+
+#define ZLIG_PROBE_SIZE (64 * 1024)
+#define ZLIG_BYPASS_RATIO 90 /* percent */
+
+typedef struct zlig zlig_t;
+
+zlig_t *zlig_deflate_new(void);
+zlig_t *zlig_inflate_new(void);
+void zlig_free(zlig_t *z);
+
+/* Compresses from IN into OUT. On return, *INLEN and *OUTLEN are set to the
+ * number of bytes consumed and produced. If FINISH is true, IN is the end
+ * of the data. Returns 1 when the stream is finished, 0 if more input or
+ * output space is needed, or -1 on error.
+ */
+int zlig_deflate(zlig_t *z, const void *in, size_t *inlen,
+        void *out, size_t *outlen, bool finish);
+
+/* Flushes all output held back by the compressor into OUT, on a byte
+ * boundary the peer can inflate up to. *OUTLEN is set as in zlig_deflate.
+ * Returns 1 when everything is flushed, 0 if more output space is needed,
+ * or -1 on error.
+ */
+int zlig_flush(zlig_t *z, void *out, size_t *outlen);
+
+/* Decompresses from IN into OUT, in the same way as zlig_deflate. Returns 1
+ * at the end of the stream, which may be before the end of IN.
+ */
+int zlig_inflate(zlig_t *z, const void *in, size_t *inlen,
+        void *out, size_t *outlen);
+
+/* true if incompressible data made the compressor give up */
+bool zlig_bypassed(const zlig_t *z);
+
+/* uncompressed and compressed byte counts so far */
+uint64_t zlig_total_plain(const zlig_t *z);
+uint64_t zlig_total_compressed(const zlig_t *z);
+
+/* Returns the compressed size in percent of the uncompressed size. */
+unsigned zlig_ratio(const zlig_t *z);
+
+#endif
+
@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2008 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <event.h>
+
+#include "event_profile.h"
+#include "log.h"
+
+/* how often the event loop lag is sampled */
+#define EP_LAG_INTERVAL 250 /* milliseconds */
+
+static LIST_HEAD(, ep_probe) ep_probes = LIST_HEAD_INITIALIZER(ep_probes);
+static uint64_t ep_slow_threshold = EP_DEFAULT_SLOW_THRESHOLD * 1000;
+
+static ep_probe_t ep_lag_probe = EP_PROBE_INITIALIZER("event loop lag");
+static struct event ep_lag_event;
+static uint64_t ep_lag_expected;
+
+uint64_t ep_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    if(clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+void ep_add_sample(ep_probe_t *probe, uint64_t usec)
+{
+    if(!probe->registered)
+    {
+        LIST_INSERT_HEAD(&ep_probes, probe, link);
+        probe->registered = true;
+    }
+
+    probe->count++;
+    probe->total_usec += usec;
+    if(usec > probe->max_usec)
+        probe->max_usec = usec;
+
+    int bucket = 0;
+    uint64_t limit = 2;
+    while(usec >= limit && bucket < EP_HISTOGRAM_BUCKETS - 1)
+    {
+        limit <<= 1;
+        bucket++;
+    }
+    probe->histogram[bucket]++;
+}
+
+void ep_record(ep_probe_t *probe, uint64_t start)
+{
+    uint64_t usec = ep_now() - start;
+
+    ep_add_sample(probe, usec);
+
+    if(ep_slow_threshold && usec >= ep_slow_threshold)
+    {
+        WARNING("slow callback %s took %"PRIu64" ms",
+                probe->name, usec / 1000);
+    }
+}
+
+void ep_set_slow_threshold(unsigned msec)
+{
+    ep_slow_threshold = (uint64_t)msec * 1000;
+}
+
+unsigned ep_get_slow_threshold(void)
+{
+    return ep_slow_threshold / 1000;
+}
+
+static void ep_schedule_lag_event(void)
+{
+    struct timeval tv = {.tv_sec = 0, .tv_usec = EP_LAG_INTERVAL * 1000};
+    ep_lag_expected = ep_now() + EP_LAG_INTERVAL * 1000;
+    evtimer_add(&ep_lag_event, &tv);
+}
+
+static void ep_lag_event_func(int fd, short why, void *data)
+{
+    uint64_t now = ep_now();
+    uint64_t lag = now > ep_lag_expected ? now - ep_lag_expected : 0;
+
+    ep_add_sample(&ep_lag_probe, lag);
+
+    if(ep_slow_threshold && lag >= ep_slow_threshold)
+        WARNING("event loop lagged %"PRIu64" ms", lag / 1000);
+
+    ep_schedule_lag_event();
+}
+
+/* Measures how late a periodic timer fires, which is how long ready
+ * events have to wait for the event loop.
+ */
+void ep_start_lag_monitor(void)
+{
+    evtimer_set(&ep_lag_event, ep_lag_event_func, NULL);
+    ep_schedule_lag_event();
+}
+
+void ep_foreach_probe(ep_probe_func_t func, void *user_data)
+{
+    ep_probe_t *probe;
+    LIST_FOREACH(probe, &ep_probes, link)
+    {
+        func(probe, user_data);
+    }
+}
+
+/* Returns the histogram as a comma separated list of bucket counts, with
+ * trailing empty buckets left out.
+ */
+char *ep_histogram_string(const ep_probe_t *probe)
+{
+    int n = EP_HISTOGRAM_BUCKETS;
+    while(n > 0 && probe->histogram[n - 1] == 0)
+        n--;
+
+    char *str = malloc(n * 21 + 1);
+    char *p = str;
+    *p = 0;
+
+    int i;
+    for(i = 0; i < n; i++)
+    {
+        p += sprintf(p, "%s%"PRIu64, i ? "," : "", probe->histogram[i]);
+    }
+
+    return str;
+}
+
+#ifdef TEST
+
+#include "unit_test.h"
+
+static void slow_func(int fd, short why, void *data)
+{
+    int *ncalls = data;
+    (*ncalls)++;
+    usleep(3000);
+}
+
+EP_EVENT_CALLBACK(slow_func)
+
+static void count_probe(ep_probe_t *probe, void *user_data)
+{
+    int *nprobes = user_data;
+    (*nprobes)++;
+}
+
+int main(void)
+{
+    sp_log_set_level("debug");
+
+    ep_probe_t probe = EP_PROBE_INITIALIZER("test");
+
+    ep_add_sample(&probe, 0);
+    ep_add_sample(&probe, 1);
+    ep_add_sample(&probe, 2);
+    ep_add_sample(&probe, 1000);
+    ep_add_sample(&probe, UINT64_MAX);
+    fail_unless(probe.count == 5);
+    fail_unless(probe.max_usec == UINT64_MAX);
+    fail_unless(probe.histogram[0] == 2);
+    fail_unless(probe.histogram[1] == 1);
+    fail_unless(probe.histogram[9] == 1); /* 512..1023 usec */
+    fail_unless(probe.histogram[EP_HISTOGRAM_BUCKETS - 1] == 1);
+
+    char *str = ep_histogram_string(&probe);
+    fail_unless(strncmp(str, "2,1,0,0,0,0,0,0,0,1,", 20) == 0);
+    free(str);
+
+    ep_probe_t empty = EP_PROBE_INITIALIZER("empty");
+    str = ep_histogram_string(&empty);
+    fail_unless(str[0] == 0);
+    free(str);
+
+    /* the wrapper calls the real callback and records under its name */
+    int ncalls = 0;
+    ep_set_slow_threshold(1);
+    EP_PROFILED(slow_func)(-1, 0, &ncalls);
+    fail_unless(ncalls == 1);
+    fail_unless(ep_get_slow_threshold() == 1);
+
+    int nprobes = 0;
+    ep_foreach_probe(count_probe, &nprobes);
+    fail_unless(nprobes == 2);
+
+    uint64_t start = ep_now();
+    usleep(1000);
+    fail_unless(ep_now() - start >= 1000);
+
+    return 0;
+}
+
+#endif
+
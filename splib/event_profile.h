@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2008 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _event_profile_h_
+#define _event_profile_h_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sys_queue.h"
+
+/* Bucket i of the latency histogram counts samples shorter than 2^(i+1)
+ * microseconds, the last bucket counts everything longer.
+ */
+#define EP_HISTOGRAM_BUCKETS 24
+
+/* default threshold for logging slow callbacks */
+#define EP_DEFAULT_SLOW_THRESHOLD 100 /* milliseconds */
+
+struct bufferevent;
+
+typedef struct ep_probe ep_probe_t;
+struct ep_probe
+{
+    LIST_ENTRY(ep_probe) link;
+    const char *name;
+    bool registered;
+
+    uint64_t count;
+    uint64_t total_usec;
+    uint64_t max_usec;
+    uint64_t histogram[EP_HISTOGRAM_BUCKETS];
+};
+
+#define EP_PROBE_INITIALIZER(probe_name) { .name = (probe_name) }
+
+typedef void (*ep_probe_func_t)(ep_probe_t *probe, void *user_data);
+
+/* Returns a monotonic timestamp in microseconds. */
+uint64_t ep_now(void);
+
+void ep_add_sample(ep_probe_t *probe, uint64_t usec);
+void ep_record(ep_probe_t *probe, uint64_t start);
+
+void ep_set_slow_threshold(unsigned msec);
+unsigned ep_get_slow_threshold(void);
+
+void ep_start_lag_monitor(void);
+void ep_foreach_probe(ep_probe_func_t func, void *user_data);
+char *ep_histogram_string(const ep_probe_t *probe);
+
+/* The macros below define a profiled wrapper, func_profiled, around a
+ * libevent callback. Register EP_PROFILED(func) instead of func to have
+ * its latency recorded under the function name.
+ */
+#define EP_PROFILED(func) func##_profiled
+
+#define EP_EVENT_CALLBACK(func) \
+static void func##_profiled(int fd, short why, void *data) \
+{ \
+    static ep_probe_t probe = EP_PROBE_INITIALIZER(#func); \
+    uint64_t start = ep_now(); \
+    func(fd, why, data); \
+    ep_record(&probe, start); \
+}
+
+#define EP_BUFFER_CALLBACK(func) \
+static void func##_profiled(struct bufferevent *bufev, void *data) \
+{ \
+    static ep_probe_t probe = EP_PROBE_INITIALIZER(#func); \
+    uint64_t start = ep_now(); \
+    func(bufev, data); \
+    ep_record(&probe, start); \
+}
+
+#define EP_ERROR_CALLBACK(func) \
+static void func##_profiled(struct bufferevent *bufev, short why, void *data) \
+{ \
+    static ep_probe_t probe = EP_PROBE_INITIALIZER(#func); \
+    uint64_t start = ep_now(); \
+    func(bufev, why, data); \
+    ep_record(&probe, start); \
+}
+
+#endif
+
@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2008 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "intern.h"
+#include "log.h"
+
+/* the table doubles when the load factor exceeds 3/4 */
+#define INTERN_MIN_SIZE 256
+
+struct intern_entry
+{
+    struct intern_entry *next;
+    unsigned hash;
+    unsigned refcount;
+    size_t len;
+    char str[];
+};
+
+static struct intern_entry **intern_table;
+static unsigned intern_size;
+static unsigned intern_nentries;
+
+/* FNV-1a */
+static unsigned intern_hash(const char *str, size_t len)
+{
+    uint32_t h = 2166136261U;
+    size_t i;
+    for(i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)str[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static void intern_resize(unsigned size)
+{
+    struct intern_entry **table = calloc(size, sizeof(struct intern_entry *));
+
+    unsigned i;
+    for(i = 0; i < intern_size; i++)
+    {
+        struct intern_entry *entry, *next;
+        for(entry = intern_table[i]; entry; entry = next)
+        {
+            next = entry->next;
+            entry->next = table[entry->hash & (size - 1)];
+            table[entry->hash & (size - 1)] = entry;
+        }
+    }
+
+    free(intern_table);
+    intern_table = table;
+    intern_size = size;
+}
+
+const char *intern_stringn(const char *str, size_t len)
+{
+    if(str == NULL)
+        return NULL;
+
+    unsigned hash = intern_hash(str, len);
+
+    if(intern_table)
+    {
+        struct intern_entry *entry;
+        for(entry = intern_table[hash & (intern_size - 1)]; entry;
+                entry = entry->next)
+        {
+            if(entry->hash == hash && entry->len == len &&
+                    memcmp(entry->str, str, len) == 0)
+            {
+                entry->refcount++;
+                return entry->str;
+            }
+        }
+    }
+
+    if(intern_nentries + 1 > intern_size / 4 * 3)
+        intern_resize(intern_size ? intern_size * 2 : INTERN_MIN_SIZE);
+
+    struct intern_entry *entry = malloc(sizeof(struct intern_entry) + len + 1);
+    entry->hash = hash;
+    entry->refcount = 1;
+    entry->len = len;
+    memcpy(entry->str, str, len);
+    entry->str[len] = 0;
+
+    unsigned bucket = hash & (intern_size - 1);
+    entry->next = intern_table[bucket];
+    intern_table[bucket] = entry;
+    intern_nentries++;
+
+    return entry->str;
+}
+
+const char *intern_string(const char *str)
+{
+    if(str == NULL)
+        return NULL;
+    return intern_stringn(str, strlen(str));
+}
+
+void intern_release(const char *str)
+{
+    if(str == NULL)
+        return;
+
+    struct intern_entry *entry = (struct intern_entry *)
+        (str - offsetof(struct intern_entry, str));
+    return_if_fail(entry->refcount > 0);
+
+    if(--entry->refcount > 0)
+        return;
+
+    struct intern_entry **prev = &intern_table[entry->hash & (intern_size - 1)];
+    while(*prev != entry)
+        prev = &(*prev)->next;
+    *prev = entry->next;
+    intern_nentries--;
+    free(entry);
+}
+
+unsigned intern_count(void)
+{
+    return intern_nentries;
+}
+
+#ifdef TEST
+
+#include <stdio.h>
+#include "unit_test.h"
+
+int main(void)
+{
+    sp_log_set_level("debug");
+
+    fail_unless(intern_string(NULL) == NULL);
+    intern_release(NULL);
+
+    const char *a = intern_string("<++ V:0.668,M:A,H:1/0/0,S:3>");
+    const char *b = intern_stringn("<++ V:0.668,M:A,H:1/0/0,S:3>$ $LAN", 28);
+    fail_unless(a == b);
+    fail_unless(strcmp(a, "<++ V:0.668,M:A,H:1/0/0,S:3>") == 0);
+    fail_unless(intern_count() == 1);
+
+    const char *empty = intern_string("");
+    fail_unless(empty && *empty == 0);
+    fail_unless(empty != a);
+    fail_unless(intern_count() == 2);
+
+    intern_release(a);
+    fail_unless(intern_count() == 2);
+    intern_release(b);
+    fail_unless(intern_count() == 1);
+    intern_release(empty);
+    fail_unless(intern_count() == 0);
+
+    /* grow the table, then release everything */
+    const char *strings[5000];
+    int i;
+    for(i = 0; i < 5000; i++)
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "LAN(T%i)", i % 2500);
+        strings[i] = intern_string(buf);
+        fail_unless(strcmp(strings[i], buf) == 0);
+        if(i >= 2500)
+            fail_unless(strings[i] == strings[i - 2500]);
+    }
+    fail_unless(intern_count() == 2500);
+    for(i = 0; i < 5000; i++)
+        intern_release(strings[i]);
+    fail_unless(intern_count() == 0);
+
+    return 0;
+}
+
+#endif
+
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2008 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _intern_h_
+#define _intern_h_
+
+#include <stddef.h>
+
+/* A table of shared, reference counted strings. Interning the same string
+ * twice returns the same pointer, so repetitive strings (client tags,
+ * connection speeds) are stored once. The returned strings must not be
+ * modified, and are released with intern_release.
+ */
+
+const char *intern_string(const char *str);
+const char *intern_stringn(const char *str, size_t len);
+void intern_release(const char *str);
+
+/* Returns the number of distinct strings in the table. */
+unsigned intern_count(void);
+
+#endif
+
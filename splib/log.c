@@ -32,9 +32,12 @@
 
 #include <sys/time.h>
 #include <event.h>
+#include <pthread.h>
+#include <stdint.h>
 
 #include "log.h"
 #include "util.h"
+#include "event_profile.h"
 
 #define SP_LOG_MAX_FILES 5
 #define SP_LOG_MAX_BYTES_NORMAL 2*1024*1024
@@ -44,7 +47,39 @@ static int sp_log_max_bytes = SP_LOG_MAX_BYTES_NORMAL;
 
 static FILE *logfp = NULL;
 static char *logfile = NULL;
-static int max_log_level = LOG_LEVEL_INFO;
+int sp_log_max_level = LOG_LEVEL_INFO;
+
+/* Once the flusher thread is started, log records are written to a ring
+ * buffer and the flusher thread writes them to the logfile. Any thread can
+ * add records without taking a lock: a slot is claimed by advancing
+ * ring_head, and published by setting its sequence number. If the ring is
+ * full the record is dropped, logging never blocks.
+ */
+typedef struct sp_log_record sp_log_record_t;
+struct sp_log_record
+{
+    unsigned long seq;
+    uint64_t usec; /* monotonic, see ep_now() */
+    int level;
+    char message[SP_LOG_MESSAGE_SIZE];
+};
+
+static sp_log_record_t *ring = NULL;
+static unsigned long ring_head = 0; /* next slot to claim */
+static unsigned long ring_tail = 0; /* next slot to flush */
+static unsigned long ring_dropped = 0;
+
+static pthread_t flusher_thread;
+static pthread_mutex_t flusher_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+static int flusher_running = 0;
+static int flusher_stop = 0;
+/* held by the flusher while writing records */
+static pthread_mutex_t write_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* wall clock time at monotonic time base_usec */
+static time_t base_time;
+static uint64_t base_usec;
 
 static int sp_log_reinit(void);
 
@@ -53,45 +88,41 @@ void sp_log_set_level(const char *level)
     return_if_fail(level);
     sp_log_max_bytes = SP_LOG_MAX_BYTES_NORMAL;
     if(strcasecmp(level, "none") == 0)
-        max_log_level = LOG_LEVEL_ERROR;
+        sp_log_max_level = LOG_LEVEL_ERROR;
     else if(strcasecmp(level, "warning") == 0)
-        max_log_level = LOG_LEVEL_WARNING;
+        sp_log_max_level = LOG_LEVEL_WARNING;
     else if(strcasecmp(level, "message") == 0)
-        max_log_level = LOG_LEVEL_INFO;
+        sp_log_max_level = LOG_LEVEL_INFO;
     else if(strcasecmp(level, "info") == 0)
-        max_log_level = LOG_LEVEL_INFO;
+        sp_log_max_level = LOG_LEVEL_INFO;
     else if(strcasecmp(level, "debug") == 0)
     {
-        max_log_level = LOG_LEVEL_DEBUG;
+        sp_log_max_level = LOG_LEVEL_DEBUG;
         sp_log_max_bytes = SP_LOG_MAX_BYTES_DEBUG;
     }
 }
 
 const char *sp_log_get_level(void)
 {
-    if(max_log_level == LOG_LEVEL_DEBUG)
+    if(sp_log_max_level == LOG_LEVEL_DEBUG)
         return "debug";
-    else if(max_log_level == LOG_LEVEL_INFO)
+    else if(sp_log_max_level == LOG_LEVEL_INFO)
         return "info";
-    else if(max_log_level == LOG_LEVEL_WARNING)
+    else if(sp_log_max_level == LOG_LEVEL_WARNING)
         return "warning";
-    else if(max_log_level == LOG_LEVEL_ERROR)
+    else if(sp_log_max_level == LOG_LEVEL_ERROR)
         return "error";
     else
         return "none";
 }
 
-static void sp_glog_func(int log_level, const char *message)
+static void sp_log_write(int log_level, time_t when, const char *message)
 {
-    if(log_level > max_log_level)
-        return;
-
     FILE *fp = logfp;
     if(fp == NULL)
         fp = stderr;
 
-    time_t now = time(0);
-    struct tm *tm = localtime(&now);
+    struct tm *tm = localtime(&when);
     char tmbuf[32];
     strftime(tmbuf, sizeof(tmbuf), "%a %e %H:%M:%S", tm);
     if((log_level & (LOG_LEVEL_WARNING | LOG_LEVEL_ERROR | LOG_LEVEL_CRITICAL)) > 0)
@@ -112,14 +143,224 @@ static void sp_glog_func(int log_level, const char *message)
     }
 }
 
+/* Claims a slot in the ring buffer, or returns NULL if it is full. */
+static sp_log_record_t *sp_log_claim(unsigned long *pos_ret)
+{
+    unsigned long pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    for(;;)
+    {
+        sp_log_record_t *rec = &ring[pos % SP_LOG_RING_SIZE];
+        unsigned long seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+        long diff = (long)(seq - pos);
+        if(diff == 0)
+        {
+            if(__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, 0,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                *pos_ret = pos;
+                return rec;
+            }
+            /* pos was updated by the failed exchange */
+        }
+        else if(diff < 0)
+        {
+            /* not yet flushed */
+            __atomic_add_fetch(&ring_dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        else
+            pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    }
+}
+
+static void sp_log_enqueue(int level, const char *fmt, va_list ap)
+{
+    unsigned long pos;
+    sp_log_record_t *rec = sp_log_claim(&pos);
+    if(rec == NULL)
+        return;
+
+    rec->usec = ep_now();
+    rec->level = level;
+    vsnprintf(rec->message, sizeof(rec->message), fmt, ap);
+    __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+
+    /* The flusher wakes up by itself every now and then. Wake it up early
+     * for warnings, or if the ring is filling up.
+     */
+    if(level <= LOG_LEVEL_WARNING ||
+       pos - __atomic_load_n(&ring_tail, __ATOMIC_RELAXED) ==
+       SP_LOG_RING_SIZE / 2)
+    {
+        pthread_cond_signal(&flusher_cond);
+    }
+}
+
+/* Writes all published records. Only called from the flusher thread, or
+ * after it has stopped. Returns the number of records written.
+ */
+static unsigned sp_log_flush_ring(void)
+{
+    unsigned n = 0;
+
+    pthread_mutex_lock(&write_mutex);
+    for(;;)
+    {
+        sp_log_record_t *rec = &ring[ring_tail % SP_LOG_RING_SIZE];
+        if(__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != ring_tail + 1)
+            break;
+
+        time_t when = base_time + (time_t)((rec->usec - base_usec) / 1000000);
+        sp_log_write(rec->level, when, rec->message);
+
+        __atomic_store_n(&rec->seq, ring_tail + SP_LOG_RING_SIZE,
+                __ATOMIC_RELEASE);
+        __atomic_store_n(&ring_tail, ring_tail + 1, __ATOMIC_RELEASE);
+        n++;
+    }
+
+    unsigned long dropped = __atomic_exchange_n(&ring_dropped, 0,
+            __ATOMIC_RELAXED);
+    if(dropped)
+    {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "log buffer full, %lu messages dropped",
+                dropped);
+        sp_log_write(LOG_LEVEL_WARNING, time(0), msg);
+    }
+
+    if(n && logfp)
+        fflush(logfp);
+    pthread_mutex_unlock(&write_mutex);
+
+    return n;
+}
+
+static void *sp_log_flusher(void *data)
+{
+    for(;;)
+    {
+        sp_log_flush_ring();
+
+        pthread_mutex_lock(&flusher_mutex);
+        if(flusher_stop)
+        {
+            pthread_mutex_unlock(&flusher_mutex);
+            break;
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 100 * 1000000;
+        if(ts.tv_nsec >= 1000000000)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&flusher_cond, &flusher_mutex, &ts);
+        pthread_mutex_unlock(&flusher_mutex);
+    }
+
+    /* write anything logged while stopping */
+    sp_log_flush_ring();
+
+    return NULL;
+}
+
+/* The logfile is flushed before fork, with the flusher held off, so the
+ * child doesn't inherit (and later write again) buffered records.
+ */
+static void sp_log_atfork_prepare(void)
+{
+    pthread_mutex_lock(&write_mutex);
+    if(logfp)
+        fflush(logfp);
+}
+
+static void sp_log_atfork_parent(void)
+{
+    pthread_mutex_unlock(&write_mutex);
+}
+
+/* The flusher thread doesn't exist in a forked child, log synchronously. */
+static void sp_log_atfork_child(void)
+{
+    pthread_mutex_unlock(&write_mutex);
+    flusher_running = 0;
+}
+
+static void sp_log_stop_flusher(void);
+
+/* Starts writing the log from a background thread. Call this after
+ * daemonizing, the thread doesn't survive a fork.
+ */
+int sp_log_start_flusher(void)
+{
+    if(flusher_running)
+        return 0;
+
+    if(ring == NULL)
+    {
+        pthread_atfork(sp_log_atfork_prepare, sp_log_atfork_parent,
+                sp_log_atfork_child);
+        /* write the last messages before exit(), they are often the
+         * interesting ones */
+        atexit(sp_log_stop_flusher);
+        ring = calloc(SP_LOG_RING_SIZE, sizeof(sp_log_record_t));
+    }
+    /* the ring may be left over from a stopped flusher */
+    unsigned long i;
+    for(i = 0; i < SP_LOG_RING_SIZE; i++)
+        ring[i].seq = i;
+    ring_head = ring_tail = 0;
+
+    base_time = time(0);
+    base_usec = ep_now();
+
+    if(logfp)
+        setvbuf(logfp, NULL, _IOFBF, BUFSIZ);
+
+    flusher_stop = 0;
+    if(pthread_create(&flusher_thread, NULL, sp_log_flusher, NULL) != 0)
+    {
+        WARNING("failed to start log flusher thread: %s", strerror(errno));
+        return -1;
+    }
+    __atomic_store_n(&flusher_running, 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+static void sp_log_stop_flusher(void)
+{
+    if(!flusher_running)
+        return;
+
+    pthread_mutex_lock(&flusher_mutex);
+    flusher_stop = 1;
+    pthread_cond_signal(&flusher_cond);
+    pthread_mutex_unlock(&flusher_mutex);
+
+    pthread_join(flusher_thread, NULL);
+    __atomic_store_n(&flusher_running, 0, __ATOMIC_RELEASE);
+
+    /* records added by other threads while the flusher was stopping */
+    sp_log_flush_ring();
+}
+
 void sp_vlog(int level, const char *fmt, va_list ap)
 {
-    char *msg;
-    int num_returned_bytes = vasprintf(&msg, fmt, ap);
-    if (num_returned_bytes == -1)
-        DEBUG("vasprintf did not return anything");
-    sp_glog_func(level, msg);
-    free(msg);
+    if(!sp_log_enabled(level))
+        return;
+
+    if(__atomic_load_n(&flusher_running, __ATOMIC_ACQUIRE))
+    {
+        sp_log_enqueue(level, fmt, ap);
+        return;
+    }
+
+    char msg[SP_LOG_MESSAGE_SIZE];
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    sp_log_write(level, time(0), msg);
 }
 
 void sp_log(int level, const char *fmt, ...)
@@ -201,7 +442,7 @@ static void event_log_callback(int severity, const char *msg)
             log_level = LOG_LEVEL_ERROR;
             break;
     }
-    sp_glog_func(log_level, msg);
+    sp_log(log_level, "%s", msg);
 }
 
 static int sp_log_reinit(void)
@@ -216,7 +457,10 @@ static int sp_log_reinit(void)
     {
         event_set_log_callback(event_log_callback);
         
-        setvbuf(logfp, NULL, _IOLBF, 0);
+        if(flusher_running)
+            setvbuf(logfp, NULL, _IOFBF, BUFSIZ);
+        else
+            setvbuf(logfp, NULL, _IOLBF, 0);
     }
     return 0;
 }
@@ -257,6 +501,8 @@ int sp_log_init(const char *workdir, const char *prefix)
 
 void sp_log_close(void)
 {
+    sp_log_stop_flusher();
+
     if(logfp)
     {
         fclose(logfp);
@@ -266,3 +512,127 @@ void sp_log_close(void)
     }
 }
 
+#ifdef TEST
+
+#include <sys/wait.h>
+
+#include "unit_test.h"
+
+static int nevaluated = 0;
+
+static int evaluate(void)
+{
+    return ++nevaluated;
+}
+
+static int count_lines(const char *path, const char *needle)
+{
+    FILE *fp = fopen(path, "r");
+    fail_unless(fp);
+    int n = 0;
+    char line[SP_LOG_MESSAGE_SIZE + 64];
+    while(fgets(line, sizeof(line), fp))
+    {
+        if(strstr(line, needle))
+            n++;
+    }
+    fclose(fp);
+    return n;
+}
+
+int main(void)
+{
+    char tmpdir[] = "/tmp/log_test.XXXXXX";
+    fail_unless(mkdtemp(tmpdir) != NULL);
+    fail_unless(sp_log_init(tmpdir, "test") == 0);
+    sp_log_set_level("info");
+
+    /* arguments of disabled levels are not evaluated */
+    DEBUG("not logged %d", evaluate());
+    fail_unless(nevaluated == 0);
+    INFO("logged %d", evaluate());
+    fail_unless(nevaluated == 1);
+    fail_unless(sp_log_enabled(LOG_LEVEL_WARNING));
+    fail_unless(!sp_log_enabled(LOG_LEVEL_DEBUG));
+
+    fail_unless(sp_log_start_flusher() == 0);
+
+    /* more records than fit in the ring, some may be dropped */
+    int total = 3 * SP_LOG_RING_SIZE;
+    int i;
+    for(i = 0; i < total; i++)
+        sp_log(LOG_LEVEL_INFO, "record %d", i);
+    sp_log_close();
+
+    char *path;
+    fail_unless(asprintf(&path, "%s/test.log", tmpdir) != -1);
+    FILE *fp = fopen(path, "r");
+    fail_unless(fp);
+
+    int nwritten = 0, ndropped = 0, last = -1;
+    char line[SP_LOG_MESSAGE_SIZE + 64];
+    while(fgets(line, sizeof(line), fp))
+    {
+        char *p;
+        int n;
+        if((p = strstr(line, "record ")) != NULL)
+        {
+            n = atoi(p + 7);
+            /* records are written in order */
+            fail_unless(n > last);
+            last = n;
+            nwritten++;
+        }
+        else if((p = strstr(line, "log buffer full, ")) != NULL)
+        {
+            ndropped += atoi(p + 17);
+        }
+    }
+    fclose(fp);
+    fail_unless(nwritten > 0);
+    fail_unless(nwritten + ndropped == total);
+
+    unlink(path);
+    free(path);
+
+    /* messages logged right before exit() are written */
+    pid_t pid = fork();
+    fail_unless(pid != -1);
+    if(pid == 0)
+    {
+        sp_log_init(tmpdir, "exit");
+        sp_log_start_flusher();
+        INFO("last words");
+        exit(0);
+    }
+    int status;
+    fail_unless(waitpid(pid, &status, 0) == pid);
+    fail_unless(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    fail_unless(asprintf(&path, "%s/exit.log", tmpdir) != -1);
+    fail_unless(count_lines(path, "last words") == 1);
+    unlink(path);
+    free(path);
+
+    /* a forked child doesn't write the parent's buffered records again */
+    fail_unless(sp_log_init(tmpdir, "fork") == 0);
+    fail_unless(sp_log_start_flusher() == 0);
+    for(i = 0; i < 100; i++)
+        INFO("before fork");
+    pid = fork();
+    fail_unless(pid != -1);
+    if(pid == 0)
+        exit(1);
+    fail_unless(waitpid(pid, &status, 0) == pid);
+    sp_log_close();
+    fail_unless(asprintf(&path, "%s/fork.log", tmpdir) != -1);
+    fail_unless(count_lines(path, "before fork") == 100);
+    unlink(path);
+    free(path);
+
+    rmdir(tmpdir);
+
+    return 0;
+}
+
+#endif
+
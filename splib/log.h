@@ -34,24 +34,41 @@ enum
   LOG_LEVEL_DEBUG             = 1 << 6,
 };
 
+/* Messages longer than this are truncated. */
+#define SP_LOG_MESSAGE_SIZE 512
+
+/* number of records in the ring buffer of the background flusher */
+#define SP_LOG_RING_SIZE 4096
+
+extern int sp_log_max_level;
+
+/* Checked by the logging macros before the arguments are evaluated. */
+#define sp_log_enabled(level) ((level) <= sp_log_max_level)
+
 int sp_log_init(const char *workdir, const char *prefix);
+int sp_log_start_flusher(void);
 void sp_log_set_level(const char *level);
 const char *sp_log_get_level(void);
 void sp_log_close(void);
 void sp_vlog(int level, const char *fmt, va_list ap);
 void sp_log(int level, const char *fmt, ...);
 
+#define sp_log_if_enabled(level, fmt, ...) do { \
+        if(sp_log_enabled(level)) \
+            sp_log(level, "[%d] (%s:%i) " fmt, getpid(), __func__, __LINE__, ## __VA_ARGS__); \
+    } while(0)
+
 #undef g_debug
-#define g_debug(fmt, ...)  sp_log(LOG_LEVEL_DEBUG, "[%d] (%s:%i) " fmt, getpid(), __func__, __LINE__, ## __VA_ARGS__)
+#define g_debug(fmt, ...)  sp_log_if_enabled(LOG_LEVEL_DEBUG, fmt, ## __VA_ARGS__)
 
 #undef g_info
-#define g_info(fmt, ...)  sp_log(LOG_LEVEL_INFO, "[%d] (%s:%i) " fmt, getpid(), __func__, __LINE__, ## __VA_ARGS__)
+#define g_info(fmt, ...)  sp_log_if_enabled(LOG_LEVEL_INFO, fmt, ## __VA_ARGS__)
 
 #undef g_warning
-#define g_warning(fmt, ...)  sp_log(LOG_LEVEL_WARNING, "[%d] (%s:%i) " fmt, getpid(), __func__, __LINE__, ## __VA_ARGS__)
+#define g_warning(fmt, ...)  sp_log_if_enabled(LOG_LEVEL_WARNING, fmt, ## __VA_ARGS__)
 
 #undef g_error
-#define g_error(fmt, ...)  sp_log(LOG_LEVEL_ERROR, "[%d] (%s:%i) " fmt, getpid(), __func__, __LINE__, ## __VA_ARGS__)
+#define g_error(fmt, ...)  sp_log_if_enabled(LOG_LEVEL_ERROR, fmt, ## __VA_ARGS__)
 
 #define DEBUG g_debug
 #define INFO g_info
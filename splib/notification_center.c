@@ -20,6 +20,10 @@
 
 #include "notification_center.h"
 
+/* registered channel names, indexed by id */
+static char **nc_channel_names = NULL;
+static unsigned nc_nchannel_names = 1;
+
 nc_t *nc_new(void)
 {
     nc_t *nc = calloc(1, sizeof(nc_t));
@@ -36,68 +40,163 @@ nc_t *nc_default(void)
     return default_nc;
 }
 
-static nc_observer_t *nc_observer_new(const char *channel,
-        nc_callback_t callback, void *user_data)
+static nc_channel_t nc_lookup_channel(const char *channel)
 {
-    nc_observer_t *ob = calloc(1, sizeof(nc_observer_t));
-    ob->channel = strdup(channel);
-    ob->callback = callback;
-    ob->user_data = user_data;
-
-    return ob;
+    nc_channel_t id;
+    for(id = 1; id < nc_nchannel_names; id++)
+    {
+        if(strcmp(nc_channel_names[id], channel) == 0)
+            return id;
+    }
+    return 0;
 }
 
-static void nc_observer_free(nc_observer_t *ob)
+/* Returns the id of a channel, registering it if needed. */
+nc_channel_t nc_channel_id(const char *channel)
 {
-    if(ob)
+    assert(channel);
+
+    nc_channel_t id = nc_lookup_channel(channel);
+    if(id == 0)
     {
-        free(ob->channel);
-        free(ob);
+        id = nc_nchannel_names++;
+        nc_channel_names = realloc(nc_channel_names,
+                nc_nchannel_names * sizeof(char *));
+        nc_channel_names[0] = NULL;
+        nc_channel_names[id] = strdup(channel);
     }
+
+    return id;
 }
 
-void nc_add_observer(nc_t *nc, const char *channel,
+const char *nc_channel_name(nc_channel_t channel_id)
+{
+    if(channel_id == 0 || channel_id >= nc_nchannel_names)
+        return NULL;
+    return nc_channel_names[channel_id];
+}
+
+static nc_channel_observers_t *nc_channel(nc_t *nc, nc_channel_t channel_id)
+{
+    if(channel_id >= nc->nchannels)
+        return NULL;
+    return &nc->channels[channel_id];
+}
+
+void nc_add_observer_id(nc_t *nc, nc_channel_t channel_id,
         nc_callback_t callback, void *user_data)
 {
     assert(nc);
-    assert(channel);
+    assert(channel_id > 0 && channel_id < nc_nchannel_names);
     assert(callback);
 
-    nc_observer_t *ob = nc_observer_new(channel, callback, user_data);
-    LIST_INSERT_HEAD(&nc->observers, ob, next);
+    if(channel_id >= nc->nchannels)
+    {
+        nc->channels = realloc(nc->channels,
+                (channel_id + 1) * sizeof(nc_channel_observers_t));
+        memset(nc->channels + nc->nchannels, 0,
+                (channel_id + 1 - nc->nchannels) *
+                sizeof(nc_channel_observers_t));
+        nc->nchannels = channel_id + 1;
+    }
+
+    nc_channel_observers_t *ch = &nc->channels[channel_id];
+    if(ch->nobservers == ch->allocated)
+    {
+        ch->allocated = ch->allocated ? ch->allocated * 2 : 4;
+        ch->observers = realloc(ch->observers,
+                ch->allocated * sizeof(nc_observer_t));
+    }
+
+    nc_observer_t *ob = &ch->observers[ch->nobservers++];
+    ob->callback = callback;
+    ob->user_data = user_data;
 }
 
-void nc_remove_observer(nc_t *nc, const char *channel, nc_callback_t callback)
+/* Drops the observers that were removed while notifications were sent. */
+static void nc_compact_channel(nc_channel_observers_t *ch)
+{
+    unsigned i, n = 0;
+    for(i = 0; i < ch->nobservers; i++)
+    {
+        if(ch->observers[i].callback)
+            ch->observers[n++] = ch->observers[i];
+    }
+    ch->nobservers = n;
+    ch->need_compact = false;
+}
+
+void nc_remove_observer_id(nc_t *nc, nc_channel_t channel_id,
+        nc_callback_t callback)
 {
     assert(nc);
-    assert(channel);
     assert(callback);
 
-    nc_observer_t *ob;
-    LIST_FOREACH(ob, &nc->observers, next)
+    nc_channel_observers_t *ch = nc_channel(nc, channel_id);
+    if(ch == NULL)
+        return;
+
+    /* the most recently added observer is removed first */
+    unsigned i;
+    for(i = ch->nobservers; i-- > 0; )
     {
-        if(ob->callback == callback && strcmp(ob->channel, channel) == 0)
+        if(ch->observers[i].callback == callback)
         {
-            LIST_REMOVE(ob, next);
-            nc_observer_free(ob);
+            ch->observers[i].callback = NULL;
+            if(ch->dispatching)
+                ch->need_compact = true;
+            else
+                nc_compact_channel(ch);
             break;
         }
     }
 }
 
-void nc_send_notification(nc_t *nc, const char *channel, void *data)
+void nc_send_notification_id(nc_t *nc, nc_channel_t channel_id, void *data)
 {
     assert(nc);
-    assert(channel);
 
-    nc_observer_t *ob;
-    LIST_FOREACH(ob, &nc->observers, next)
+    nc_channel_observers_t *ch = nc_channel(nc, channel_id);
+    if(ch == NULL || ch->nobservers == 0)
+        return;
+
+    const char *channel = nc_channel_names[channel_id];
+
+    /* Observers are called in reverse order of registration. Observers
+     * added by a callback are not called for this notification. The
+     * array may be reallocated by a callback, so index it each time.
+     */
+    ch->dispatching++;
+    unsigned i;
+    for(i = ch->nobservers; i-- > 0; )
     {
-        if(strcmp(channel, ob->channel) == 0)
-        {
-            ob->callback(nc, channel, data, ob->user_data);
-        }
+        nc_observer_t ob = nc->channels[channel_id].observers[i];
+        if(ob.callback)
+            ob.callback(nc, channel, data, ob.user_data);
     }
+
+    ch = &nc->channels[channel_id];
+    if(--ch->dispatching == 0 && ch->need_compact)
+        nc_compact_channel(ch);
+}
+
+void nc_add_observer(nc_t *nc, const char *channel,
+        nc_callback_t callback, void *user_data)
+{
+    assert(channel);
+    nc_add_observer_id(nc, nc_channel_id(channel), callback, user_data);
+}
+
+void nc_remove_observer(nc_t *nc, const char *channel, nc_callback_t callback)
+{
+    assert(channel);
+    nc_remove_observer_id(nc, nc_lookup_channel(channel), callback);
+}
+
+void nc_send_notification(nc_t *nc, const char *channel, void *data)
+{
+    assert(channel);
+    nc_send_notification_id(nc, nc_lookup_channel(channel), data);
 }
 
 #ifdef TEST
@@ -120,6 +219,32 @@ void sample_callback(nc_t *nc, const char *channel, void *data, void *user_data)
     ++sample_callback_called;
 }
 
+static int order[4];
+static int norder = 0;
+
+static void first_callback(nc_t *nc, const char *channel, void *data,
+        void *user_data)
+{
+    order[norder++] = 1;
+}
+
+static void second_callback(nc_t *nc, const char *channel, void *data,
+        void *user_data)
+{
+    order[norder++] = 2;
+}
+
+/* removes itself and the first callback, and adds another observer */
+static void removing_callback(nc_t *nc, const char *channel, void *data,
+        void *user_data)
+{
+    order[norder++] = 3;
+    nc_remove_observer(nc, channel, removing_callback);
+    nc_remove_observer(nc, channel, first_callback);
+    nc_add_observer(nc, "other channel", second_callback, NULL);
+    nc_add_observer(nc, channel, second_callback, NULL);
+}
+
 int main(int argc, char **argv)
 {
     /* create the shared, default notification center */
@@ -136,10 +261,38 @@ int main(int argc, char **argv)
     nc_send_notification(nc, "sample channel", "sample data");
     fail_unless(sample_callback_called == 1);
 
+    /* notify by channel id */
+    nc_channel_t id = nc_channel_id("sample channel");
+    fail_unless(id > 0);
+    fail_unless(nc_channel_id("sample channel") == id);
+    fail_unless(strcmp(nc_channel_name(id), "sample channel") == 0);
+    fail_unless(nc_channel_id("another channel") != id);
+    nc_send_notification_id(nc, id, "sample data");
+    fail_unless(sample_callback_called == 2);
+
     /* remove the observer */
     nc_remove_observer(nc, "sample channel", sample_callback);
     nc_send_notification(nc, "sample channel", "sample data");
-    fail_unless(sample_callback_called == 1);
+    fail_unless(sample_callback_called == 2);
+
+    /* observers are called in reverse order of registration, and may add
+     * and remove observers while a notification is sent
+     */
+    nc_add_observer(nc, "test channel", first_callback, NULL);
+    nc_add_observer(nc, "test channel", removing_callback, NULL);
+    nc_add_observer(nc, "test channel", second_callback, NULL);
+    nc_send_notification(nc, "test channel", NULL);
+    fail_unless(norder == 2);
+    fail_unless(order[0] == 2 && order[1] == 3);
+
+    norder = 0;
+    nc_send_notification(nc, "test channel", NULL);
+    fail_unless(norder == 2);
+    fail_unless(order[0] == 2 && order[1] == 2);
+
+    norder = 0;
+    nc_send_notification(nc, "other channel", NULL);
+    fail_unless(norder == 1);
 
     return 0;
 }
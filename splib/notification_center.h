@@ -17,29 +17,57 @@
 #ifndef _notification_center_h_
 #define _notification_center_h_
 
+#include <stdbool.h>
+
 #include "sys_queue.h"
 
+/* Channel names are interned to small integer ids, and each notification
+ * center keeps an array of observers per channel id. Sending a
+ * notification only visits the observers of its channel. Observers may be
+ * added or removed from within a callback.
+ */
+
+typedef unsigned nc_channel_t; /* 0 is not a valid channel */
+
 typedef struct notification_center nc_t;
 typedef struct nc_observer nc_observer_t;
+typedef struct nc_channel_observers nc_channel_observers_t;
 typedef void (*nc_callback_t)(nc_t *nc, const char *channel,
         void *data, void *user_data);
 
 struct nc_observer
 {
-    char *channel;
-    nc_callback_t callback;
+    nc_callback_t callback; /* NULL if removed during dispatch */
     void *user_data;
-    LIST_ENTRY(nc_observer) next;
+};
+
+struct nc_channel_observers
+{
+    nc_observer_t *observers;
+    unsigned nobservers;
+    unsigned allocated;
+    unsigned dispatching; /* nesting depth of notifications being sent */
+    bool need_compact;
 };
 
 struct notification_center
 {
-    LIST_HEAD(, nc_observer) observers;
+    nc_channel_observers_t *channels; /* indexed by channel id */
+    unsigned nchannels;
 };
 
 nc_t *nc_new(void);
 nc_t *nc_default(void);
 
+nc_channel_t nc_channel_id(const char *channel);
+const char *nc_channel_name(nc_channel_t channel_id);
+
+void nc_add_observer_id(nc_t *nc, nc_channel_t channel_id,
+        nc_callback_t callback, void *user_data);
+void nc_remove_observer_id(nc_t *nc, nc_channel_t channel_id,
+        nc_callback_t callback);
+void nc_send_notification_id(nc_t *nc, nc_channel_t channel_id, void *data);
+
 void nc_add_observer(nc_t *nc, const char *channel,
         nc_callback_t callback, void *user_data);
 void nc_remove_observer(nc_t *nc, const char *channel,
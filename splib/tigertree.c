@@ -200,6 +200,45 @@ void tt_destroy(TT_CONTEXT *ctx)
     }
 }
 
+/* Computes the root hash from the NLEAVES leaf hashes in LEAVES, so leaf
+ * data received from others can be checked against a known root.
+ */
+void tt_root_from_leaves(const void *leaves, unsigned nleaves, u_int8_t *root)
+{
+    assert(nleaves > 0);
+
+    u_int8_t *level = malloc(nleaves * TIGERSIZE);
+    memcpy(level, leaves, nleaves * TIGERSIZE);
+
+    u_int64_t node[(1 + NODESIZE + 7) / 8];
+    u_int8_t *nodep = (u_int8_t *)node;
+    nodep[0] = 1; /* flag for inner node calculation */
+
+    while(nleaves > 1)
+    {
+        unsigned i, n = 0;
+        for(i = 0; i + 1 < nleaves; i += 2)
+        {
+            u_int64_t res[3];
+            memcpy(nodep + 1, level + i * TIGERSIZE, NODESIZE);
+            tiger(node, (u_int64_t)(NODESIZE + 1), res);
+            res[0] = U_INT64_TO_LE(res[0]);
+            res[1] = U_INT64_TO_LE(res[1]);
+            res[2] = U_INT64_TO_LE(res[2]);
+            memcpy(level + n++ * TIGERSIZE, res, TIGERSIZE);
+        }
+        if(i < nleaves)
+        {
+            /* an odd node is promoted to the next level as is */
+            memmove(level + n++ * TIGERSIZE, level + i * TIGERSIZE, TIGERSIZE);
+        }
+        nleaves = n;
+    }
+
+    memcpy(root, level, TIGERSIZE);
+    free(level);
+}
+
 /* returned string should be free'd by the caller
  * should only be called after tt_digest
  */
@@ -44,6 +44,8 @@ struct tt_context {
 void tt_init(TT_CONTEXT *ctx, unsigned int leafsize);
 void tt_update(TT_CONTEXT *ctx, unsigned char *buffer, unsigned len);
 void tt_digest(TT_CONTEXT *ctx, unsigned char *hash);
+void tt_root_from_leaves(const void *leaves, unsigned nleaves,
+        unsigned char *root);
 char *tt_base32(TT_CONTEXT *ctx);
 char *tt_leafdata_base32(TT_CONTEXT *ctx);
 char *tt_leafdata_base64(TT_CONTEXT *ctx);
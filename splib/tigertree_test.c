@@ -34,6 +34,37 @@ int main(void)
 
     char *hash_base32 = tt_base32(&tth);
     fail_unless(strcmp(hash_base32, "UUP2CKMGSUCSKXBQKSK7U76YVYFPUDXFNCYEOFI") == 0);
+    free(hash_base32);
+    tt_destroy(&tth);
+
+    /* the root can be computed from the leaves, also with an odd leaf */
+    unsigned size = 5 * 64 * 1024 + 1000;
+    unsigned char *data = malloc(size);
+    unsigned i;
+    for(i = 0; i < size; i++)
+        data[i] = i * 7 + (i >> 12);
+
+    unsigned char root[TIGERSIZE], leaves_root[TIGERSIZE];
+    tt_init(&tth, 64 * 1024);
+    tt_update(&tth, data, size);
+    tt_digest(&tth, root);
+    fail_unless(tth.leaves_len == 6 * TIGERSIZE);
+    tt_root_from_leaves(tth.leaves, 6, leaves_root);
+    fail_unless(memcmp(root, leaves_root, TIGERSIZE) == 0);
+
+    /* a leaf is the root of the tree of its own data */
+    struct tt_context leaf;
+    tt_init(&leaf, 0);
+    tt_update(&leaf, data + 5 * 64 * 1024, 1000);
+    tt_digest(&leaf, leaves_root);
+    fail_unless(memcmp((char *)tth.leaves + 5 * TIGERSIZE, leaves_root,
+                TIGERSIZE) == 0);
+
+    tt_root_from_leaves(tth.leaves, 1, leaves_root);
+    fail_unless(memcmp(tth.leaves, leaves_root, TIGERSIZE) == 0);
+
+    tt_destroy(&tth);
+    free(data);
 
     return 0;
 }
@@ -135,6 +135,9 @@ char *data_to_hex(const char *data, unsigned int len)
 
 void print_command(const char *command, const char *fmt, ...)
 {
+    if(!sp_log_enabled(LOG_LEVEL_DEBUG))
+        return;
+
     char *prestr;
 
     va_list ap;
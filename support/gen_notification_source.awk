@@ -55,6 +55,11 @@ BEGIN {
         argtypes[i] = argtype
     }
     printf("\n\n/*\n * Notification type %s\n */\n\n", name);
+    printf("static nc_channel_t %s_channel;\n\n", name);
+    printf("static nc_channel_t nc_%s_channel(void)\n{\n", name);
+    printf("    if(%s_channel == 0)\n", name);
+    printf("        %s_channel = nc_channel_id(\"%s\");\n", name, name);
+    printf("    return %s_channel;\n}\n\n", name);
     printf("void nc_send_%s_notification(nc_t *nc", name);
     for(i = 0; i < n; i++)
     {
@@ -69,12 +74,12 @@ BEGIN {
         printf("\n")
     }
     printf("    };\n");
-    printf("    nc_send_notification(nc, \"%s\", &%s_data);\n", name, name);
+    printf("    nc_send_notification_id(nc, nc_%s_channel(), &%s_data);\n", name, name);
     printf("}\n");
 
     printf("\nvoid nc_add_%s_observer(nc_t *nc, nc_%s_callback_t callback, void *user_data)\n", name, name)
     printf("{\n")
-    printf("    nc_add_observer(nc, \"%s\", (nc_callback_t)callback, user_data);\n", name);
+    printf("    nc_add_observer_id(nc, nc_%s_channel(), (nc_callback_t)callback, user_data);\n", name);
     printf("}\n");
 }
 